@@ -1197,6 +1197,30 @@ hsaKmtQueryPointerInfo(
     HsaPointerInfo *    PointerInfo     //OUT
     );
 
+/**
+  Returns information about NumPointers pointers at once, like
+  hsaKmtQueryPointerInfo for each of them. Pointers that are not known
+  get Type HSA_POINTER_UNKNOWN. This is faster than querying pointers
+  one by one: each aperture is locked once and its allocations are
+  looked up in address order.
+
+  RegisteredNodes and MappedNodes point into the NodeIds buffer of
+  NumNodeIds entries, which must stay valid as long as they are used.
+  If the buffer is too small, the arrays of the pointers that didn't
+  fit are NULL while their counts are set, and the function returns
+  HSAKMT_STATUS_BUFFER_TOO_SMALL. Two entries per pointer and GPU
+  always suffice.
+*/
+HSAKMT_STATUS
+HSAKMTAPI
+hsaKmtQueryPointerInfoBatch(
+    HSAuint64           NumPointers,    //IN
+    const void **       Pointers,       //IN
+    HsaPointerInfo *    PointerInfo,    //OUT, NumPointers entries
+    HSAuint32 *         NodeIds,        //OUT
+    HSAuint64           NumNodeIds      //IN
+    );
+
 /**
   Associates user data with a memory allocation
 */
@@ -1207,6 +1231,202 @@ hsaKmtSetMemoryUserData(
     void *          UserData    //IN
     );
 
+/**
+  Returns statistics of an internal memory management cache. Counters
+  are process-wide and cumulative.
+*/
+HSAKMT_STATUS
+HSAKMTAPI
+hsaKmtGetMemoryCacheStats(
+    HSA_MEMORY_CACHE_TYPE   CacheType,  //IN
+    HsaMemoryCacheStats*    Stats       //OUT
+    );
+
+/**
+  Returns the number of memory mappings of the process, the limit set
+  by vm.max_map_count and how many mappings the SVM apertures use.
+  Allocations that map memory for the CPU are refused with a few
+  mappings of headroom left, so that reaching the limit can't leave
+  holes in reserved address space.
+*/
+HSAKMT_STATUS
+HSAKMTAPI
+hsaKmtGetVirtualMemoryStats(
+    HsaVirtualMemoryStats*  Stats       //OUT
+    );
+
+/**
+  Returns statistics of an aperture: its objects and allocated address
+  space, and how fragmented the free address space is. NodeId selects
+  the GPU of per-GPU apertures and is ignored for the others. The
+  counters are kept up to date by every allocation, so this is cheap
+  enough to poll.
+*/
+HSAKMT_STATUS
+HSAKMTAPI
+hsaKmtGetApertureStats(
+    HSAuint32               NodeId,     //IN
+    HSA_MEMORY_APERTURE     Aperture,   //IN
+    HsaApertureStats*       Stats       //OUT
+    );
+
+/**
+  Waits until all memory freed with hsaKmtFreeMemory before the call
+  has been released. Only needed if frees are deferred to a background
+  thread with HSA_DEFERRED_FREE, e.g. before reusing freed addresses
+  with FixedAddress allocations.
+*/
+HSAKMT_STATUS
+HSAKMTAPI
+hsaKmtFlushDeferredFrees(void);
+
+/**
+  Allocates memory like hsaKmtAllocMemory, registers it to the
+  NumberOfNodes nodes in NodeArray like hsaKmtRegisterMemoryToNodes and
+  maps it like hsaKmtMapMemoryToGPU, in one call. Nothing is left
+  allocated if any step fails. Free it with hsaKmtUnmapMemoryToGPU and
+  hsaKmtFreeMemory.
+*/
+HSAKMT_STATUS
+HSAKMTAPI
+hsaKmtAllocAndMapMemory(
+    HSAuint32       PreferredNode,  //IN
+    HSAuint64       SizeInBytes,    //IN (multiple of page size)
+    HsaMemFlags     MemFlags,       //IN
+    HSAuint64       NumberOfNodes,  //IN (0 to map to all GPUs)
+    HSAuint32*      NodeArray,      //IN
+    void**          MemoryAddress,  //IN/OUT
+    HSAuint64*      AlternateVAGPU  //OUT
+    );
+
+/**
+  Maps NumberOfRequests allocations to GPUs in one call. Each allocation
+  is mapped to exactly the nodes in its request, as with
+  hsaKmtMapMemoryToGPUNodes, or to all its registered nodes if
+  NumberOfNodes is 0. The result for each allocation is returned in its
+  Status, the first failure is also returned by the call.
+*/
+HSAKMT_STATUS
+HSAKMTAPI
+hsaKmtMapMemoryToGPUBatch(
+    HsaMemoryMapRequest*    Requests,           //IN/OUT
+    HSAuint64               NumberOfRequests    //IN
+    );
+
+/**
+  Unmaps NumberOfRequests allocations from the nodes in their requests,
+  or from all nodes if NumberOfNodes is 0. Results are returned as with
+  hsaKmtMapMemoryToGPUBatch.
+*/
+HSAKMT_STATUS
+HSAKMTAPI
+hsaKmtUnmapMemoryToGPUBatch(
+    HsaMemoryMapRequest*    Requests,           //IN/OUT
+    HSAuint64               NumberOfRequests    //IN
+    );
+
+/**
+  Creates a memory arena: one allocation of SizeInBytes on PreferredNode
+  with MemFlags, mapped to the NumberOfNodes nodes in NodeArray (or to all
+  GPUs if NumberOfNodes is 0). Memory is handed out of the arena with
+  hsaKmtAllocFromMemoryArena without any kernel calls and released all
+  at once with hsaKmtResetMemoryArena.
+*/
+HSAKMT_STATUS
+HSAKMTAPI
+hsaKmtCreateMemoryArena(
+    HSAuint32           PreferredNode,  //IN
+    HSAuint64           SizeInBytes,    //IN (multiple of page size)
+    HsaMemFlags         MemFlags,       //IN
+    HSAuint64           NumberOfNodes,  //IN
+    HSAuint32*          NodeArray,      //IN
+    HSA_MEMORY_ARENA*   Arena           //OUT
+    );
+
+/**
+  Allocates SizeInBytes from an arena, aligned to Alignment (a power of
+  two, 0 for no alignment). Thread safe. Returns
+  HSAKMT_STATUS_NO_MEMORY when the arena is exhausted. The memory must
+  not be freed with hsaKmtFreeMemory.
+*/
+HSAKMT_STATUS
+HSAKMTAPI
+hsaKmtAllocFromMemoryArena(
+    HSA_MEMORY_ARENA    Arena,          //IN
+    HSAuint64           SizeInBytes,    //IN
+    HSAuint64           Alignment,      //IN
+    void**              MemoryAddress   //OUT
+    );
+
+/**
+  Releases all allocations of an arena. The caller must make sure the
+  CPU and GPUs no longer access them.
+*/
+HSAKMT_STATUS
+HSAKMTAPI
+hsaKmtResetMemoryArena(
+    HSA_MEMORY_ARENA    Arena           //IN
+    );
+
+/**
+  Unmaps and frees an arena and all allocations from it
+*/
+HSAKMT_STATUS
+HSAKMTAPI
+hsaKmtDestroyMemoryArena(
+    HSA_MEMORY_ARENA    Arena           //IN
+    );
+
+/**
+  Allocates paged system memory like hsaKmtAllocMemory, with its pages
+  interleaved across NUMA nodes. CPU nodes in NodeArray are used as
+  they are, GPU nodes stand for the CPU node they are directly linked
+  to. Setting MemFlags.ui32.Interleave in hsaKmtAllocMemory instead
+  interleaves across the CPU nodes nearest to all GPUs.
+
+  hsaKmtQueryPointerInfo reports MemFlags.ui32.Interleave only if the
+  pages are interleaved, with Node set to the first node. The memory is
+  placed normally if there is only one NUMA node.
+*/
+HSAKMT_STATUS
+HSAKMTAPI
+hsaKmtAllocMemoryInterleaved(
+    HSAuint32       NumberOfNodes,  //IN
+    HSAuint32*      NodeArray,      //IN
+    HSAuint64       SizeInBytes,    //IN (multiple of page size)
+    HsaMemFlags     MemFlags,       //IN
+    void**          MemoryAddress   //IN/OUT
+    );
+
+/**
+  Returns the call sites of tracked allocations, ordered by the memory
+  they still have allocated, most first. Allocations and registrations
+  are tracked if HSA_ALLOC_TRACK is set to N when KFD is opened, 1 in N
+  of them with their call stack. On input NumSites is the size of the
+  Sites array, on output the number of sites returned.
+
+  Returns HSAKMT_STATUS_NOT_SUPPORTED if tracking is disabled.
+*/
+HSAKMT_STATUS
+HSAKMTAPI
+hsaKmtGetAllocationSites(
+    HsaAllocationSite*  Sites,          //OUT
+    HSAuint32*          NumSites        //IN/OUT
+    );
+
+/**
+  Prints the MaxSites call sites with the most allocated memory and
+  their call stacks to stderr, like the report printed by
+  hsaKmtCloseKFD when tracked memory was not freed.
+
+  Returns HSAKMT_STATUS_NOT_SUPPORTED if tracking is disabled.
+*/
+HSAKMT_STATUS
+HSAKMTAPI
+hsaKmtDumpAllocationSites(
+    HSAuint32           MaxSites        //IN
+    );
+
 #ifdef __cplusplus
 }   //extern "C"
 #endif
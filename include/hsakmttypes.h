@@ -539,7 +539,11 @@ typedef struct _HsaMemFlags
 					    // and optimal alignment requirements
             unsigned int FixedAddress : 1; // Allocate memory at specified virtual address. Fail if address is not free.
             unsigned int NoNUMABind:    1; // Don't bind system memory to a specific NUMA node
-            unsigned int Reserved    : 15;
+            unsigned int Populate    :  1; // Fault in paged system memory when it is allocated, using
+                                           // threads on the CPUs of its NUMA node
+            unsigned int Interleave  :  1; // Interleave paged system memory pages across the NUMA nodes
+                                           // nearest to all GPUs, see hsaKmtAllocMemoryInterleaved
+            unsigned int Reserved    : 13;
 
         } ui32;
         HSAuint32 Value;
@@ -1270,7 +1274,11 @@ typedef enum _HSA_POINTER_TYPE {
 typedef struct _HsaPointerInfo {
     HSA_POINTER_TYPE   Type;             // Pointer type
     HSAuint32          Node;             // Node where the memory is located
-    HsaMemFlags        MemFlags;         // Only valid for HSA_POINTER_ALLOCATED
+    HsaMemFlags        MemFlags;         // Only valid for HSA_POINTER_ALLOCATED. For paged
+                                         // system memory, PageSize is 2MB only if huge pages
+                                         // were obtained when it was allocated, and Interleave
+                                         // is set only if its pages are interleaved across
+                                         // NUMA nodes. Node is then the first of those nodes.
     void               *CPUAddress;      // Start address for CPU access
     HSAuint64          GPUAddress;       // Start address for GPU access
     HSAuint64          SizeInBytes;      // Size in bytes
@@ -1283,11 +1291,89 @@ typedef struct _HsaPointerInfo {
 
 typedef HSAuint32 HsaSharedMemoryHandle[8];
 
+typedef struct _HsaMemoryMapRequest {
+    void               *MemoryAddress;   // Start of the allocation to (un)map
+    HSAuint64          SizeInBytes;      // Size of the allocation
+    HSAuint32          NumberOfNodes;    // Nodes in NodeArray, 0 for all nodes
+    HSAuint32          *NodeArray;       // Nodes to (un)map the allocation on
+    HSAKMT_STATUS      Status;           // Result for this allocation
+} HsaMemoryMapRequest;
+
 typedef struct _HsaMemoryRange {
 	void               *MemoryAddress;   // Pointer to GPU memory
 	HSAuint64          SizeInBytes;      // Size of above memory
 } HsaMemoryRange;
 
+typedef enum _HSA_MEMORY_CACHE_TYPE {
+    HSA_MEMORY_CACHE_POINTER_LOOKUP = 0, // Per-thread cache of pointer to allocation lookups
+    HSA_MEMORY_CACHE_BUFFER_OBJECT  = 1, // Freed buffer objects kept for reuse, see HSA_BO_CACHE_MB
+    HSA_MEMORY_CACHE_USERPTR        = 2, // Userptr BOs shared by registrations, see HSA_USERPTR_CACHE_MB
+    HSA_MEMORY_CACHE_IPC_IMPORT     = 3, // Imported IPC buffers shared by registrations, see HSA_IPC_CACHE_MB
+    HSA_MEMORY_CACHE_NUM_TYPES
+} HSA_MEMORY_CACHE_TYPE;
+
+typedef struct _HsaMemoryCacheStats {
+    HSAuint64          Hits;             // Lookups satisfied from the cache
+    HSAuint64          Misses;           // Lookups that were not
+    HSAuint64          BytesCached;      // Size of the objects currently cached
+    HSAuint64          Evictions;        // Objects dropped from the cache
+    HSAuint64          Reserved[4];      // Reserved for future extension
+} HsaMemoryCacheStats;
+
+typedef struct _HsaVirtualMemoryStats {
+    HSAuint64          MapCount;         // Memory mappings (VMAs) of the process
+    HSAuint64          MaxMapCount;      // Limit of mappings (vm.max_map_count), 0 if unknown
+    HSAuint64          Headroom;         // MaxMapCount - MapCount
+    HSAuint64          ApertureMappings; // Mappings the SVM apertures are estimated to use
+    HSAuint64          ApertureAreas;    // Address ranges allocated in the SVM apertures
+    HSAuint64          Recounts;         // Times the mappings of the process were counted
+    HSAuint64          Refused;          // Allocations refused to keep headroom below the limit
+    HSAuint64          Reserved[4];      // Reserved for future extension
+} HsaVirtualMemoryStats;
+
+typedef enum _HSA_MEMORY_APERTURE {
+    HSA_MEMORY_APERTURE_SVM          = 0, // dGPU SVM aperture shared by all GPUs
+    HSA_MEMORY_APERTURE_SVM_COHERENT = 1, // Coherent SVM aperture, the same as SVM on GFXv9 and later
+    HSA_MEMORY_APERTURE_GPUVM        = 2, // Per-GPU GPUVM aperture on APUs
+    HSA_MEMORY_APERTURE_SCRATCH      = 3, // Per-GPU scratch backing memory
+    HSA_MEMORY_APERTURE_CPUVM        = 4, // System memory on APUs that is not mapped to GPUs
+    HSA_MEMORY_APERTURE_NUM_TYPES
+} HSA_MEMORY_APERTURE;
+
+typedef struct _HsaApertureStats {
+    HSAuint64          ObjectCount;      // Live allocations and registrations
+    HSAuint64          ObjectBytes;      // Size of the above
+    HSAuint64          AreaCount;        // Allocated address ranges
+    HSAuint64          AreaBytes;        // Size of the above without guard pages
+    HSAuint64          ReservedBytes;    // Address space reserved for the aperture
+    HSAuint64          UnbackedBytes;    // Allocated address space without objects
+    HSAuint64          GuardBytes;       // Guard pages after allocated ranges
+    HSAuint64          HoleCount;        // Free ranges, 0 if the kernel manages the address space
+    HSAuint64          LargestHole;      // Size of the largest free range
+    HSAuint64          UserptrCount;     // Registered system memory ranges
+    HSAuint64          UserptrBytes;     // Size of the above, pinned while registered
+    HSAuint64          Reserved[4];      // Reserved for future extension
+} HsaApertureStats;
+
+// Opaque handle of a memory arena, see hsaKmtCreateMemoryArena
+typedef struct _HsaMemoryArena *HSA_MEMORY_ARENA;
+
+#define HSA_ALLOCATION_SITE_FRAMES 12
+
+// Call site of allocations, see hsaKmtGetAllocationSites. The counts are
+// those of the tracked allocations multiplied by SampleRate.
+typedef struct _HsaAllocationSite {
+    HSAuint64          LiveBytes;        // Allocated here and not freed yet
+    HSAuint64          LiveCount;        // Allocations of the above
+    HSAuint64          PeakBytes;        // Largest LiveBytes so far
+    HSAuint64          TotalBytes;       // Allocated here since tracking started
+    HSAuint64          TotalCount;       // Allocations of the above
+    HSAuint32          SampleRate;       // 1 in SampleRate allocations is tracked
+    HSAuint32          NumFrames;        // Valid entries in Frames
+    void*              Frames[HSA_ALLOCATION_SITE_FRAMES]; // Return addresses, innermost first
+    HSAuint64          Reserved[4];      // Reserved for future extension
+} HsaAllocationSite;
+
 #pragma pack(pop, hsakmttypes_h)
 
 
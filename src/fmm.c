@@ -23,6 +23,7 @@
  * DEALINGS IN THE SOFTWARE.
  */
 
+#define _GNU_SOURCE /* for writer-preferring rwlocks */
 #include "fmm.h"
 #include "linux/kfd_ioctl.h"
 #include "libhsakmt.h"
@@ -35,7 +36,14 @@
 #include <inttypes.h>
 #include <sys/mman.h>
 #include <sys/time.h>
+#include <time.h>
 #include <errno.h>
+#include <signal.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <execinfo.h>
 #include <pci/pci.h>
 #include <numa.h>
 #include <numaif.h>
@@ -47,6 +55,21 @@
 #define MPOL_F_STATIC_NODES     (1 << 15)
 #endif
 
+/* Not defined by older C libraries */
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#define MADV_POPULATE_WRITE 23
+#endif
+#ifndef MADV_COLLAPSE
+#define MADV_COLLAPSE 25
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
 #define NON_VALID_GPU_ID 0
 
 #define INIT_MANAGEABLE_APERTURE(base_value, limit_value) {	\
@@ -55,7 +78,7 @@
 	.align = 0,						\
 	.guard_pages = 1,					\
 	.vm_ranges = NULL,					\
-	.fmm_mutex = PTHREAD_MUTEX_INITIALIZER,			\
+	.fmm_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP,	\
 	.is_cpu_accessible = false,				\
 	.ops = &reserved_aperture_ops				\
 	}
@@ -75,28 +98,39 @@
 #define vm_object_tree(app, is_userptr)				\
 		((is_userptr) ? &(app)->user_tree : &(app)->tree)
 
+#define vm_area_entry(n) rb_entry(n, vm_area_t, node)
+
+/* Sets of GPUs are bitmasks of gpu_mem[] indices. They are translated
+ * to arrays of KFD gpu_ids only at the ioctl boundary.
+ */
+typedef uint64_t gpu_mask_t;
+#define FMM_MAX_GPUS (sizeof(gpu_mask_t) * 8)
+#define GPU_MASK(gpu_mem_id) ((gpu_mask_t)1 << (gpu_mem_id))
+
+/* vm_objects and vm_areas are allocated from per-aperture slabs aligned
+ * to the cache line size. The fields used by tree lookups come first so
+ * that they share the first cache lines.
+ */
 struct vm_object {
+	rbtree_node_t node;
 	void *start;
-	void *userptr;
-	uint64_t userptr_size;
 	uint64_t size; /* size allocated on GPU. When the user requests a random
 			* size, Thunk aligns it to page size and allocates this
 			* aligned size on GPU
 			*/
 	uint64_t handle; /* opaque */
-	uint32_t node_id;
-	rbtree_node_t node;
+	void *userptr;
+	uint64_t userptr_size;
 	rbtree_node_t user_node;
+	uint32_t node_id;
 
 	uint32_t flags; /* memory allocation flags */
 	/* Registered nodes to map on SVM mGPU */
-	uint32_t *registered_device_id_array;
-	uint32_t registered_device_id_array_size;
+	gpu_mask_t registered_gpus;
 	uint32_t *registered_node_id_array;
 	uint32_t registration_count; /* the same memory region can be registered multiple times */
 	/* Nodes that mapped already */
-	uint32_t *mapped_device_id_array;
-	uint32_t mapped_device_id_array_size;
+	gpu_mask_t mapped_gpus;
 	uint32_t *mapped_node_id_array;
 	uint32_t mapping_count;
 	/* Metadata of imported graphics buffers */
@@ -105,20 +139,76 @@ struct vm_object {
 	void *user_data;
 	/* Flag to indicate imported KFD buffer */
 	bool is_imported_kfd_bo;
+	/* Flag to indicate the BO was exported to other processes */
+	bool is_exported;
+	/* Queued for a deferred free */
+	bool free_pending;
+	/* GPU and KFD allocation flags of BOs that can be kept in the BO
+	 * cache when freed. alloc_gpu_id is 0 for all other objects.
+	 */
+	uint32_t alloc_gpu_id;
+	uint32_t alloc_ioc_flags;
+	/* BO shared with other objects, NULL for objects with their own BO */
+	struct shared_bo *shared_bo;
+	/* All BOs of a userptr that was split into several BOs, the first
+	 * one is handle. NULL for objects with a single BO.
+	 */
+	uint64_t *split_handles;
+	uint32_t num_split_handles;
+	/* Call site that allocated or registered the memory when it was
+	 * sampled by the allocation tracker, NULL otherwise
+	 */
+	struct alloc_site *site;
+	/* Cached import of an IPC buffer, NULL for other objects */
+	struct ipc_import *ipc_import;
 };
 typedef struct vm_object vm_object_t;
 
 struct vm_area {
+	/* Node in the aperture's area_tree, keyed by start address. The
+	 * augmented value is the size of the largest hole preceding any
+	 * area in this subtree.
+	 */
+	rbtree_node_t node;
 	void *start;
 	void *end;
 	struct vm_area *next;
 	struct vm_area *prev;
+	/* Whether there is free address space before the area, counted in
+	 * the aperture's num_holes
+	 */
+	bool has_hole;
 };
 typedef struct vm_area vm_area_t;
 
+#define VM_SLAB_SIZE	(64 * 1024)
+#define VM_SLAB_ALIGN	64	/* CPU cache line size */
+
+typedef struct vm_slab {
+	struct vm_slab *next;
+} vm_slab_t;
+
+/* Allocator for fixed-size metadata of an aperture, protected by the
+ * aperture's fmm_lock. Freed entries go to a free list for reuse.
+ * Slabs are only returned to the system all at once.
+ */
+typedef struct {
+	void *free_list;
+	vm_slab_t *slabs;
+} vm_slab_cache_t;
+
 /* Memory manager for an aperture */
 typedef struct manageable_aperture manageable_aperture_t;
 
+/* Address range that was already mapped by someone else when a growable
+ * aperture grew over it
+ */
+typedef struct aperture_skip {
+	void *start;
+	void *end;
+	struct aperture_skip *next;
+} aperture_skip_t;
+
 /* Aperture management function pointers to allow different management
  * schemes.
  */
@@ -157,11 +247,50 @@ struct manageable_aperture {
 	uint64_t align;
 	uint32_t guard_pages;
 	vm_area_t *vm_ranges;
+	rbtree_t area_tree;
 	rbtree_t tree;
 	rbtree_t user_tree;
-	pthread_mutex_t fmm_mutex;
+	pthread_rwlock_t fmm_lock;
 	bool is_cpu_accessible;
 	const manageable_aperture_ops_t *ops;
+	vm_slab_cache_t object_cache;
+	vm_slab_cache_t area_cache;
+	/* Changed whenever an object is added or removed. Invalidates
+	 * cached lookup results, see vm_lookup_cache_find.
+	 */
+	uint64_t generation;
+	/* A sharded aperture doesn't manage any areas or objects itself.
+	 * Its range is split into num_shards independently locked
+	 * apertures of shard_size bytes each, see aperture_shard.
+	 */
+	manageable_aperture_t *shards;
+	uint32_t num_shards;
+	uint64_t shard_size;
+	/* Number of objects in user_tree. Read without the lock to skip
+	 * shards without userptrs.
+	 */
+	uint32_t num_userptrs;
+	/* Number of allocated address ranges and their size without guard
+	 * pages, updated atomically because mmap apertures are not locked
+	 */
+	uint32_t num_areas;
+	uint64_t area_bytes;
+	/* Statistics of the objects and free ranges, protected by fmm_lock.
+	 * See fmm_get_aperture_stats.
+	 */
+	uint32_t num_objects;
+	uint64_t object_bytes;
+	uint64_t userptr_bytes;
+	uint32_t num_holes;
+	/* A growable reserved aperture only has base to reserved_limit
+	 * reserved and reserves more on demand, up to grow_limit. NULL if
+	 * the whole aperture is reserved. Ranges in skipped, sorted by
+	 * address, belong to someone else and are kept out of the
+	 * allocator by areas of their own. See reserved_aperture_grow.
+	 */
+	void *reserved_limit;
+	void *grow_limit;
+	aperture_skip_t *skipped;
 };
 
 typedef struct {
@@ -205,14 +334,34 @@ typedef struct {
 	/* whether to use userptr for paged memory */
 	bool userptr_for_paged_mem;
 
+	/* huge pages for all paged memory, not only on request */
+	bool paged_huge_all;
+
+	/* try hugetlbfs pages before transparent huge pages */
+	bool paged_hugetlb;
+
+	/* populate paged memory with huge pages when it is allocated */
+	bool paged_huge_populate;
+
 	/* whether to check userptrs on registration */
 	bool check_userptr;
 
+	/* split larger userptrs into BOs of this size, 0 to disable */
+	uint64_t userptr_split_size;
+
 	/* whether to check reserve svm on registration */
 	bool reserve_svm;
 
 	/* whether all memory is coherent (GPU cache disabled) */
 	bool disable_cache;
+
+	/* maximum number of shards per reserved SVM aperture */
+	uint32_t max_shards;
+
+	/* grow reserved SVM apertures in steps of this size instead of
+	 * reserving them completely, 0 to disable
+	 */
+	uint64_t grow_size;
 } svm_t;
 
 /* The other apertures are specific to each GPU. gpu_mem_t manages GPU
@@ -241,9 +390,47 @@ static svm_t svm = {
  */
 static manageable_aperture_t cpuvm_aperture = INIT_MANAGEABLE_APERTURE(0, 0);
 
-/* GPU node array for default mappings */
-static uint32_t all_gpu_id_array_size;
-static uint32_t *all_gpu_id_array;
+/* Per-thread cache of recent vm_find_object results. Entries are keyed
+ * by the looked up address and size, not by object ranges, because
+ * objects can overlap. An entry is valid while the generation of its
+ * aperture is unchanged. fmm_epoch changes when apertures are torn down,
+ * so stale entries never dereference freed apertures.
+ */
+#define VM_LOOKUP_CACHE_SIZE 8
+
+typedef struct {
+	const void *addr;
+	uint64_t size;
+	manageable_aperture_t *aper;
+	vm_object_t *obj;
+	uint64_t generation;
+	uint64_t epoch;
+} vm_lookup_cache_entry_t;
+
+static __thread vm_lookup_cache_entry_t vm_lookup_cache[VM_LOOKUP_CACHE_SIZE];
+static __thread unsigned int vm_lookup_cache_next;
+static uint64_t fmm_epoch = 1;
+
+/* Hits and misses are counted per thread and added to the process-wide
+ * counters in batches, to keep atomics out of the lookup path
+ */
+#define VM_LOOKUP_STATS_BATCH 256
+
+static __thread uint32_t vm_lookup_pending_hits, vm_lookup_pending_misses;
+static uint64_t vm_lookup_hits, vm_lookup_misses;
+
+/* Reserved SVM apertures are sharded to let threads allocate in
+ * parallel. Each thread prefers one shard, assigned round-robin on its
+ * first allocation. 0 means not assigned yet.
+ */
+#define SVM_DEFAULT_MAX_SHARDS 8
+#define SVM_MIN_SHARD_SIZE (64ULL << 30)
+
+static __thread uint32_t svm_thread_shard;
+static uint32_t svm_next_shard;
+
+/* GPUs for default mappings */
+static gpu_mask_t all_gpu_mask;
 
 /* IPC structures and helper functions */
 typedef enum _HSA_APERTURE {
@@ -290,25 +477,169 @@ static int __fmm_release(vm_object_t *object, manageable_aperture_t *aperture);
 static int _fmm_unmap_from_gpu_scratch(uint32_t gpu_id,
 				       manageable_aperture_t *aperture,
 				       void *address);
-static void print_device_id_array(uint32_t *device_id_array, uint32_t device_id_array_size);
+static int _fmm_unmap_from_gpu(manageable_aperture_t *aperture, void *address,
+		gpu_mask_t nodes_to_unmap, vm_object_t *obj);
+static void print_gpu_mask(gpu_mask_t mask);
+static void *fmm_allocate_host_gpu(uint32_t node_id, uint64_t numa_mask,
+				   void *address, uint64_t MemorySizeInBytes,
+				   HsaMemFlags flags);
+static void fmm_prefault_range(void *addr, uint64_t size, bool check);
+static bool vma_budget_reserve(manageable_aperture_t *app);
+static void vma_budget_released(manageable_aperture_t *app);
+static void vma_budget_unreserve(manageable_aperture_t *app);
+static void fmm_populate_host_memory(uint32_t node_id, void *mem,
+				     uint64_t size);
+static void alloc_site_release(struct alloc_site *site, uint64_t size);
+
+/* Aperture locks are reader-writer locks. Lookups that don't modify
+ * the aperture or its objects take them for reading. Writers are
+ * preferred, so a steady stream of lookups can't starve allocations.
+ */
+static void fmm_init_lock(pthread_rwlock_t *lock)
+{
+	pthread_rwlockattr_t attr;
+
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr,
+			PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+}
+
+static inline void fmm_lock_aperture(manageable_aperture_t *app,
+				     bool exclusive)
+{
+	if (exclusive)
+		pthread_rwlock_wrlock(&app->fmm_lock);
+	else
+		pthread_rwlock_rdlock(&app->fmm_lock);
+}
+
+/* Size of the hole between an area and the previous one. The hole
+ * before the first area is measured from address 0. The aperture base
+ * is applied when the hole is actually used.
+ */
+static uint64_t vm_area_hole_size(vm_area_t *area)
+{
+	uint64_t prev_end = area->prev ? (uint64_t)area->prev->end + 1 : 0;
+
+	return (uint64_t)area->start - prev_end;
+}
+
+static void vm_area_augment(rbtree_node_t *n, rbtree_node_t *sentinel)
+{
+	uint64_t hole = vm_area_hole_size(vm_area_entry(n));
+
+	/* The sentinel's augmented value is 0 */
+	hole = MAX(hole, n->left->augmented);
+	n->augmented = MAX(hole, n->right->augmented);
+}
+
+/* Count the hole before area in num_holes if there is one. Unlike the
+ * free-hole index, the hole before the first area starts at the
+ * aperture base.
+ */
+static void vm_area_count_hole(manageable_aperture_t *app, vm_area_t *area)
+{
+	bool has_hole = area->prev ? vm_area_hole_size(area) > 0 :
+				     area->start > app->base;
+
+	if (has_hole != area->has_hole) {
+		app->num_holes += has_hole ? 1 : -1;
+		area->has_hole = has_hole;
+	}
+}
+
+/* Update the free-hole index after the hole before area changed size */
+static void vm_area_hole_changed(manageable_aperture_t *app, vm_area_t *area)
+{
+	if (area) {
+		rbtree_augment_propagate(&app->area_tree, &area->node);
+		vm_area_count_hole(app, area);
+	}
+}
+
+static void *vm_slab_alloc(vm_slab_cache_t *cache, uint64_t size)
+{
+	uint64_t obj_size = ALIGN_UP(size, VM_SLAB_ALIGN);
+	vm_slab_t *slab;
+	char *obj;
+	void *mem;
+
+	if (!cache->free_list) {
+		if (posix_memalign(&mem, VM_SLAB_ALIGN, VM_SLAB_SIZE))
+			return NULL;
+
+		slab = mem;
+		slab->next = cache->slabs;
+		cache->slabs = slab;
+
+		/* The first cache line holds the slab header. Build the
+		 * free list backwards so that entries are handed out in
+		 * address order.
+		 */
+		obj = (char *)slab + VM_SLAB_ALIGN +
+			(VM_SLAB_SIZE - VM_SLAB_ALIGN) / obj_size * obj_size;
+		while ((obj -= obj_size) > (char *)slab) {
+			*(void **)obj = cache->free_list;
+			cache->free_list = obj;
+		}
+	}
+
+	obj = cache->free_list;
+	cache->free_list = *(void **)obj;
+
+	return obj;
+}
+
+static void vm_slab_free(vm_slab_cache_t *cache, void *obj)
+{
+	*(void **)obj = cache->free_list;
+	cache->free_list = obj;
+}
+
+/* Release all slabs. Everything allocated from the cache is freed. */
+static void vm_slab_cache_destroy(vm_slab_cache_t *cache)
+{
+	vm_slab_t *slab;
+
+	while ((slab = cache->slabs)) {
+		cache->slabs = slab->next;
+		free(slab);
+	}
+	cache->free_list = NULL;
+}
+
+/* Invalidate cached lookups in this aperture. Call with fmm_lock write-locked
+ * whenever an object is added to or removed from the aperture's trees.
+ */
+static void vm_objects_changed(manageable_aperture_t *app)
+{
+	app->generation++;
+}
 
-static vm_area_t *vm_create_and_init_area(void *start, void *end)
+static vm_area_t *vm_create_and_init_area(manageable_aperture_t *app,
+					  void *start, void *end)
 {
-	vm_area_t *area = (vm_area_t *) malloc(sizeof(vm_area_t));
+	vm_area_t *area = vm_slab_alloc(&app->area_cache, sizeof(vm_area_t));
 
 	if (area) {
 		area->start = start;
 		area->end = end;
 		area->next = area->prev = NULL;
+		area->has_hole = false;
+		area->node.key = rbtree_key((unsigned long)start, 0);
 	}
 
 	return area;
 }
 
-static vm_object_t *vm_create_and_init_object(void *start, uint64_t size,
+static vm_object_t *vm_create_and_init_object(manageable_aperture_t *app,
+					      void *start, uint64_t size,
 					      uint64_t handle, uint32_t flags)
 {
-	vm_object_t *object = (vm_object_t *) malloc(sizeof(vm_object_t));
+	vm_object_t *object = vm_slab_alloc(&app->object_cache,
+					    sizeof(vm_object_t));
 
 	if (object) {
 		object->start = start;
@@ -316,10 +647,8 @@ static vm_object_t *vm_create_and_init_object(void *start, uint64_t size,
 		object->userptr_size = 0;
 		object->size = size;
 		object->handle = handle;
-		object->registered_device_id_array_size = 0;
-		object->mapped_device_id_array_size = 0;
-		object->registered_device_id_array = NULL;
-		object->mapped_device_id_array = NULL;
+		object->registered_gpus = 0;
+		object->mapped_gpus = 0;
 		object->registered_node_id_array = NULL;
 		object->mapped_node_id_array = NULL;
 		object->registration_count = 0;
@@ -328,6 +657,15 @@ static vm_object_t *vm_create_and_init_object(void *start, uint64_t size,
 		object->metadata = NULL;
 		object->user_data = NULL;
 		object->is_imported_kfd_bo = false;
+		object->is_exported = false;
+		object->free_pending = false;
+		object->alloc_gpu_id = 0;
+		object->alloc_ioc_flags = 0;
+		object->shared_bo = NULL;
+		object->split_handles = NULL;
+		object->num_split_handles = 0;
+		object->site = NULL;
+		object->ipc_import = NULL;
 		object->node.key = rbtree_key((unsigned long)start, size);
 		object->user_node.key = rbtree_key(0, 0);
 	}
@@ -352,18 +690,17 @@ static void vm_remove_area(manageable_aperture_t *app, vm_area_t *area)
 	if (next) /* If not the last element */
 		next->prev = prev;
 
-	free(area);
+	rbtree_delete(&app->area_tree, &area->node);
+	vm_area_hole_changed(app, next);
+	if (area->has_hole)
+		app->num_holes--;
+
+	vm_slab_free(&app->area_cache, area);
 }
 
-static void vm_remove_object(manageable_aperture_t *app, vm_object_t *object)
+/* Free allocations inside the object */
+static void vm_free_object_arrays(vm_object_t *object)
 {
-	/* Free allocations inside the object */
-	if (object->registered_device_id_array)
-		free(object->registered_device_id_array);
-
-	if (object->mapped_device_id_array)
-		free(object->mapped_device_id_array);
-
 	if (object->metadata)
 		free(object->metadata);
 
@@ -371,24 +708,53 @@ static void vm_remove_object(manageable_aperture_t *app, vm_object_t *object)
 		free(object->registered_node_id_array);
 	if (object->mapped_node_id_array)
 		free(object->mapped_node_id_array);
+	if (object->split_handles)
+		free(object->split_handles);
+}
+
+static void vm_remove_object(manageable_aperture_t *app, vm_object_t *object)
+{
+	vm_free_object_arrays(object);
 
 	rbtree_delete(&app->tree, &object->node);
-	if (object->userptr)
+	app->num_objects--;
+	app->object_bytes -= object->size;
+	if (object->site)
+		alloc_site_release(object->site, object->size);
+	if (object->userptr) {
 		rbtree_delete(&app->user_tree, &object->user_node);
+		__atomic_sub_fetch(&app->num_userptrs, 1, __ATOMIC_RELAXED);
+		app->userptr_bytes -= object->userptr_size;
+	}
+	vm_objects_changed(app);
 
-	free(object);
+	vm_slab_free(&app->object_cache, object);
 }
 
-static void vm_add_area_after(vm_area_t *after_this, vm_area_t *new_area)
+/* Insert new_area after after_this, or at the head of the list if
+ * after_this is NULL
+ */
+static void vm_add_area_after(manageable_aperture_t *app,
+			      vm_area_t *after_this, vm_area_t *new_area)
 {
-	vm_area_t *next = after_this->next;
+	vm_area_t *next = after_this ? after_this->next : app->vm_ranges;
 
-	after_this->next = new_area;
+	if (after_this)
+		after_this->next = new_area;
+	else
+		app->vm_ranges = new_area;
 	new_area->next = next;
 
 	new_area->prev = after_this;
 	if (next)
 		next->prev = new_area;
+
+	/* The list must be linked before inserting, the augment callback
+	 * uses the previous area to compute the hole size
+	 */
+	rbtree_insert(&app->area_tree, &new_area->node);
+	vm_area_count_hole(app, new_area);
+	vm_area_hole_changed(app, next);
 }
 
 static void vm_split_area(manageable_aperture_t *app, vm_area_t *area,
@@ -398,14 +764,17 @@ static void vm_split_area(manageable_aperture_t *app, vm_area_t *area,
 	 * The existing area is split to: [area->start, address - 1]
 	 * and [address + MemorySizeInBytes, area->end]
 	 */
-	vm_area_t *new_area = vm_create_and_init_area(
+	vm_area_t *new_area = vm_create_and_init_area(app,
 				VOID_PTR_ADD(address, MemorySizeInBytes),
 				area->end);
 
+	if (!new_area)
+		return;
+
 	/* Shrink the existing area */
 	area->end = VOID_PTR_SUB(address, 1);
 
-	vm_add_area_after(area, new_area);
+	vm_add_area_after(app, area, new_area);
 }
 
 static vm_object_t *vm_find_object_by_address_userptr(manageable_aperture_t *app,
@@ -454,57 +823,17 @@ static vm_object_t *vm_find_object_by_address_userptr(manageable_aperture_t *app
 }
 
 
+/* Find the object containing address. If several objects overlap at
+ * address, e.g. userptrs registered for overlapping ranges, the one with
+ * the lowest start address is returned.
+ */
 static vm_object_t *vm_find_object_by_address_userptr_range(manageable_aperture_t *app,
 						    const void *address, int is_userptr)
 {
-	vm_object_t *cur = NULL;
 	rbtree_t *tree = vm_object_tree(app, is_userptr);
-	rbtree_key_t key = rbtree_key((unsigned long)address, 0);
-	rbtree_node_t *ln = rbtree_lookup_nearest(tree, &key,
-			LKP_ALL, LEFT);
-	rbtree_node_t *rn = rbtree_lookup_nearest(tree, &key,
-			LKP_ALL, RIGHT);
-	void *start;
-	uint64_t size;
-	int bad = 0;
-
-loop:
-	while (ln) {
-		cur = vm_object_entry(ln, is_userptr);
-		if (is_userptr == 0) {
-			start = cur->start;
-			size = cur->size;
-		} else {
-			start = cur->userptr;
-			size = cur->userptr_size;
-		}
-
-		if (address >= start &&
-				(uint64_t)address < ((uint64_t)start + size))
-			break;
-
-		cur = NULL;
-
-		if (ln == rn)
-			break;
+	rbtree_node_t *n = rbtree_lookup_interval(tree, (unsigned long)address);
 
-		ln = rbtree_next(tree, ln);
-	}
-
-	if (cur == NULL && bad == 0) {
-		/* As there is area overlap, say, (address, size) like
-		 * (0x100, 32), (0x108, 8), and the key.address is 0x118
-		 * The lookup above only find (0x108, 8), but the correct node should
-		 * be (0x100, 16). So try to walk though the tree to find the node.
-		 */
-		rn = ln;
-		key = rbtree_key(0, 0);
-		ln = rbtree_lookup_nearest(tree, &key, LKP_ALL, RIGHT);
-		bad = 1;
-		goto loop;
-	}
-
-	return cur; /* NULL if not found */
+	return n ? vm_object_entry(n, is_userptr) : NULL;
 }
 
 static vm_object_t *vm_find_object_by_address(manageable_aperture_t *app,
@@ -531,18 +860,66 @@ static vm_object_t *vm_find_object_by_userptr_range(manageable_aperture_t *app,
 	return vm_find_object_by_address_userptr_range(app, address, 1);
 }
 
+/* Find the last area starting at or below address, NULL if none */
+static vm_area_t *vm_find_preceding(manageable_aperture_t *app,
+				    const void *address)
+{
+	rbtree_key_t key = rbtree_key((unsigned long)address, 0);
+	rbtree_node_t *n = rbtree_lookup_nearest(&app->area_tree, &key,
+						 LKP_ADDR, LEFT);
+
+	return n ? vm_area_entry(n) : NULL;
+}
+
 static vm_area_t *vm_find(manageable_aperture_t *app, void *address)
 {
-	vm_area_t *cur = app->vm_ranges;
+	vm_area_t *cur = vm_find_preceding(app, address);
 
-	/* Look up the appropriate address range containing the given address */
-	while (cur) {
-		if (cur->start <= address && cur->end >= address)
-			break;
-		cur = cur->next;
-	};
+	/* Check that the area actually contains the given address */
+	if (cur && cur->end >= address)
+		return cur;
 
-	return cur; /* NULL if not found */
+	return NULL;
+}
+
+/* First address at or after the area prev (or the aperture base if prev
+ * is NULL) that satisfies the alignment and end-alignment offset
+ */
+static void *vm_hole_start(manageable_aperture_t *app, vm_area_t *prev,
+			   uint64_t align, uint64_t offset)
+{
+	uint64_t start = prev ? (uint64_t)prev->end + 1 : (uint64_t)app->base;
+
+	return (void *)(ALIGN_UP(start, align) + offset);
+}
+
+/* Find the lowest area that has a big enough hole before it for an
+ * aligned allocation of size bytes. Subtrees whose largest hole is
+ * smaller than min_hole are skipped. If min_hole is big enough for any
+ * alignment of the allocation, the first subtree that isn't skipped
+ * always contains a fit and this is O(log n).
+ */
+static vm_area_t *vm_find_hole(manageable_aperture_t *app, rbtree_node_t *n,
+			       uint64_t min_hole, uint64_t size,
+			       uint64_t align, uint64_t offset)
+{
+	vm_area_t *area;
+	void *start;
+
+	if (n == &app->area_tree.sentinel || n->augmented < min_hole)
+		return NULL;
+
+	area = vm_find_hole(app, n->left, min_hole, size, align, offset);
+	if (area)
+		return area;
+
+	area = vm_area_entry(n);
+	start = vm_hole_start(app, area->prev, align, offset);
+	if (area->start > start &&
+	    VOID_PTRS_SUB(area->start, start) >= size)
+		return area;
+
+	return vm_find_hole(app, n->right, min_hole, size, align, offset);
 }
 
 static bool aperture_is_valid(void *app_base, void *app_limit)
@@ -563,7 +940,7 @@ static uint64_t vm_align_area_size(manageable_aperture_t *app, uint64_t size)
 }
 
 /*
- * Assumes that fmm_mutex is locked on entry.
+ * Assumes that fmm_lock is write-locked on entry.
  */
 static void reserved_aperture_release(manageable_aperture_t *app,
 				      void *address,
@@ -585,15 +962,19 @@ static void reserved_aperture_release(manageable_aperture_t *app,
 		vm_remove_area(app, area);
 	} else if (SizeOfRegion > MemorySizeInBytes) {
 		/* shrink from the start */
-		if (area->start == address)
+		if (area->start == address) {
 			area->start =
 				VOID_PTR_ADD(area->start, MemorySizeInBytes);
+			/* Moving the start keeps the order in the tree */
+			area->node.key.addr = (unsigned long)area->start;
+			vm_area_hole_changed(app, area);
 		/* shrink from the end */
-		else if (VOID_PTRS_SUB(area->end, address) + 1 ==
-				MemorySizeInBytes)
+		} else if (VOID_PTRS_SUB(area->end, address) + 1 ==
+				MemorySizeInBytes) {
 			area->end = VOID_PTR_SUB(area->end, MemorySizeInBytes);
+			vm_area_hole_changed(app, area->next);
 		/* split the area */
-		else
+		} else
 			vm_split_area(app, area, address, MemorySizeInBytes);
 	}
 
@@ -620,8 +1001,117 @@ static void reserved_aperture_release(manageable_aperture_t *app,
 	}
 }
 
+static bool reserve_address_noreplace(void *addr, uint64_t size)
+{
+	void *ret = mmap(addr, size, PROT_NONE, MAP_ANONYMOUS | MAP_NORESERVE |
+			 MAP_PRIVATE | MAP_FIXED_NOREPLACE, -1, 0);
+
+	if (ret == addr)
+		return true;
+	/* Kernels before 4.17 treat the address as a hint */
+	if (ret != MAP_FAILED)
+		munmap(ret, size);
+	return false;
+}
+
+/* Keep the range start to end of a growable aperture out of the
+ * allocator. It must be after all areas.
+ */
+static int aperture_skip_range(manageable_aperture_t *app, void *start,
+			       void *end)
+{
+	aperture_skip_t *skip, **last = &app->skipped;
+	rbtree_node_t *n = rbtree_min_max(&app->area_tree, RIGHT);
+	vm_area_t *area;
+
+	while (*last)
+		last = &(*last)->next;
+
+	skip = malloc(sizeof(*skip));
+	if (!skip)
+		return -1;
+	area = vm_create_and_init_area(app, start, end);
+	if (!area) {
+		free(skip);
+		return -1;
+	}
+	vm_add_area_after(app, n ? vm_area_entry(n) : NULL, area);
+
+	skip->start = start;
+	skip->end = end;
+	skip->next = NULL;
+	*last = skip;
+
+	return 0;
+}
+
+/* Reserve address space of a growable aperture up to at least end.
+ * Growing in steps of svm.grow_size keeps the number of reservations
+ * low, they are merged with the previous one by the kernel.
+ *
+ * MAP_FIXED_NOREPLACE keeps anything mapped there in the meantime. If
+ * the step is partly in use, it is reserved in huge pages and the ones
+ * in use are skipped. Returns 1 if any were skipped, so that the caller
+ * needs to look for a free range again, 0 if the step was reserved
+ * completely and -1 if the aperture can't grow. Assumes that fmm_lock
+ * is write-locked.
+ */
+static int reserved_aperture_grow(manageable_aperture_t *app, void *end)
+{
+	void *start = VOID_PTR_ADD(app->reserved_limit, 1), *skip = NULL;
+	uint64_t size, offset;
+	int ret = 0;
+
+	if (end > app->grow_limit)
+		return -1;
+
+	size = ALIGN_UP(VOID_PTRS_SUB(end, app->reserved_limit),
+			GPU_HUGE_PAGE_SIZE);
+	size = MAX(size, svm.grow_size);
+	size = MIN(size, VOID_PTRS_SUB(app->grow_limit, app->reserved_limit));
+
+	if (!reserve_address_noreplace(start, size)) {
+		for (offset = 0; offset < size; offset += GPU_HUGE_PAGE_SIZE) {
+			void *addr = VOID_PTR_ADD(start, offset);
+			uint64_t n = MIN(GPU_HUGE_PAGE_SIZE, size - offset);
+
+			if (!reserve_address_noreplace(addr, n)) {
+				if (!skip)
+					skip = addr;
+				continue;
+			}
+			if (skip && aperture_skip_range(app, skip,
+						VOID_PTR_SUB(addr, 1))) {
+				/* Later steps aren't reserved yet, this one
+				 * is above the new limit
+				 */
+				munmap(addr, n);
+				goto fail;
+			}
+			skip = NULL;
+		}
+		if (skip && aperture_skip_range(app, skip,
+				VOID_PTR_ADD(start, size - 1)))
+			goto fail;
+		pr_info("SVM aperture %p - %p skipped address space in use below %p\n",
+			app->base, app->limit, VOID_PTR_ADD(start, size));
+		ret = 1;
+	}
+
+	app->reserved_limit = VOID_PTR_ADD(start, size - 1);
+	pr_debug("Grew SVM aperture %p - %p to %p\n", app->base, app->limit,
+		 app->reserved_limit);
+
+	return ret;
+
+fail:
+	/* Can't track more skipped ranges, stop growing here */
+	app->grow_limit = app->reserved_limit = VOID_PTR_SUB(skip, 1);
+	return -1;
+}
+
 /*
- * returns allocated address or NULL. Assumes, that fmm_mutex is locked
+ * returns allocated address or NULL. Assumes, that fmm_lock is write-locked
  * on entry.
  */
 static void *reserved_aperture_allocate_aligned(manageable_aperture_t *app,
@@ -631,7 +1121,8 @@ static void *reserved_aperture_allocate_aligned(manageable_aperture_t *app,
 {
 	uint64_t offset = 0, orig_align = align;
 	vm_area_t *cur, *next;
-	void *start;
+	void *start, *limit;
+	int r;
 
 	if (align < app->align)
 		align = app->align;
@@ -653,22 +1144,50 @@ static void *reserved_aperture_allocate_aligned(manageable_aperture_t *app,
 
 	MemorySizeInBytes = vm_align_area_size(app, MemorySizeInBytes);
 
-	/* Find a big enough "hole" in the address space */
-	cur = NULL;
-	next = app->vm_ranges;
-	start = address ? address :
-		(void *)(ALIGN_UP((uint64_t)app->base, align) + offset);
-	while (next) {
-		if (next->start > start &&
-		    VOID_PTRS_SUB(next->start, start) >= MemorySizeInBytes)
-			break;
-
-		cur = next;
-		next = next->next;
-		if (!address)
-			start = (void *)(ALIGN_UP((uint64_t)cur->end + 1, align) + offset);
+retry:
+	limit = app->reserved_limit ? app->grow_limit : app->limit;
+	if (address) {
+		/* The area preceding the required address and the one
+		 * after it bound the only hole that can contain it
+		 */
+		start = address;
+		cur = vm_find_preceding(app, address);
+		next = cur ? cur->next : app->vm_ranges;
+		if (next && VOID_PTRS_SUB(next->start, start) < MemorySizeInBytes)
+			/* Required address range overlaps the next area */
+			return NULL;
+	} else {
+		/* Find a big enough "hole" in the address space. Holes
+		 * that fit regardless of alignment are found quickly, then
+		 * the space after the last area is tried. Holes that only
+		 * fit after alignment are only searched if both fail
+		 * because that may scan many holes.
+		 */
+		next = vm_find_hole(app, app->area_tree.root,
+				    MemorySizeInBytes + offset + align - PAGE_SIZE,
+				    MemorySizeInBytes, align, offset);
+		if (next) {
+			cur = next->prev;
+		} else {
+			rbtree_node_t *n = rbtree_min_max(&app->area_tree, RIGHT);
+
+			cur = n ? vm_area_entry(n) : NULL;
+			start = vm_hole_start(app, cur, align, offset);
+			if (start > limit ||
+			    VOID_PTRS_SUB(limit, start) + 1 < MemorySizeInBytes) {
+				next = vm_find_hole(app, app->area_tree.root,
+						    MemorySizeInBytes,
+						    MemorySizeInBytes,
+						    align, offset);
+				if (!next)
+					return NULL;
+				cur = next->prev;
+			}
+		}
+		start = vm_hole_start(app, cur, align, offset);
 	}
-	if (!next && VOID_PTRS_SUB(app->limit, start) + 1 < MemorySizeInBytes)
+	if (!next && (start > limit ||
+		      VOID_PTRS_SUB(limit, start) + 1 < MemorySizeInBytes))
 		/* No hole found and not enough space after the last area */
 		return NULL;
 
@@ -676,24 +1195,31 @@ static void *reserved_aperture_allocate_aligned(manageable_aperture_t *app,
 		/* Required address is not free or overlaps */
 		return NULL;
 
+	if (app->reserved_limit &&
+	    VOID_PTR_ADD(start, MemorySizeInBytes - 1) > app->reserved_limit) {
+		r = reserved_aperture_grow(app,
+				VOID_PTR_ADD(start, MemorySizeInBytes - 1));
+		if (r < 0 && address)
+			return NULL;
+		if (r)
+			/* Look again around skipped ranges or within
+			 * the new grow_limit
+			 */
+			goto retry;
+	}
+
 	if (cur && VOID_PTR_ADD(cur->end, 1) == start) {
 		/* extend existing area */
 		cur->end = VOID_PTR_ADD(start, MemorySizeInBytes-1);
+		vm_area_hole_changed(app, next);
 	} else {
 		vm_area_t *new_area;
 		/* create a new area between cur and next */
-		new_area = vm_create_and_init_area(start,
+		new_area = vm_create_and_init_area(app, start,
 				VOID_PTR_ADD(start, (MemorySizeInBytes - 1)));
 		if (!new_area)
 			return NULL;
-		new_area->next = next;
-		new_area->prev = cur;
-		if (cur)
-			cur->next = new_area;
-		else
-			app->vm_ranges = new_area;
-		if (next)
-			next->prev = new_area;
+		vm_add_area_after(app, cur, new_area);
 	}
 
 	return start;
@@ -778,41 +1304,138 @@ static void *aperture_allocate_area_aligned(manageable_aperture_t *app,
 					    uint64_t MemorySizeInBytes,
 					    uint64_t align)
 {
-	return app->ops->allocate_area_aligned(app, address, MemorySizeInBytes, align);
+	void *mem = app->ops->allocate_area_aligned(app, address,
+						    MemorySizeInBytes, align);
+
+	if (mem) {
+		__atomic_add_fetch(&app->num_areas, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&app->area_bytes, MemorySizeInBytes,
+				   __ATOMIC_RELAXED);
+	}
+	return mem;
 }
 static void *aperture_allocate_area(manageable_aperture_t *app, void *address,
 				    uint64_t MemorySizeInBytes)
 {
-	return app->ops->allocate_area_aligned(app, address, MemorySizeInBytes, app->align);
+	return aperture_allocate_area_aligned(app, address, MemorySizeInBytes,
+					      app->align);
 }
 static void aperture_release_area(manageable_aperture_t *app, void *address,
 				  uint64_t MemorySizeInBytes)
 {
 	app->ops->release_area(app, address, MemorySizeInBytes);
+	__atomic_sub_fetch(&app->num_areas, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&app->area_bytes, MemorySizeInBytes,
+			   __ATOMIC_RELAXED);
+	vma_budget_released(app);
 }
 
-/* returns 0 on success. Assumes, that fmm_mutex is locked on entry */
-static vm_object_t *aperture_allocate_object(manageable_aperture_t *app,
-					     void *new_address,
-					     uint64_t handle,
-					     uint64_t MemorySizeInBytes,
-					     uint32_t flags)
+/* The shard of a sharded aperture that address belongs to. Addresses
+ * outside the aperture belong to the nearest shard. Apertures that
+ * aren't sharded are their own only shard.
+ */
+static manageable_aperture_t *aperture_shard(manageable_aperture_t *app,
+					     const void *address)
 {
-	vm_object_t *new_object;
+	uint64_t i;
 
-	/* Allocate new object */
-	new_object = vm_create_and_init_object(new_address,
-					       MemorySizeInBytes,
-					       handle, flags);
-	if (!new_object)
-		return NULL;
+	if (!app->num_shards)
+		return app;
 
-	rbtree_insert(&app->tree, &new_object->node);
+	if (address < app->base)
+		return &app->shards[0];
 
-	return new_object;
+	i = ((uint64_t)address - (uint64_t)app->base) / app->shard_size;
+	return &app->shards[MIN(i, app->num_shards - 1)];
 }
 
-static int32_t gpu_mem_find_by_gpu_id(uint32_t gpu_id)
+/* Allocate address space in an aperture and return the shard that owns
+ * it in *out_app. Objects in the new area must be created in that shard.
+ * Without a fixed address, threads start looking in their own shard and
+ * fall back to the others when it is full. The address space of mmap
+ * apertures is managed by the kernel, so they are not locked here.
+ */
+static void *fmm_allocate_va(manageable_aperture_t *app, void *address,
+			     uint64_t size, uint64_t align,
+			     manageable_aperture_t **out_app)
+{
+	manageable_aperture_t *shard = app;
+	void *mem = NULL;
+	uint32_t i, first;
+
+	if (!vma_budget_reserve(app))
+		return NULL;
+
+	if (app->ops == &mmap_aperture_ops) {
+		mem = aperture_allocate_area_aligned(app, address, size, align);
+	} else if (!app->num_shards || address) {
+		shard = aperture_shard(app, address);
+		pthread_rwlock_wrlock(&shard->fmm_lock);
+		mem = aperture_allocate_area_aligned(shard, address, size, align);
+		pthread_rwlock_unlock(&shard->fmm_lock);
+	} else {
+		if (!svm_thread_shard)
+			svm_thread_shard = __atomic_add_fetch(&svm_next_shard, 1,
+							      __ATOMIC_RELAXED);
+		first = svm_thread_shard;
+
+		for (i = 0; i < app->num_shards && !mem; i++) {
+			shard = &app->shards[(first + i) % app->num_shards];
+			pthread_rwlock_wrlock(&shard->fmm_lock);
+			mem = aperture_allocate_area_aligned(shard, NULL, size,
+							     align);
+			pthread_rwlock_unlock(&shard->fmm_lock);
+		}
+	}
+
+	if (!mem)
+		vma_budget_unreserve(app);
+
+	if (out_app)
+		*out_app = shard;
+	return mem;
+}
+
+/* Release address space allocated with fmm_allocate_va */
+static void fmm_release_va(manageable_aperture_t *app, void *address,
+			   uint64_t size)
+{
+	if (app->ops == &mmap_aperture_ops) {
+		aperture_release_area(app, address, size);
+		return;
+	}
+
+	app = aperture_shard(app, address);
+	pthread_rwlock_wrlock(&app->fmm_lock);
+	aperture_release_area(app, address, size);
+	pthread_rwlock_unlock(&app->fmm_lock);
+}
+
+/* returns 0 on success. Assumes, that fmm_lock is write-locked on entry */
+static vm_object_t *aperture_allocate_object(manageable_aperture_t *app,
+					     void *new_address,
+					     uint64_t handle,
+					     uint64_t MemorySizeInBytes,
+					     uint32_t flags)
+{
+	vm_object_t *new_object;
+
+	/* Allocate new object */
+	new_object = vm_create_and_init_object(app, new_address,
+					       MemorySizeInBytes,
+					       handle, flags);
+	if (!new_object)
+		return NULL;
+
+	rbtree_insert(&app->tree, &new_object->node);
+	app->num_objects++;
+	app->object_bytes += MemorySizeInBytes;
+	vm_objects_changed(app);
+
+	return new_object;
+}
+
+static int32_t gpu_mem_find_by_gpu_id(uint32_t gpu_id)
 {
 	uint32_t i;
 
@@ -823,6 +1446,56 @@ static int32_t gpu_mem_find_by_gpu_id(uint32_t gpu_id)
 	return -1;
 }
 
+/* Convert an array of gpu_ids to a GPU mask. Fails on unknown gpu_ids. */
+static bool gpu_ids_to_mask(const uint32_t *gpu_ids, uint32_t n_gpus,
+			    gpu_mask_t *mask)
+{
+	int32_t gpu_mem_id;
+	uint32_t i;
+
+	*mask = 0;
+	for (i = 0; i < n_gpus; i++) {
+		gpu_mem_id = gpu_mem_find_by_gpu_id(gpu_ids[i]);
+		if (gpu_mem_id < 0)
+			return false;
+		*mask |= GPU_MASK(gpu_mem_id);
+	}
+
+	return true;
+}
+
+/* Fill gpu_ids (or node_ids) of the GPUs in mask in gpu_mem[] order.
+ * The array must have room for FMM_MAX_GPUS entries. Returns the number
+ * of entries written.
+ */
+static uint32_t gpu_mask_to_ids(gpu_mask_t mask, uint32_t *ids, bool node_ids)
+{
+	uint32_t n = 0;
+	int gpu_mem_id;
+
+	while (mask) {
+		gpu_mem_id = __builtin_ctzll(mask);
+		mask &= mask - 1;
+		ids[n++] = node_ids ? gpu_mem[gpu_mem_id].node_id :
+				      gpu_mem[gpu_mem_id].gpu_id;
+	}
+
+	return n;
+}
+
+/* The GPUs of the first n entries gpu_mask_to_ids() returns for mask */
+static gpu_mask_t gpu_mask_first(gpu_mask_t mask, uint32_t n)
+{
+	gpu_mask_t first = 0;
+
+	while (mask && n--) {
+		first |= mask & -mask;
+		mask &= mask - 1;
+	}
+
+	return first;
+}
+
 static manageable_aperture_t *fmm_get_aperture(HsaApertureInfo info)
 {
 	switch (info.type) {
@@ -868,12 +1541,14 @@ static manageable_aperture_t *fmm_find_aperture(const void *address,
 
 			aperture = fmm_is_scratch_aperture(address);
 			if (!aperture) {
-				aperture = svm.dgpu_aperture;
+				aperture = aperture_shard(svm.dgpu_aperture,
+							  address);
 				_info.type = HSA_APERTURE_DGPU;
 			}
 		} else if (address >= svm.dgpu_alt_aperture->base &&
 			address <= svm.dgpu_alt_aperture->limit) {
-			aperture = svm.dgpu_alt_aperture;
+			aperture = aperture_shard(svm.dgpu_alt_aperture,
+						  address);
 			_info.type = HSA_APERTURE_DGPU_ALT;
 		} else {
 			/* Not in SVM, it can be system memory registered by userptr */
@@ -882,7 +1557,7 @@ static manageable_aperture_t *fmm_find_aperture(const void *address,
 		}
 	} else { /* APU */
 		if (address >= svm.dgpu_aperture->base && address <= svm.dgpu_aperture->limit) {
-			aperture = svm.dgpu_aperture;
+			aperture = aperture_shard(svm.dgpu_aperture, address);
 			_info.type = HSA_APERTURE_DGPU;
 		} else {
 			/* gpuvm_aperture */
@@ -941,12 +1616,12 @@ static vm_object_t *fmm_allocate_memory_object(uint32_t gpu_id, void *mem,
 		return NULL;
 
 	/* Allocate object */
-	pthread_mutex_lock(&aperture->fmm_mutex);
+	pthread_rwlock_wrlock(&aperture->fmm_lock);
 	vm_obj = aperture_allocate_object(aperture, mem, args.handle,
 				      MemorySizeInBytes, flags);
 	if (!vm_obj)
 		goto err_object_allocation_failed;
-	pthread_mutex_unlock(&aperture->fmm_mutex);
+	pthread_rwlock_unlock(&aperture->fmm_lock);
 
 	if (mmap_offset)
 		*mmap_offset = args.mmap_offset;
@@ -954,7 +1629,7 @@ static vm_object_t *fmm_allocate_memory_object(uint32_t gpu_id, void *mem,
 	return vm_obj;
 
 err_object_allocation_failed:
-	pthread_mutex_unlock(&aperture->fmm_mutex);
+	pthread_rwlock_unlock(&aperture->fmm_lock);
 	free_args.handle = args.handle;
 	kmtIoctl(kfd_fd, AMDKFD_IOC_FREE_MEMORY_OF_GPU, &free_args);
 
@@ -973,6 +1648,7 @@ static void manageable_aperture_print(manageable_aperture_t *app)
 	vm_area_t *cur = app->vm_ranges;
 	rbtree_node_t *n = rbtree_node_any(&app->tree, LEFT);
 	vm_object_t *object;
+	uint32_t i;
 
 	pr_info("\t Base: %p\n", app->base);
 	pr_info("\t Limit: %p\n", app->limit);
@@ -988,6 +1664,10 @@ static void manageable_aperture_print(manageable_aperture_t *app)
 				object->start, object->size);
 		n = rbtree_next(&app->tree, n);
 	}
+	for (i = 0; i < app->num_shards; i++) {
+		pr_info("\t Shard %u:\n", i);
+		manageable_aperture_print(&app->shards[i]);
+	}
 }
 
 void fmm_print(uint32_t gpu_id)
@@ -1019,26 +1699,178 @@ void fmm_print(uint32_t gpu_id)
 }
 #endif
 
+static void vm_lookup_stats_flush(void)
+{
+	__atomic_add_fetch(&vm_lookup_hits, vm_lookup_pending_hits,
+			   __ATOMIC_RELAXED);
+	__atomic_add_fetch(&vm_lookup_misses, vm_lookup_pending_misses,
+			   __ATOMIC_RELAXED);
+	vm_lookup_pending_hits = vm_lookup_pending_misses = 0;
+}
+
+static void vm_lookup_stats_count(bool hit)
+{
+	if (hit)
+		vm_lookup_pending_hits++;
+	else
+		vm_lookup_pending_misses++;
+
+	if (vm_lookup_pending_hits + vm_lookup_pending_misses >=
+	    VM_LOOKUP_STATS_BATCH)
+		vm_lookup_stats_flush();
+}
+
+/* Look up addr and size in the calling thread's lookup cache. On a hit,
+ * returns the object with its aperture's fmm_lock locked, for writing
+ * if exclusive is set.
+ */
+static vm_object_t *vm_lookup_cache_find(const void *addr, uint64_t size,
+					 bool exclusive,
+					 manageable_aperture_t **out_aper)
+{
+	vm_lookup_cache_entry_t *entry;
+	uint32_t i;
+
+	for (i = 0; i < VM_LOOKUP_CACHE_SIZE; i++) {
+		entry = &vm_lookup_cache[i];
+		if (!entry->obj || entry->addr != addr ||
+		    entry->size != size || entry->epoch != fmm_epoch)
+			continue;
+
+		fmm_lock_aperture(entry->aper, exclusive);
+		if (entry->generation == entry->aper->generation) {
+			vm_lookup_stats_count(true);
+			*out_aper = entry->aper;
+			return entry->obj;
+		}
+		pthread_rwlock_unlock(&entry->aper->fmm_lock);
+
+		entry->obj = NULL;
+		break;
+	}
+
+	vm_lookup_stats_count(false);
+	return NULL;
+}
+
+/* Remember a lookup result. Call with aper->fmm_lock held. */
+static void vm_lookup_cache_insert(const void *addr, uint64_t size,
+				   manageable_aperture_t *aper,
+				   vm_object_t *obj)
+{
+	vm_lookup_cache_entry_t *entry;
+
+	entry = &vm_lookup_cache[vm_lookup_cache_next++ % VM_LOOKUP_CACHE_SIZE];
+	entry->addr = addr;
+	entry->size = size;
+	entry->aper = aper;
+	entry->obj = obj;
+	entry->generation = aper->generation;
+	entry->epoch = fmm_epoch;
+}
+
+/* Userptrs registered in a sharded aperture can be in any shard. Search
+ * all of them for the object a lookup in a single tree would find,
+ * holding at most two shard locks at a time, in shard order. Returns
+ * with the lock of the shard the object was found in held.
+ */
+static vm_object_t *vm_find_userptr_in_shards(manageable_aperture_t *app,
+					      const void *addr, uint64_t size,
+					      bool exclusive,
+					      manageable_aperture_t **out_app)
+{
+	manageable_aperture_t *shard, *found = NULL;
+	vm_object_t *obj, *best = NULL;
+	uint32_t i;
+
+	for (i = 0; i < app->num_shards; i++) {
+		shard = &app->shards[i];
+		if (!__atomic_load_n(&shard->num_userptrs, __ATOMIC_RELAXED))
+			continue;
+
+		fmm_lock_aperture(shard, exclusive);
+		if (size == UINT64_MAX)
+			obj = vm_find_object_by_userptr_range(shard, addr);
+		else
+			obj = vm_find_object_by_userptr(shard, addr, size);
+
+		if (!obj || (best && rbtree_key_compare(LKP_ALL,
+							&obj->user_node.key,
+							&best->user_node.key) >= 0)) {
+			pthread_rwlock_unlock(&shard->fmm_lock);
+			continue;
+		}
+
+		if (found)
+			pthread_rwlock_unlock(&found->fmm_lock);
+		best = obj;
+		found = shard;
+
+		/* Only range lookups can have several matches */
+		if (size != UINT64_MAX)
+			break;
+	}
+
+	*out_app = found;
+	return best;
+}
+
+/* Find the object at addr in aper, which the caller has locked. If
+ * userptr is true, addr is a CPU address outside of the SVM apertures.
+ */
+static vm_object_t *vm_find_object_in_aperture(manageable_aperture_t *aper,
+					       const void *addr, uint64_t size,
+					       bool userptr)
+{
+	vm_object_t *obj = NULL;
+	long page_offset;
+
+	if (userptr || aper->ops == &mmap_aperture_ops)
+		obj = vm_find_object_by_userptr(aper, addr, size);
+	if (!obj && !userptr) {
+		page_offset = (long)addr & (PAGE_SIZE-1);
+		obj = vm_find_object_by_address(aper,
+				(const uint8_t *)addr - page_offset, 0);
+		/* If we find a userptr here, it's a match on the aligned
+		 * GPU address. Make sure that the page offset and size
+		 * match too.
+		 */
+		if (obj && obj->userptr &&
+		    (((long)obj->userptr & (PAGE_SIZE - 1)) != page_offset ||
+		     (size && size != obj->userptr_size)))
+			obj = NULL;
+	}
+
+	return obj;
+}
+
 /* vm_find_object - Find a VM object in any aperture
  *
  * @addr: VM address of the object
  * @size: size of the object, 0 means "don't care",
  *        UINT64_MAX means addr can match any address within the object
+ * @exclusive: lock the aperture for writing instead of reading
  * @out_aper: Aperture where the object was found
  *
  * Returns a pointer to the object if found, NULL otherwise. If an
  * object is found, this function returns with the
- * (*out_aper)->fmm_mutex locked.
+ * (*out_aper)->fmm_lock locked. Only lock for reading if neither the
+ * object nor the aperture are modified.
  */
 static vm_object_t *vm_find_object(const void *addr, uint64_t size,
+				   bool exclusive,
 				   manageable_aperture_t **out_aper)
 {
-	manageable_aperture_t *aper = NULL;
+	manageable_aperture_t *aper = NULL, *searched = NULL;
 	bool range = (size == UINT64_MAX);
 	bool userptr = false;
 	vm_object_t *obj = NULL;
 	uint32_t i;
 
+	obj = vm_lookup_cache_find(addr, size, exclusive, out_aper);
+	if (obj)
+		return obj;
+
 	for (i = 0; i < gpu_mem_count; i++)
 		if (gpu_mem[i].gpu_id != NON_VALID_GPU_ID &&
 		    addr >= gpu_mem[i].gpuvm_aperture.base &&
@@ -1053,17 +1885,25 @@ static vm_object_t *vm_find_object(const void *addr, uint64_t size,
 
 		if ((addr >= svm.dgpu_aperture->base) &&
 		    (addr <= svm.dgpu_aperture->limit))
-			aper = svm.dgpu_aperture;
+			aper = aperture_shard(svm.dgpu_aperture, addr);
 		else if ((addr >= svm.dgpu_alt_aperture->base) &&
 			 (addr <= svm.dgpu_alt_aperture->limit))
-			aper = svm.dgpu_alt_aperture;
+			aper = aperture_shard(svm.dgpu_alt_aperture, addr);
 		else {
 			aper = svm.dgpu_aperture;
 			userptr = true;
 		}
 	}
 
-	pthread_mutex_lock(&aper->fmm_mutex);
+	if (userptr && aper->num_shards) {
+		/* Not cached, the result depends on all shards */
+		searched = aper;
+		obj = vm_find_userptr_in_shards(aper, addr, size, exclusive,
+						&aper);
+		goto no_svm;
+	}
+
+	fmm_lock_aperture(aper, exclusive);
 	if (range) {
 		/* mmap_apertures can have userptrs in them. Try to
 		 * look up addresses as userptrs first to sort out any
@@ -1075,37 +1915,33 @@ static vm_object_t *vm_find_object(const void *addr, uint64_t size,
 		if (!obj && !userptr)
 			obj = vm_find_object_by_address_range(aper, addr);
 	} else {
-		if (userptr || aper->ops == &mmap_aperture_ops)
-			obj = vm_find_object_by_userptr(aper, addr, size);
-		if (!obj && !userptr) {
-			long page_offset = (long)addr & (PAGE_SIZE-1);
-			const void *page_addr = (const uint8_t *)addr - page_offset;
-
-			obj = vm_find_object_by_address(aper, page_addr, 0);
-			/* If we find a userptr here, it's a match on
-			 * the aligned GPU address. Make sure that the
-			 * page offset and size match too.
-			 */
-			if (obj && obj->userptr &&
-			    (((long)obj->userptr & (PAGE_SIZE - 1)) != page_offset ||
-			     (size && size != obj->userptr_size)))
-				obj = NULL;
-		}
+		obj = vm_find_object_in_aperture(aper, addr, size, userptr);
 	}
 
+	if (obj)
+		vm_lookup_cache_insert(addr, size, aper, obj);
+
 no_svm:
 	if (!obj && !is_dgpu) {
-		/* On APUs try finding it in the CPUVM aperture */
+		/* On APUs try finding it in the CPUVM aperture. The result
+		 * only depends on the CPUVM aperture, and can be cached, if
+		 * no other aperture was searched.
+		 */
+		bool cacheable = !aper && !searched;
+
 		if (aper)
-			pthread_mutex_unlock(&aper->fmm_mutex);
+			pthread_rwlock_unlock(&aper->fmm_lock);
 
 		aper = &cpuvm_aperture;
 
-		pthread_mutex_lock(&aper->fmm_mutex);
+		fmm_lock_aperture(aper, exclusive);
 		if (range)
 			obj = vm_find_object_by_address_range(aper, addr);
 		else
 			obj = vm_find_object_by_address(aper, addr, 0);
+
+		if (obj && cacheable)
+			vm_lookup_cache_insert(addr, size, aper, obj);
 	}
 
 	if (obj) {
@@ -1114,7 +1950,7 @@ no_svm:
 	}
 
 	if (aper)
-		pthread_mutex_unlock(&aper->fmm_mutex);
+		pthread_rwlock_unlock(&aper->fmm_lock);
 	return NULL;
 }
 
@@ -1152,26 +1988,23 @@ static void fmm_release_scratch(uint32_t gpu_id)
 
 	if (topology_is_dgpu(gpu_mem[gpu_mem_id].device_id)) {
 		/* unmap and remove all remaining objects */
-		pthread_mutex_lock(&aperture->fmm_mutex);
+		pthread_rwlock_wrlock(&aperture->fmm_lock);
 		while ((n = rbtree_node_any(&aperture->tree, MID))) {
 			obj = vm_object_entry(n, 0);
 
 			void *obj_addr = obj->start;
 
-			pthread_mutex_unlock(&aperture->fmm_mutex);
+			pthread_rwlock_unlock(&aperture->fmm_lock);
 
 			_fmm_unmap_from_gpu_scratch(gpu_id, aperture, obj_addr);
 
-			pthread_mutex_lock(&aperture->fmm_mutex);
+			pthread_rwlock_wrlock(&aperture->fmm_lock);
 		}
-		pthread_mutex_unlock(&aperture->fmm_mutex);
+		pthread_rwlock_unlock(&aperture->fmm_lock);
 
 		/* release address space */
-		pthread_mutex_lock(&svm.dgpu_aperture->fmm_mutex);
-		aperture_release_area(svm.dgpu_aperture,
-				      gpu_mem[gpu_mem_id].scratch_physical.base,
-				      size);
-		pthread_mutex_unlock(&svm.dgpu_aperture->fmm_mutex);
+		fmm_release_va(svm.dgpu_aperture,
+			       gpu_mem[gpu_mem_id].scratch_physical.base, size);
 	} else
 		/* release address space */
 		munmap(gpu_mem[gpu_mem_id].scratch_physical.base, size);
@@ -1218,11 +2051,8 @@ void *fmm_allocate_scratch(uint32_t gpu_id, void *address, uint64_t MemorySizeIn
 
 	/* Allocate address space for scratch backing, 64KB aligned */
 	if (topology_is_dgpu(gpu_mem[gpu_mem_id].device_id)) {
-		pthread_mutex_lock(&svm.dgpu_aperture->fmm_mutex);
-		mem = aperture_allocate_area_aligned(
-			svm.dgpu_aperture, address,
-			aligned_size, SCRATCH_ALIGN);
-		pthread_mutex_unlock(&svm.dgpu_aperture->fmm_mutex);
+		mem = fmm_allocate_va(svm.dgpu_aperture, address,
+				      aligned_size, SCRATCH_ALIGN, NULL);
 	} else {
 		uint64_t aligned_padded_size = aligned_size +
 			SCRATCH_ALIGN - PAGE_SIZE;
@@ -1265,10 +2095,14 @@ void *fmm_allocate_scratch(uint32_t gpu_id, void *address, uint64_t MemorySizeIn
 	return mem;
 }
 
+/* Allocates address space in *aperture and a BO. Returns the shard of
+ * *aperture that the BO was allocated in in *aperture.
+ */
 static void *__fmm_allocate_device(uint32_t gpu_id, void *address, uint64_t MemorySizeInBytes,
-		manageable_aperture_t *aperture, uint64_t *mmap_offset,
+		manageable_aperture_t **_aperture, uint64_t *mmap_offset,
 		uint32_t flags, vm_object_t **vm_obj)
 {
+	manageable_aperture_t *aperture = *_aperture;
 	void *mem = NULL;
 	vm_object_t *obj;
 
@@ -1277,9 +2111,14 @@ static void *__fmm_allocate_device(uint32_t gpu_id, void *address, uint64_t Memo
 		return NULL;
 
 	/* Allocate address space */
-	pthread_mutex_lock(&aperture->fmm_mutex);
-	mem = aperture_allocate_area(aperture, address, MemorySizeInBytes);
-	pthread_mutex_unlock(&aperture->fmm_mutex);
+	mem = fmm_allocate_va(aperture, address, MemorySizeInBytes,
+			      aperture->align, &aperture);
+	*_aperture = aperture;
+	if (!mem) {
+		if (vm_obj)
+			*vm_obj = NULL;
+		return NULL;
+	}
 
 	/*
 	 * Now that we have the area reserved, allocate memory in the device
@@ -1292,9 +2131,7 @@ static void *__fmm_allocate_device(uint32_t gpu_id, void *address, uint64_t Memo
 		 * allocation of memory in device failed.
 		 * Release region in aperture
 		 */
-		pthread_mutex_lock(&aperture->fmm_mutex);
-		aperture_release_area(aperture, mem, MemorySizeInBytes);
-		pthread_mutex_unlock(&aperture->fmm_mutex);
+		fmm_release_va(aperture, mem, MemorySizeInBytes);
 
 		/* Assign NULL to mem to indicate failure to calling function */
 		mem = NULL;
@@ -1305,127 +2142,2253 @@ static void *__fmm_allocate_device(uint32_t gpu_id, void *address, uint64_t Memo
 	return mem;
 }
 
-void *fmm_allocate_device(uint32_t gpu_id, void *address, uint64_t MemorySizeInBytes, HsaMemFlags flags)
-{
+/* Cache of freed BOs, enabled by setting HSA_BO_CACHE_MB. Freed device
+ * and non-paged system memory BOs keep their address space, CPU mapping
+ * and KFD handle. Later allocations with the same GPU, size and flags
+ * reuse them without calling into KFD. Contents of reused BOs are not
+ * cleared.
+ *
+ * When the cache grows beyond the high watermark, the least recently
+ * freed BOs are released until it is below the low watermark. BOs that
+ * were not reused within the idle timeout are released on the next
+ * cache operation.
+ */
+#define BO_CACHE_BUCKETS 64
+#define BO_CACHE_DEFAULT_IDLE_MS 1000
+
+typedef struct bo_cache_entry {
+	/* Entries with the same hash, most recently freed first */
+	struct bo_cache_entry *next, *prev;
+	/* All entries, most recently freed first */
+	struct bo_cache_entry *lru_next, *lru_prev;
 	manageable_aperture_t *aperture;
-	int32_t gpu_mem_id;
-	uint32_t ioc_flags = KFD_IOC_ALLOC_MEM_FLAGS_VRAM;
-	uint64_t size, mmap_offset;
-	void *mem;
-	vm_object_t *vm_obj = NULL;
+	void *start;
+	uint64_t size;
+	uint64_t handle;
+	uint32_t gpu_id;
+	uint32_t ioc_flags;
+	uint32_t mem_flags;
+	uint64_t free_time;
+} bo_cache_entry_t;
+
+static struct {
+	pthread_mutex_t lock;
+	bo_cache_entry_t *buckets[BO_CACHE_BUCKETS];
+	bo_cache_entry_t *lru_head, *lru_tail;
+	bo_cache_entry_t *free_entries;
+	uint64_t bytes;
+	uint64_t high, low; /* watermarks in bytes, high == 0 disables */
+	uint64_t idle_ns; /* 0 disables the idle timeout */
+	uint64_t hits, misses, evictions;
+} bo_cache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER
+};
 
-	/* Retrieve gpu_mem id according to gpu_id */
-	gpu_mem_id = gpu_mem_find_by_gpu_id(gpu_id);
-	if (gpu_mem_id < 0)
-		return NULL;
+static uint64_t bo_cache_now(void)
+{
+	struct timespec ts;
 
-	size = MemorySizeInBytes;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-	if (flags.ui32.HostAccess)
-		ioc_flags |= KFD_IOC_ALLOC_MEM_FLAGS_PUBLIC;
+static uint32_t bo_cache_hash(uint32_t gpu_id, uint64_t size,
+			      uint32_t ioc_flags, uint32_t mem_flags)
+{
+	uint64_t key = (size >> PAGE_SHIFT) ^ ((uint64_t)gpu_id << 32) ^
+		ioc_flags ^ ((uint64_t)mem_flags << 16);
 
-	ioc_flags |= fmm_translate_hsa_to_ioc_flags(flags);
+	return (key * 0x9e3779b97f4a7c15ULL) >> 58;
+}
 
-	if (topology_is_svm_needed(get_device_id_by_gpu_id(gpu_id))) {
-		aperture = svm.dgpu_aperture;
-		if (flags.ui32.AQLQueueMemory)
-			size = MemorySizeInBytes * 2;
-	} else {
-		aperture = &gpu_mem[gpu_mem_id].gpuvm_aperture;
+/* Remove an entry from the cache. Call with bo_cache.lock held. */
+static void bo_cache_unlink(bo_cache_entry_t *entry)
+{
+	if (entry->prev)
+		entry->prev->next = entry->next;
+	else
+		bo_cache.buckets[bo_cache_hash(entry->gpu_id, entry->size,
+					       entry->ioc_flags,
+					       entry->mem_flags)] = entry->next;
+	if (entry->next)
+		entry->next->prev = entry->prev;
+
+	if (entry->lru_prev)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else
+		bo_cache.lru_head = entry->lru_next;
+	if (entry->lru_next)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		bo_cache.lru_tail = entry->lru_prev;
+
+	bo_cache.bytes -= entry->size;
+}
+
+/* Unlink the entries that exceed the watermarks or the idle timeout and
+ * return them as a list linked by next. Call with bo_cache.lock held.
+ */
+static bo_cache_entry_t *bo_cache_trim(uint64_t now)
+{
+	bo_cache_entry_t *evicted = NULL, *entry;
+	uint64_t target = bo_cache.bytes > bo_cache.high ?
+		bo_cache.low : bo_cache.high;
+
+	while ((entry = bo_cache.lru_tail) &&
+	       (bo_cache.bytes > target ||
+		(bo_cache.idle_ns && now - entry->free_time > bo_cache.idle_ns))) {
+		bo_cache_unlink(entry);
+		bo_cache.evictions++;
+		entry->next = evicted;
+		evicted = entry;
 	}
 
-	if (!flags.ui32.CoarseGrain || svm.disable_cache)
-		ioc_flags |= KFD_IOC_ALLOC_MEM_FLAGS_COHERENT;
+	return evicted;
+}
 
-	mem = __fmm_allocate_device(gpu_id, address, size, aperture, &mmap_offset,
-				    ioc_flags, &vm_obj);
+/* Free a BO that has no vm_object and its address space */
+static void fmm_release_detached_bo(manageable_aperture_t *aperture,
+				    void *start, uint64_t size, uint64_t handle)
+{
+	struct kfd_ioctl_free_memory_of_gpu_args args = {0};
 
-	if (mem && vm_obj) {
-		pthread_mutex_lock(&aperture->fmm_mutex);
-		/* Store memory allocation flags, not ioc flags */
-		vm_obj->flags = flags.Value;
-		gpuid_to_nodeid(gpu_id, &vm_obj->node_id);
-		pthread_mutex_unlock(&aperture->fmm_mutex);
-	}
+	args.handle = handle;
+	if (kmtIoctl(kfd_fd, AMDKFD_IOC_FREE_MEMORY_OF_GPU, &args))
+		pr_err("Failed to free BO at %p\n", start);
+	else
+		fmm_release_va(aperture, start, size);
+}
 
-	if (mem) {
-		int map_fd = mmap_offset >= (1ULL<<40) ? kfd_fd :
-					gpu_mem[gpu_mem_id].drm_render_fd;
-		int prot = flags.ui32.HostAccess ? PROT_READ | PROT_WRITE :
-					PROT_NONE;
-		int flag = flags.ui32.HostAccess ? MAP_SHARED | MAP_FIXED :
-					MAP_PRIVATE|MAP_FIXED;
-		void *ret = mmap(mem, MemorySizeInBytes, prot, flag,
-					map_fd, mmap_offset);
+/* Map or unmap a BO on the GPUs in gpus. The GPUs where KFD succeeded
+ * are returned in done.
+ */
+static int fmm_map_bo_ioctl(uint64_t handle, gpu_mask_t gpus, bool map,
+			    gpu_mask_t *done)
+{
+	struct kfd_ioctl_map_memory_to_gpu_args map_args = {0};
+	struct kfd_ioctl_unmap_memory_from_gpu_args unmap_args = {0};
+	uint32_t gpu_ids[FMM_MAX_GPUS];
+	int ret;
 
-		if (ret == MAP_FAILED) {
-			__fmm_release(vm_obj, aperture);
-			return NULL;
-		}
+	if (map) {
+		map_args.handle = handle;
+		map_args.device_ids_array_ptr = (uint64_t)gpu_ids;
+		map_args.n_devices = gpu_mask_to_ids(gpus, gpu_ids, false);
+		ret = kmtIoctl(kfd_fd, AMDKFD_IOC_MAP_MEMORY_TO_GPU, &map_args);
+		*done = gpu_mask_first(gpus, map_args.n_success);
+	} else {
+		unmap_args.handle = handle;
+		unmap_args.device_ids_array_ptr = (uint64_t)gpu_ids;
+		unmap_args.n_devices = gpu_mask_to_ids(gpus, gpu_ids, false);
+		ret = kmtIoctl(kfd_fd, AMDKFD_IOC_UNMAP_MEMORY_FROM_GPU,
+			       &unmap_args);
+		*done = gpu_mask_first(gpus, unmap_args.n_success);
 	}
 
-	return mem;
+	return ret;
 }
 
-void *fmm_allocate_doorbell(uint32_t gpu_id, uint64_t MemorySizeInBytes,
-			    uint64_t doorbell_mmap_offset)
+/* Release the BOs of evicted entries. Call without bo_cache.lock held. */
+static void bo_cache_release(bo_cache_entry_t *evicted)
 {
-	manageable_aperture_t *aperture;
-	int32_t gpu_mem_id;
-	uint32_t ioc_flags;
-	void *mem;
-	vm_object_t *vm_obj = NULL;
-
-	/* Retrieve gpu_mem id according to gpu_id */
-	gpu_mem_id = gpu_mem_find_by_gpu_id(gpu_id);
-	if (gpu_mem_id < 0)
-		return NULL;
+	bo_cache_entry_t *entry;
 
-	/* Use fine-grained aperture */
-	aperture = svm.dgpu_alt_aperture;
-	ioc_flags = KFD_IOC_ALLOC_MEM_FLAGS_DOORBELL |
-		    KFD_IOC_ALLOC_MEM_FLAGS_WRITABLE |
-		    KFD_IOC_ALLOC_MEM_FLAGS_COHERENT;
+	while ((entry = evicted)) {
+		evicted = entry->next;
 
-	mem = __fmm_allocate_device(gpu_id, NULL, MemorySizeInBytes, aperture, NULL,
-				    ioc_flags, &vm_obj);
+		fmm_release_detached_bo(entry->aperture, entry->start,
+					entry->size, entry->handle);
+		free(entry);
+	}
+}
 
-	if (mem && vm_obj) {
-		HsaMemFlags flags;
+/* Take over a freed object instead of releasing it. Returns false if
+ * the object can't be cached and must be released by the caller.
+ */
+static bool bo_cache_put(vm_object_t *object, manageable_aperture_t *aperture)
+{
+	bo_cache_entry_t *entry, *evicted, **bucket;
 
-		/* Cook up some flags for storing in the VM object */
-		flags.Value = 0;
-		flags.ui32.NonPaged = 1;
-		flags.ui32.HostAccess = 1;
-		flags.ui32.Reserved = 0xBe1;
+	if (!bo_cache.high)
+		return false;
 
-		pthread_mutex_lock(&aperture->fmm_mutex);
-		vm_obj->flags = flags.Value;
-		gpuid_to_nodeid(gpu_id, &vm_obj->node_id);
-		pthread_mutex_unlock(&aperture->fmm_mutex);
+	pthread_mutex_lock(&bo_cache.lock);
+	entry = bo_cache.free_entries;
+	if (entry)
+		bo_cache.free_entries = entry->next;
+	pthread_mutex_unlock(&bo_cache.lock);
+	if (!entry) {
+		entry = malloc(sizeof(*entry));
+		if (!entry)
+			return false;
 	}
 
-	if (mem) {
-		void *ret = mmap(mem, MemorySizeInBytes,
-				 PROT_READ | PROT_WRITE,
-				 MAP_SHARED | MAP_FIXED, kfd_fd,
-				 doorbell_mmap_offset);
-		if (ret == MAP_FAILED) {
-			__fmm_release(vm_obj, aperture);
-			return NULL;
-		}
+	pthread_rwlock_wrlock(&aperture->fmm_lock);
+	/* Only plain allocations can be handed out again. Freeing the BO
+	 * implicitly unmaps it from all GPUs, do that explicitly here.
+	 */
+	if (!object->alloc_gpu_id || object->userptr || object->metadata ||
+	    object->is_imported_kfd_bo || object->is_exported ||
+	    object->size > bo_cache.high ||
+	    (object->mapped_gpus &&
+	     _fmm_unmap_from_gpu(aperture, object->start, 0, object))) {
+		pthread_rwlock_unlock(&aperture->fmm_lock);
+		free(entry);
+		return false;
 	}
+	entry->aperture = aperture;
+	entry->start = object->start;
+	entry->size = object->size;
+	entry->handle = object->handle;
+	entry->gpu_id = object->alloc_gpu_id;
+	entry->ioc_flags = object->alloc_ioc_flags;
+	entry->mem_flags = object->flags;
+	vm_remove_object(aperture, object);
+	pthread_rwlock_unlock(&aperture->fmm_lock);
+
+	entry->free_time = bo_cache_now();
+	bucket = &bo_cache.buckets[bo_cache_hash(entry->gpu_id, entry->size,
+						 entry->ioc_flags,
+						 entry->mem_flags)];
+
+	pthread_mutex_lock(&bo_cache.lock);
+	entry->prev = NULL;
+	entry->next = *bucket;
+	if (entry->next)
+		entry->next->prev = entry;
+	*bucket = entry;
+	entry->lru_prev = NULL;
+	entry->lru_next = bo_cache.lru_head;
+	if (entry->lru_next)
+		entry->lru_next->lru_prev = entry;
+	else
+		bo_cache.lru_tail = entry;
+	bo_cache.lru_head = entry;
+	bo_cache.bytes += entry->size;
+	evicted = bo_cache_trim(entry->free_time);
+	pthread_mutex_unlock(&bo_cache.lock);
 
-	return mem;
+	bo_cache_release(evicted);
+
+	return true;
 }
 
-static void *fmm_allocate_host_cpu(void *address, uint64_t MemorySizeInBytes,
-				HsaMemFlags flags)
+/* Reuse a cached BO allocated with the same parameters. Returns its
+ * address and new object and the aperture it lives in, or NULL on a
+ * cache miss.
+ */
+static void *bo_cache_get(uint32_t gpu_id, uint64_t size, uint32_t ioc_flags,
+			  uint32_t mem_flags, manageable_aperture_t **aperture,
+			  vm_object_t **vm_obj)
 {
-	void *mem = NULL;
-	vm_object_t *vm_obj;
-	int mmap_prot = PROT_READ;
-
+	bo_cache_entry_t *entry, *evicted;
+	manageable_aperture_t *app;
+	vm_object_t *obj;
+	void *mem;
+
+	if (!bo_cache.high)
+		return NULL;
+
+	pthread_mutex_lock(&bo_cache.lock);
+	for (entry = bo_cache.buckets[bo_cache_hash(gpu_id, size, ioc_flags,
+						    mem_flags)];
+	     entry; entry = entry->next)
+		if (entry->gpu_id == gpu_id && entry->size == size &&
+		    entry->ioc_flags == ioc_flags &&
+		    entry->mem_flags == mem_flags)
+			break;
+	if (entry) {
+		bo_cache_unlink(entry);
+		bo_cache.hits++;
+	} else {
+		bo_cache.misses++;
+	}
+	evicted = bo_cache_trim(bo_cache_now());
+	pthread_mutex_unlock(&bo_cache.lock);
+
+	bo_cache_release(evicted);
+	if (!entry)
+		return NULL;
+
+	app = entry->aperture;
+	pthread_rwlock_wrlock(&app->fmm_lock);
+	obj = aperture_allocate_object(app, entry->start, entry->handle,
+				       entry->size, ioc_flags);
+	pthread_rwlock_unlock(&app->fmm_lock);
+	if (!obj) {
+		entry->next = NULL;
+		bo_cache_release(entry);
+		return NULL;
+	}
+	mem = entry->start;
+
+	pthread_mutex_lock(&bo_cache.lock);
+	entry->next = bo_cache.free_entries;
+	bo_cache.free_entries = entry;
+	pthread_mutex_unlock(&bo_cache.lock);
+
+	*aperture = app;
+	*vm_obj = obj;
+	return mem;
+}
+
+/* Forget all cached BOs without freeing them. Used when the apertures
+ * are torn down or after fork, where KFD handles are not valid anymore.
+ */
+static void bo_cache_clear(void)
+{
+	bo_cache_entry_t *entry;
+
+	pthread_mutex_init(&bo_cache.lock, NULL);
+
+	while ((entry = bo_cache.lru_head)) {
+		bo_cache.lru_head = entry->lru_next;
+		free(entry);
+	}
+	while ((entry = bo_cache.free_entries)) {
+		bo_cache.free_entries = entry->next;
+		free(entry);
+	}
+	memset(bo_cache.buckets, 0, sizeof(bo_cache.buckets));
+	bo_cache.lru_tail = NULL;
+	bo_cache.bytes = 0;
+}
+
+/* Release all cached BOs, e.g. to free their CPU mappings */
+static void bo_cache_flush(void)
+{
+	bo_cache_entry_t *evicted = NULL, *entry;
+
+	pthread_mutex_lock(&bo_cache.lock);
+	while ((entry = bo_cache.lru_tail)) {
+		bo_cache_unlink(entry);
+		bo_cache.evictions++;
+		entry->next = evicted;
+		evicted = entry;
+	}
+	pthread_mutex_unlock(&bo_cache.lock);
+
+	bo_cache_release(evicted);
+}
+
+/* Budget of memory mappings (VMAs) against vm.max_map_count. Every CPU
+ * mapping in a reserved aperture splits the PROT_NONE reservation, so it
+ * costs up to two VMAs, one in an mmap aperture costs one. Released
+ * ranges are merged back into the reservation by the kernel.
+ *
+ * Once the limit is reached, mmap with MAP_FIXED fails after the old
+ * mapping may already be gone, which punches holes into reservations.
+ * So allocations are refused while fewer than VMA_HEADROOM_MIN mappings
+ * are left.
+ *
+ * The process-wide count is read from /proc/self/maps, which is slow
+ * with many mappings. In between, allocations are charged their
+ * worst-case cost and releases are credited with it. Releases may free
+ * fewer mappings than that, so at most half of the headroom is taken on
+ * credit. Cached BOs are released before an allocation is refused. After
+ * a refusal, the mappings are counted again once that credit is used up
+ * or after VMA_RECOUNT_MS.
+ */
+#define VMA_HEADROOM_MIN(max) MAX(64UL, (max) / 256)
+#define VMA_RECOUNT_MS 10
+
+static struct {
+	pthread_mutex_t lock;
+	uint64_t max;		/* vm.max_map_count, 0 if unknown */
+	uint64_t count;		/* mappings at the last count */
+	uint64_t added;		/* worst-case mappings added since */
+	uint64_t freed;		/* worst-case mappings freed since */
+	uint64_t refused_time;	/* time of the last refusal, 0 if none */
+	uint64_t recounts;
+	uint64_t refused;
+} vma_budget = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static uint64_t vma_count_mappings(void)
+{
+	char buf[16384];
+	uint64_t count = 0;
+	ssize_t n, i;
+	int fd;
+
+	fd = open("/proc/self/maps", O_RDONLY);
+	if (fd < 0)
+		return 0;
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		for (i = 0; i < n; i++)
+			count += buf[i] == '\n';
+	close(fd);
+
+	return count;
+}
+
+static void vma_budget_init(void)
+{
+	unsigned long max = 0;
+	FILE *fd;
+
+	fd = fopen("/proc/sys/vm/max_map_count", "r");
+	if (fd) {
+		if (fscanf(fd, "%lu", &max) != 1)
+			max = 0;
+		fclose(fd);
+	}
+
+	pthread_mutex_lock(&vma_budget.lock);
+	vma_budget.max = max;
+	vma_budget.count = max ? vma_count_mappings() : 0;
+	vma_budget.added = vma_budget.freed = 0;
+	vma_budget.refused_time = 0;
+	pthread_mutex_unlock(&vma_budget.lock);
+}
+
+/* Whether added more mappings on top of count leave enough headroom */
+static bool vma_budget_fits(uint64_t count, uint64_t added, uint64_t freed)
+{
+	uint64_t headroom = VMA_HEADROOM_MIN(vma_budget.max);
+
+	return count + added + headroom <=
+		vma_budget.max + MIN(freed, headroom / 2);
+}
+
+/* Count the mappings again and charge cost if that leaves enough
+ * headroom. Call with vma_budget.lock held.
+ */
+static bool vma_budget_recount(uint64_t cost)
+{
+	bool ok;
+
+	vma_budget.count = vma_count_mappings();
+	vma_budget.recounts++;
+	ok = vma_budget_fits(vma_budget.count, cost, 0);
+	__atomic_store_n(&vma_budget.added, ok ? cost : 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&vma_budget.freed, 0, __ATOMIC_RELAXED);
+
+	return ok;
+}
+
+static uint64_t vma_budget_cost(manageable_aperture_t *app)
+{
+	if (!app->is_cpu_accessible)
+		return 0;
+	return app->ops == &reserved_aperture_ops ? 2 : 1;
+}
+
+static void vma_budget_released(manageable_aperture_t *app)
+{
+	uint64_t cost = vma_budget_cost(app);
+
+	if (cost)
+		__atomic_add_fetch(&vma_budget.freed, cost, __ATOMIC_RELAXED);
+}
+
+/* Charge the mappings of a new allocation in app. Returns false if it
+ * would leave too little headroom.
+ */
+static bool vma_budget_reserve(manageable_aperture_t *app)
+{
+	uint64_t cost = vma_budget_cost(app), added, freed, now;
+	bool ok;
+
+	if (!cost || !vma_budget.max)
+		return true;
+
+	added = __atomic_add_fetch(&vma_budget.added, cost, __ATOMIC_RELAXED);
+	freed = __atomic_load_n(&vma_budget.freed, __ATOMIC_RELAXED);
+	if (vma_budget_fits(vma_budget.count, added, freed))
+		return true;
+	__atomic_sub_fetch(&vma_budget.added, cost, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&vma_budget.lock);
+	now = bo_cache_now();
+	if (vma_budget.refused_time &&
+	    freed < VMA_HEADROOM_MIN(vma_budget.max) / 2 &&
+	    now - vma_budget.refused_time < VMA_RECOUNT_MS * 1000000ULL) {
+		vma_budget.refused++;
+		pthread_mutex_unlock(&vma_budget.lock);
+		return false;
+	}
+	ok = vma_budget_recount(cost);
+	pthread_mutex_unlock(&vma_budget.lock);
+	if (ok)
+		return true;
+
+	/* Cached BOs keep their CPU mappings */
+	bo_cache_flush();
+
+	pthread_mutex_lock(&vma_budget.lock);
+	ok = vma_budget_recount(cost);
+	if (ok) {
+		vma_budget.refused_time = 0;
+	} else {
+		vma_budget.refused++;
+		vma_budget.refused_time = now;
+	}
+	pthread_mutex_unlock(&vma_budget.lock);
+
+	if (!ok)
+		pr_err_once("%lu of %lu memory mappings used, increase vm.max_map_count\n",
+			    vma_budget.count, vma_budget.max);
+	return ok;
+}
+
+/* Take back the charge of an allocation that failed */
+static void vma_budget_unreserve(manageable_aperture_t *app)
+{
+	uint64_t cost = vma_budget_cost(app), added;
+
+	if (!cost || !vma_budget.max)
+		return;
+
+	/* A recount in the meantime may have dropped the charge already */
+	added = __atomic_load_n(&vma_budget.added, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&vma_budget.added, &added,
+					    added > cost ? added - cost : 0,
+					    true, __ATOMIC_RELAXED,
+					    __ATOMIC_RELAXED))
+		;
+}
+
+/* Mappings the apertures of app are estimated to use */
+static uint64_t vma_aperture_mappings(manageable_aperture_t *app,
+				      uint64_t *areas)
+{
+	uint64_t n = __atomic_load_n(&app->num_areas, __ATOMIC_RELAXED);
+	uint64_t mappings;
+	uint32_t i;
+
+	*areas += n;
+	if (!app->is_cpu_accessible)
+		mappings = 0;
+	else if (app->ops == &reserved_aperture_ops)
+		mappings = 2 * n;
+	else
+		mappings = n;
+
+	for (i = 0; i < app->num_shards; i++)
+		mappings += vma_aperture_mappings(&app->shards[i], areas);
+
+	return mappings;
+}
+
+HSAKMT_STATUS fmm_get_virtual_memory_stats(HsaVirtualMemoryStats *stats)
+{
+	uint32_t i;
+
+	memset(stats, 0, sizeof(*stats));
+
+	for (i = 0; i < SVM_APERTURE_NUM; i++)
+		if (i == SVM_DEFAULT || svm.dgpu_alt_aperture != svm.dgpu_aperture)
+			stats->ApertureMappings +=
+				vma_aperture_mappings(&svm.apertures[i],
+						      &stats->ApertureAreas);
+
+	/* Allocations charged since the last count stay charged, which
+	 * errs on the safe side
+	 */
+	pthread_mutex_lock(&vma_budget.lock);
+	vma_budget.count = vma_count_mappings();
+	vma_budget.recounts++;
+	stats->MapCount = vma_budget.count;
+	stats->MaxMapCount = vma_budget.max;
+	stats->Headroom = vma_budget.max > vma_budget.count ?
+		vma_budget.max - vma_budget.count : 0;
+	stats->Recounts = vma_budget.recounts;
+	stats->Refused = vma_budget.refused;
+	pthread_mutex_unlock(&vma_budget.lock);
+
+	return HSAKMT_STATUS_SUCCESS;
+}
+
+/* Largest hole between two areas of an aperture. The augmented values
+ * also cover the hole before the first area, measured from address 0,
+ * so walk down to the first area and leave its own hole out. O(log n).
+ */
+static uint64_t vm_largest_inner_hole(manageable_aperture_t *app)
+{
+	rbtree_node_t *sentinel = &app->area_tree.sentinel;
+	rbtree_node_t *n = app->area_tree.root;
+	uint64_t largest = 0;
+
+	for (; n != sentinel; n = n->left) {
+		largest = MAX(largest, n->right->augmented);
+		if (n->left == sentinel)
+			break;
+		largest = MAX(largest, vm_area_hole_size(vm_area_entry(n)));
+	}
+
+	return largest;
+}
+
+static void aperture_stats_add(manageable_aperture_t *app,
+			       HsaApertureStats *stats)
+{
+	uint64_t areas = __atomic_load_n(&app->num_areas, __ATOMIC_RELAXED);
+	rbtree_node_t *n;
+	vm_area_t *first, *last;
+	uint64_t head, tail;
+	void *end;
+	uint32_t i;
+
+	for (i = 0; i < app->num_shards; i++)
+		aperture_stats_add(&app->shards[i], stats);
+	if (app->num_shards)
+		return;
+
+	pthread_rwlock_rdlock(&app->fmm_lock);
+
+	stats->AreaCount += areas;
+	stats->AreaBytes += __atomic_load_n(&app->area_bytes,
+					    __ATOMIC_RELAXED);
+	stats->ObjectCount += app->num_objects;
+	stats->ObjectBytes += app->object_bytes;
+	stats->UserptrCount += app->num_userptrs;
+	stats->UserptrBytes += app->userptr_bytes;
+
+	/* The kernel manages the address space of mmap apertures, so
+	 * their holes are unknown
+	 */
+	if (app->ops != &reserved_aperture_ops) {
+		stats->ReservedBytes += __atomic_load_n(&app->area_bytes,
+							__ATOMIC_RELAXED);
+		goto out;
+	}
+
+	stats->GuardBytes += areas * app->guard_pages * PAGE_SIZE;
+	end = app->reserved_limit ? app->reserved_limit : app->limit;
+	stats->ReservedBytes += VOID_PTRS_SUB(end, app->base) + 1;
+
+	/* Unreserved address space of a growable aperture is free too */
+	end = app->reserved_limit ? app->grow_limit : app->limit;
+	n = rbtree_min_max(&app->area_tree, RIGHT);
+	if (!n) {
+		stats->HoleCount++;
+		stats->LargestHole = MAX(stats->LargestHole,
+					 VOID_PTRS_SUB(end, app->base) + 1);
+		goto out;
+	}
+
+	last = vm_area_entry(n);
+	first = vm_area_entry(rbtree_min_max(&app->area_tree, LEFT));
+	head = first->has_hole ? VOID_PTRS_SUB(first->start, app->base) : 0;
+	tail = VOID_PTRS_SUB(end, last->end);
+	stats->HoleCount += app->num_holes + (tail ? 1 : 0);
+	stats->LargestHole = MAX(stats->LargestHole,
+				 vm_largest_inner_hole(app));
+	stats->LargestHole = MAX(stats->LargestHole, head);
+	stats->LargestHole = MAX(stats->LargestHole, tail);
+
+out:
+	pthread_rwlock_unlock(&app->fmm_lock);
+}
+
+HSAKMT_STATUS fmm_get_aperture_stats(uint32_t gpu_id,
+				     HSA_MEMORY_APERTURE type,
+				     HsaApertureStats *stats)
+{
+	manageable_aperture_t *aperture = NULL;
+	int32_t gpu_mem_id;
+
+	memset(stats, 0, sizeof(*stats));
+
+	switch (type) {
+	case HSA_MEMORY_APERTURE_SVM:
+		aperture = svm.dgpu_aperture;
+		break;
+	case HSA_MEMORY_APERTURE_SVM_COHERENT:
+		aperture = svm.dgpu_alt_aperture;
+		break;
+	case HSA_MEMORY_APERTURE_GPUVM:
+	case HSA_MEMORY_APERTURE_SCRATCH:
+		gpu_mem_id = gpu_mem_find_by_gpu_id(gpu_id);
+		if (gpu_mem_id < 0)
+			return HSAKMT_STATUS_INVALID_NODE_UNIT;
+		if (type == HSA_MEMORY_APERTURE_GPUVM)
+			aperture = &gpu_mem[gpu_mem_id].gpuvm_aperture;
+		else
+			aperture = &gpu_mem[gpu_mem_id].scratch_physical;
+		break;
+	case HSA_MEMORY_APERTURE_CPUVM:
+		/* Only tracks objects, it has no address space of its own */
+		pthread_rwlock_rdlock(&cpuvm_aperture.fmm_lock);
+		stats->ObjectCount = cpuvm_aperture.num_objects;
+		stats->ObjectBytes = cpuvm_aperture.object_bytes;
+		pthread_rwlock_unlock(&cpuvm_aperture.fmm_lock);
+		return HSAKMT_STATUS_SUCCESS;
+	default:
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+	}
+
+	if (!aperture || !aperture_is_valid(aperture->base, aperture->limit))
+		return HSAKMT_STATUS_NOT_SUPPORTED;
+
+	aperture_stats_add(aperture, stats);
+	if (stats->AreaBytes > stats->ObjectBytes)
+		stats->UnbackedBytes = stats->AreaBytes - stats->ObjectBytes;
+
+	return HSAKMT_STATUS_SUCCESS;
+}
+
+/* Trace recorder, enabled by HSA_TRACE_FILE. Records are appended to a
+ * ring buffer that is written to the file one half at a time by the
+ * thread that fills a half. Callers never wait for the file: records
+ * that don't fit while a half is being written are dropped and counted
+ * in the header.
+ */
+#define TRACE_DEFAULT_BUFFER_KB	1024
+
+static struct {
+	pthread_mutex_t lock;
+	int fd;
+	fmm_trace_record_t *ring;
+	uint64_t size;		/* records in ring, a power of 2 */
+	uint64_t head;		/* records appended */
+	uint64_t written;	/* records written to fd */
+	bool writing;
+	uint64_t start_ns;
+	uint64_t dropped;
+} trace = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.fd = -1
+};
+
+static __thread uint32_t trace_tid;
+
+static void trace_init(const char *path, unsigned int buffer_kb)
+{
+	fmm_trace_header_t header = {0};
+	uint64_t size = 2;
+	struct timespec ts;
+	char name[PATH_MAX];
+
+	if (trace.fd >= 0)
+		return;
+
+	while (size * 2 * sizeof(fmm_trace_record_t) <= buffer_kb * 1024ULL)
+		size *= 2;
+
+	snprintf(name, sizeof(name), "%s.%d", path, getpid());
+	trace.ring = malloc(size * sizeof(*trace.ring));
+	if (!trace.ring)
+		return;
+	trace.fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (trace.fd < 0) {
+		pr_err("Failed to open trace file %s: %s\n", name,
+		       strerror(errno));
+		free(trace.ring);
+		trace.ring = NULL;
+		return;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	memcpy(header.magic, FMM_TRACE_MAGIC, sizeof(header.magic));
+	header.version = FMM_TRACE_VERSION;
+	header.record_size = sizeof(fmm_trace_record_t);
+	header.num_gpus = gpu_mem_count;
+	header.page_size = PAGE_SIZE;
+	header.start_time = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	if (write(trace.fd, &header, sizeof(header)) != sizeof(header)) {
+		close(trace.fd);
+		trace.fd = -1;
+		free(trace.ring);
+		trace.ring = NULL;
+		return;
+	}
+
+	trace.size = size;
+	trace.head = trace.written = 0;
+	trace.dropped = 0;
+	trace.writing = false;
+	trace.start_ns = bo_cache_now();
+	pr_info("Tracing memory management calls to %s\n", name);
+}
+
+/* Write n records starting at record first. Called with writing set,
+ * so the records can't be overwritten without holding the lock.
+ */
+static void trace_write(uint64_t first, uint64_t n)
+{
+	uint64_t i = first & (trace.size - 1);
+	uint64_t chunk = MIN(n, trace.size - i);
+
+	if (write(trace.fd, &trace.ring[i], chunk * sizeof(*trace.ring)) < 0 ||
+	    (n > chunk && write(trace.fd, trace.ring,
+				(n - chunk) * sizeof(*trace.ring)) < 0))
+		pr_err_once("Failed to write trace: %s\n", strerror(errno));
+}
+
+/* Flush what is left and close the file */
+static void trace_fini(void)
+{
+	uint64_t n;
+
+	if (trace.fd < 0)
+		return;
+
+	pthread_mutex_lock(&trace.lock);
+	while (trace.writing) {
+		pthread_mutex_unlock(&trace.lock);
+		sched_yield();
+		pthread_mutex_lock(&trace.lock);
+	}
+	n = trace.head - trace.written;
+	trace_write(trace.written, n);
+	trace.written += n;
+	if (pwrite(trace.fd, &trace.dropped, sizeof(trace.dropped),
+		   offsetof(fmm_trace_header_t, dropped)) < 0)
+		pr_err("Failed to write trace: %s\n", strerror(errno));
+	close(trace.fd);
+	trace.fd = -1;
+	free(trace.ring);
+	trace.ring = NULL;
+	pthread_mutex_unlock(&trace.lock);
+}
+
+/* The parent's unwritten records must not be written again by a forked
+ * child. The child opens its own file when it opens KFD.
+ */
+static void trace_clear(void)
+{
+	if (trace.fd < 0)
+		return;
+
+	close(trace.fd);
+	trace.fd = -1;
+	free(trace.ring);
+	trace.ring = NULL;
+	pthread_mutex_init(&trace.lock, NULL);
+}
+
+uint64_t fmm_trace_begin(void)
+{
+	if (trace.fd < 0)
+		return 0;
+
+	return bo_cache_now();
+}
+
+uint64_t fmm_trace_gpus(uint64_t begin, const uint32_t *ids, uint64_t n,
+			bool node_ids)
+{
+	gpu_mask_t gpus = 0;
+	uint64_t i;
+	uint32_t j;
+
+	if (!begin || !ids)
+		return 0;
+
+	for (i = 0; i < n; i++)
+		for (j = 0; j < gpu_mem_count; j++)
+			if (ids[i] == (node_ids ? gpu_mem[j].node_id :
+					gpu_mem[j].gpu_id))
+				gpus |= GPU_MASK(j);
+
+	return gpus;
+}
+
+static void trace_fill(fmm_trace_record_t *record, uint64_t begin,
+		       uint64_t end, fmm_trace_op_t op, const void *address,
+		       uint64_t size, uint32_t node, uint64_t gpus,
+		       uint32_t flags, HSAKMT_STATUS status)
+{
+	if (!trace_tid)
+		trace_tid = syscall(SYS_gettid);
+
+	record->time_ns = begin - trace.start_ns;
+	record->address = (uint64_t)address;
+	record->size = size;
+	record->gpus = gpus;
+	record->flags = flags;
+	record->duration_ns = MIN(end - begin, (uint64_t)UINT32_MAX);
+	record->tid = trace_tid;
+	record->node = node;
+	record->op = op;
+	record->status = status;
+}
+
+/* Append n records with trace.lock held and write out a full half of
+ * the ring if nobody else does. Drops the lock.
+ */
+static void trace_commit(uint64_t n)
+{
+	uint64_t half = trace.size / 2, first = trace.written;
+	bool write_half = false;
+
+	trace.head += n;
+	if (!trace.writing && trace.head - trace.written >= half) {
+		trace.writing = true;
+		write_half = true;
+	}
+	pthread_mutex_unlock(&trace.lock);
+
+	if (!write_half)
+		return;
+
+	/* Written outside the lock, the other half keeps taking records */
+	trace_write(first, half);
+
+	pthread_mutex_lock(&trace.lock);
+	trace.written += half;
+	trace.writing = false;
+	pthread_mutex_unlock(&trace.lock);
+}
+
+void fmm_trace_end(uint64_t begin, fmm_trace_op_t op, const void *address,
+		   uint64_t size, uint32_t node, uint64_t gpus, uint32_t flags,
+		   HSAKMT_STATUS status)
+{
+	uint64_t end;
+
+	if (!begin)
+		return;
+
+	end = bo_cache_now();
+	pthread_mutex_lock(&trace.lock);
+	if (trace.fd < 0 || trace.head - trace.written >= trace.size) {
+		trace.dropped++;
+		pthread_mutex_unlock(&trace.lock);
+		return;
+	}
+	trace_fill(&trace.ring[trace.head & (trace.size - 1)], begin, end,
+		   op, address, size, node, gpus, flags, status);
+	trace_commit(1);
+}
+
+/* All requests of a batch are appended together so that replaying can
+ * batch them again
+ */
+void fmm_trace_batch(uint64_t begin, const HsaMemoryMapRequest *requests,
+		     uint64_t n_requests, bool map)
+{
+	const HsaMemoryMapRequest *request;
+	uint64_t end, i;
+
+	if (!begin)
+		return;
+
+	end = bo_cache_now();
+	pthread_mutex_lock(&trace.lock);
+	if (trace.fd < 0 ||
+	    trace.head - trace.written + n_requests > trace.size) {
+		trace.dropped += n_requests;
+		pthread_mutex_unlock(&trace.lock);
+		return;
+	}
+	for (i = 0; i < n_requests; i++) {
+		request = &requests[i];
+		trace_fill(&trace.ring[(trace.head + i) & (trace.size - 1)],
+			   begin, end,
+			   map ? FMM_TRACE_MAP_BATCH : FMM_TRACE_UNMAP_BATCH,
+			   request->MemoryAddress, request->SizeInBytes, 0,
+			   fmm_trace_gpus(begin, request->NodeArray,
+					  request->NumberOfNodes, true),
+			   n_requests, request->Status);
+	}
+	trace_commit(n_requests);
+}
+
+/* Allocation tracker, enabled by HSA_ALLOC_TRACK. A sampled allocation
+ * or registration records the call stack that made it in its vm_object.
+ * Sites with the same stack share the counters of live and peak bytes,
+ * so memory that is never freed can be found by where it came from.
+ * Counters of sampled allocations are scaled by the sample rate.
+ */
+#define ALLOC_SITE_FRAMES	HSA_ALLOCATION_SITE_FRAMES
+#define ALLOC_SITE_BUCKETS	1024
+#define ALLOC_SITE_MAX		4096
+#define ALLOC_TRACK_DEFAULT_SITES	10
+
+typedef struct alloc_site {
+	struct alloc_site *next;	/* in hash bucket */
+	struct alloc_site *all;		/* in list of all sites */
+	uint64_t hash;
+	void *frames[ALLOC_SITE_FRAMES];
+	uint32_t num_frames;
+	/* Updated atomically, releases happen under aperture locks */
+	uint64_t live_bytes;
+	uint64_t live_count;
+	uint64_t peak_bytes;
+	uint64_t allocs;
+	uint64_t alloc_bytes;
+} alloc_site_t;
+
+static struct {
+	pthread_mutex_t lock;
+	uint32_t sample;	/* track 1 in sample allocations, 0 = off */
+	uint32_t report_sites;
+	uint32_t num_sites;
+	alloc_site_t *buckets[ALLOC_SITE_BUCKETS];
+	alloc_site_t *sites;
+	/* Stacks beyond ALLOC_SITE_MAX are accounted here */
+	alloc_site_t overflow;
+	uint64_t live_bytes;
+	uint64_t peak_bytes;
+} alloc_track = {
+	.lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static __thread uint32_t alloc_track_countdown;
+
+static void alloc_track_peak(uint64_t *peak, uint64_t live)
+{
+	uint64_t old = __atomic_load_n(peak, __ATOMIC_RELAXED);
+
+	while (live > old &&
+	       !__atomic_compare_exchange_n(peak, &old, live, true,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static alloc_site_t *alloc_site_get(void **frames, uint32_t n)
+{
+	alloc_site_t *site;
+	uint64_t hash = 14695981039346656037ULL;
+	uint32_t i;
+
+	for (i = 0; i < n; i++)
+		hash = (hash ^ (uintptr_t)frames[i]) * 1099511628211ULL;
+
+	for (site = alloc_track.buckets[hash % ALLOC_SITE_BUCKETS]; site;
+	     site = site->next)
+		if (site->hash == hash && site->num_frames == n &&
+		    !memcmp(site->frames, frames, n * sizeof(*frames)))
+			return site;
+
+	if (alloc_track.num_sites >= ALLOC_SITE_MAX)
+		return &alloc_track.overflow;
+	site = calloc(1, sizeof(*site));
+	if (!site)
+		return &alloc_track.overflow;
+
+	site->hash = hash;
+	site->num_frames = n;
+	memcpy(site->frames, frames, n * sizeof(*frames));
+	site->next = alloc_track.buckets[hash % ALLOC_SITE_BUCKETS];
+	alloc_track.buckets[hash % ALLOC_SITE_BUCKETS] = site;
+	site->all = alloc_track.sites;
+	alloc_track.sites = site;
+	alloc_track.num_sites++;
+
+	return site;
+}
+
+void fmm_track_allocation(const void *address)
+{
+	manageable_aperture_t *aperture;
+	vm_object_t *object;
+	alloc_site_t *site;
+	void *frames[ALLOC_SITE_FRAMES + 1];
+	uint64_t live;
+	int n;
+
+	if (!alloc_track.sample || !address)
+		return;
+	if (alloc_track_countdown > 1) {
+		alloc_track_countdown--;
+		return;
+	}
+	alloc_track_countdown = alloc_track.sample;
+
+	/* Skip this function's own frame */
+	n = backtrace(frames, ALLOC_SITE_FRAMES + 1);
+	if (n < 2)
+		return;
+
+	pthread_mutex_lock(&alloc_track.lock);
+	site = alloc_site_get(&frames[1], n - 1);
+	pthread_mutex_unlock(&alloc_track.lock);
+
+	object = vm_find_object(address, 0, true, &aperture);
+	if (!object)
+		return;
+	/* Memory registered again keeps the site of its first registration */
+	if (!object->site) {
+		object->site = site;
+		__atomic_add_fetch(&site->allocs, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&site->alloc_bytes, object->size,
+				   __ATOMIC_RELAXED);
+		__atomic_add_fetch(&site->live_count, 1, __ATOMIC_RELAXED);
+		live = __atomic_add_fetch(&site->live_bytes, object->size,
+					  __ATOMIC_RELAXED);
+		alloc_track_peak(&site->peak_bytes, live);
+		live = __atomic_add_fetch(&alloc_track.live_bytes, object->size,
+					  __ATOMIC_RELAXED);
+		alloc_track_peak(&alloc_track.peak_bytes, live);
+	}
+	pthread_rwlock_unlock(&aperture->fmm_lock);
+}
+
+static void alloc_site_release(alloc_site_t *site, uint64_t size)
+{
+	__atomic_sub_fetch(&site->live_count, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&site->live_bytes, size, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&alloc_track.live_bytes, size, __ATOMIC_RELAXED);
+}
+
+static int alloc_site_cmp(const void *a, const void *b)
+{
+	const alloc_site_t *sa = *(alloc_site_t * const *)a;
+	const alloc_site_t *sb = *(alloc_site_t * const *)b;
+	uint64_t la = __atomic_load_n(&sa->live_bytes, __ATOMIC_RELAXED);
+	uint64_t lb = __atomic_load_n(&sb->live_bytes, __ATOMIC_RELAXED);
+
+	if (la != lb)
+		return la < lb ? 1 : -1;
+	return sa->peak_bytes < sb->peak_bytes ? 1 :
+		sa->peak_bytes > sb->peak_bytes ? -1 : 0;
+}
+
+/* Return all sites ranked by live bytes, then peak bytes, in an array
+ * the caller frees. Call with alloc_track.lock held.
+ */
+static alloc_site_t **alloc_sites_ranked(uint32_t *num_sites)
+{
+	alloc_site_t **ranked, *site;
+	uint32_t n = 0;
+
+	ranked = malloc((alloc_track.num_sites + 1) * sizeof(*ranked));
+	if (!ranked)
+		return NULL;
+
+	for (site = alloc_track.sites; site; site = site->all)
+		ranked[n++] = site;
+	if (alloc_track.overflow.allocs)
+		ranked[n++] = &alloc_track.overflow;
+	qsort(ranked, n, sizeof(*ranked), alloc_site_cmp);
+	*num_sites = n;
+
+	return ranked;
+}
+
+HSAKMT_STATUS fmm_get_allocation_sites(HsaAllocationSite *sites,
+				       uint32_t *num_sites)
+{
+	alloc_site_t **ranked;
+	uint64_t scale = alloc_track.sample;
+	uint32_t i, n;
+
+	if (!alloc_track.sample)
+		return HSAKMT_STATUS_NOT_SUPPORTED;
+
+	pthread_mutex_lock(&alloc_track.lock);
+	ranked = alloc_sites_ranked(&n);
+	pthread_mutex_unlock(&alloc_track.lock);
+	if (!ranked)
+		return HSAKMT_STATUS_NO_MEMORY;
+
+	n = MIN(n, *num_sites);
+	for (i = 0; i < n; i++) {
+		memset(&sites[i], 0, sizeof(sites[i]));
+		sites[i].LiveBytes = ranked[i]->live_bytes * scale;
+		sites[i].LiveCount = ranked[i]->live_count * scale;
+		sites[i].PeakBytes = ranked[i]->peak_bytes * scale;
+		sites[i].TotalCount = ranked[i]->allocs * scale;
+		sites[i].TotalBytes = ranked[i]->alloc_bytes * scale;
+		sites[i].SampleRate = alloc_track.sample;
+		sites[i].NumFrames = ranked[i]->num_frames;
+		memcpy(sites[i].Frames, ranked[i]->frames,
+		       ranked[i]->num_frames * sizeof(void *));
+	}
+	*num_sites = n;
+	free(ranked);
+
+	return HSAKMT_STATUS_SUCCESS;
+}
+
+HSAKMT_STATUS fmm_dump_allocation_sites(uint32_t max_sites)
+{
+	alloc_site_t **ranked, *site;
+	uint64_t scale = alloc_track.sample;
+	uint32_t i, n;
+
+	if (!alloc_track.sample)
+		return HSAKMT_STATUS_NOT_SUPPORTED;
+
+	pthread_mutex_lock(&alloc_track.lock);
+	ranked = alloc_sites_ranked(&n);
+	pthread_mutex_unlock(&alloc_track.lock);
+	if (!ranked)
+		return HSAKMT_STATUS_NO_MEMORY;
+
+	fprintf(stderr, "hsakmt: %" PRIu64 " bytes live, peak %" PRIu64
+		" bytes, %u allocation sites, 1 in %u allocations tracked\n",
+		alloc_track.live_bytes * scale, alloc_track.peak_bytes * scale,
+		n, alloc_track.sample);
+	for (i = 0; i < n && i < max_sites; i++) {
+		site = ranked[i];
+		fprintf(stderr, "hsakmt: #%u %" PRIu64 " bytes live in %" PRIu64
+			" allocations, peak %" PRIu64 " bytes, %" PRIu64
+			" bytes in %" PRIu64 " allocations total\n",
+			i, site->live_bytes * scale, site->live_count * scale,
+			site->peak_bytes * scale, site->alloc_bytes * scale,
+			site->allocs * scale);
+		if (site == &alloc_track.overflow)
+			fprintf(stderr, "\t(call stacks beyond %u sites)\n",
+				ALLOC_SITE_MAX);
+		else
+			backtrace_symbols_fd(site->frames, site->num_frames,
+					     STDERR_FILENO);
+	}
+	fflush(stderr);
+	free(ranked);
+
+	return HSAKMT_STATUS_SUCCESS;
+}
+
+/* Report the sites that still have live memory when KFD is closed */
+static void alloc_track_fini(void)
+{
+	if (!alloc_track.sample)
+		return;
+
+	if (alloc_track.live_bytes)
+		fmm_dump_allocation_sites(alloc_track.report_sites);
+}
+
+/* A forked child starts without any of the parent's memory, and tracks
+ * again once it opens KFD
+ */
+static void alloc_track_clear(void)
+{
+	alloc_site_t *site, *next;
+
+	for (site = alloc_track.sites; site; site = next) {
+		next = site->all;
+		free(site);
+	}
+	memset(&alloc_track, 0, sizeof(alloc_track));
+	pthread_mutex_init(&alloc_track.lock, NULL);
+}
+
+/* A BO that backs several vm_objects, e.g. the sub-allocations of a
+ * chunk. Each object maps its part of the BO on its own, so the BO's GPU
+ * mappings are reference counted per GPU. They are protected by the
+ * fmm_lock of the aperture that holds the objects.
+ */
+typedef struct shared_bo {
+	uint64_t handle;
+	gpu_mask_t mapped_gpus;
+	uint16_t map_refs[FMM_MAX_GPUS];
+} shared_bo_t;
+
+/* Map an object of a shared BO to GPUs. Only GPUs that don't have the
+ * BO mapped yet need KFD. Call with the aperture locked for writing.
+ */
+static int shared_bo_map(vm_object_t *object, gpu_mask_t gpus)
+{
+	shared_bo_t *bo = object->shared_bo;
+	gpu_mask_t done = 0, mapped, m;
+	int ret = 0;
+
+	gpus &= ~object->mapped_gpus;
+	if (gpus & ~bo->mapped_gpus)
+		ret = fmm_map_bo_ioctl(bo->handle, gpus & ~bo->mapped_gpus,
+				       true, &done);
+	bo->mapped_gpus |= done;
+	mapped = gpus & bo->mapped_gpus;
+
+	for (m = mapped; m; m &= m - 1)
+		bo->map_refs[__builtin_ctzll(m)]++;
+	object->mapped_gpus |= mapped;
+
+	return ret;
+}
+
+/* Unmap an object of a shared BO from GPUs. The BO is unmapped from
+ * GPUs where no other object is mapped. Call with the aperture locked
+ * for writing.
+ */
+static int shared_bo_unmap(vm_object_t *object, gpu_mask_t gpus)
+{
+	shared_bo_t *bo = object->shared_bo;
+	gpu_mask_t last = 0, done = 0, unmapped, m;
+	int ret = 0;
+
+	gpus &= object->mapped_gpus;
+	for (m = gpus; m; m &= m - 1)
+		if (bo->map_refs[__builtin_ctzll(m)] == 1)
+			last |= m & -m;
+	if (last)
+		ret = fmm_map_bo_ioctl(bo->handle, last, false, &done);
+	bo->mapped_gpus &= ~done;
+	unmapped = (gpus & ~last) | done;
+
+	for (m = unmapped; m; m &= m - 1)
+		bo->map_refs[__builtin_ctzll(m)]--;
+	object->mapped_gpus &= ~unmapped;
+
+	return ret;
+}
+
+/* Sub-allocator for small BOs, enabled by setting HSA_SUBALLOC to a
+ * non-0 value. Allocations smaller than SUBALLOC_MAX_SIZE are rounded up
+ * to a power of two and carved out of 2MB chunks. Each chunk is one BO
+ * with a single CPU mapping, holding allocations of one size for one
+ * node and set of flags. Sub-allocations are vm_objects of their own
+ * that share the BO of their chunk.
+ *
+ * Executable memory, including the queue and event buffers allocated by
+ * the thunk itself, always gets its own BO, as KFD identifies those
+ * buffers by their BO.
+ */
+#define SUBALLOC_CHUNK_SIZE GPU_HUGE_PAGE_SIZE
+#define SUBALLOC_MAX_SIZE (64 * 1024)
+#define SUBALLOC_MAX_SLOTS (SUBALLOC_CHUNK_SIZE / 4096)
+
+typedef struct suballoc_pool suballoc_pool_t;
+
+typedef struct suballoc_chunk {
+	shared_bo_t bo;
+	/* Chunks of the pool with free slots */
+	struct suballoc_chunk *next, *prev;
+	suballoc_pool_t *pool;
+	manageable_aperture_t *aperture;
+	void *start;
+	uint32_t node_id;
+	uint32_t free_slots;
+	uint64_t used_slots[SUBALLOC_MAX_SLOTS / 64];
+} suballoc_chunk_t;
+
+/* Chunks for allocations of one size with the same flags on one GPU
+ * (device) or system memory node (!device)
+ */
+struct suballoc_pool {
+	suballoc_pool_t *next;
+	bool device;
+	uint32_t id;
+	uint32_t mem_flags;
+	uint32_t slot_shift;
+	uint32_t num_slots;
+	suballoc_chunk_t *chunks;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	suballoc_pool_t *pools;
+	bool enabled;
+} suballoc = {
+	.lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static bool suballoc_possible(void *address, uint64_t size,
+			      HsaMemFlags flags)
+{
+	return suballoc.enabled && !address && size < SUBALLOC_MAX_SIZE &&
+		!flags.ui32.ExecuteAccess && !flags.ui32.AQLQueueMemory;
+}
+
+static void suballoc_link_chunk(suballoc_chunk_t *chunk)
+{
+	suballoc_pool_t *pool = chunk->pool;
+
+	chunk->prev = NULL;
+	chunk->next = pool->chunks;
+	if (chunk->next)
+		chunk->next->prev = chunk;
+	pool->chunks = chunk;
+}
+
+static void suballoc_unlink_chunk(suballoc_chunk_t *chunk)
+{
+	if (chunk->prev)
+		chunk->prev->next = chunk->next;
+	else
+		chunk->pool->chunks = chunk->next;
+	if (chunk->next)
+		chunk->next->prev = chunk->prev;
+}
+
+/* Find or create the pool. Call with suballoc.lock held. */
+static suballoc_pool_t *suballoc_get_pool(bool device, uint32_t id,
+					  uint64_t size, uint32_t mem_flags)
+{
+	uint32_t slot_shift = PAGE_SHIFT;
+	suballoc_pool_t *pool;
+
+	while ((1ULL << slot_shift) < size)
+		slot_shift++;
+
+	for (pool = suballoc.pools; pool; pool = pool->next)
+		if (pool->device == device && pool->id == id &&
+		    pool->mem_flags == mem_flags &&
+		    pool->slot_shift == slot_shift)
+			return pool;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+	pool->device = device;
+	pool->id = id;
+	pool->mem_flags = mem_flags;
+	pool->slot_shift = slot_shift;
+	pool->num_slots = SUBALLOC_CHUNK_SIZE >> slot_shift;
+	pool->next = suballoc.pools;
+	suballoc.pools = pool;
+
+	return pool;
+}
+
+/* Allocate a chunk BO for the pool and detach it from its vm_object.
+ * Call without suballoc.lock held.
+ */
+static suballoc_chunk_t *suballoc_create_chunk(suballoc_pool_t *pool)
+{
+	manageable_aperture_t *aperture;
+	suballoc_chunk_t *chunk;
+	vm_object_t *obj;
+	HsaMemFlags flags;
+	void *mem;
+
+	chunk = calloc(1, sizeof(*chunk));
+	if (!chunk)
+		return NULL;
+
+	flags.Value = pool->mem_flags;
+	if (pool->device)
+		mem = fmm_allocate_device(pool->id, NULL, SUBALLOC_CHUNK_SIZE,
+					  flags);
+	else
+		mem = fmm_allocate_host_gpu(pool->id, 0, NULL,
+					    SUBALLOC_CHUNK_SIZE, flags);
+	if (!mem) {
+		free(chunk);
+		return NULL;
+	}
+
+	obj = vm_find_object(mem, 0, true, &aperture);
+	if (!obj) {
+		free(chunk);
+		return NULL;
+	}
+	chunk->pool = pool;
+	chunk->aperture = aperture;
+	chunk->start = mem;
+	chunk->bo.handle = obj->handle;
+	chunk->node_id = obj->node_id;
+	chunk->free_slots = pool->num_slots;
+	vm_remove_object(aperture, obj);
+	pthread_rwlock_unlock(&aperture->fmm_lock);
+
+	return chunk;
+}
+
+/* Carve a sub-allocation out of a chunk of the matching pool. Returns
+ * its address and new object and the aperture it lives in, or NULL if
+ * the allocation needs its own BO.
+ */
+static void *suballoc_allocate(bool device, uint32_t id, uint64_t size,
+			       HsaMemFlags flags,
+			       manageable_aperture_t **aperture,
+			       vm_object_t **vm_obj)
+{
+	suballoc_pool_t *pool;
+	suballoc_chunk_t *chunk, *new_chunk = NULL;
+	vm_object_t *obj;
+	uint32_t slot = 0, i;
+	uint64_t offset;
+	void *mem;
+
+	pthread_mutex_lock(&suballoc.lock);
+	pool = suballoc_get_pool(device, id, size, flags.Value);
+	if (!pool) {
+		pthread_mutex_unlock(&suballoc.lock);
+		return NULL;
+	}
+	while (!pool->chunks) {
+		/* Don't hold the lock while allocating from KFD */
+		pthread_mutex_unlock(&suballoc.lock);
+		new_chunk = suballoc_create_chunk(pool);
+		if (!new_chunk)
+			return NULL;
+		pthread_mutex_lock(&suballoc.lock);
+		suballoc_link_chunk(new_chunk);
+	}
+	chunk = pool->chunks;
+	for (i = 0; i < SUBALLOC_MAX_SLOTS / 64; i++)
+		if (~chunk->used_slots[i]) {
+			slot = i * 64 + __builtin_ctzll(~chunk->used_slots[i]);
+			break;
+		}
+	chunk->used_slots[slot / 64] |= 1ULL << (slot % 64);
+	if (!--chunk->free_slots)
+		suballoc_unlink_chunk(chunk);
+	pthread_mutex_unlock(&suballoc.lock);
+
+	offset = (uint64_t)slot << pool->slot_shift;
+	mem = VOID_PTR_ADD(chunk->start, offset);
+
+	pthread_rwlock_wrlock(&chunk->aperture->fmm_lock);
+	obj = aperture_allocate_object(chunk->aperture, mem, chunk->bo.handle,
+				       size, 0);
+	if (obj) {
+		obj->flags = flags.Value;
+		obj->node_id = chunk->node_id;
+		obj->shared_bo = &chunk->bo;
+	}
+	pthread_rwlock_unlock(&chunk->aperture->fmm_lock);
+	if (!obj) {
+		pthread_mutex_lock(&suballoc.lock);
+		chunk->used_slots[slot / 64] &= ~(1ULL << (slot % 64));
+		if (!chunk->free_slots++)
+			suballoc_link_chunk(chunk);
+		pthread_mutex_unlock(&suballoc.lock);
+		return NULL;
+	}
+
+	*aperture = chunk->aperture;
+	*vm_obj = obj;
+	return mem;
+}
+
+/* Free a sub-allocation. Empty chunks are released, except for one per
+ * pool.
+ */
+static void suballoc_free(vm_object_t *object, manageable_aperture_t *aperture)
+{
+	suballoc_chunk_t *chunk, *release = NULL;
+	suballoc_pool_t *pool;
+	uint32_t slot;
+
+	pthread_rwlock_wrlock(&aperture->fmm_lock);
+	chunk = (suballoc_chunk_t *)object->shared_bo;
+	pool = chunk->pool;
+	slot = VOID_PTRS_SUB(object->start, chunk->start) >> pool->slot_shift;
+	if (object->mapped_gpus)
+		shared_bo_unmap(object, object->mapped_gpus);
+	vm_remove_object(aperture, object);
+	pthread_rwlock_unlock(&aperture->fmm_lock);
+
+	pthread_mutex_lock(&suballoc.lock);
+	chunk->used_slots[slot / 64] &= ~(1ULL << (slot % 64));
+	if (!chunk->free_slots++)
+		suballoc_link_chunk(chunk);
+	if (chunk->free_slots == pool->num_slots &&
+	    (pool->chunks != chunk || chunk->next)) {
+		suballoc_unlink_chunk(chunk);
+		release = chunk;
+	}
+	pthread_mutex_unlock(&suballoc.lock);
+
+	if (release) {
+		fmm_release_detached_bo(release->aperture, release->start,
+					SUBALLOC_CHUNK_SIZE, release->bo.handle);
+		free(release);
+	}
+}
+
+/* Forget all chunks without freeing them, see bo_cache_clear */
+static void suballoc_clear(void)
+{
+	suballoc_pool_t *pool;
+	suballoc_chunk_t *chunk;
+
+	pthread_mutex_init(&suballoc.lock, NULL);
+
+	/* Full chunks are only referenced by their sub-allocations. Their
+	 * vm_objects are gone at this point, so they are leaked.
+	 */
+	while ((pool = suballoc.pools)) {
+		suballoc.pools = pool->next;
+		while ((chunk = pool->chunks)) {
+			pool->chunks = chunk->next;
+			free(chunk);
+		}
+		free(pool);
+	}
+}
+
+/* Cache of userptr BOs, enabled by setting HSA_USERPTR_CACHE_MB to the
+ * number of MB of unused userptr BOs to keep pinned. Registering a range
+ * inside an existing userptr BO creates an object of its own that shares
+ * the BO instead of creating another one. A registration that overlaps
+ * BOs in use gets a new BO covering all of them, so that later
+ * registrations anywhere in the combined range hit it. BOs are never
+ * resized, as their GPU addresses are in use.
+ *
+ * BOs whose last registration is gone stay in the cache on an LRU list
+ * until the budget is exceeded or a new BO overlaps them.
+ */
+typedef struct userptr_bo {
+	shared_bo_t bo;
+	/* Node in ucache.tree, keyed by the page aligned CPU range */
+	rbtree_node_t node;
+	/* LRU list of unused BOs, also links evicted BOs */
+	struct userptr_bo *lru_prev, *lru_next;
+	manageable_aperture_t *aperture;
+	void *start;
+	uint64_t size;
+	uint32_t flags;
+	bool coarse_grain;
+	/* Registrations sharing the BO */
+	uint32_t refs;
+} userptr_bo_t;
+
+#define userptr_bo_entry(n) rb_entry(n, userptr_bo_t, node)
+
+static struct {
+	pthread_mutex_t lock;
+	rbtree_t tree;
+	userptr_bo_t *lru_head, *lru_tail;
+	uint64_t idle_bytes;
+	uint64_t budget;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+} ucache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static void ucache_lru_add(userptr_bo_t *ubo)
+{
+	ubo->lru_prev = NULL;
+	ubo->lru_next = ucache.lru_head;
+	if (ubo->lru_next)
+		ubo->lru_next->lru_prev = ubo;
+	else
+		ucache.lru_tail = ubo;
+	ucache.lru_head = ubo;
+	ucache.idle_bytes += ubo->size;
+}
+
+static void ucache_lru_del(userptr_bo_t *ubo)
+{
+	if (ubo->lru_prev)
+		ubo->lru_prev->lru_next = ubo->lru_next;
+	else
+		ucache.lru_head = ubo->lru_next;
+	if (ubo->lru_next)
+		ubo->lru_next->lru_prev = ubo->lru_prev;
+	else
+		ucache.lru_tail = ubo->lru_prev;
+	ucache.idle_bytes -= ubo->size;
+}
+
+/* Remove an unused BO from the cache and add it to the evicted list.
+ * Call with ucache.lock held.
+ */
+static void ucache_evict(userptr_bo_t *ubo, userptr_bo_t **evicted)
+{
+	ucache_lru_del(ubo);
+	rbtree_delete(&ucache.tree, &ubo->node);
+	ucache.evictions++;
+	ubo->lru_next = *evicted;
+	*evicted = ubo;
+}
+
+/* Release the BOs of the evicted list. Call without ucache.lock held. */
+static void ucache_release(userptr_bo_t *evicted)
+{
+	userptr_bo_t *ubo;
+
+	while ((ubo = evicted)) {
+		evicted = ubo->lru_next;
+
+		fmm_release_detached_bo(ubo->aperture, ubo->start, ubo->size,
+					ubo->bo.handle);
+		free(ubo);
+	}
+}
+
+/* Find a BO other than skip whose CPU range contains [start, start +
+ * size). Call with ucache.lock held.
+ */
+static userptr_bo_t *ucache_find(uint64_t start, uint64_t size,
+				 bool coarse_grain, userptr_bo_t *skip)
+{
+	rbtree_node_t *n = rbtree_lookup_interval(&ucache.tree, start);
+	userptr_bo_t *ubo;
+
+	/* All BOs containing start follow the lowest one in key order */
+	for (; n && n->key.addr <= start; n = rbtree_next(&ucache.tree, n)) {
+		ubo = userptr_bo_entry(n);
+		if (ubo != skip && ubo->coarse_grain == coarse_grain &&
+		    n->key.addr + n->key.size >= start + size)
+			return ubo;
+	}
+
+	return NULL;
+}
+
+/* Get a BO containing [*start, *start + *size) with a reference. On a
+ * miss, *start and *size are extended to the range of the new BO to
+ * create. Returns NULL in that case. Call without ucache.lock held.
+ */
+static userptr_bo_t *ucache_get(uint64_t *start, uint64_t *size,
+				bool coarse_grain)
+{
+	uint64_t end = *start + *size, bo_start = *start, bo_end = end;
+	userptr_bo_t *ubo, *evicted = NULL;
+	rbtree_key_t key = rbtree_key(*start, 0);
+	rbtree_node_t *n, *next;
+
+	pthread_mutex_lock(&ucache.lock);
+	ubo = ucache_find(*start, *size, coarse_grain, NULL);
+	if (ubo) {
+		if (!ubo->refs++)
+			ucache_lru_del(ubo);
+		ucache.hits++;
+		pthread_mutex_unlock(&ucache.lock);
+		return ubo;
+	}
+	ucache.misses++;
+
+	/* Unused BOs overlapping the range would pin the same pages twice,
+	 * drop them. Cover BOs in use instead.
+	 */
+	n = rbtree_lookup_interval(&ucache.tree, *start);
+	if (!n)
+		n = rbtree_lookup_nearest(&ucache.tree, &key, LKP_ALL, RIGHT);
+	for (; n && n->key.addr < end; n = next) {
+		next = rbtree_next(&ucache.tree, n);
+		ubo = userptr_bo_entry(n);
+		if (n->key.addr + n->key.size <= *start ||
+		    ubo->coarse_grain != coarse_grain)
+			continue;
+		if (!ubo->refs) {
+			ucache_evict(ubo, &evicted);
+			continue;
+		}
+		bo_start = MIN(bo_start, n->key.addr);
+		bo_end = MAX(bo_end, n->key.addr + n->key.size);
+	}
+	pthread_mutex_unlock(&ucache.lock);
+
+	ucache_release(evicted);
+
+	*start = bo_start;
+	*size = bo_end - bo_start;
+	return NULL;
+}
+
+/* Drop a reference to a BO. Unused BOs are kept unless another BO
+ * covers them or the cache is over budget.
+ */
+static void ucache_put(userptr_bo_t *ubo)
+{
+	userptr_bo_t *evicted = NULL;
+
+	pthread_mutex_lock(&ucache.lock);
+	if (!--ubo->refs) {
+		ucache_lru_add(ubo);
+		if (ucache_find(ubo->node.key.addr, ubo->node.key.size,
+				ubo->coarse_grain, ubo))
+			ucache_evict(ubo, &evicted);
+		while (ucache.idle_bytes > ucache.budget)
+			ucache_evict(ucache.lru_tail, &evicted);
+	}
+	pthread_mutex_unlock(&ucache.lock);
+
+	ucache_release(evicted);
+}
+
+/* Create an object for a registration of [addr, addr + size) on a cached
+ * userptr BO, creating the BO if needed
+ */
+static vm_object_t *ucache_register(uint32_t gpu_id, uint64_t addr,
+				    uint64_t size, uint32_t flags,
+				    bool coarse_grain,
+				    manageable_aperture_t **out_aper)
+{
+	manageable_aperture_t *aperture = svm.dgpu_aperture;
+	uint64_t bo_start = addr, bo_size = size, mmap_offset;
+	userptr_bo_t *ubo;
+	vm_object_t *obj;
+	uint64_t offset;
+	void *mem;
+
+	ubo = ucache_get(&bo_start, &bo_size, coarse_grain);
+	if (!ubo) {
+		ubo = calloc(1, sizeof(*ubo));
+		if (!ubo)
+			return NULL;
+
+		/* Allocate the BO and detach it from its vm_object */
+		mmap_offset = bo_start;
+		mem = __fmm_allocate_device(gpu_id, NULL, bo_size, &aperture,
+					    &mmap_offset, flags, &obj);
+		if (!mem) {
+			free(ubo);
+			return NULL;
+		}
+		pthread_rwlock_wrlock(&aperture->fmm_lock);
+		ubo->bo.handle = obj->handle;
+		ubo->flags = obj->flags;
+		vm_remove_object(aperture, obj);
+		pthread_rwlock_unlock(&aperture->fmm_lock);
+
+		ubo->aperture = aperture;
+		ubo->start = mem;
+		ubo->size = bo_size;
+		ubo->coarse_grain = coarse_grain;
+		ubo->refs = 1;
+		ubo->node.key = rbtree_key(bo_start, bo_size);
+
+		pthread_mutex_lock(&ucache.lock);
+		rbtree_insert(&ucache.tree, &ubo->node);
+		pthread_mutex_unlock(&ucache.lock);
+	}
+
+	offset = addr - ubo->node.key.addr;
+	mem = VOID_PTR_ADD(ubo->start, offset);
+
+	aperture = ubo->aperture;
+	pthread_rwlock_wrlock(&aperture->fmm_lock);
+	obj = aperture_allocate_object(aperture, mem, ubo->bo.handle, size,
+				       ubo->flags);
+	if (obj)
+		obj->shared_bo = &ubo->bo;
+	pthread_rwlock_unlock(&aperture->fmm_lock);
+
+	if (!obj) {
+		ucache_put(ubo);
+		return NULL;
+	}
+
+	*out_aper = aperture;
+	return obj;
+}
+
+/* Release the object of a registration on a cached userptr BO */
+static void ucache_deregister(vm_object_t *object,
+			      manageable_aperture_t *aperture)
+{
+	userptr_bo_t *ubo = (userptr_bo_t *)object->shared_bo;
+
+	pthread_rwlock_wrlock(&aperture->fmm_lock);
+	if (object->mapped_gpus)
+		shared_bo_unmap(object, object->mapped_gpus);
+	vm_remove_object(aperture, object);
+	pthread_rwlock_unlock(&aperture->fmm_lock);
+
+	ucache_put(ubo);
+}
+
+/* Forget all cached BOs without freeing them, see bo_cache_clear */
+static void ucache_clear(void)
+{
+	rbtree_node_t *n;
+
+	pthread_mutex_init(&ucache.lock, NULL);
+
+	/* The tree may not be initialized if the cache was never enabled */
+	if (ucache.tree.root)
+		while ((n = rbtree_min_max(&ucache.tree, LEFT))) {
+			rbtree_delete(&ucache.tree, n);
+			free(userptr_bo_entry(n));
+		}
+	rbtree_init_interval(&ucache.tree);
+	ucache.lru_head = NULL;
+	ucache.lru_tail = NULL;
+	ucache.idle_bytes = 0;
+}
+
+/* Cache of imported IPC buffers, enabled by setting HSA_IPC_CACHE_MB to
+ * the number of MB of unused imports to keep. Registering a share handle
+ * that is already imported from the same GPU returns the existing
+ * mapping with another reference on it. The object is released with the
+ * last reference.
+ *
+ * Imports whose last reference is gone keep their BO, CPU mapping and
+ * address space on an LRU list until the budget is exceeded, so that
+ * importing them again only needs a new object.
+ */
+#define IPC_CACHE_BUCKETS 256
+
+typedef struct ipc_import {
+	/* Chain in icache.buckets */
+	struct ipc_import *next;
+	/* LRU list of unused imports, also links evicted imports */
+	struct ipc_import *lru_prev, *lru_next;
+	uint32_t share_handle[4];
+	uint32_t export_gpu_id;
+	uint32_t node_id;
+	uint64_t handle;
+	manageable_aperture_t *aperture;
+	void *start;
+	uint64_t size;
+	/* Object of the import while it has references */
+	vm_object_t *obj;
+	/* Registrations of the import */
+	uint32_t refs;
+} ipc_import_t;
+
+static struct {
+	pthread_mutex_t lock;
+	ipc_import_t *buckets[IPC_CACHE_BUCKETS];
+	ipc_import_t *lru_head, *lru_tail;
+	uint64_t idle_bytes;
+	uint64_t budget;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+} icache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static ipc_import_t **icache_bucket(const uint32_t *share_handle,
+				    uint32_t export_gpu_id)
+{
+	uint32_t hash = export_gpu_id;
+	int i;
+
+	for (i = 0; i < 4; i++)
+		hash = (hash ^ share_handle[i]) * 0x9e3779b1;
+
+	return &icache.buckets[hash >> 24];
+}
+
+/* Call with icache.lock held */
+static ipc_import_t *icache_find(const uint32_t *share_handle,
+				 uint32_t export_gpu_id)
+{
+	ipc_import_t *imp;
+
+	for (imp = *icache_bucket(share_handle, export_gpu_id); imp;
+	     imp = imp->next)
+		if (imp->export_gpu_id == export_gpu_id &&
+		    !memcmp(imp->share_handle, share_handle,
+			    sizeof(imp->share_handle)))
+			return imp;
+
+	return NULL;
+}
+
+static void icache_lru_add(ipc_import_t *imp)
+{
+	imp->lru_prev = NULL;
+	imp->lru_next = icache.lru_head;
+	if (imp->lru_next)
+		imp->lru_next->lru_prev = imp;
+	else
+		icache.lru_tail = imp;
+	icache.lru_head = imp;
+	icache.idle_bytes += imp->size;
+}
+
+static void icache_lru_del(ipc_import_t *imp)
+{
+	if (imp->lru_prev)
+		imp->lru_prev->lru_next = imp->lru_next;
+	else
+		icache.lru_head = imp->lru_next;
+	if (imp->lru_next)
+		imp->lru_next->lru_prev = imp->lru_prev;
+	else
+		icache.lru_tail = imp->lru_prev;
+	icache.idle_bytes -= imp->size;
+}
+
+/* Remove an unused import from the cache and add it to the evicted
+ * list. Call with icache.lock held.
+ */
+static void icache_evict(ipc_import_t *imp, ipc_import_t **evicted)
+{
+	ipc_import_t **p = icache_bucket(imp->share_handle,
+					 imp->export_gpu_id);
+
+	while (*p != imp)
+		p = &(*p)->next;
+	*p = imp->next;
+
+	icache_lru_del(imp);
+	icache.evictions++;
+	imp->lru_next = *evicted;
+	*evicted = imp;
+}
+
+/* Release the BOs of the evicted list. Call without icache.lock held. */
+static void icache_release(ipc_import_t *evicted)
+{
+	ipc_import_t *imp;
+
+	while ((imp = evicted)) {
+		evicted = imp->lru_next;
+
+		fmm_release_detached_bo(imp->aperture, imp->start, imp->size,
+					imp->handle);
+		free(imp);
+	}
+}
+
+/* Take a reference on the import of a share handle, creating its object
+ * again if it was unused. gpus are added to the registered GPUs, none
+ * means all of them. Returns NULL on a miss.
+ */
+static vm_object_t *icache_get(const uint32_t *share_handle,
+			       uint32_t export_gpu_id, uint64_t size,
+			       gpu_mask_t gpus)
+{
+	manageable_aperture_t *aperture;
+	ipc_import_t *imp;
+	vm_object_t *obj = NULL;
+
+	pthread_mutex_lock(&icache.lock);
+	imp = icache_find(share_handle, export_gpu_id);
+	if (!imp || imp->size != size)
+		goto miss;
+
+	aperture = imp->aperture;
+	pthread_rwlock_wrlock(&aperture->fmm_lock);
+	if (!imp->refs) {
+		obj = aperture_allocate_object(aperture, imp->start,
+					       imp->handle, imp->size, 0);
+		if (!obj) {
+			pthread_rwlock_unlock(&aperture->fmm_lock);
+			goto miss;
+		}
+		obj->node_id = imp->node_id;
+		obj->is_imported_kfd_bo = true;
+		obj->ipc_import = imp;
+		imp->obj = obj;
+		icache_lru_del(imp);
+	}
+	obj = imp->obj;
+	if (!imp->refs++ || (obj->registered_gpus && gpus))
+		obj->registered_gpus |= gpus;
+	else
+		obj->registered_gpus = 0;
+	pthread_rwlock_unlock(&aperture->fmm_lock);
+	icache.hits++;
+	pthread_mutex_unlock(&icache.lock);
+
+	return obj;
+
+miss:
+	icache.misses++;
+	pthread_mutex_unlock(&icache.lock);
+	return NULL;
+}
+
+/* Add a new import to the cache. The object stays uncached if another
+ * thread imported the same handle in the meantime.
+ */
+static void icache_put_new(const uint32_t *share_handle,
+			   uint32_t export_gpu_id, vm_object_t *obj,
+			   manageable_aperture_t *aperture)
+{
+	ipc_import_t *imp, **bucket;
+
+	imp = calloc(1, sizeof(*imp));
+	if (!imp)
+		return;
+
+	memcpy(imp->share_handle, share_handle, sizeof(imp->share_handle));
+	imp->export_gpu_id = export_gpu_id;
+	imp->aperture = aperture;
+	imp->refs = 1;
+
+	pthread_mutex_lock(&icache.lock);
+	if (icache_find(share_handle, export_gpu_id)) {
+		pthread_mutex_unlock(&icache.lock);
+		free(imp);
+		return;
+	}
+	pthread_rwlock_wrlock(&aperture->fmm_lock);
+	imp->node_id = obj->node_id;
+	imp->handle = obj->handle;
+	imp->start = obj->start;
+	imp->size = obj->size;
+	imp->obj = obj;
+	obj->ipc_import = imp;
+	pthread_rwlock_unlock(&aperture->fmm_lock);
+	bucket = icache_bucket(share_handle, export_gpu_id);
+	imp->next = *bucket;
+	*bucket = imp;
+	pthread_mutex_unlock(&icache.lock);
+}
+
+/* Drop a registration of a cached import. The last one releases the
+ * object and keeps the import unless the cache is over budget.
+ */
+static void icache_deregister(vm_object_t *object,
+			      manageable_aperture_t *aperture)
+{
+	ipc_import_t *imp = object->ipc_import, *evicted = NULL;
+	bool unmapped = true;
+
+	pthread_mutex_lock(&icache.lock);
+	if (!--imp->refs) {
+		pthread_rwlock_wrlock(&aperture->fmm_lock);
+		if (object->mapped_gpus)
+			unmapped = !_fmm_unmap_from_gpu(aperture, object->start,
+							0, object);
+		vm_remove_object(aperture, object);
+		pthread_rwlock_unlock(&aperture->fmm_lock);
+
+		imp->obj = NULL;
+		icache_lru_add(imp);
+		/* Freeing the BO unmaps what is left */
+		if (!unmapped)
+			icache_evict(imp, &evicted);
+		while (icache.idle_bytes > icache.budget)
+			icache_evict(icache.lru_tail, &evicted);
+	}
+	pthread_mutex_unlock(&icache.lock);
+
+	icache_release(evicted);
+}
+
+/* Forget all cached imports without freeing them, see bo_cache_clear */
+static void icache_clear(void)
+{
+	ipc_import_t *imp;
+	uint32_t i;
+
+	pthread_mutex_init(&icache.lock, NULL);
+
+	for (i = 0; i < IPC_CACHE_BUCKETS; i++)
+		while ((imp = icache.buckets[i])) {
+			icache.buckets[i] = imp->next;
+			free(imp);
+		}
+	icache.lru_head = NULL;
+	icache.lru_tail = NULL;
+	icache.idle_bytes = 0;
+}
+
+void *fmm_allocate_device(uint32_t gpu_id, void *address, uint64_t MemorySizeInBytes, HsaMemFlags flags)
+{
+	manageable_aperture_t *aperture;
+	int32_t gpu_mem_id;
+	uint32_t ioc_flags = KFD_IOC_ALLOC_MEM_FLAGS_VRAM;
+	uint64_t size, mmap_offset;
+	void *mem, *cached = NULL;
+	bool cacheable;
+	vm_object_t *vm_obj = NULL;
+
+	/* Retrieve gpu_mem id according to gpu_id */
+	gpu_mem_id = gpu_mem_find_by_gpu_id(gpu_id);
+	if (gpu_mem_id < 0)
+		return NULL;
+
+	size = MemorySizeInBytes;
+
+	if (flags.ui32.HostAccess)
+		ioc_flags |= KFD_IOC_ALLOC_MEM_FLAGS_PUBLIC;
+
+	ioc_flags |= fmm_translate_hsa_to_ioc_flags(flags);
+
+	if (topology_is_svm_needed(get_device_id_by_gpu_id(gpu_id))) {
+		aperture = svm.dgpu_aperture;
+		if (flags.ui32.AQLQueueMemory)
+			size = MemorySizeInBytes * 2;
+	} else {
+		aperture = &gpu_mem[gpu_mem_id].gpuvm_aperture;
+	}
+
+	if (!flags.ui32.CoarseGrain || svm.disable_cache)
+		ioc_flags |= KFD_IOC_ALLOC_MEM_FLAGS_COHERENT;
+
+	if (aperture == svm.dgpu_aperture &&
+	    suballoc_possible(address, size, flags)) {
+		mem = suballoc_allocate(true, gpu_id, size, flags, &aperture,
+					&vm_obj);
+		if (mem)
+			return mem;
+	}
+
+	cacheable = !address && !flags.ui32.AQLQueueMemory;
+	if (cacheable)
+		cached = bo_cache_get(gpu_id, size, ioc_flags, flags.Value,
+				      &aperture, &vm_obj);
+
+	mem = cached;
+	if (!mem)
+		mem = __fmm_allocate_device(gpu_id, address, size, &aperture,
+					    &mmap_offset, ioc_flags, &vm_obj);
+
+	if (mem && vm_obj) {
+		pthread_rwlock_wrlock(&aperture->fmm_lock);
+		/* Store memory allocation flags, not ioc flags */
+		vm_obj->flags = flags.Value;
+		gpuid_to_nodeid(gpu_id, &vm_obj->node_id);
+		if (cacheable) {
+			vm_obj->alloc_gpu_id = gpu_id;
+			vm_obj->alloc_ioc_flags = ioc_flags;
+		}
+		pthread_rwlock_unlock(&aperture->fmm_lock);
+	}
+
+	/* Cached BOs are still mapped for CPU access */
+	if (mem && !cached) {
+		int map_fd = mmap_offset >= (1ULL<<40) ? kfd_fd :
+					gpu_mem[gpu_mem_id].drm_render_fd;
+		int prot = flags.ui32.HostAccess ? PROT_READ | PROT_WRITE :
+					PROT_NONE;
+		int flag = flags.ui32.HostAccess ? MAP_SHARED | MAP_FIXED :
+					MAP_PRIVATE|MAP_FIXED;
+		void *ret = mmap(mem, MemorySizeInBytes, prot, flag,
+					map_fd, mmap_offset);
+
+		if (ret == MAP_FAILED) {
+			__fmm_release(vm_obj, aperture);
+			return NULL;
+		}
+	}
+
+	return mem;
+}
+
+void *fmm_allocate_doorbell(uint32_t gpu_id, uint64_t MemorySizeInBytes,
+			    uint64_t doorbell_mmap_offset)
+{
+	manageable_aperture_t *aperture;
+	int32_t gpu_mem_id;
+	uint32_t ioc_flags;
+	void *mem;
+	vm_object_t *vm_obj = NULL;
+
+	/* Retrieve gpu_mem id according to gpu_id */
+	gpu_mem_id = gpu_mem_find_by_gpu_id(gpu_id);
+	if (gpu_mem_id < 0)
+		return NULL;
+
+	/* Use fine-grained aperture */
+	aperture = svm.dgpu_alt_aperture;
+	ioc_flags = KFD_IOC_ALLOC_MEM_FLAGS_DOORBELL |
+		    KFD_IOC_ALLOC_MEM_FLAGS_WRITABLE |
+		    KFD_IOC_ALLOC_MEM_FLAGS_COHERENT;
+
+	mem = __fmm_allocate_device(gpu_id, NULL, MemorySizeInBytes, &aperture, NULL,
+				    ioc_flags, &vm_obj);
+
+	if (mem && vm_obj) {
+		HsaMemFlags flags;
+
+		/* Cook up some flags for storing in the VM object */
+		flags.Value = 0;
+		flags.ui32.NonPaged = 1;
+		flags.ui32.HostAccess = 1;
+		flags.ui32.Reserved = 0xBe1;
+
+		pthread_rwlock_wrlock(&aperture->fmm_lock);
+		vm_obj->flags = flags.Value;
+		gpuid_to_nodeid(gpu_id, &vm_obj->node_id);
+		pthread_rwlock_unlock(&aperture->fmm_lock);
+	}
+
+	if (mem) {
+		void *ret = mmap(mem, MemorySizeInBytes,
+				 PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_FIXED, kfd_fd,
+				 doorbell_mmap_offset);
+		if (ret == MAP_FAILED) {
+			__fmm_release(vm_obj, aperture);
+			return NULL;
+		}
+	}
+
+	return mem;
+}
+
+static void *fmm_allocate_host_cpu(void *address, uint64_t MemorySizeInBytes,
+				HsaMemFlags flags)
+{
+	void *mem = NULL;
+	vm_object_t *vm_obj;
+	int mmap_prot = PROT_READ;
+
 	if (address)
 		return NULL;
 
@@ -1444,22 +4407,28 @@ static void *fmm_allocate_host_cpu(void *address, uint64_t MemorySizeInBytes,
 	if (mem == MAP_FAILED)
 		return NULL;
 
-	pthread_mutex_lock(&cpuvm_aperture.fmm_mutex);
+	if (flags.ui32.Populate && !flags.ui32.ReadOnly)
+		fmm_populate_host_memory(0, mem, MemorySizeInBytes);
+
+	pthread_rwlock_wrlock(&cpuvm_aperture.fmm_lock);
 	vm_obj = aperture_allocate_object(&cpuvm_aperture, mem, 0,
 				      MemorySizeInBytes, flags.Value);
 	if (vm_obj)
 		vm_obj->node_id = 0; /* APU systems only have one CPU node */
-	pthread_mutex_unlock(&cpuvm_aperture.fmm_mutex);
+	pthread_rwlock_unlock(&cpuvm_aperture.fmm_lock);
 
 	return mem;
 }
 
-static int bind_mem_to_numa(uint32_t node_id, void *mem,
+/* Bind memory to the NUMA node node_id, or interleave it across the
+ * nodes in numa_mask if flags.ui32.Interleave is set
+ */
+static int bind_mem_to_numa(uint32_t node_id, uint64_t numa_mask, void *mem,
 			    uint64_t SizeInBytes, HsaMemFlags flags)
 {
 	int mode = MPOL_F_STATIC_NODES;
 	struct bitmask *node_mask;
-	int num_node;
+	int num_node, i;
 	long r;
 
 	pr_debug("%s mem %p flags 0x%x size 0x%lx node_id %d\n", __func__,
@@ -1474,7 +4443,7 @@ static int bind_mem_to_numa(uint32_t node_id, void *mem,
 	num_node = numa_max_node() + 1;
 
 	/* Ignore binding requests to invalid nodes IDs */
-	if (node_id >= (unsigned)num_node) {
+	if (!flags.ui32.Interleave && node_id >= (unsigned)num_node) {
 		pr_warn("node_id %d >= num_node %d\n", node_id, num_node);
 		return 0;
 	}
@@ -1486,8 +4455,15 @@ static int bind_mem_to_numa(uint32_t node_id, void *mem,
 	if (!node_mask)
 		return -ENOMEM;
 
-	numa_bitmask_setbit(node_mask, node_id);
-	mode |= flags.ui32.NoSubstitute ? MPOL_BIND : MPOL_PREFERRED;
+	if (flags.ui32.Interleave) {
+		for (i = 0; i < num_node && i < 64; i++)
+			if (numa_mask & (1ULL << i))
+				numa_bitmask_setbit(node_mask, i);
+		mode |= MPOL_INTERLEAVE;
+	} else {
+		numa_bitmask_setbit(node_mask, node_id);
+		mode |= flags.ui32.NoSubstitute ? MPOL_BIND : MPOL_PREFERRED;
+	}
 	r = mbind(mem, SizeInBytes, mode, node_mask->maskp, num_node + 1, 0);
 	numa_bitmask_free(node_mask);
 
@@ -1515,8 +4491,47 @@ static int bind_mem_to_numa(uint32_t node_id, void *mem,
 	return 0;
 }
 
-static void *fmm_allocate_host_gpu(uint32_t node_id, void *address,
-				   uint64_t MemorySizeInBytes, HsaMemFlags flags)
+/* Map anonymous pages for paged memory over the reserved range at mem.
+ * With huge set, hugetlbfs pages are tried first if enabled, then
+ * transparent huge pages. *hugetlb is set if hugetlbfs pages were used.
+ */
+static bool fmm_map_paged_memory(void *mem, uint64_t size, bool huge,
+				 bool *hugetlb)
+{
+	void *tmp;
+
+	*hugetlb = false;
+	if (huge && svm.paged_hugetlb && !(size & (GPU_HUGE_PAGE_SIZE - 1))) {
+		/* hugetlbfs reserves the pages when mapping them, which fails
+		 * if there aren't enough. Don't replace the reserved range
+		 * before that, so the address space can't be lost.
+		 */
+		tmp = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			   MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB |
+			   MAP_HUGE_2MB, -1, 0);
+		if (tmp != MAP_FAILED) {
+			if (mremap(tmp, size, size, MREMAP_MAYMOVE | MREMAP_FIXED,
+				   mem) != MAP_FAILED) {
+				*hugetlb = true;
+				return true;
+			}
+			munmap(tmp, size);
+		}
+	}
+
+	if (mmap(mem, size, PROT_READ | PROT_WRITE,
+		 MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED, -1, 0) == MAP_FAILED)
+		return false;
+
+	if (huge)
+		madvise(mem, size, MADV_HUGEPAGE);
+
+	return true;
+}
+
+static void *fmm_allocate_host_gpu(uint32_t node_id, uint64_t numa_mask,
+				   void *address, uint64_t MemorySizeInBytes,
+				   HsaMemFlags flags)
 {
 	void *mem;
 	manageable_aperture_t *aperture;
@@ -1525,6 +4540,7 @@ static void *fmm_allocate_host_gpu(uint32_t node_id, void *address,
 	uint64_t size;
 	int32_t gpu_drm_fd;
 	uint32_t gpu_id;
+	bool cacheable = false, huge, hugetlb, populated;
 	vm_object_t *vm_obj = NULL;
 
 	if (!g_first_gpu_mem)
@@ -1533,6 +4549,9 @@ static void *fmm_allocate_host_gpu(uint32_t node_id, void *address,
 	gpu_id = g_first_gpu_mem->gpu_id;
 	gpu_drm_fd = g_first_gpu_mem->drm_render_fd;
 
+	if (!numa_mask || flags.ui32.NoNUMABind)
+		flags.ui32.Interleave = 0;
+
 	size = MemorySizeInBytes;
 	ioc_flags = 0;
 	if (flags.ui32.CoarseGrain)
@@ -1551,21 +4570,27 @@ static void *fmm_allocate_host_gpu(uint32_t node_id, void *address,
 	 * memory is allocated from KFD
 	 */
 	if (!flags.ui32.NonPaged && svm.userptr_for_paged_mem) {
+		huge = !flags.ui32.AQLQueueMemory &&
+			MemorySizeInBytes >= GPU_HUGE_PAGE_SIZE &&
+			(flags.ui32.PageSize == HSA_PAGE_SIZE_2MB ||
+			 svm.paged_huge_all);
+
 		/* Allocate address space */
-		pthread_mutex_lock(&aperture->fmm_mutex);
-		mem = aperture_allocate_area(aperture, address, size);
-		pthread_mutex_unlock(&aperture->fmm_mutex);
+		mem = fmm_allocate_va(aperture, address, size,
+				      huge ? GPU_HUGE_PAGE_SIZE : aperture->align,
+				      &aperture);
 		if (!mem)
 			return NULL;
+		if ((uint64_t)mem & (GPU_HUGE_PAGE_SIZE - 1))
+			huge = false;
 
 		/* Map anonymous pages */
-		if (mmap(mem, MemorySizeInBytes, PROT_READ | PROT_WRITE,
-			 MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED, -1, 0)
-		    == MAP_FAILED)
+		if (!fmm_map_paged_memory(mem, MemorySizeInBytes, huge, &hugetlb))
 			goto out_release_area;
 
-		/* Bind to NUMA node */
-		if (bind_mem_to_numa(node_id, mem, MemorySizeInBytes, flags))
+		/* Bind to NUMA node or interleave */
+		if (bind_mem_to_numa(node_id, numa_mask, mem, MemorySizeInBytes,
+				     flags))
 			goto out_release_area;
 
 		/* Mappings in the DGPU aperture don't need to be copied on
@@ -1574,6 +4599,27 @@ static void *fmm_allocate_host_gpu(uint32_t node_id, void *address,
 		 */
 		madvise(mem, MemorySizeInBytes, MADV_DONTFORK);
 
+		/* Fault in the pages after binding them to the NUMA node.
+		 * Transparent huge pages are only known to be obtained if
+		 * the populated range can be collapsed into them.
+		 */
+		populated = flags.ui32.Populate ||
+			(huge && svm.paged_huge_populate);
+		if (flags.ui32.Populate)
+			fmm_populate_host_memory(flags.ui32.Interleave ?
+						 INVALID_NODEID : node_id,
+						 mem, MemorySizeInBytes);
+		else if (populated)
+			fmm_prefault_range(mem, MemorySizeInBytes, false);
+		if (huge && !hugetlb)
+			huge = populated &&
+				!madvise(mem, MemorySizeInBytes &
+					 ~(GPU_HUGE_PAGE_SIZE - 1),
+					 MADV_COLLAPSE);
+		/* Report the page size that was obtained */
+		flags.ui32.PageSize = huge ? HSA_PAGE_SIZE_2MB :
+			HSA_PAGE_SIZE_4KB;
+
 		/* Create userptr BO */
 		mmap_offset = (uint64_t)mem;
 		ioc_flags |= KFD_IOC_ALLOC_MEM_FLAGS_USERPTR;
@@ -1583,8 +4629,26 @@ static void *fmm_allocate_host_gpu(uint32_t node_id, void *address,
 		if (!vm_obj)
 			goto out_release_area;
 	} else {
+		/* KFD places GTT memory itself */
+		flags.ui32.Interleave = 0;
 		ioc_flags |= KFD_IOC_ALLOC_MEM_FLAGS_GTT;
-		mem =  __fmm_allocate_device(gpu_id, address, size, aperture,
+		if (suballoc_possible(address, size, flags)) {
+			mem = suballoc_allocate(false, node_id, size, flags,
+						&aperture, &vm_obj);
+			if (mem)
+				return mem;
+		}
+
+		cacheable = !address && !flags.ui32.AQLQueueMemory;
+		if (cacheable) {
+			mem = bo_cache_get(gpu_id, size, ioc_flags, flags.Value,
+					   &aperture, &vm_obj);
+			if (mem)
+				/* Still mapped for CPU access */
+				goto out;
+		}
+
+		mem =  __fmm_allocate_device(gpu_id, address, size, &aperture,
 					     &mmap_offset, ioc_flags, &vm_obj);
 
 		if (mem && flags.ui32.HostAccess) {
@@ -1608,41 +4672,116 @@ static void *fmm_allocate_host_gpu(uint32_t node_id, void *address,
 		}
 	}
 
+out:
 	if (mem && vm_obj) {
 		/* Store memory allocation flags, not ioc flags */
-		pthread_mutex_lock(&aperture->fmm_mutex);
+		pthread_rwlock_wrlock(&aperture->fmm_lock);
 		vm_obj->flags = flags.Value;
 		vm_obj->node_id = node_id;
-		pthread_mutex_unlock(&aperture->fmm_mutex);
+		if (cacheable) {
+			vm_obj->alloc_gpu_id = gpu_id;
+			vm_obj->alloc_ioc_flags = ioc_flags;
+		}
+		pthread_rwlock_unlock(&aperture->fmm_lock);
 	}
 
 	return mem;
 
 out_release_area:
 	/* Release address space */
-	pthread_mutex_lock(&aperture->fmm_mutex);
-	aperture_release_area(aperture, mem, size);
-	pthread_mutex_unlock(&aperture->fmm_mutex);
+	fmm_release_va(aperture, mem, size);
 
 	return NULL;
 }
 
+/* NUMA nodes to interleave memory across for the given HSA nodes. CPU
+ * nodes stand for themselves, GPU nodes for the CPU node they are
+ * directly linked to. No nodes means all GPU nodes. Returns 0 if there
+ * is nothing to interleave across.
+ */
+static uint64_t fmm_interleave_mask(uint32_t num_nodes,
+				    const uint32_t *node_ids)
+{
+	uint32_t i, n, node, gpu_id;
+	uint64_t mask = 0;
+	int max_node;
+
+	if (numa_available() == -1)
+		return 0;
+	max_node = numa_max_node();
+	if (!max_node)
+		return 0;
+
+	n = num_nodes ? num_nodes : get_num_sysfs_nodes();
+	for (i = 0; i < n; i++) {
+		node = num_nodes ? node_ids[i] : i;
+		if (validate_nodeid(node, &gpu_id) != HSAKMT_STATUS_SUCCESS)
+			continue;
+		if (gpu_id)
+			node = get_direct_link_cpu(node);
+		else if (!num_nodes)
+			continue;
+		if (node == INVALID_NODEID || node >= 64 ||
+		    node > (uint32_t)max_node)
+			continue;
+		mask |= 1ULL << node;
+	}
+
+	return mask;
+}
+
 void *fmm_allocate_host(uint32_t node_id, void *address,
 			uint64_t MemorySizeInBytes, HsaMemFlags flags)
 {
-	if (is_dgpu)
-		return fmm_allocate_host_gpu(node_id, address, MemorySizeInBytes, flags);
-	return fmm_allocate_host_cpu(address, MemorySizeInBytes, flags);
+	uint64_t numa_mask = 0;
+
+	if (!is_dgpu) {
+		flags.ui32.Interleave = 0;
+		return fmm_allocate_host_cpu(address, MemorySizeInBytes, flags);
+	}
+
+	if (flags.ui32.Interleave)
+		numa_mask = fmm_interleave_mask(0, NULL);
+
+	return fmm_allocate_host_gpu(node_id, numa_mask, address,
+				     MemorySizeInBytes, flags);
+}
+
+void *fmm_allocate_host_interleaved(uint32_t num_nodes,
+				    const uint32_t *node_ids, void *address,
+				    uint64_t MemorySizeInBytes,
+				    HsaMemFlags flags)
+{
+	uint64_t numa_mask = fmm_interleave_mask(num_nodes, node_ids);
+	uint32_t node_id;
+
+	/* Memory is reported on the first node it is interleaved across */
+	flags.ui32.Interleave = numa_mask != 0;
+	if (numa_mask)
+		node_id = __builtin_ctzll(numa_mask);
+	else
+		node_id = num_nodes ? node_ids[0] : 0;
+
+	if (!is_dgpu) {
+		flags.ui32.Interleave = 0;
+		return fmm_allocate_host_cpu(address, MemorySizeInBytes, flags);
+	}
+
+	return fmm_allocate_host_gpu(node_id, numa_mask, address,
+				     MemorySizeInBytes, flags);
 }
 
 static int __fmm_release(vm_object_t *object, manageable_aperture_t *aperture)
 {
 	struct kfd_ioctl_free_memory_of_gpu_args args = {0};
+	uint64_t size;
+	void *start;
+	uint32_t i;
 
 	if (!object)
 		return -EINVAL;
 
-	pthread_mutex_lock(&aperture->fmm_mutex);
+	pthread_rwlock_wrlock(&aperture->fmm_lock);
 
 	/* If memory is user memory and it's still GPU mapped, munmap
 	 * would cause an eviction. If the restore happens quickly
@@ -1651,18 +4790,31 @@ static int __fmm_release(vm_object_t *object, manageable_aperture_t *aperture)
 	 */
 	args.handle = object->handle;
 	if (kmtIoctl(kfd_fd, AMDKFD_IOC_FREE_MEMORY_OF_GPU, &args)) {
-		pthread_mutex_unlock(&aperture->fmm_mutex);
+		pthread_rwlock_unlock(&aperture->fmm_lock);
 		return -errno;
 	}
+	/* The other BOs of a split userptr go with the object. Free them
+	 * only once the first one is gone, so that a failed release
+	 * leaves all handles valid.
+	 */
+	for (i = 1; i < object->num_split_handles; i++) {
+		args.handle = object->split_handles[i];
+		if (kmtIoctl(kfd_fd, AMDKFD_IOC_FREE_MEMORY_OF_GPU, &args))
+			pr_err("Failed to free BO %u of userptr %p\n", i,
+			       object->userptr);
+	}
 
-	aperture_release_area(aperture, object->start, object->size);
+	start = object->start;
+	size = object->size;
 	vm_remove_object(aperture, object);
 
-	pthread_mutex_unlock(&aperture->fmm_mutex);
+	pthread_rwlock_unlock(&aperture->fmm_lock);
+
+	fmm_release_va(aperture, start, size);
 	return 0;
 }
 
-HSAKMT_STATUS fmm_release(void *address)
+static HSAKMT_STATUS fmm_release_now(void *address)
 {
 	manageable_aperture_t *aperture = NULL;
 	vm_object_t *object = NULL;
@@ -1677,30 +4829,315 @@ HSAKMT_STATUS fmm_release(void *address)
 			return HSAKMT_STATUS_SUCCESS;
 		}
 
-	object = vm_find_object(address, 0, &aperture);
+	object = vm_find_object(address, 0, true, &aperture);
+
+	if (!object)
+		return HSAKMT_STATUS_MEMORY_NOT_REGISTERED;
+
+	if (aperture == &cpuvm_aperture) {
+		/* APU system memory */
+		uint64_t size = 0;
+
+		size = object->size;
+		vm_remove_object(&cpuvm_aperture, object);
+		pthread_rwlock_unlock(&aperture->fmm_lock);
+		munmap(address, size);
+	} else {
+		pthread_rwlock_unlock(&aperture->fmm_lock);
+
+		if (object->shared_bo) {
+			if (object->userptr)
+				ucache_deregister(object, aperture);
+			else
+				suballoc_free(object, aperture);
+			return HSAKMT_STATUS_SUCCESS;
+		}
+		if (object->ipc_import) {
+			icache_deregister(object, aperture);
+			return HSAKMT_STATUS_SUCCESS;
+		}
+
+		if (bo_cache_put(object, aperture))
+			return HSAKMT_STATUS_SUCCESS;
+
+		if (__fmm_release(object, aperture))
+			return HSAKMT_STATUS_ERROR;
+
+		if (!aperture->is_cpu_accessible)
+			fmm_print(gpu_mem[i].gpu_id);
+	}
+
+	return HSAKMT_STATUS_SUCCESS;
+}
+
+/* Deferred frees, enabled by setting HSA_DEFERRED_FREE to a non-0
+ * value. fmm_release only validates the address and pushes it to a
+ * lock-free stack. A background thread takes all queued frees at once
+ * and releases them in the order they were queued. The address space
+ * of a BO only becomes reusable once its free has been processed, use
+ * fmm_flush_deferred_frees to wait for that.
+ *
+ * After being woken up, the thread waits DEFERRED_FREE_BATCH_US for
+ * more frees to batch up. Only waking it up takes a system call.
+ */
+#define DEFERRED_FREE_BATCH_US 100
+
+typedef struct deferred_free_entry {
+	struct deferred_free_entry *next;
+	void *address;
+} deferred_free_entry_t;
+
+static struct {
+	/* Stack of queued frees, newest first */
+	deferred_free_entry_t *head;
+	/* Batches taken off the stack that are still being processed, and
+	 * the number of times that dropped to 0
+	 */
+	uint32_t busy;
+	uint64_t idle;
+	sem_t wake;
+	/* Protects starting the thread, busy and idle */
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	pthread_t thread;
+	bool enabled;
+	bool running;
+	bool stop;
+	/* The thread is waiting for wake */
+	bool sleeping;
+} deferred_free = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER
+};
+
+/* Count a batch as being processed before taking it off the stack.
+ * Returns the idle count at that point.
+ */
+static uint64_t deferred_free_begin(void)
+{
+	uint64_t idle;
+
+	pthread_mutex_lock(&deferred_free.lock);
+	idle = deferred_free.idle;
+	deferred_free.busy++;
+	pthread_mutex_unlock(&deferred_free.lock);
+
+	return idle;
+}
+
+static void deferred_free_end(void)
+{
+	pthread_mutex_lock(&deferred_free.lock);
+	if (!--deferred_free.busy) {
+		deferred_free.idle++;
+		pthread_cond_broadcast(&deferred_free.done);
+	}
+	pthread_mutex_unlock(&deferred_free.lock);
+}
+
+/* Process all queued frees in the order they were queued. Call between
+ * deferred_free_begin and deferred_free_end. Returns the number of
+ * frees processed.
+ */
+static uint64_t deferred_free_process(void)
+{
+	deferred_free_entry_t *batch, *entry, *fifo = NULL;
+	uint64_t n = 0;
+
+	batch = __atomic_exchange_n(&deferred_free.head, NULL,
+				    __ATOMIC_ACQUIRE);
+
+	while ((entry = batch)) {
+		batch = entry->next;
+		entry->next = fifo;
+		fifo = entry;
+	}
+	while ((entry = fifo)) {
+		fifo = entry->next;
+		if (fmm_release_now(entry->address) != HSAKMT_STATUS_SUCCESS)
+			pr_err("Deferred free of %p failed\n", entry->address);
+		free(entry);
+		n++;
+	}
+
+	return n;
+}
+
+/* Process all queued frees. Returns the number of frees processed. */
+static uint64_t deferred_free_drain(void)
+{
+	uint64_t n;
+
+	if (!__atomic_load_n(&deferred_free.head, __ATOMIC_ACQUIRE))
+		return 0;
+
+	deferred_free_begin();
+	n = deferred_free_process();
+	deferred_free_end();
+
+	return n;
+}
+
+static void *deferred_free_thread(void *arg)
+{
+	struct timespec batch = {
+		.tv_sec = 0,
+		.tv_nsec = DEFERRED_FREE_BATCH_US * 1000
+	};
+
+	for (;;) {
+		__atomic_store_n(&deferred_free.sleeping, true, __ATOMIC_SEQ_CST);
+		if (!__atomic_load_n(&deferred_free.head, __ATOMIC_SEQ_CST) &&
+		    !__atomic_load_n(&deferred_free.stop, __ATOMIC_SEQ_CST)) {
+			while (sem_wait(&deferred_free.wake) && errno == EINTR)
+				;
+			if (!__atomic_load_n(&deferred_free.stop,
+					     __ATOMIC_ACQUIRE))
+				nanosleep(&batch, NULL);
+		}
+		__atomic_store_n(&deferred_free.sleeping, false,
+				 __ATOMIC_RELAXED);
+
+		while (deferred_free_drain())
+			;
+		if (__atomic_load_n(&deferred_free.stop, __ATOMIC_ACQUIRE))
+			break;
+	}
+
+	return NULL;
+}
+
+/* Start the thread with all signals blocked, so that signals keep
+ * going to the application's threads. Call with deferred_free.lock held.
+ */
+static int deferred_free_start(void)
+{
+	sigset_t all, old;
+	int r;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	r = pthread_create(&deferred_free.thread, NULL, deferred_free_thread,
+			   NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (r)
+		return r;
+
+	__atomic_store_n(&deferred_free.running, true, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static HSAKMT_STATUS fmm_release_deferred(void *address)
+{
+	manageable_aperture_t *aperture;
+	deferred_free_entry_t *entry;
+	vm_object_t *object;
+	bool pending;
+
+	if (!__atomic_load_n(&deferred_free.running, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&deferred_free.lock);
+		if (!deferred_free.running && deferred_free_start()) {
+			pr_err("Failed to start deferred free thread\n");
+			deferred_free.enabled = false;
+		}
+		pthread_mutex_unlock(&deferred_free.lock);
+		if (!deferred_free.enabled)
+			return fmm_release_now(address);
+	}
 
+	/* Scratch memory, APU system memory and unknown addresses are
+	 * handled right away
+	 */
+	object = vm_find_object(address, 0, false, &aperture);
 	if (!object)
+		return fmm_release_now(address);
+	if (aperture == &cpuvm_aperture) {
+		pthread_rwlock_unlock(&aperture->fmm_lock);
+		return fmm_release_now(address);
+	}
+	pending = __atomic_exchange_n(&object->free_pending, true,
+				      __ATOMIC_RELAXED);
+	pthread_rwlock_unlock(&aperture->fmm_lock);
+	if (pending)
 		return HSAKMT_STATUS_MEMORY_NOT_REGISTERED;
 
-	if (aperture == &cpuvm_aperture) {
-		/* APU system memory */
-		uint64_t size = 0;
+	entry = malloc(sizeof(*entry));
+	if (!entry)
+		return fmm_release_now(address);
+	entry->address = address;
+
+	entry->next = __atomic_load_n(&deferred_free.head, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&deferred_free.head, &entry->next,
+					    entry, true, __ATOMIC_SEQ_CST,
+					    __ATOMIC_RELAXED))
+		;
+	/* Wake the thread up if it's waiting, once */
+	if (__atomic_exchange_n(&deferred_free.sleeping, false,
+				__ATOMIC_SEQ_CST))
+		sem_post(&deferred_free.wake);
 
-		size = object->size;
-		vm_remove_object(&cpuvm_aperture, object);
-		pthread_mutex_unlock(&aperture->fmm_mutex);
-		munmap(address, size);
-	} else {
-		pthread_mutex_unlock(&aperture->fmm_mutex);
+	return HSAKMT_STATUS_SUCCESS;
+}
 
-		if (__fmm_release(object, aperture))
-			return HSAKMT_STATUS_ERROR;
+HSAKMT_STATUS fmm_release(void *address)
+{
+	if (deferred_free.enabled)
+		return fmm_release_deferred(address);
 
-		if (!aperture->is_cpu_accessible)
-			fmm_print(gpu_mem[i].gpu_id);
+	return fmm_release_now(address);
+}
+
+/* Wait until all frees queued before the call have been processed.
+ * Frees that are not taken here were taken by batches that started
+ * earlier, they are done once no batch is busy.
+ */
+void fmm_flush_deferred_frees(void)
+{
+	uint64_t idle;
+
+	/* Help with the work instead of waiting for the thread */
+	idle = deferred_free_begin();
+	deferred_free_process();
+	deferred_free_end();
+
+	pthread_mutex_lock(&deferred_free.lock);
+	while (deferred_free.idle == idle)
+		pthread_cond_wait(&deferred_free.done, &deferred_free.lock);
+	pthread_mutex_unlock(&deferred_free.lock);
+}
+
+/* Process all queued frees and stop the thread */
+static void deferred_free_stop(void)
+{
+	if (deferred_free.running) {
+		__atomic_store_n(&deferred_free.stop, true, __ATOMIC_SEQ_CST);
+		sem_post(&deferred_free.wake);
+		pthread_join(deferred_free.thread, NULL);
+		deferred_free.running = false;
+		deferred_free.stop = false;
 	}
+	deferred_free_drain();
+}
 
-	return HSAKMT_STATUS_SUCCESS;
+/* Forget queued frees in a forked child, the thread only exists in
+ * the parent. See fmm_clear_all_mem.
+ */
+static void deferred_free_clear(void)
+{
+	deferred_free_entry_t *entry;
+
+	while ((entry = deferred_free.head)) {
+		deferred_free.head = entry->next;
+		free(entry);
+	}
+	deferred_free.busy = 0;
+	deferred_free.idle = 0;
+	deferred_free.running = false;
+	deferred_free.stop = false;
+	deferred_free.sleeping = false;
+	sem_init(&deferred_free.wake, 0, 0);
+	pthread_mutex_init(&deferred_free.lock, NULL);
+	pthread_cond_init(&deferred_free.done, NULL);
 }
 
 static int fmm_set_memory_policy(uint32_t gpu_id, int default_policy, int alt_policy,
@@ -1877,6 +5314,124 @@ static void *reserve_address(void *addr, unsigned long long int len)
 	return ret_addr;
 }
 
+/* Split a reserved SVM aperture into up to svm.max_shards shards of at
+ * least SVM_MIN_SHARD_SIZE. If that's not possible, the aperture is
+ * used without shards.
+ */
+static void svm_init_shards(manageable_aperture_t *app)
+{
+	uint64_t size = VOID_PTRS_SUB(app->limit, app->base) + 1;
+	manageable_aperture_t *shard;
+	uint32_t i, n;
+
+	n = size / SVM_MIN_SHARD_SIZE < svm.max_shards ?
+		size / SVM_MIN_SHARD_SIZE : svm.max_shards;
+	if (n < 2)
+		return;
+
+	app->shards = calloc(n, sizeof(*app->shards));
+	if (!app->shards)
+		return;
+
+	app->shard_size = (size / n) & ~(uint64_t)(GPU_HUGE_PAGE_SIZE - 1);
+	for (i = 0; i < n; i++) {
+		shard = &app->shards[i];
+		shard->base = VOID_PTR_ADD(app->base, i * app->shard_size);
+		/* The last shard gets the remainder */
+		shard->limit = i < n - 1 ?
+			VOID_PTR_ADD(shard->base, app->shard_size - 1) :
+			app->limit;
+		shard->align = app->align;
+		shard->guard_pages = app->guard_pages;
+		shard->is_cpu_accessible = app->is_cpu_accessible;
+		shard->ops = app->ops;
+		fmm_init_lock(&shard->fmm_lock);
+		rbtree_init_augmented(&shard->area_tree, vm_area_augment);
+		rbtree_init_interval(&shard->tree);
+		rbtree_init_interval(&shard->user_tree);
+	}
+	app->num_shards = n;
+
+	pr_info("Split SVM aperture %p - %p into %u shards\n",
+		app->base, app->limit, n);
+}
+
+/* Make a reserved SVM aperture growable: keep only the first
+ * svm.grow_size of it and of each of its shards reserved and release
+ * the rest. base and limit stay the same, so addresses in the released
+ * part still belong to the aperture.
+ */
+static void svm_init_growth(manageable_aperture_t *app)
+{
+	uint32_t i;
+
+	if (app->num_shards) {
+		for (i = 0; i < app->num_shards; i++)
+			svm_init_growth(&app->shards[i]);
+		return;
+	}
+
+	app->grow_limit = app->limit;
+	app->skipped = NULL;
+	if (VOID_PTRS_SUB(app->limit, app->base) < svm.grow_size)
+		app->reserved_limit = app->limit;
+	else
+		app->reserved_limit = VOID_PTR_ADD(app->base,
+						   svm.grow_size - 1);
+	if (app->reserved_limit < app->limit)
+		munmap(VOID_PTR_ADD(app->reserved_limit, 1),
+		       VOID_PTRS_SUB(app->limit, app->reserved_limit));
+}
+
+/* Reserve the reserved parts of a growable SVM aperture again in a
+ * child process after fork and keep the skipped ranges out of the
+ * allocator again, or release them if release is set. Returns false if
+ * reserving failed.
+ */
+static bool svm_remap_growth(manageable_aperture_t *app, bool release)
+{
+	aperture_skip_t *skip = app->skipped;
+	void *start = app->base, *end;
+	uint32_t i;
+	bool ok = true;
+
+	if (app->num_shards) {
+		for (i = 0; i < app->num_shards; i++)
+			ok = svm_remap_growth(&app->shards[i], release) && ok;
+		return ok;
+	}
+
+	while (start <= app->reserved_limit) {
+		end = skip ? VOID_PTR_SUB(skip->start, 1) : app->reserved_limit;
+		if (end >= start) {
+			uint64_t size = VOID_PTRS_SUB(end, start) + 1;
+
+			if (release)
+				munmap(start, size);
+			else if (mmap(start, size, PROT_NONE,
+				      MAP_ANONYMOUS | MAP_NORESERVE |
+				      MAP_PRIVATE | MAP_FIXED,
+				      -1, 0) == MAP_FAILED)
+				ok = false;
+		}
+		if (!skip)
+			break;
+		if (!release) {
+			vm_area_t *area = vm_create_and_init_area(app,
+						skip->start, skip->end);
+
+			if (!area)
+				return false;
+			vm_add_area_after(app, vm_find_preceding(app,
+						skip->start), area);
+		}
+		start = VOID_PTR_ADD(skip->end, 1);
+		skip = skip->next;
+	}
+
+	return ok;
+}
+
 /* Managed SVM aperture limits: only reserve up to 40 bits (1TB, what
  * GFX8 supports). Need to find at least 4GB of usable address space.
  */
@@ -2019,6 +5574,16 @@ static HSAKMT_STATUS init_svm_apertures(HSAuint64 base, HSAuint64 limit,
 	pr_info("SVM (non-coherent): %12p - %12p\n",
 		svm.apertures[SVM_DEFAULT].base, svm.apertures[SVM_DEFAULT].limit);
 
+	svm_init_shards(&svm.apertures[SVM_DEFAULT]);
+	svm_init_shards(&svm.apertures[SVM_COHERENT]);
+
+	if (svm.grow_size) {
+		svm_init_growth(&svm.apertures[SVM_COHERENT]);
+		svm_init_growth(&svm.apertures[SVM_DEFAULT]);
+		pr_info("Reserved SVM apertures grow in %luMB steps\n",
+			svm.grow_size >> 20);
+	}
+
 	svm.dgpu_aperture = &svm.apertures[SVM_DEFAULT];
 	svm.dgpu_alt_aperture = &svm.apertures[SVM_COHERENT];
 
@@ -2031,19 +5596,25 @@ static void fmm_init_rbtree(void)
 	int i = gpu_mem_count;
 
 	if (once++ == 0) {
-		rbtree_init(&svm.apertures[SVM_DEFAULT].tree);
-		rbtree_init(&svm.apertures[SVM_DEFAULT].user_tree);
-		rbtree_init(&svm.apertures[SVM_COHERENT].tree);
-		rbtree_init(&svm.apertures[SVM_COHERENT].user_tree);
-		rbtree_init(&cpuvm_aperture.tree);
-		rbtree_init(&cpuvm_aperture.user_tree);
+		rbtree_init_augmented(&svm.apertures[SVM_DEFAULT].area_tree,
+				      vm_area_augment);
+		rbtree_init_augmented(&svm.apertures[SVM_COHERENT].area_tree,
+				      vm_area_augment);
+		rbtree_init_augmented(&cpuvm_aperture.area_tree,
+				      vm_area_augment);
+		rbtree_init_interval(&svm.apertures[SVM_DEFAULT].tree);
+		rbtree_init_interval(&svm.apertures[SVM_DEFAULT].user_tree);
+		rbtree_init_interval(&svm.apertures[SVM_COHERENT].tree);
+		rbtree_init_interval(&svm.apertures[SVM_COHERENT].user_tree);
+		rbtree_init_interval(&cpuvm_aperture.tree);
+		rbtree_init_interval(&cpuvm_aperture.user_tree);
 	}
 
 	while (i--) {
-		rbtree_init(&gpu_mem[i].scratch_physical.tree);
-		rbtree_init(&gpu_mem[i].scratch_physical.user_tree);
-		rbtree_init(&gpu_mem[i].gpuvm_aperture.tree);
-		rbtree_init(&gpu_mem[i].gpuvm_aperture.user_tree);
+		rbtree_init_interval(&gpu_mem[i].scratch_physical.tree);
+		rbtree_init_interval(&gpu_mem[i].scratch_physical.user_tree);
+		rbtree_init_interval(&gpu_mem[i].gpuvm_aperture.tree);
+		rbtree_init_interval(&gpu_mem[i].gpuvm_aperture.user_tree);
 	}
 }
 
@@ -2061,7 +5632,7 @@ static void *map_mmio(uint32_t node_id, uint32_t gpu_id, int mmap_fd)
 	ioc_flags = KFD_IOC_ALLOC_MEM_FLAGS_MMIO_REMAP |
 		KFD_IOC_ALLOC_MEM_FLAGS_WRITABLE |
 		KFD_IOC_ALLOC_MEM_FLAGS_COHERENT;
-	mem = __fmm_allocate_device(gpu_id, NULL, PAGE_SIZE, aperture,
+	mem = __fmm_allocate_device(gpu_id, NULL, PAGE_SIZE, &aperture,
 			&mmap_offset, ioc_flags, &vm_obj);
 
 	if (!mem || !vm_obj)
@@ -2071,10 +5642,10 @@ static void *map_mmio(uint32_t node_id, uint32_t gpu_id, int mmap_fd)
 	flags.ui32.NonPaged = 1;
 	flags.ui32.HostAccess = 1;
 	flags.ui32.Reserved = 0;
-	pthread_mutex_lock(&aperture->fmm_mutex);
+	pthread_rwlock_wrlock(&aperture->fmm_lock);
 	vm_obj->flags = flags.Value;
 	vm_obj->node_id = node_id;
-	pthread_mutex_unlock(&aperture->fmm_mutex);
+	pthread_rwlock_unlock(&aperture->fmm_lock);
 
 	/* Map for CPU access*/
 	ret = mmap(mem, PAGE_SIZE,
@@ -2118,7 +5689,14 @@ HSAKMT_STATUS fmm_init_process_apertures(unsigned int NumNodes)
 	uint32_t num_of_sysfs_nodes;
 	HSAKMT_STATUS ret = HSAKMT_STATUS_SUCCESS;
 	char *disableCache, *pagedUserptr, *checkUserptr, *guardPagesStr, *reserveSvm;
-	unsigned int guardPages = 1;
+	char *svmShardsStr, *boCacheStr, *subAllocStr, *deferredFreeStr;
+	char *userptrCacheStr, *userptrSplitStr, *pagedHugeStr, *svmGrowStr;
+	char *traceFile, *traceBufferStr, *allocTrackStr, *allocTrackSitesStr;
+	char *ipcCacheStr;
+	unsigned int guardPages = 1, traceBufferKB = TRACE_DEFAULT_BUFFER_KB;
+	unsigned int boCacheHigh = 0, boCacheLow, boCacheIdle = BO_CACHE_DEFAULT_IDLE_MS;
+	unsigned int userptrCacheMB = 0, userptrSplitMB = 0, svmGrowMB = 0;
+	unsigned int ipcCacheMB = 0;
 	struct pci_access *pacc;
 	uint64_t svm_base = 0, svm_limit = 0;
 	uint32_t svm_alignment = 0;
@@ -2133,12 +5711,34 @@ HSAKMT_STATUS fmm_init_process_apertures(unsigned int NumNodes)
 	pagedUserptr = getenv("HSA_USERPTR_FOR_PAGED_MEM");
 	svm.userptr_for_paged_mem = (!pagedUserptr || strcmp(pagedUserptr, "0"));
 
+	/* Paged memory allocated with PageSize 2MB uses transparent huge
+	 * pages. HSA_PAGED_HUGE_PAGES=thp does that for all paged memory of
+	 * at least 2MB, HSA_PAGED_HUGE_PAGES=hugetlb also tries hugetlbfs
+	 * pages first. HSA_PAGED_HUGE_POPULATE=1 faults them in up front.
+	 */
+	pagedHugeStr = getenv("HSA_PAGED_HUGE_PAGES");
+	svm.paged_hugetlb = pagedHugeStr && !strcmp(pagedHugeStr, "hugetlb");
+	svm.paged_huge_all = svm.paged_hugetlb ||
+		(pagedHugeStr && !strcmp(pagedHugeStr, "thp"));
+	pagedHugeStr = getenv("HSA_PAGED_HUGE_POPULATE");
+	svm.paged_huge_populate = pagedHugeStr && strcmp(pagedHugeStr, "0");
+
 	/* If HSA_CHECK_USERPTR is set to a non-0 value, check all userptrs
 	 * when they are registered
 	 */
 	checkUserptr = getenv("HSA_CHECK_USERPTR");
 	svm.check_userptr = (checkUserptr && strcmp(checkUserptr, "0"));
 
+	/* HSA_USERPTR_SPLIT_MB splits larger userptrs into BOs of this
+	 * size, which are prefaulted and created in parallel
+	 */
+	userptrSplitStr = getenv("HSA_USERPTR_SPLIT_MB");
+	if (userptrSplitStr)
+		sscanf(userptrSplitStr, "%u", &userptrSplitMB);
+	svm.userptr_split_size = (uint64_t)userptrSplitMB << 20;
+
+	vma_budget_init();
+
 	/* If HSA_RESERVE_SVM is set to a non-0 value,
 	 * enable packet capture and replay mode.
 	 */
@@ -2150,6 +5750,91 @@ HSAKMT_STATUS fmm_init_process_apertures(unsigned int NumNodes)
 	if (!guardPagesStr || sscanf(guardPagesStr, "%u", &guardPages) != 1)
 		guardPages = 1;
 
+	/* Specify the maximum number of shards of reserved SVM apertures,
+	 * 1 disables sharding
+	 */
+	svmShardsStr = getenv("HSA_SVM_SHARDS");
+	if (!svmShardsStr || sscanf(svmShardsStr, "%u", &svm.max_shards) != 1 ||
+	    !svm.max_shards)
+		svm.max_shards = SVM_DEFAULT_MAX_SHARDS;
+
+	/* HSA_SVM_GROW_MB reserves SVM apertures in steps of this size
+	 * when they are used instead of all at once. Only applies to
+	 * reserved apertures, see HSA_RESERVE_SVM.
+	 */
+	svmGrowStr = getenv("HSA_SVM_GROW_MB");
+	if (svmGrowStr)
+		sscanf(svmGrowStr, "%u", &svmGrowMB);
+	svm.grow_size = ALIGN_UP((uint64_t)svmGrowMB << 20, GPU_HUGE_PAGE_SIZE);
+
+	/* HSA_BO_CACHE_MB enables the BO cache and sets its high watermark.
+	 * HSA_BO_CACHE_LOW_MB defaults to half of it. Cached BOs are
+	 * released after HSA_BO_CACHE_IDLE_MS, 0 keeps them indefinitely.
+	 */
+	boCacheStr = getenv("HSA_BO_CACHE_MB");
+	if (boCacheStr)
+		sscanf(boCacheStr, "%u", &boCacheHigh);
+	boCacheLow = boCacheHigh / 2;
+	boCacheStr = getenv("HSA_BO_CACHE_LOW_MB");
+	if (boCacheStr && sscanf(boCacheStr, "%u", &boCacheLow) == 1 &&
+	    boCacheLow > boCacheHigh)
+		boCacheLow = boCacheHigh;
+	boCacheStr = getenv("HSA_BO_CACHE_IDLE_MS");
+	if (boCacheStr)
+		sscanf(boCacheStr, "%u", &boCacheIdle);
+	bo_cache.high = (uint64_t)boCacheHigh << 20;
+	bo_cache.low = (uint64_t)boCacheLow << 20;
+	bo_cache.idle_ns = boCacheIdle * 1000000ULL;
+
+	/* A non-0 HSA_SUBALLOC packs small allocations into shared BOs */
+	subAllocStr = getenv("HSA_SUBALLOC");
+	suballoc.enabled = subAllocStr && strcmp(subAllocStr, "0");
+
+	/* HSA_USERPTR_CACHE_MB enables sharing userptr BOs between
+	 * registrations and keeps this much of unused ones
+	 */
+	userptrCacheStr = getenv("HSA_USERPTR_CACHE_MB");
+	if (userptrCacheStr)
+		sscanf(userptrCacheStr, "%u", &userptrCacheMB);
+	ucache.budget = (uint64_t)userptrCacheMB << 20;
+	rbtree_init_interval(&ucache.tree);
+
+	/* HSA_IPC_CACHE_MB enables sharing imports of the same IPC handle
+	 * and keeps this much of unused ones
+	 */
+	ipcCacheStr = getenv("HSA_IPC_CACHE_MB");
+	if (ipcCacheStr)
+		sscanf(ipcCacheStr, "%u", &ipcCacheMB);
+	icache.budget = (uint64_t)ipcCacheMB << 20;
+
+	/* A non-0 HSA_DEFERRED_FREE moves freeing BOs to a thread */
+	deferredFreeStr = getenv("HSA_DEFERRED_FREE");
+	deferred_free.enabled = deferredFreeStr && strcmp(deferredFreeStr, "0");
+	if (deferred_free.enabled && !deferred_free.running)
+		sem_init(&deferred_free.wake, 0, 0);
+
+	/* HSA_TRACE_FILE records memory management calls to this file
+	 * with the PID appended, see fmm_trace_record_t. HSA_TRACE_BUFFER_KB
+	 * sets the size of the ring buffer.
+	 */
+	traceFile = getenv("HSA_TRACE_FILE");
+	traceBufferStr = getenv("HSA_TRACE_BUFFER_KB");
+	if (traceBufferStr)
+		sscanf(traceBufferStr, "%u", &traceBufferKB);
+
+	/* HSA_ALLOC_TRACK=N records the call stack of 1 in N allocations
+	 * and registrations. The HSA_ALLOC_TRACK_SITES sites with the most
+	 * live memory are reported when KFD is closed.
+	 */
+	alloc_track.sample = 0;
+	alloc_track.report_sites = ALLOC_TRACK_DEFAULT_SITES;
+	allocTrackStr = getenv("HSA_ALLOC_TRACK");
+	if (allocTrackStr)
+		sscanf(allocTrackStr, "%u", &alloc_track.sample);
+	allocTrackSitesStr = getenv("HSA_ALLOC_TRACK_SITES");
+	if (allocTrackSitesStr)
+		sscanf(allocTrackSitesStr, "%u", &alloc_track.report_sites);
+
 	gpu_mem_count = 0;
 	g_first_gpu_mem = NULL;
 
@@ -2176,7 +5861,16 @@ HSAKMT_STATUS fmm_init_process_apertures(unsigned int NumNodes)
 
 		/* Skip non-GPU nodes */
 		if (gpu_id != 0) {
-			int fd = open_drm_render_device(props.DrmRenderMinor);
+			int fd;
+
+			if (gpu_mem_count == FMM_MAX_GPUS) {
+				pr_err("More than %zu GPUs are not supported\n",
+				       FMM_MAX_GPUS);
+				ret = HSAKMT_STATUS_ERROR;
+				goto sysfs_parse_failed;
+			}
+
+			fd = open_drm_render_device(props.DrmRenderMinor);
 			if (fd <= 0) {
 				ret = HSAKMT_STATUS_ERROR;
 				goto sysfs_parse_failed;
@@ -2190,13 +5884,20 @@ HSAKMT_STATUS fmm_init_process_apertures(unsigned int NumNodes)
 
 			gpu_mem[gpu_mem_count].scratch_physical.align = PAGE_SIZE;
 			gpu_mem[gpu_mem_count].scratch_physical.ops = &reserved_aperture_ops;
-			pthread_mutex_init(&gpu_mem[gpu_mem_count].scratch_physical.fmm_mutex, NULL);
+			fmm_init_lock(&gpu_mem[gpu_mem_count].scratch_physical.fmm_lock);
+			rbtree_init_augmented(&gpu_mem[gpu_mem_count].scratch_physical.area_tree,
+					      vm_area_augment);
 
 			gpu_mem[gpu_mem_count].gpuvm_aperture.align =
 				get_vm_alignment(props.DeviceId);
 			gpu_mem[gpu_mem_count].gpuvm_aperture.guard_pages = guardPages;
 			gpu_mem[gpu_mem_count].gpuvm_aperture.ops = &reserved_aperture_ops;
-			pthread_mutex_init(&gpu_mem[gpu_mem_count].gpuvm_aperture.fmm_mutex, NULL);
+			fmm_init_lock(&gpu_mem[gpu_mem_count].gpuvm_aperture.fmm_lock);
+			/* Initialized here, the start of the aperture is
+			 * reserved before fmm_init_rbtree is called
+			 */
+			rbtree_init_augmented(&gpu_mem[gpu_mem_count].gpuvm_aperture.area_tree,
+					      vm_area_augment);
 
 			if (!g_first_gpu_mem)
 				g_first_gpu_mem = &gpu_mem[gpu_mem_count];
@@ -2231,16 +5932,7 @@ HSAKMT_STATUS fmm_init_process_apertures(unsigned int NumNodes)
 	if (ret != HSAKMT_STATUS_SUCCESS)
 		goto get_aperture_ioctl_failed;
 
-	all_gpu_id_array_size = 0;
-	all_gpu_id_array = NULL;
-	if (num_of_sysfs_nodes > 0) {
-		all_gpu_id_array = malloc(sizeof(uint32_t) * gpu_mem_count);
-		if (!all_gpu_id_array) {
-			ret = HSAKMT_STATUS_NO_MEMORY;
-			goto get_aperture_ioctl_failed;
-		}
-	}
-
+	all_gpu_mask = 0;
 	for (i = 0 ; i < num_of_sysfs_nodes ; i++) {
 		/* Map Kernel process device data node i <--> gpu_mem_id which
 		 * indexes into gpu_mem[] based on gpu_id
@@ -2249,11 +5941,11 @@ HSAKMT_STATUS fmm_init_process_apertures(unsigned int NumNodes)
 		if (gpu_mem_id < 0)
 			continue;
 
-		if (all_gpu_id_array_size == gpu_mem_count) {
+		if (all_gpu_mask & GPU_MASK(gpu_mem_id)) {
 			ret = HSAKMT_STATUS_ERROR;
 			goto invalid_gpu_id;
 		}
-		all_gpu_id_array[all_gpu_id_array_size++] = process_apertures[i].gpu_id;
+		all_gpu_mask |= GPU_MASK(gpu_mem_id);
 
 		gpu_mem[gpu_mem_id].lds_aperture.base =
 			PORT_UINT64_TO_VPTR(process_apertures[i].lds_base);
@@ -2307,7 +5999,6 @@ HSAKMT_STATUS fmm_init_process_apertures(unsigned int NumNodes)
 		if (ret != HSAKMT_STATUS_SUCCESS)
 			goto acquire_vm_failed;
 	}
-	all_gpu_id_array_size *= sizeof(uint32_t);
 
 	if (svm_limit) {
 		/* At least one GPU uses GPUVM in canonical address
@@ -2366,6 +6057,9 @@ HSAKMT_STATUS fmm_init_process_apertures(unsigned int NumNodes)
 					gpu_mem_id);
 	}
 
+	if (traceFile && *traceFile)
+		trace_init(traceFile, traceBufferKB);
+
 	free(process_apertures);
 	return ret;
 
@@ -2373,8 +6067,7 @@ invalid_gpu_id:
 init_svm_failed:
 acquire_vm_failed:
 set_memory_policy_failed:
-	free(all_gpu_id_array);
-	all_gpu_id_array = NULL;
+	all_gpu_mask = 0;
 get_aperture_ioctl_failed:
 	free(process_apertures);
 sysfs_parse_failed:
@@ -2384,8 +6077,25 @@ sysfs_parse_failed:
 
 void fmm_destroy_process_apertures(void)
 {
+	uint32_t i;
+
+	/* Queues the MMIO frees if deferred, before the thread is stopped */
 	release_mmio();
+	deferred_free_stop();
+	trace_fini();
+	alloc_track_fini();
+	fmm_epoch++;
+	bo_cache_clear();
+	suballoc_clear();
+	ucache_clear();
+	icache_clear();
 	if (gpu_mem) {
+		for (i = 0; i < gpu_mem_count; i++) {
+			vm_slab_cache_destroy(&gpu_mem[i].gpuvm_aperture.object_cache);
+			vm_slab_cache_destroy(&gpu_mem[i].gpuvm_aperture.area_cache);
+			vm_slab_cache_destroy(&gpu_mem[i].scratch_physical.object_cache);
+			vm_slab_cache_destroy(&gpu_mem[i].scratch_physical.area_cache);
+		}
 		free(gpu_mem);
 		gpu_mem = NULL;
 	}
@@ -2457,82 +6167,292 @@ HSAKMT_STATUS fmm_get_aperture_base_and_limit(aperture_type_e aperture_type, HSA
 	return err;
 }
 
-static bool id_in_array(uint32_t id, uint32_t *ids_array,
-		uint32_t ids_array_size)
+/* Prefaulting and registering large user buffers, and populating new
+ * paged memory, is split into units of work that are processed by up to
+ * USERPTR_MAX_WORKERS threads running on the NUMA node of the buffer.
+ */
+#define USERPTR_MAX_WORKERS 16
+#define USERPTR_PREFAULT_UNIT (64ULL << 20)
+#define USERPTR_PARALLEL_MIN_SIZE (256ULL << 20)
+
+typedef struct userptr_work {
+	uint8_t *cpu_addr;
+	uint64_t size;
+	uint64_t unit;
+	uint32_t num_units;
+	uint32_t next_unit;
+	int numa_node;
+	/* Create a userptr BO for each unit at va_addr, if handles is set */
+	uint8_t *va_addr;
+	uint32_t gpu_id;
+	uint32_t ioc_flags;
+	uint64_t *handles;
+	/* Zero new memory by writing it if it can't be populated */
+	bool zero;
+	bool failed;
+} userptr_work_t;
+
+/* Fault in the pages of a range for writing, so that pinning them
+ * doesn't have to. Falls back to reading for read-only mappings. If
+ * check is set and neither works, every page is touched instead, which
+ * crashes in an easy to debug place if the range is not mapped.
+ */
+static void fmm_prefault_range(void *addr, uint64_t size, bool check)
+{
+	if (!madvise(addr, size, MADV_POPULATE_WRITE) ||
+	    !madvise(addr, size, MADV_POPULATE_READ))
+		return;
+
+	if (check)
+		fmm_check_user_memory(addr, size);
+}
+
+static void *userptr_worker(void *arg)
 {
+	struct kfd_ioctl_alloc_memory_of_gpu_args args;
+	userptr_work_t *work = arg;
+	uint64_t offset, size;
 	uint32_t i;
 
-	for (i = 0; i < ids_array_size/sizeof(uint32_t); i++) {
-		if (id == ids_array[i])
-			return true;
+	if (work->numa_node >= 0)
+		numa_run_on_node(work->numa_node);
+
+	while ((i = __atomic_fetch_add(&work->next_unit, 1, __ATOMIC_RELAXED)) <
+	       work->num_units) {
+		offset = (uint64_t)i * work->unit;
+		size = MIN(work->unit, work->size - offset);
+
+		if (!work->zero)
+			fmm_prefault_range(work->cpu_addr + offset, size,
+					   svm.check_userptr);
+		else if (madvise(work->cpu_addr + offset, size,
+				 MADV_POPULATE_WRITE))
+			memset(work->cpu_addr + offset, 0, size);
+		if (!work->handles)
+			continue;
+
+		memset(&args, 0, sizeof(args));
+		args.gpu_id = work->gpu_id;
+		args.size = size;
+		args.flags = work->ioc_flags |
+			KFD_IOC_ALLOC_MEM_FLAGS_NO_SUBSTITUTE;
+		args.va_addr = (uint64_t)work->va_addr + offset;
+		args.mmap_offset = (uint64_t)work->cpu_addr + offset;
+		if (kmtIoctl(kfd_fd, AMDKFD_IOC_ALLOC_MEMORY_OF_GPU, &args)) {
+			__atomic_store_n(&work->failed, true, __ATOMIC_RELAXED);
+			continue;
+		}
+		work->handles[i] = args.handle;
 	}
-	return false;
+
+	return NULL;
 }
 
-/* Helper function to remove ids_array from
- * obj->mapped_device_id_array
+/* Nodes for userptr_run_workers other than a NUMA node */
+#define USERPTR_NODE_OF_RANGE -1
+#define USERPTR_ANY_NODE -2
+
+/* Process all units of work, on worker threads if there is more than
+ * one unit and on the calling thread otherwise. The workers run on the
+ * given NUMA node, on the node of the range or on any CPU.
  */
-static void remove_device_ids_from_mapped_array(vm_object_t *obj,
-		uint32_t *ids_array, uint32_t ids_array_size)
+static void userptr_run_workers(userptr_work_t *work, int node)
 {
-	uint32_t i = 0, j = 0;
+	pthread_t threads[USERPTR_MAX_WORKERS];
+	uint32_t n = MIN(work->num_units, USERPTR_MAX_WORKERS);
+	uint32_t started = 0, i, cpus = 0;
+	struct bitmask *cpumask;
+	sigset_t set, old;
+
+	if (numa_available() == -1 || node == USERPTR_ANY_NODE)
+		node = -1;
+	else if (node < 0 &&
+		 get_mempolicy(&node, NULL, 0, work->cpu_addr,
+			       MPOL_F_NODE | MPOL_F_ADDR))
+		node = -1;
+	if (node >= 0) {
+		cpumask = numa_allocate_cpumask();
+		if (cpumask && !numa_node_to_cpus(node, cpumask))
+			cpus = numa_bitmask_weight(cpumask);
+		if (cpumask)
+			numa_free_cpumask(cpumask);
+	}
+	if (!cpus)
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	n = MIN(n, cpus);
+
+	work->numa_node = node;
+	if (n > 1) {
+		/* Signals are for the application's threads */
+		sigfillset(&set);
+		pthread_sigmask(SIG_BLOCK, &set, &old);
+		for (i = 0; i < n; i++)
+			if (!pthread_create(&threads[started], NULL,
+					    userptr_worker, work))
+				started++;
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+	}
+
+	if (!started) {
+		/* Don't move the calling thread to another node */
+		work->numa_node = -1;
+		userptr_worker(work);
+	}
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+}
 
-	if (obj->mapped_device_id_array == ids_array)
-		goto set_size_and_free;
+/* Prefault a user buffer before registering it, in parallel if it is
+ * large. Small buffers are only touched to check them.
+ */
+static void fmm_prefault_user_memory(void *addr, uint64_t size)
+{
+	uint64_t page_offset = (uint64_t)addr & (PAGE_SIZE - 1);
+	userptr_work_t work = {0};
 
-	for (i = 0; i < obj->mapped_device_id_array_size/
-			sizeof(uint32_t); i++) {
-		if (!id_in_array(obj->mapped_device_id_array[i],
-					ids_array, ids_array_size))
-			obj->mapped_device_id_array[j++] =
-				obj->mapped_device_id_array[i];
+	if (size < USERPTR_PARALLEL_MIN_SIZE) {
+		fmm_check_user_memory(addr, size);
+		return;
 	}
 
-set_size_and_free:
-	obj->mapped_device_id_array_size = j*sizeof(uint32_t);
-	if (!j) {
-		if (obj->mapped_device_id_array)
-			free(obj->mapped_device_id_array);
+	work.cpu_addr = VOID_PTR_SUB(addr, page_offset);
+	work.size = PAGE_ALIGN_UP(page_offset + size);
+	work.unit = USERPTR_PREFAULT_UNIT;
+	work.num_units = (work.size + work.unit - 1) / work.unit;
+	userptr_run_workers(&work, USERPTR_NODE_OF_RANGE);
+}
+
+/* Fault in new paged system memory with threads running on the CPUs of
+ * the NUMA node it is meant for, so that every page is first touched
+ * there. Paged memory requested from a GPU node belongs to the CPU node
+ * the GPU is directly linked to. INVALID_NODEID is for memory spread
+ * across nodes, which is populated from any CPU. The kernel zeroes the
+ * pages as they are faulted in.
+ */
+static void fmm_populate_host_memory(uint32_t node_id, void *mem,
+				     uint64_t size)
+{
+	userptr_work_t work = {0};
+	uint32_t gpu_id;
+	int node = node_id == INVALID_NODEID ? USERPTR_ANY_NODE : (int)node_id;
 
-		obj->mapped_device_id_array = NULL;
+	if (validate_nodeid(node_id, &gpu_id) == HSAKMT_STATUS_SUCCESS &&
+	    gpu_id) {
+		node_id = get_direct_link_cpu(node_id);
+		node = node_id == INVALID_NODEID ? USERPTR_NODE_OF_RANGE :
+			(int)node_id;
 	}
+	if (node >= 0 && numa_available() != -1 && node > numa_max_node())
+		node = USERPTR_NODE_OF_RANGE;
+
+	work.cpu_addr = mem;
+	work.size = size;
+	work.unit = USERPTR_PREFAULT_UNIT;
+	work.num_units = (size + work.unit - 1) / work.unit;
+	work.zero = true;
+	userptr_run_workers(&work, node);
 }
 
-/* Helper function to add ids_array to
- * obj->mapped_device_id_array
+/* Create the object of a large userptr registration out of BOs of
+ * svm.userptr_split_size each. The BOs are created concurrently, each
+ * after prefaulting its part of the range. They get contiguous GPU
+ * addresses in one VA range, so the object behaves like a single BO.
  */
-static void add_device_ids_to_mapped_array(vm_object_t *obj,
-		uint32_t *ids_array, uint32_t ids_array_size)
+static vm_object_t *fmm_allocate_split_userptr(uint32_t gpu_id, uint64_t addr,
+					       uint64_t size, uint32_t ioc_flags,
+					       manageable_aperture_t **out_aper)
 {
-	uint32_t new_array_size;
+	struct kfd_ioctl_free_memory_of_gpu_args free_args = {0};
+	manageable_aperture_t *aperture = svm.dgpu_aperture;
+	userptr_work_t work = {0};
+	vm_object_t *obj = NULL;
+	uint32_t i;
+	void *mem;
 
-	/* Remove any potential duplicated ids */
-	remove_device_ids_from_mapped_array(obj, ids_array, ids_array_size);
-	new_array_size = obj->mapped_device_id_array_size
-		+ ids_array_size;
+	if (!aperture_is_valid(aperture->base, aperture->limit))
+		return NULL;
 
-	obj->mapped_device_id_array = (uint32_t *)realloc(
-			obj->mapped_device_id_array, new_array_size);
+	mem = fmm_allocate_va(aperture, NULL, size, aperture->align, &aperture);
+	if (!mem)
+		return NULL;
 
-	memcpy(&obj->mapped_device_id_array
-			[obj->mapped_device_id_array_size/sizeof(uint32_t)],
-			ids_array, ids_array_size);
+	work.cpu_addr = (uint8_t *)addr;
+	work.size = size;
+	work.unit = svm.userptr_split_size;
+	work.num_units = (size + work.unit - 1) / work.unit;
+	work.va_addr = mem;
+	work.gpu_id = gpu_id;
+	work.ioc_flags = ioc_flags;
+	work.handles = calloc(work.num_units, sizeof(*work.handles));
+	if (!work.handles)
+		goto out_release_va;
+
+	userptr_run_workers(&work, USERPTR_NODE_OF_RANGE);
+	if (work.failed)
+		goto out_free_bos;
+
+	pthread_rwlock_wrlock(&aperture->fmm_lock);
+	obj = aperture_allocate_object(aperture, mem, work.handles[0], size,
+				       ioc_flags);
+	if (obj) {
+		obj->split_handles = work.handles;
+		obj->num_split_handles = work.num_units;
+	}
+	pthread_rwlock_unlock(&aperture->fmm_lock);
+	if (obj) {
+		*out_aper = aperture;
+		return obj;
+	}
 
-	obj->mapped_device_id_array_size = new_array_size;
+out_free_bos:
+	for (i = 0; i < work.num_units; i++) {
+		if (!work.handles[i])
+			continue;
+		free_args.handle = work.handles[i];
+		kmtIoctl(kfd_fd, AMDKFD_IOC_FREE_MEMORY_OF_GPU, &free_args);
+	}
+	free(work.handles);
+out_release_va:
+	fmm_release_va(aperture, mem, size);
+	return NULL;
 }
 
+/* Map or unmap all BOs of a split userptr. A GPU only counts as mapped
+ * if all BOs are mapped on it.
+ */
+static int fmm_map_split_userptr(vm_object_t *object, gpu_mask_t gpus,
+				 bool map)
+{
+	gpu_mask_t done, all = gpus;
+	uint32_t i;
+	int ret = 0;
+
+	for (i = 0; i < object->num_split_handles; i++) {
+		if (fmm_map_bo_ioctl(object->split_handles[i], gpus, map, &done))
+			ret = -1;
+		all &= done;
+	}
+
+	if (map)
+		object->mapped_gpus |= all;
+	else
+		object->mapped_gpus &= ~all;
+
+	return ret;
+}
 
-/* If nodes_to_map is not NULL, map the nodes specified; otherwise map all. */
+/* If nodes_to_map is not empty, map the nodes specified; otherwise map all. */
 static int _fmm_map_to_gpu(manageable_aperture_t *aperture,
 			void *address, uint64_t size, vm_object_t *obj,
-			uint32_t *nodes_to_map, uint32_t nodes_array_size)
+			gpu_mask_t nodes_to_map)
 {
 	struct kfd_ioctl_map_memory_to_gpu_args args = {0};
+	uint32_t gpu_ids[FMM_MAX_GPUS];
 	vm_object_t *object;
 	int ret = 0;
 
 	if (!obj)
-		pthread_mutex_lock(&aperture->fmm_mutex);
+		pthread_rwlock_wrlock(&aperture->fmm_lock);
 
 	object = obj;
 	if (!object) {
@@ -2553,31 +6473,30 @@ static int _fmm_map_to_gpu(manageable_aperture_t *aperture,
 		goto exit_ok;
 	}
 
-	args.handle = object->handle;
-	if (nodes_to_map) {
-	/* If specified, map the requested */
-		args.device_ids_array_ptr = (uint64_t)nodes_to_map;
-		args.n_devices = nodes_array_size / sizeof(uint32_t);
-	} else if (object->registered_device_id_array_size > 0) {
-	/* otherwise map all registered */
-		args.device_ids_array_ptr =
-			(uint64_t)object->registered_device_id_array;
-		args.n_devices = object->registered_device_id_array_size /
-			sizeof(uint32_t);
-	} else {
-	/* not specified, not registered: map all GPUs */
-		args.device_ids_array_ptr = (uint64_t)all_gpu_id_array;
-		args.n_devices = all_gpu_id_array_size / sizeof(uint32_t);
+	/* If not specified, map all registered. Not registered: map all GPUs */
+	if (!nodes_to_map)
+		nodes_to_map = object->registered_gpus ?
+			object->registered_gpus : all_gpu_mask;
+
+	if (object->shared_bo) {
+		ret = shared_bo_map(object, nodes_to_map);
+		goto out_mapped;
+	}
+	if (object->split_handles) {
+		ret = fmm_map_split_userptr(object, nodes_to_map, true);
+		goto out_mapped;
 	}
+
+	args.handle = object->handle;
+	args.device_ids_array_ptr = (uint64_t)gpu_ids;
+	args.n_devices = gpu_mask_to_ids(nodes_to_map, gpu_ids, false);
 	args.n_success = 0;
 
 	ret = kmtIoctl(kfd_fd, AMDKFD_IOC_MAP_MEMORY_TO_GPU, &args);
 
-	add_device_ids_to_mapped_array(object,
-				(uint32_t *)args.device_ids_array_ptr,
-				args.n_success * sizeof(uint32_t));
-	print_device_id_array((uint32_t *)object->mapped_device_id_array,
-			      object->mapped_device_id_array_size);
+	object->mapped_gpus |= gpu_mask_first(nodes_to_map, args.n_success);
+out_mapped:
+	print_gpu_mask(object->mapped_gpus);
 
 	object->mapping_count = 1;
 	/* Mapping changed and lifecycle of object->mapped_node_id_array
@@ -2591,7 +6510,7 @@ static int _fmm_map_to_gpu(manageable_aperture_t *aperture,
 exit_ok:
 err_object_not_found:
 	if (!obj)
-		pthread_mutex_unlock(&aperture->fmm_mutex);
+		pthread_rwlock_unlock(&aperture->fmm_lock);
 
 	return ret;
 }
@@ -2646,7 +6565,7 @@ static int _fmm_map_to_gpu_scratch(uint32_t gpu_id, manageable_aperture_t *apert
 
 
 	/* map to GPU */
-	ret = _fmm_map_to_gpu(aperture, address, size, NULL, &gpu_id, sizeof(uint32_t));
+	ret = _fmm_map_to_gpu(aperture, address, size, NULL, GPU_MASK(gpu_mem_id));
 	if (ret != 0)
 		__fmm_release(obj, aperture);
 
@@ -2662,15 +6581,15 @@ static int _fmm_map_to_gpu_userptr(void *addr, uint64_t size,
 	HSAuint32 page_offset = (HSAuint64)addr & (PAGE_SIZE-1);
 	int ret;
 
-	aperture = svm.dgpu_aperture;
-
 	svm_addr = object->start;
 	svm_size = object->size;
 
+	aperture = aperture_shard(svm.dgpu_aperture, svm_addr);
+
 	/* Map and return the GPUVM address adjusted by the offset
 	 * from the start of the page
 	 */
-	ret = _fmm_map_to_gpu(aperture, svm_addr, svm_size, object, NULL, 0);
+	ret = _fmm_map_to_gpu(aperture, svm_addr, svm_size, object, 0);
 	if (ret == 0 && gpuvm_addr)
 		*gpuvm_addr = (uint64_t)svm_addr + page_offset;
 
@@ -2693,7 +6612,7 @@ int fmm_map_to_gpu(void *address, uint64_t size, uint64_t *gpuvm_address)
 							&gpu_mem[i].scratch_physical,
 							address, size);
 
-	object = vm_find_object(address, size, &aperture);
+	object = vm_find_object(address, size, true, &aperture);
 	if (!object) {
 		if (!is_dgpu) {
 			/* Prefetch memory on APUs with dummy-reads */
@@ -2712,7 +6631,7 @@ int fmm_map_to_gpu(void *address, uint64_t size, uint64_t *gpuvm_address)
 	} else if (object->userptr) {
 		ret = _fmm_map_to_gpu_userptr(address, size, gpuvm_address, object);
 	} else {
-		ret = _fmm_map_to_gpu(aperture, address, size, object, NULL, 0);
+		ret = _fmm_map_to_gpu(aperture, address, size, object, 0);
 		/* Update alternate GPUVM address only for
 		 * CPU-invisible apertures on old APUs
 		 */
@@ -2720,33 +6639,72 @@ int fmm_map_to_gpu(void *address, uint64_t size, uint64_t *gpuvm_address)
 			*gpuvm_address = VOID_PTRS_SUB(object->start, aperture->base);
 	}
 
-	pthread_mutex_unlock(&aperture->fmm_mutex);
+	pthread_rwlock_unlock(&aperture->fmm_lock);
+	return ret;
+}
+
+/* Register a new allocation to the GPUs in gpu_id_array and map it to
+ * them (all GPUs if n_gpus is 0), finding its object only once. Other
+ * than fmm_register_memory, this doesn't take ownership of gpu_id_array.
+ */
+int fmm_register_and_map(void *address, uint64_t size,
+			 const uint32_t *gpu_id_array, uint32_t n_gpus,
+			 uint64_t *gpuvm_address)
+{
+	manageable_aperture_t *aperture;
+	vm_object_t *object;
+	gpu_mask_t gpus;
+	int ret;
+
+	if (!gpu_ids_to_mask(gpu_id_array, n_gpus, &gpus))
+		return -EINVAL;
+
+	object = vm_find_object(address, size, true, &aperture);
+	if (!object || aperture == &cpuvm_aperture || object->userptr ||
+	    object->registered_gpus) {
+		/* Not a new GPU allocation, take the slow path */
+		if (object)
+			pthread_rwlock_unlock(&aperture->fmm_lock);
+		return fmm_map_to_gpu(address, size, gpuvm_address);
+	}
+
+	/* Nothing is mapped yet, no need to free mapped_node_id_array */
+	object->registered_gpus = gpus;
+	ret = _fmm_map_to_gpu(aperture, address, size, object, 0);
+	if (!ret && gpuvm_address && !aperture->is_cpu_accessible)
+		*gpuvm_address = VOID_PTRS_SUB(object->start, aperture->base);
+
+	pthread_rwlock_unlock(&aperture->fmm_lock);
 	return ret;
 }
 
-static void print_device_id_array(uint32_t *device_id_array, uint32_t device_id_array_size)
+static void print_gpu_mask(gpu_mask_t mask)
 {
 #ifdef DEBUG_PRINT_APERTURE
-	device_id_array_size /= sizeof(uint32_t);
+	uint32_t gpu_ids[FMM_MAX_GPUS];
+	uint32_t n_gpus = gpu_mask_to_ids(mask, gpu_ids, false);
 
-	pr_info("device id array size %d\n", device_id_array_size);
+	pr_info("device id array size %d\n", n_gpus);
 
-	for (uint32_t i = 0 ; i < device_id_array_size; i++)
-		pr_info("%d . 0x%x\n", (i+1), device_id_array[i]);
+	for (uint32_t i = 0 ; i < n_gpus; i++)
+		pr_info("%d . 0x%x\n", (i+1), gpu_ids[i]);
 #endif
 }
 
+/* If nodes_to_unmap is not empty, unmap the nodes specified; otherwise
+ * unmap all mapped nodes.
+ */
 static int _fmm_unmap_from_gpu(manageable_aperture_t *aperture, void *address,
-		uint32_t *device_ids_array, uint32_t device_ids_array_size,
-		vm_object_t *obj)
+		gpu_mask_t nodes_to_unmap, vm_object_t *obj)
 {
+	uint32_t gpu_ids[FMM_MAX_GPUS];
 	vm_object_t *object;
 	int ret = 0;
 	struct kfd_ioctl_unmap_memory_from_gpu_args args = {0};
 	HSAuint32 page_offset = (HSAint64)address & (PAGE_SIZE - 1);
 
 	if (!obj)
-		pthread_mutex_lock(&aperture->fmm_mutex);
+		pthread_rwlock_wrlock(&aperture->fmm_lock);
 
 	/* Find the object to retrieve the handle */
 	object = obj;
@@ -2764,15 +6722,9 @@ static int _fmm_unmap_from_gpu(manageable_aperture_t *aperture, void *address,
 		goto out;
 	}
 
-	args.handle = object->handle;
-	if (device_ids_array && device_ids_array_size > 0) {
-		args.device_ids_array_ptr = (uint64_t)device_ids_array;
-		args.n_devices = device_ids_array_size / sizeof(uint32_t);
-	} else if (object->mapped_device_id_array_size > 0) {
-		args.device_ids_array_ptr = (uint64_t)object->mapped_device_id_array;
-		args.n_devices = object->mapped_device_id_array_size /
-			sizeof(uint32_t);
-	} else {
+	if (!nodes_to_unmap)
+		nodes_to_unmap = object->mapped_gpus;
+	if (!nodes_to_unmap) {
 		/*
 		 * When unmap exits here it should return failing error code as the user tried to
 		 * unmap already unmapped buffer. Currently we returns success as KFDTEST and RT
@@ -2781,17 +6733,26 @@ static int _fmm_unmap_from_gpu(manageable_aperture_t *aperture, void *address,
 		ret = 0;
 		goto out;
 	}
+	if (object->shared_bo) {
+		ret = shared_bo_unmap(object, nodes_to_unmap);
+		goto out_unmapped;
+	}
+	if (object->split_handles) {
+		ret = fmm_map_split_userptr(object, nodes_to_unmap, false);
+		goto out_unmapped;
+	}
+	args.handle = object->handle;
+	args.device_ids_array_ptr = (uint64_t)gpu_ids;
+	args.n_devices = gpu_mask_to_ids(nodes_to_unmap, gpu_ids, false);
 	args.n_success = 0;
 
-	print_device_id_array((void *)args.device_ids_array_ptr,
-			      args.n_devices * sizeof(uint32_t));
+	print_gpu_mask(nodes_to_unmap);
 
 	ret = kmtIoctl(kfd_fd, AMDKFD_IOC_UNMAP_MEMORY_FROM_GPU, &args);
 
-	remove_device_ids_from_mapped_array(object,
-			(uint32_t *)args.device_ids_array_ptr,
-			args.n_success * sizeof(uint32_t));
+	object->mapped_gpus &= ~gpu_mask_first(nodes_to_unmap, args.n_success);
 
+out_unmapped:
 	if (object->mapped_node_id_array)
 		free(object->mapped_node_id_array);
 	object->mapped_node_id_array = NULL;
@@ -2799,7 +6760,7 @@ static int _fmm_unmap_from_gpu(manageable_aperture_t *aperture, void *address,
 
 out:
 	if (!obj)
-		pthread_mutex_unlock(&aperture->fmm_mutex);
+		pthread_rwlock_unlock(&aperture->fmm_lock);
 	return ret;
 }
 
@@ -2807,6 +6768,7 @@ static int _fmm_unmap_from_gpu_scratch(uint32_t gpu_id,
 				       manageable_aperture_t *aperture,
 				       void *address)
 {
+	uint32_t gpu_ids[FMM_MAX_GPUS];
 	int32_t gpu_mem_id;
 	vm_object_t *object;
 	struct kfd_ioctl_unmap_memory_from_gpu_args args = {0};
@@ -2820,7 +6782,7 @@ static int _fmm_unmap_from_gpu_scratch(uint32_t gpu_id,
 	if (!topology_is_dgpu(gpu_mem[gpu_mem_id].device_id))
 		return 0; /* Nothing to do on APU */
 
-	pthread_mutex_lock(&aperture->fmm_mutex);
+	pthread_rwlock_wrlock(&aperture->fmm_lock);
 
 	/* Find the object to retrieve the handle and size */
 	object = vm_find_object_by_address(aperture, address, 0);
@@ -2829,22 +6791,20 @@ static int _fmm_unmap_from_gpu_scratch(uint32_t gpu_id,
 		goto err;
 	}
 
-	if (!object->mapped_device_id_array ||
-			object->mapped_device_id_array_size == 0) {
-		pthread_mutex_unlock(&aperture->fmm_mutex);
+	if (!object->mapped_gpus) {
+		pthread_rwlock_unlock(&aperture->fmm_lock);
 		return 0;
 	}
 
 	/* unmap from GPU */
 	args.handle = object->handle;
-	args.device_ids_array_ptr = (uint64_t)object->mapped_device_id_array;
-	args.n_devices = object->mapped_device_id_array_size / sizeof(uint32_t);
+	args.device_ids_array_ptr = (uint64_t)gpu_ids;
+	args.n_devices = gpu_mask_to_ids(object->mapped_gpus, gpu_ids, false);
 	args.n_success = 0;
 	ret = kmtIoctl(kfd_fd, AMDKFD_IOC_UNMAP_MEMORY_FROM_GPU, &args);
 
-	remove_device_ids_from_mapped_array(object,
-			(uint32_t *)args.device_ids_array_ptr,
-			args.n_success * sizeof(uint32_t));
+	object->mapped_gpus &= ~gpu_mask_first(object->mapped_gpus,
+					       args.n_success);
 
 	if (object->mapped_node_id_array)
 		free(object->mapped_node_id_array);
@@ -2853,13 +6813,13 @@ static int _fmm_unmap_from_gpu_scratch(uint32_t gpu_id,
 	if (ret)
 		goto err;
 
-	pthread_mutex_unlock(&aperture->fmm_mutex);
+	pthread_rwlock_unlock(&aperture->fmm_lock);
 
 	/* free object in scratch backing aperture */
 	return __fmm_release(object, aperture);
 
 err:
-	pthread_mutex_unlock(&aperture->fmm_mutex);
+	pthread_rwlock_unlock(&aperture->fmm_lock);
 	return ret;
 }
 
@@ -2879,7 +6839,7 @@ int fmm_unmap_from_gpu(void *address)
 							&gpu_mem[i].scratch_physical,
 							address);
 
-	object = vm_find_object(address, 0, &aperture);
+	object = vm_find_object(address, 0, true, &aperture);
 	if (!object)
 		/* On APUs GPU unmapping of system memory is a no-op */
 		return is_dgpu ? -EINVAL : 0;
@@ -2889,9 +6849,9 @@ int fmm_unmap_from_gpu(void *address)
 		/* On APUs GPU unmapping of system memory is a no-op */
 		ret = 0;
 	else
-		ret = _fmm_unmap_from_gpu(aperture, address, NULL, 0, object);
+		ret = _fmm_unmap_from_gpu(aperture, address, 0, object);
 
-	pthread_mutex_unlock(&aperture->fmm_mutex);
+	pthread_rwlock_unlock(&aperture->fmm_lock);
 
 	return ret;
 }
@@ -2921,24 +6881,25 @@ bool fmm_get_handle(void *address, uint64_t *handle)
 	if (!aperture) {
 		if ((address >= svm.dgpu_aperture->base) &&
 			(address <= svm.dgpu_aperture->limit)) {
-			aperture = svm.dgpu_aperture;
+			aperture = aperture_shard(svm.dgpu_aperture, address);
 		} else if ((address >= svm.dgpu_alt_aperture->base) &&
 			(address <= svm.dgpu_alt_aperture->limit)) {
-			aperture = svm.dgpu_alt_aperture;
+			aperture = aperture_shard(svm.dgpu_alt_aperture,
+						  address);
 		}
 	}
 
 	if (!aperture)
 		return false;
 
-	pthread_mutex_lock(&aperture->fmm_mutex);
+	pthread_rwlock_rdlock(&aperture->fmm_lock);
 	/* Find the object to retrieve the handle */
 	object = vm_find_object_by_address(aperture, address, 0);
 	if (object && handle) {
 		*handle = object->handle;
 		found = true;
 	}
-	pthread_mutex_unlock(&aperture->fmm_mutex);
+	pthread_rwlock_unlock(&aperture->fmm_lock);
 
 
 	return found;
@@ -2951,6 +6912,7 @@ static HSAKMT_STATUS fmm_register_user_memory(void *addr, HSAuint64 size,
 	HSAuint32 page_offset = (HSAuint64)addr & (PAGE_SIZE-1);
 	HSAuint64 aligned_addr = (HSAuint64)addr - page_offset;
 	HSAuint64 aligned_size = PAGE_ALIGN_UP(page_offset + size);
+	uint32_t ioc_flags;
 	void *svm_addr;
 	HSAuint32 gpu_id;
 	vm_object_t *obj;
@@ -2961,28 +6923,49 @@ static HSAKMT_STATUS fmm_register_user_memory(void *addr, HSAuint64 size,
 
 	gpu_id = g_first_gpu_mem->gpu_id;
 
+	ioc_flags = KFD_IOC_ALLOC_MEM_FLAGS_USERPTR |
+		KFD_IOC_ALLOC_MEM_FLAGS_WRITABLE |
+		KFD_IOC_ALLOC_MEM_FLAGS_EXECUTABLE |
+		(coarse_grain ? 0 : KFD_IOC_ALLOC_MEM_FLAGS_COHERENT);
+
+	/* Large userptrs are always prefaulted, on the worker threads that
+	 * create their BOs
+	 */
+	if (svm.userptr_split_size && aligned_size > svm.userptr_split_size) {
+		obj = fmm_allocate_split_userptr(gpu_id, aligned_addr,
+						 aligned_size, ioc_flags,
+						 &aperture);
+		goto out_init_object;
+	}
+
 	/* Optionally check that the CPU mapping is valid */
 	if (svm.check_userptr)
-		fmm_check_user_memory(addr, size);
+		fmm_prefault_user_memory(addr, size);
 
-	/* Allocate BO, userptr address is passed in mmap_offset */
-	svm_addr = __fmm_allocate_device(gpu_id, NULL, aligned_size, aperture,
-			 &aligned_addr, KFD_IOC_ALLOC_MEM_FLAGS_USERPTR |
-			 KFD_IOC_ALLOC_MEM_FLAGS_WRITABLE |
-			 KFD_IOC_ALLOC_MEM_FLAGS_EXECUTABLE |
-			 (coarse_grain ? 0 : KFD_IOC_ALLOC_MEM_FLAGS_COHERENT), &obj);
-	if (!svm_addr)
-		return HSAKMT_STATUS_ERROR;
+	if (ucache.budget) {
+		obj = ucache_register(gpu_id, aligned_addr, aligned_size,
+				      ioc_flags, coarse_grain, &aperture);
+	} else {
+		/* Allocate BO, userptr address is passed in mmap_offset */
+		svm_addr = __fmm_allocate_device(gpu_id, NULL, aligned_size,
+				&aperture, &aligned_addr, ioc_flags, &obj);
+		if (!svm_addr)
+			return HSAKMT_STATUS_ERROR;
+	}
 
+out_init_object:
 	if (obj) {
-		pthread_mutex_lock(&aperture->fmm_mutex);
+		pthread_rwlock_wrlock(&aperture->fmm_lock);
 		obj->userptr = addr;
 		gpuid_to_nodeid(gpu_id, &obj->node_id);
 		obj->userptr_size = size;
 		obj->registration_count = 1;
 		obj->user_node.key = rbtree_key((unsigned long)addr, size);
 		rbtree_insert(&aperture->user_tree, &obj->user_node);
-		pthread_mutex_unlock(&aperture->fmm_mutex);
+		__atomic_add_fetch(&aperture->num_userptrs, 1, __ATOMIC_RELAXED);
+		aperture->userptr_bytes += size;
+		vm_objects_changed(aperture);
+		pthread_rwlock_unlock(&aperture->fmm_lock);
 	} else
 		return HSAKMT_STATUS_ERROR;
 
@@ -2998,12 +6981,17 @@ HSAKMT_STATUS fmm_register_memory(void *address, uint64_t size_in_bytes,
 {
 	manageable_aperture_t *aperture = NULL;
 	vm_object_t *object = NULL;
+	gpu_mask_t gpus;
 	HSAKMT_STATUS ret;
 
 	if (gpu_id_array_size > 0 && !gpu_id_array)
 		return HSAKMT_STATUS_INVALID_PARAMETER;
 
-	object = vm_find_object(address, size_in_bytes, &aperture);
+	if (!gpu_ids_to_mask(gpu_id_array, gpu_id_array_size / sizeof(uint32_t),
+			     &gpus))
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	object = vm_find_object(address, size_in_bytes, true, &aperture);
 	if (!object) {
 		if (!is_dgpu)
 			/* System memory registration on APUs is a no-op */
@@ -3013,10 +7001,10 @@ HSAKMT_STATUS fmm_register_memory(void *address, uint64_t size_in_bytes,
 		ret = fmm_register_user_memory(address, size_in_bytes, &object, coarse_grain);
 		if (ret != HSAKMT_STATUS_SUCCESS)
 			return ret;
-		if (gpu_id_array_size == 0)
+		if (!gpus)
 			return HSAKMT_STATUS_SUCCESS;
-		aperture = svm.dgpu_aperture;
-		pthread_mutex_lock(&aperture->fmm_mutex);
+		aperture = aperture_shard(svm.dgpu_aperture, object->start);
+		pthread_rwlock_wrlock(&aperture->fmm_lock);
 		/* fall through for registered device ID array setup */
 	} else if (object->userptr) {
 		/* Update an existing userptr */
@@ -3024,27 +7012,16 @@ HSAKMT_STATUS fmm_register_memory(void *address, uint64_t size_in_bytes,
 	}
 	/* Successful vm_find_object returns with aperture locked */
 
-	if (object->registered_device_id_array_size > 0) {
+	if (object->registered_gpus) {
 		/* Multiple registration is allowed, but not changing nodes */
-		if ((gpu_id_array_size != object->registered_device_id_array_size)
-			|| memcmp(object->registered_device_id_array,
-					gpu_id_array, gpu_id_array_size)) {
+		if (gpus != object->registered_gpus) {
 			pr_err("Cannot change nodes in a registered addr.\n");
-			pthread_mutex_unlock(&aperture->fmm_mutex);
+			pthread_rwlock_unlock(&aperture->fmm_lock);
 			return HSAKMT_STATUS_MEMORY_ALREADY_REGISTERED;
-		} else {
-			/* Delete the new array, keep the existing one. */
-			if (gpu_id_array)
-				free(gpu_id_array);
-
-			pthread_mutex_unlock(&aperture->fmm_mutex);
-			return HSAKMT_STATUS_SUCCESS;
 		}
-	}
-
-	if (gpu_id_array_size > 0) {
-		object->registered_device_id_array = gpu_id_array;
-		object->registered_device_id_array_size = gpu_id_array_size;
+		/* Same nodes, the array is consumed below */
+	} else if (gpus) {
+		object->registered_gpus = gpus;
 		/* Registration of object changed. Lifecycle of object->
 		 * registered_node_id_array terminates here. Free old one
 		 * and re-allocate on next query
@@ -3055,7 +7032,9 @@ HSAKMT_STATUS fmm_register_memory(void *address, uint64_t size_in_bytes,
 		}
 	}
 
-	pthread_mutex_unlock(&aperture->fmm_mutex);
+	pthread_rwlock_unlock(&aperture->fmm_lock);
+	if (gpu_id_array)
+		free(gpu_id_array);
 	return HSAKMT_STATUS_SUCCESS;
 }
 
@@ -3073,6 +7052,7 @@ HSAKMT_STATUS fmm_register_graphics_handle(HSAuint64 GraphicsResourceHandle,
 	void *metadata;
 	void *mem, *aperture_base;
 	int32_t gpu_mem_id;
+	gpu_mask_t gpus;
 	int r;
 	HSAKMT_STATUS status = HSAKMT_STATUS_ERROR;
 	static const uint64_t IMAGE_ALIGN = 256*1024;
@@ -3080,6 +7060,10 @@ HSAKMT_STATUS fmm_register_graphics_handle(HSAuint64 GraphicsResourceHandle,
 	if (gpu_id_array_size > 0 && !gpu_id_array)
 		return HSAKMT_STATUS_INVALID_PARAMETER;
 
+	if (!gpu_ids_to_mask(gpu_id_array, gpu_id_array_size / sizeof(uint32_t),
+			     &gpus))
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
 	infoArgs.dmabuf_fd = GraphicsResourceHandle;
 	infoArgs.metadata_size = GRAPHICS_METADATA_DEFAULT_SIZE;
 	metadata = calloc(infoArgs.metadata_size, 1);
@@ -3113,10 +7097,8 @@ HSAKMT_STATUS fmm_register_graphics_handle(HSAuint64 GraphicsResourceHandle,
 	}
 	if (!aperture_is_valid(aperture->base, aperture->limit))
 		goto error_free_metadata;
-	pthread_mutex_lock(&aperture->fmm_mutex);
-	mem = aperture_allocate_area_aligned(aperture, NULL, infoArgs.size,
-					     IMAGE_ALIGN);
-	pthread_mutex_unlock(&aperture->fmm_mutex);
+	mem = fmm_allocate_va(aperture, NULL, infoArgs.size, IMAGE_ALIGN,
+			      &aperture);
 	if (!mem)
 		goto error_free_metadata;
 
@@ -3128,19 +7110,21 @@ HSAKMT_STATUS fmm_register_graphics_handle(HSAuint64 GraphicsResourceHandle,
 	if (r)
 		goto error_release_aperture;
 
-	pthread_mutex_lock(&aperture->fmm_mutex);
+	pthread_rwlock_wrlock(&aperture->fmm_lock);
 	obj = aperture_allocate_object(aperture, mem, importArgs.handle,
 				       infoArgs.size, infoArgs.flags);
 	if (obj) {
 		obj->metadata = metadata;
-		obj->registered_device_id_array = gpu_id_array;
-		obj->registered_device_id_array_size = gpu_id_array_size;
+		obj->registered_gpus = gpus;
 		gpuid_to_nodeid(infoArgs.gpu_id, &obj->node_id);
 	}
-	pthread_mutex_unlock(&aperture->fmm_mutex);
+	pthread_rwlock_unlock(&aperture->fmm_lock);
 	if (!obj)
 		goto error_release_buffer;
 
+	if (gpu_id_array)
+		free(gpu_id_array);
+
 	GraphicsResourceInfo->MemoryAddress = mem;
 	GraphicsResourceInfo->SizeInBytes = infoArgs.size;
 	GraphicsResourceInfo->Metadata = (void *)(unsigned long)infoArgs.metadata_ptr;
@@ -3153,7 +7137,7 @@ error_release_buffer:
 	freeArgs.handle = importArgs.handle;
 	kmtIoctl(kfd_fd, AMDKFD_IOC_FREE_MEMORY_OF_GPU, &freeArgs);
 error_release_aperture:
-	aperture_release_area(aperture, mem, infoArgs.size);
+	fmm_release_va(aperture, mem, infoArgs.size);
 error_free_metadata:
 	free(metadata);
 
@@ -3180,9 +7164,21 @@ HSAKMT_STATUS fmm_share_memory(void *MemoryAddress,
 	if (!aperture)
 		return HSAKMT_STATUS_INVALID_PARAMETER;
 
-	pthread_mutex_lock(&aperture->fmm_mutex);
+	pthread_rwlock_rdlock(&aperture->fmm_lock);
 	obj = vm_find_object_by_address(aperture, MemoryAddress, 0);
-	pthread_mutex_unlock(&aperture->fmm_mutex);
+	/* Exporting part of a shared BO would share all of it, and a
+	 * split userptr is more than one BO
+	 */
+	if (obj && (obj->shared_bo || obj->split_handles)) {
+		pthread_rwlock_unlock(&aperture->fmm_lock);
+		return HSAKMT_STATUS_NOT_SUPPORTED;
+	}
+	/* Other processes may still use the BO after it is freed here,
+	 * keep it out of the BO cache
+	 */
+	if (obj)
+		__atomic_store_n(&obj->is_exported, true, __ATOMIC_RELAXED);
+	pthread_rwlock_unlock(&aperture->fmm_lock);
 	if (!obj)
 		return HSAKMT_STATUS_INVALID_PARAMETER;
 
@@ -3231,20 +7227,36 @@ HSAKMT_STATUS fmm_register_shared_memory(const HsaSharedMemoryHandle *SharedMemo
 	const HsaSharedMemoryStruct *SharedMemoryStruct =
 		to_const_hsa_shared_memory_struct(SharedMemoryHandle);
 	HSAuint64 SizeInPages = SharedMemoryStruct->SizeInPages;
+	gpu_mask_t gpus;
 
 	if (gpu_id_array_size > 0 && !gpu_id_array)
 		return HSAKMT_STATUS_INVALID_PARAMETER;
 
+	if (!gpu_ids_to_mask(gpu_id_array, gpu_id_array_size / sizeof(uint32_t),
+			     &gpus))
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	if (icache.budget) {
+		obj = icache_get(SharedMemoryStruct->ShareHandle,
+				 SharedMemoryStruct->ExportGpuId,
+				 SizeInPages << PAGE_SHIFT, gpus);
+		if (obj) {
+			*MemoryAddress = obj->start;
+			*SizeInBytes = (SizeInPages << PAGE_SHIFT);
+			if (gpu_id_array)
+				free(gpu_id_array);
+			return HSAKMT_STATUS_SUCCESS;
+		}
+	}
+
 	memcpy(importArgs.share_handle, SharedMemoryStruct->ShareHandle,
 			sizeof(importArgs.share_handle));
 	importArgs.gpu_id = SharedMemoryStruct->ExportGpuId;
 
 	aperture = fmm_get_aperture(SharedMemoryStruct->ApeInfo);
 
-	pthread_mutex_lock(&aperture->fmm_mutex);
-	reservedMem = aperture_allocate_area(aperture, NULL,
-			(SizeInPages << PAGE_SHIFT));
-	pthread_mutex_unlock(&aperture->fmm_mutex);
+	reservedMem = fmm_allocate_va(aperture, NULL,
+			(SizeInPages << PAGE_SHIFT), aperture->align, &aperture);
 	if (!reservedMem) {
 		err = HSAKMT_STATUS_NO_MEMORY;
 		goto err_free_buffer;
@@ -3257,7 +7269,7 @@ HSAKMT_STATUS fmm_register_shared_memory(const HsaSharedMemoryHandle *SharedMemo
 		goto err_import;
 	}
 
-	pthread_mutex_lock(&aperture->fmm_mutex);
+	pthread_rwlock_wrlock(&aperture->fmm_lock);
 	obj = aperture_allocate_object(aperture, reservedMem, importArgs.handle,
 				       (SizeInPages << PAGE_SHIFT),
 				       0);
@@ -3265,7 +7277,7 @@ HSAKMT_STATUS fmm_register_shared_memory(const HsaSharedMemoryHandle *SharedMemo
 		err = HSAKMT_STATUS_NO_MEMORY;
 		goto err_free_mem;
 	}
-	pthread_mutex_unlock(&aperture->fmm_mutex);
+	pthread_rwlock_unlock(&aperture->fmm_lock);
 
 	if (importArgs.mmap_offset) {
 		int32_t gpu_mem_id = gpu_mem_find_by_gpu_id(importArgs.gpu_id);
@@ -3291,19 +7303,23 @@ HSAKMT_STATUS fmm_register_shared_memory(const HsaSharedMemoryHandle *SharedMemo
 	*MemoryAddress = reservedMem;
 	*SizeInBytes = (SizeInPages << PAGE_SHIFT);
 
-	if (gpu_id_array_size > 0) {
-		obj->registered_device_id_array = gpu_id_array;
-		obj->registered_device_id_array_size = gpu_id_array_size;
-	}
+	obj->registered_gpus = gpus;
 	obj->is_imported_kfd_bo = true;
 
+	if (icache.budget)
+		icache_put_new(SharedMemoryStruct->ShareHandle,
+			       SharedMemoryStruct->ExportGpuId, obj, aperture);
+
+	if (gpu_id_array)
+		free(gpu_id_array);
+
 	return HSAKMT_STATUS_SUCCESS;
 err_free_obj:
-	pthread_mutex_lock(&aperture->fmm_mutex);
+	pthread_rwlock_wrlock(&aperture->fmm_lock);
 	vm_remove_object(aperture, obj);
 err_free_mem:
 	aperture_release_area(aperture, reservedMem, (SizeInPages << PAGE_SHIFT));
-	pthread_mutex_unlock(&aperture->fmm_mutex);
+	pthread_rwlock_unlock(&aperture->fmm_lock);
 err_free_buffer:
 	freeArgs.handle = importArgs.handle;
 	kmtIoctl(kfd_fd, AMDKFD_IOC_FREE_MEMORY_OF_GPU, &freeArgs);
@@ -3316,7 +7332,7 @@ HSAKMT_STATUS fmm_deregister_memory(void *address)
 	manageable_aperture_t *aperture;
 	vm_object_t *object;
 
-	object = vm_find_object(address, 0, &aperture);
+	object = vm_find_object(address, 0, true, &aperture);
 	if (!object)
 		/* On APUs we assume it's a random system memory address
 		 * where registration and dergistration is a no-op
@@ -3330,13 +7346,13 @@ HSAKMT_STATUS fmm_deregister_memory(void *address)
 		/* API-allocated system memory on APUs, deregistration
 		 * is a no-op
 		 */
-		pthread_mutex_unlock(&aperture->fmm_mutex);
+		pthread_rwlock_unlock(&aperture->fmm_lock);
 		return HSAKMT_STATUS_SUCCESS;
 	}
 
 	if (object->registration_count > 1) {
 		--object->registration_count;
-		pthread_mutex_unlock(&aperture->fmm_mutex);
+		pthread_rwlock_unlock(&aperture->fmm_lock);
 		return HSAKMT_STATUS_SUCCESS;
 	}
 
@@ -3345,28 +7361,79 @@ HSAKMT_STATUS fmm_deregister_memory(void *address)
 		 * buffer. Deregistering imported graphics buffers or
 		 * userptrs means releasing the BO.
 		 */
-		pthread_mutex_unlock(&aperture->fmm_mutex);
-		__fmm_release(object, aperture);
+		pthread_rwlock_unlock(&aperture->fmm_lock);
+		if (object->shared_bo)
+			ucache_deregister(object, aperture);
+		else if (object->ipc_import)
+			icache_deregister(object, aperture);
+		else
+			__fmm_release(object, aperture);
 		return HSAKMT_STATUS_SUCCESS;
 	}
 
-	if (!object->registered_device_id_array ||
-		object->registered_device_id_array_size <= 0) {
-		pthread_mutex_unlock(&aperture->fmm_mutex);
+	if (!object->registered_gpus) {
+		pthread_rwlock_unlock(&aperture->fmm_lock);
 		return HSAKMT_STATUS_MEMORY_NOT_REGISTERED;
 	}
 
-	if (object->registered_device_id_array) {
-		free(object->registered_device_id_array);
-		object->registered_device_id_array = NULL;
-		object->registered_device_id_array_size = 0;
-	}
+	object->registered_gpus = 0;
 	if (object->registered_node_id_array)
 		free(object->registered_node_id_array);
 	object->registered_node_id_array = NULL;
 	object->registration_count = 0;
 
-	pthread_mutex_unlock(&aperture->fmm_mutex);
+	pthread_rwlock_unlock(&aperture->fmm_lock);
+
+	return HSAKMT_STATUS_SUCCESS;
+}
+
+/* Map object to exactly the GPUs in nodes, unmapping it from others.
+ * Call with the aperture locked for writing.
+ */
+static HSAKMT_STATUS fmm_map_object_to_gpus(manageable_aperture_t *aperture,
+					    vm_object_t *object, void *address,
+					    uint64_t size, gpu_mask_t nodes,
+					    uint64_t *gpuvm_address)
+{
+	gpu_mask_t registered_nodes, unmap_nodes, map_nodes;
+	int ret;
+
+	/* APU memory is not supported by this function */
+	if (aperture == &cpuvm_aperture || !aperture->is_cpu_accessible)
+		return HSAKMT_STATUS_ERROR;
+
+	/* For userptr, we ignore the nodes array and map all registered nodes.
+	 * This is to simply the implementation of allowing the same memory
+	 * region to be registered multiple times.
+	 */
+	if (object->userptr) {
+		ret = _fmm_map_to_gpu_userptr(address, size, gpuvm_address,
+					      object);
+		return ret ? HSAKMT_STATUS_ERROR : HSAKMT_STATUS_SUCCESS;
+	}
+
+	/* Verify that all nodes to map are registered already */
+	registered_nodes = object->registered_gpus ?
+		object->registered_gpus : all_gpu_mask;
+	if (nodes & ~registered_nodes)
+		return HSAKMT_STATUS_ERROR;
+
+	/* Unmap buffer from all nodes that have this buffer mapped that are not included on nodes_to_map array */
+	unmap_nodes = object->mapped_gpus & ~nodes;
+	if (unmap_nodes) {
+		ret = _fmm_unmap_from_gpu(aperture, address, unmap_nodes,
+					  object);
+		if (ret != HSAKMT_STATUS_SUCCESS)
+			return ret;
+	}
+
+	/* Remove already mapped nodes from nodes_to_map
+	 * to generate the final map list
+	 */
+	map_nodes = nodes & ~object->mapped_gpus;
+	if (map_nodes &&
+	    _fmm_map_to_gpu(aperture, address, size, object, map_nodes))
+		return HSAKMT_STATUS_ERROR;
 
 	return HSAKMT_STATUS_SUCCESS;
 }
@@ -3382,175 +7449,636 @@ HSAKMT_STATUS fmm_map_to_gpu_nodes(void *address, uint64_t size,
 {
 	manageable_aperture_t *aperture;
 	vm_object_t *object;
-	uint32_t i;
-	uint32_t *registered_node_id_array, registered_node_id_array_size;
-	HSAKMT_STATUS ret = HSAKMT_STATUS_ERROR;
-	int retcode = 0;
+	gpu_mask_t nodes;
+	HSAKMT_STATUS ret;
 
 	if (!num_of_nodes || !nodes_to_map || !address)
 		return HSAKMT_STATUS_INVALID_PARAMETER;
 
-	object = vm_find_object(address, size, &aperture);
+	if (!gpu_ids_to_mask(nodes_to_map, num_of_nodes, &nodes))
+		return HSAKMT_STATUS_ERROR;
+
+	object = vm_find_object(address, size, true, &aperture);
 	if (!object)
 		return HSAKMT_STATUS_ERROR;
 	/* Successful vm_find_object returns with aperture locked */
 
-	/* APU memory is not supported by this function */
-	if (aperture == &cpuvm_aperture || !aperture->is_cpu_accessible) {
-		pthread_mutex_unlock(&aperture->fmm_mutex);
-		return HSAKMT_STATUS_ERROR;
+	ret = fmm_map_object_to_gpus(aperture, object, address, size, nodes,
+				     gpuvm_address);
+
+	pthread_rwlock_unlock(&aperture->fmm_lock);
+
+	return ret;
+}
+
+/* Map or unmap the buffers of a batch. Requests for BOs in the SVM
+ * apertures are sorted by aperture, so that each aperture is locked
+ * once and the ioctls for its BOs are issued back to back. Others,
+ * like userptrs and scratch memory, are handled one by one.
+ */
+typedef struct {
+	manageable_aperture_t *aperture;
+	HsaMemoryMapRequest *request;
+	gpu_mask_t nodes;
+} fmm_batch_entry_t;
+
+static int fmm_batch_entry_cmp(const void *a, const void *b)
+{
+	const fmm_batch_entry_t *x = a, *y = b;
+
+	if (x->aperture == y->aperture)
+		return 0;
+	return x->aperture < y->aperture ? -1 : 1;
+}
+
+static HSAKMT_STATUS node_ids_to_gpu_mask(const uint32_t *node_ids,
+					  uint32_t n_nodes, gpu_mask_t *mask)
+{
+	HSAKMT_STATUS ret;
+	int32_t gpu_mem_id;
+	uint32_t gpu_id, i;
+
+	if (n_nodes && !node_ids)
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	*mask = 0;
+	for (i = 0; i < n_nodes; i++) {
+		ret = validate_nodeid(node_ids[i], &gpu_id);
+		if (ret != HSAKMT_STATUS_SUCCESS)
+			return ret;
+		gpu_mem_id = gpu_mem_find_by_gpu_id(gpu_id);
+		if (gpu_mem_id < 0)
+			return HSAKMT_STATUS_INVALID_NODE_UNIT;
+		*mask |= GPU_MASK(gpu_mem_id);
 	}
 
-	/* For userptr, we ignore the nodes array and map all registered nodes.
-	 * This is to simply the implementation of allowing the same memory
-	 * region to be registered multiple times.
-	 */
-	if (object->userptr) {
-		retcode = _fmm_map_to_gpu_userptr(address, size,
-					gpuvm_address, object);
-		pthread_mutex_unlock(&aperture->fmm_mutex);
-		return retcode ? HSAKMT_STATUS_ERROR : HSAKMT_STATUS_SUCCESS;
+	return HSAKMT_STATUS_SUCCESS;
+}
+
+/* Map or unmap one request with its aperture locked for writing */
+static HSAKMT_STATUS fmm_batch_one(manageable_aperture_t *aperture,
+				   vm_object_t *object,
+				   HsaMemoryMapRequest *request,
+				   gpu_mask_t nodes, bool map)
+{
+	if (!object)
+		return HSAKMT_STATUS_ERROR;
+
+	if (map) {
+		/* No nodes: map to all registered nodes */
+		if (!nodes)
+			nodes = object->registered_gpus ?
+				object->registered_gpus : all_gpu_mask;
+		return fmm_map_object_to_gpus(aperture, object,
+					      request->MemoryAddress,
+					      request->SizeInBytes, nodes,
+					      NULL);
 	}
 
-	/* Verify that all nodes to map are registered already */
-	registered_node_id_array = all_gpu_id_array;
-	registered_node_id_array_size = all_gpu_id_array_size;
-	if (object->registered_device_id_array_size > 0 &&
-			object->registered_device_id_array) {
-		registered_node_id_array = object->registered_device_id_array;
-		registered_node_id_array_size = object->registered_device_id_array_size;
-	}
-	for (i = 0 ; i < num_of_nodes; i++) {
-		if (!id_in_array(nodes_to_map[i], registered_node_id_array,
-					registered_node_id_array_size)) {
-			pthread_mutex_unlock(&aperture->fmm_mutex);
-			return HSAKMT_STATUS_ERROR;
+	if (aperture == &cpuvm_aperture)
+		/* On APUs GPU unmapping of system memory is a no-op */
+		return HSAKMT_STATUS_SUCCESS;
+	/* No nodes: unmap from all mapped nodes */
+	if (_fmm_unmap_from_gpu(aperture, request->MemoryAddress, nodes,
+				object))
+		return HSAKMT_STATUS_ERROR;
+	return HSAKMT_STATUS_SUCCESS;
+}
+
+HSAKMT_STATUS fmm_map_batch(HsaMemoryMapRequest *requests,
+			    uint64_t n_requests, bool map)
+{
+	HSAKMT_STATUS ret = HSAKMT_STATUS_SUCCESS;
+	manageable_aperture_t *aperture, *locked = NULL;
+	fmm_batch_entry_t *entries;
+	HsaMemoryMapRequest *request, *prev = NULL;
+	HsaApertureInfo info;
+	vm_object_t *object;
+	uint64_t i, n = 0;
+	gpu_mask_t nodes = 0;
+	bool sorted = true;
+
+	entries = malloc(n_requests * sizeof(*entries));
+	if (!entries)
+		return HSAKMT_STATUS_NO_MEMORY;
+
+	for (i = 0; i < n_requests; i++) {
+		request = &requests[i];
+		/* Requests usually share their node array */
+		if (!prev || request->NodeArray != prev->NodeArray ||
+		    request->NumberOfNodes != prev->NumberOfNodes ||
+		    prev->Status != HSAKMT_STATUS_SUCCESS)
+			request->Status = node_ids_to_gpu_mask(
+					request->NodeArray,
+					request->NumberOfNodes, &nodes);
+		else
+			request->Status = HSAKMT_STATUS_SUCCESS;
+		prev = request;
+		if (request->Status != HSAKMT_STATUS_SUCCESS)
+			continue;
+		if (!request->MemoryAddress) {
+			request->Status = HSAKMT_STATUS_INVALID_PARAMETER;
+			continue;
 		}
-	}
 
-	/* Unmap buffer from all nodes that have this buffer mapped that are not included on nodes_to_map array */
-	if (object->mapped_device_id_array_size > 0) {
-		uint32_t temp_node_id_array[object->mapped_device_id_array_size];
-		uint32_t temp_node_id_array_size = 0;
-
-		for (i = 0 ; i < object->mapped_device_id_array_size / sizeof(uint32_t); i++) {
-			if (!id_in_array(object->mapped_device_id_array[i],
-					nodes_to_map,
-					num_of_nodes*sizeof(uint32_t)))
-				temp_node_id_array[temp_node_id_array_size++] =
-					object->mapped_device_id_array[i];
-		}
-		temp_node_id_array_size *= sizeof(uint32_t);
-
-		if (temp_node_id_array_size) {
-			ret = _fmm_unmap_from_gpu(aperture, address,
-					temp_node_id_array,
-					temp_node_id_array_size,
-					object);
-			if (ret != HSAKMT_STATUS_SUCCESS) {
-				pthread_mutex_unlock(&aperture->fmm_mutex);
-				return ret;
-			}
+		aperture = NULL;
+		if (is_dgpu)
+			aperture = fmm_find_aperture(request->MemoryAddress,
+						     &info);
+		if (aperture &&
+		    (info.type == HSA_APERTURE_DGPU ||
+		     info.type == HSA_APERTURE_DGPU_ALT) &&
+		    request->MemoryAddress >= aperture->base &&
+		    request->MemoryAddress <= aperture->limit) {
+			entries[n].aperture = aperture;
+			entries[n].request = request;
+			entries[n].nodes = nodes;
+			if (n && fmm_batch_entry_cmp(&entries[n - 1],
+						     &entries[n]) > 0)
+				sorted = false;
+			n++;
+			continue;
 		}
+
+		/* Everything else takes the same path as single requests */
+		if (!map && !nodes) {
+			request->Status = fmm_unmap_from_gpu(
+					request->MemoryAddress) ?
+				HSAKMT_STATUS_ERROR : HSAKMT_STATUS_SUCCESS;
+			continue;
+		}
+		object = vm_find_object(request->MemoryAddress,
+					request->SizeInBytes, true, &aperture);
+		request->Status = fmm_batch_one(aperture, object, request,
+						nodes, map);
+		if (object)
+			pthread_rwlock_unlock(&aperture->fmm_lock);
 	}
 
-	/* Remove already mapped nodes from nodes_to_map
-	 * to generate the final map list
-	 */
-	uint32_t map_node_id_array[num_of_nodes];
-	uint32_t map_node_id_array_size = 0;
+	if (!sorted)
+		qsort(entries, n, sizeof(*entries), fmm_batch_entry_cmp);
 
-	for (i = 0; i < num_of_nodes; i++) {
-		if (!id_in_array(nodes_to_map[i],
-				object->mapped_device_id_array,
-				object->mapped_device_id_array_size))
-			map_node_id_array[map_node_id_array_size++] =
-				nodes_to_map[i];
+	for (i = 0; i < n; i++) {
+		request = entries[i].request;
+		if (entries[i].aperture != locked) {
+			if (locked)
+				pthread_rwlock_unlock(&locked->fmm_lock);
+			locked = entries[i].aperture;
+			pthread_rwlock_wrlock(&locked->fmm_lock);
+		}
+		object = vm_find_object_in_aperture(locked,
+						    request->MemoryAddress,
+						    request->SizeInBytes, false);
+		request->Status = fmm_batch_one(locked, object, request,
+						entries[i].nodes, map);
 	}
+	if (locked)
+		pthread_rwlock_unlock(&locked->fmm_lock);
+	free(entries);
 
-	if (map_node_id_array_size)
-		retcode = _fmm_map_to_gpu(aperture, address, size, object,
-				map_node_id_array,
-				map_node_id_array_size * sizeof(uint32_t));
+	for (i = 0; i < n_requests && ret == HSAKMT_STATUS_SUCCESS; i++)
+		ret = requests[i].Status;
 
-	pthread_mutex_unlock(&aperture->fmm_mutex);
+	return ret;
+}
 
-	if (retcode != 0)
-		return HSAKMT_STATUS_ERROR;
+/* Fill in everything but the node ID arrays. Call with the object's
+ * aperture locked.
+ */
+static void mem_info_fill(vm_object_t *vm_obj, HsaPointerInfo *info)
+{
+	memset(info, 0, sizeof(HsaPointerInfo));
 
-	return 0;
+	if (vm_obj->is_imported_kfd_bo)
+		info->Type = HSA_POINTER_REGISTERED_SHARED;
+	else if (vm_obj->metadata)
+		info->Type = HSA_POINTER_REGISTERED_GRAPHICS;
+	else if (vm_obj->userptr)
+		info->Type = HSA_POINTER_REGISTERED_USER;
+	else
+		info->Type = HSA_POINTER_ALLOCATED;
+
+	info->Node = vm_obj->node_id;
+	info->GPUAddress = (HSAuint64)vm_obj->start;
+	info->SizeInBytes = vm_obj->size;
+	info->NRegisteredNodes = __builtin_popcountll(vm_obj->registered_gpus);
+	info->NMappedNodes = __builtin_popcountll(vm_obj->mapped_gpus);
+	info->UserData = vm_obj->user_data;
+
+	if (info->Type == HSA_POINTER_REGISTERED_USER) {
+		info->CPUAddress = vm_obj->userptr;
+		info->SizeInBytes = vm_obj->userptr_size;
+		info->GPUAddress += ((HSAuint64)info->CPUAddress & (PAGE_SIZE - 1));
+	} else if (info->Type == HSA_POINTER_ALLOCATED) {
+		info->MemFlags.Value = vm_obj->flags;
+		info->CPUAddress = vm_obj->start;
+	}
 }
 
 HSAKMT_STATUS fmm_get_mem_info(const void *address, HsaPointerInfo *info)
 {
 	HSAKMT_STATUS ret = HSAKMT_STATUS_SUCCESS;
-	uint32_t i;
 	manageable_aperture_t *aperture;
 	vm_object_t *vm_obj;
+	bool exclusive = false;
 
 	memset(info, 0, sizeof(HsaPointerInfo));
 
-	vm_obj = vm_find_object(address, UINT64_MAX, &aperture);
+retry:
+	vm_obj = vm_find_object(address, UINT64_MAX, exclusive, &aperture);
 	if (!vm_obj) {
 		info->Type = HSA_POINTER_UNKNOWN;
 		return HSAKMT_STATUS_ERROR;
 	}
 	/* Successful vm_find_object returns with the aperture locked */
 
-	if (vm_obj->is_imported_kfd_bo)
-		info->Type = HSA_POINTER_REGISTERED_SHARED;
-	else if (vm_obj->metadata)
-		info->Type = HSA_POINTER_REGISTERED_GRAPHICS;
-	else if (vm_obj->userptr)
-		info->Type = HSA_POINTER_REGISTERED_USER;
-	else
-		info->Type = HSA_POINTER_ALLOCATED;
+	/* The node ID arrays are created on the first query. Only that
+	 * needs the aperture locked for writing.
+	 */
+	if (!exclusive &&
+	    ((vm_obj->registered_gpus && !vm_obj->registered_node_id_array) ||
+	     (vm_obj->mapped_gpus && !vm_obj->mapped_node_id_array))) {
+		pthread_rwlock_unlock(&aperture->fmm_lock);
+		exclusive = true;
+		goto retry;
+	}
+
+	mem_info_fill(vm_obj, info);
 
-	info->Node = vm_obj->node_id;
-	info->GPUAddress = (HSAuint64)vm_obj->start;
-	info->SizeInBytes = vm_obj->size;
 	/* registered nodes */
-	info->NRegisteredNodes =
-		vm_obj->registered_device_id_array_size / sizeof(uint32_t);
 	if (info->NRegisteredNodes && !vm_obj->registered_node_id_array) {
 		vm_obj->registered_node_id_array = (uint32_t *)
-			(uint32_t *)malloc(vm_obj->registered_device_id_array_size);
+			malloc(info->NRegisteredNodes * sizeof(uint32_t));
 		/* vm_obj->registered_node_id_array allocated here will be
 		 * freed whenever the registration is changed (deregistration or
 		 * register to new nodes) or the memory being freed
 		 */
-		for (i = 0; i < info->NRegisteredNodes; i++)
-			gpuid_to_nodeid(vm_obj->registered_device_id_array[i],
-				&vm_obj->registered_node_id_array[i]);
+		if (vm_obj->registered_node_id_array)
+			gpu_mask_to_ids(vm_obj->registered_gpus,
+					vm_obj->registered_node_id_array, true);
+		else
+			info->NRegisteredNodes = 0;
 	}
 	info->RegisteredNodes = vm_obj->registered_node_id_array;
 	/* mapped nodes */
-	info->NMappedNodes =
-		vm_obj->mapped_device_id_array_size / sizeof(uint32_t);
 	if (info->NMappedNodes && !vm_obj->mapped_node_id_array) {
-		vm_obj->mapped_node_id_array =
-			(uint32_t *)malloc(vm_obj->mapped_device_id_array_size);
+		vm_obj->mapped_node_id_array = (uint32_t *)
+			malloc(info->NMappedNodes * sizeof(uint32_t));
 		/* vm_obj->mapped_node_id_array allocated here will be
 		 * freed whenever the mapping is changed (unmapped or map
 		 * to new nodes) or memory being freed
 		 */
-		for (i = 0; i < info->NMappedNodes; i++)
-			gpuid_to_nodeid(vm_obj->mapped_device_id_array[i],
-				&vm_obj->mapped_node_id_array[i]);
+		if (vm_obj->mapped_node_id_array)
+			gpu_mask_to_ids(vm_obj->mapped_gpus,
+					vm_obj->mapped_node_id_array, true);
+		else
+			info->NMappedNodes = 0;
 	}
 	info->MappedNodes = vm_obj->mapped_node_id_array;
-	info->UserData = vm_obj->user_data;
 
-	if (info->Type == HSA_POINTER_REGISTERED_USER) {
-		info->CPUAddress = vm_obj->userptr;
-		info->SizeInBytes = vm_obj->userptr_size;
-		info->GPUAddress += ((HSAuint64)info->CPUAddress & (PAGE_SIZE - 1));
-	} else if (info->Type == HSA_POINTER_ALLOCATED) {
-		info->MemFlags.Value = vm_obj->flags;
-		info->CPUAddress = vm_obj->start;
+	pthread_rwlock_unlock(&aperture->fmm_lock);
+	return ret;
+}
+
+/* Pointer of a batched query. Apertures cover disjoint address ranges,
+ * so sorting by address groups the queries of each aperture and orders
+ * them like its objects. Userptrs can be anywhere outside of them and
+ * are sorted after all others.
+ */
+#define MEM_INFO_USERPTR	(1ULL << 63)
+
+typedef struct {
+	uint64_t key;		/* address, MEM_INFO_USERPTR for userptrs */
+	uint64_t index;		/* in the caller's arrays */
+} mem_info_query_t;
+
+#define MEM_INFO_ADDRESS(query)	\
+	((const void *)(uintptr_t)((query)->key & ~MEM_INFO_USERPTR))
+
+typedef struct {
+	uint32_t *ids;
+	uint64_t size;
+	uint64_t used;
+	bool overflow;
+} mem_info_nodes_t;
+
+/* The aperture vm_find_object() would search for address */
+static manageable_aperture_t *mem_info_aperture(const void *address,
+						bool *userptr)
+{
+	uint32_t i;
+
+	*userptr = false;
+	for (i = 0; i < gpu_mem_count; i++)
+		if (gpu_mem[i].gpu_id != NON_VALID_GPU_ID &&
+		    address >= gpu_mem[i].gpuvm_aperture.base &&
+		    address <= gpu_mem[i].gpuvm_aperture.limit)
+			return &gpu_mem[i].gpuvm_aperture;
+
+	if (!svm.dgpu_aperture)
+		return NULL;
+
+	if (address >= svm.dgpu_aperture->base &&
+	    address <= svm.dgpu_aperture->limit)
+		return aperture_shard(svm.dgpu_aperture, address);
+	if (address >= svm.dgpu_alt_aperture->base &&
+	    address <= svm.dgpu_alt_aperture->limit)
+		return aperture_shard(svm.dgpu_alt_aperture, address);
+
+	*userptr = true;
+	return svm.dgpu_aperture;
+}
+
+/* LSD radix sort by key, 11 bits per pass. Passes where all keys have
+ * the same digit are skipped, which are most of them for addresses of
+ * one process.
+ */
+#define MEM_INFO_RADIX_BITS	11
+#define MEM_INFO_RADIX		(1 << MEM_INFO_RADIX_BITS)
+
+static mem_info_query_t *mem_info_sort(mem_info_query_t *queries,
+				       mem_info_query_t *tmp, uint64_t n)
+{
+	uint64_t diff = 0, i, pos, *count, c;
+	mem_info_query_t *swap;
+	unsigned int shift;
+
+	for (i = 1; i < n; i++)
+		diff |= queries[i].key ^ queries[0].key;
+
+	count = calloc(MEM_INFO_RADIX, sizeof(*count));
+	if (!count)
+		return NULL;
+
+	for (shift = 0; shift < 64; shift += MEM_INFO_RADIX_BITS) {
+		if (!((diff >> shift) & (MEM_INFO_RADIX - 1)))
+			continue;
+
+		memset(count, 0, MEM_INFO_RADIX * sizeof(*count));
+		for (i = 0; i < n; i++)
+			count[(queries[i].key >> shift) & (MEM_INFO_RADIX - 1)]++;
+		for (i = 0, pos = 0; i < MEM_INFO_RADIX; i++) {
+			c = count[i];
+			count[i] = pos;
+			pos += c;
+		}
+		for (i = 0; i < n; i++)
+			tmp[count[(queries[i].key >> shift) &
+				  (MEM_INFO_RADIX - 1)]++] = queries[i];
+
+		swap = queries;
+		queries = tmp;
+		tmp = swap;
+	}
+	free(count);
+
+	return queries;
+}
+
+/* Fill in the object's info and its node IDs from the caller's buffer */
+static void mem_info_batch_fill(vm_object_t *obj, HsaPointerInfo *info,
+				mem_info_nodes_t *nodes)
+{
+	uint32_t *ids;
+	uint32_t n;
+
+	mem_info_fill(obj, info);
+	n = info->NRegisteredNodes + info->NMappedNodes;
+	if (!n)
+		return;
+
+	if (nodes->size - nodes->used < n) {
+		/* The counts tell how much space was missing */
+		nodes->overflow = true;
+		return;
+	}
+	ids = nodes->ids + nodes->used;
+	nodes->used += n;
+
+	gpu_mask_to_ids(obj->registered_gpus, ids, true);
+	gpu_mask_to_ids(obj->mapped_gpus, ids + info->NRegisteredNodes, true);
+	if (info->NRegisteredNodes)
+		info->RegisteredNodes = ids;
+	if (info->NMappedNodes)
+		info->MappedNodes = ids + info->NRegisteredNodes;
+}
+
+static bool vm_object_contains(vm_object_t *obj, const void *address)
+{
+	return (uint64_t)address >= (uint64_t)obj->start &&
+		(uint64_t)address - (uint64_t)obj->start < obj->size;
+}
+
+/* Resolve sorted queries in one aperture like vm_find_object() does for
+ * ranges. Objects in reserved apertures don't overlap, so the objects
+ * of sorted queries are found by walking the tree in order from the
+ * last one. The tree is only searched when they are far apart.
+ */
+#define MEM_INFO_WALK	16
+
+static void mem_info_batch_aperture(manageable_aperture_t *app, bool userptr,
+				    mem_info_query_t *queries, uint64_t n,
+				    HsaPointerInfo *infos,
+				    mem_info_nodes_t *nodes)
+{
+	bool in_order = !userptr && app->ops == &reserved_aperture_ops;
+	vm_object_t *obj, *cur, *cursor = NULL;
+	unsigned int steps;
+	rbtree_node_t *rn;
+	const void *address;
+	bool walked;
+	uint64_t i;
+
+	pthread_rwlock_rdlock(&app->fmm_lock);
+	for (i = 0; i < n; i++) {
+		address = MEM_INFO_ADDRESS(&queries[i]);
+		obj = NULL;
+		walked = false;
+
+		/* cursor starts at or below all remaining addresses */
+		for (cur = cursor, steps = 0; in_order && cur &&
+		     steps < MEM_INFO_WALK; steps++) {
+			if (cur->start > address) {
+				walked = true;
+				break;
+			}
+			cursor = cur;
+			if (vm_object_contains(cur, address)) {
+				obj = cur;
+				walked = true;
+				break;
+			}
+			rn = rbtree_next(&app->tree, &cur->node);
+			cur = rn ? vm_object_entry(rn, 0) : NULL;
+			walked = !cur;
+		}
+
+		if (!walked) {
+			if (userptr || app->ops == &mmap_aperture_ops)
+				obj = vm_find_object_by_userptr_range(app,
+								      address);
+			if (!obj && !userptr)
+				obj = vm_find_object_by_address_range(app,
+								      address);
+		}
+		if (!obj)
+			continue;
+
+		cursor = obj;
+		mem_info_batch_fill(obj, &infos[queries[i].index], nodes);
+	}
+	pthread_rwlock_unlock(&app->fmm_lock);
+}
+
+/* Userptrs can be in any shard. Like vm_find_userptr_in_shards(), the
+ * match with the lowest key wins. The first pass finds the best shard
+ * of each query, the second one fills in the queries from their best
+ * shards. Shards are locked one at a time.
+ */
+static HSAKMT_STATUS mem_info_batch_shards(manageable_aperture_t *app,
+					   mem_info_query_t *queries,
+					   uint64_t n, HsaPointerInfo *infos,
+					   mem_info_nodes_t *nodes)
+{
+	struct {
+		rbtree_key_t key;
+		uint32_t shard;
+	} *best;
+	manageable_aperture_t *shard;
+	const void *address;
+	vm_object_t *obj;
+	uint64_t i;
+	uint32_t s;
+
+	best = malloc(n * sizeof(*best));
+	if (!best)
+		return HSAKMT_STATUS_NO_MEMORY;
+	for (i = 0; i < n; i++)
+		best[i].shard = UINT32_MAX;
+
+	for (s = 0; s < app->num_shards; s++) {
+		shard = &app->shards[s];
+		if (!__atomic_load_n(&shard->num_userptrs, __ATOMIC_RELAXED))
+			continue;
+
+		pthread_rwlock_rdlock(&shard->fmm_lock);
+		for (i = 0; i < n; i++) {
+			address = MEM_INFO_ADDRESS(&queries[i]);
+			obj = vm_find_object_by_userptr_range(shard, address);
+			if (!obj || (best[i].shard != UINT32_MAX &&
+				     rbtree_key_compare(LKP_ALL,
+							&obj->user_node.key,
+							&best[i].key) >= 0))
+				continue;
+
+			best[i].key = obj->user_node.key;
+			best[i].shard = s;
+		}
+		pthread_rwlock_unlock(&shard->fmm_lock);
+	}
+
+	/* Objects may have changed in between. What is found now is
+	 * still a valid answer.
+	 */
+	for (s = 0; s < app->num_shards; s++) {
+		shard = &app->shards[s];
+		for (i = 0; i < n && best[i].shard != s; i++)
+			;
+		if (i == n)
+			continue;
+
+		pthread_rwlock_rdlock(&shard->fmm_lock);
+		for (; i < n; i++) {
+			if (best[i].shard != s)
+				continue;
+			address = MEM_INFO_ADDRESS(&queries[i]);
+			obj = vm_find_object_by_userptr_range(shard, address);
+			if (obj)
+				mem_info_batch_fill(obj,
+						    &infos[queries[i].index],
+						    nodes);
+		}
+		pthread_rwlock_unlock(&shard->fmm_lock);
+	}
+	free(best);
+
+	return HSAKMT_STATUS_SUCCESS;
+}
+
+HSAKMT_STATUS fmm_get_mem_info_batch(const void **addresses, uint64_t n,
+				     HsaPointerInfo *infos,
+				     uint32_t *node_ids, uint64_t num_node_ids)
+{
+	mem_info_nodes_t nodes = {
+		.ids = node_ids,
+		.size = node_ids ? num_node_ids : 0
+	};
+	HSAKMT_STATUS ret = HSAKMT_STATUS_SUCCESS;
+	mem_info_query_t *buf, *queries;
+	manageable_aperture_t *app;
+	vm_object_t *obj;
+	bool userptr, u;
+	uint64_t i, j;
+
+	buf = malloc(2 * n * sizeof(*buf));
+	if (!buf)
+		return HSAKMT_STATUS_NO_MEMORY;
+
+	for (i = 0; i < n; i++) {
+		memset(&infos[i], 0, sizeof(infos[i]));
+		infos[i].Type = HSA_POINTER_UNKNOWN;
+		mem_info_aperture(addresses[i], &userptr);
+		buf[i].key = (uint64_t)addresses[i] |
+			(userptr ? MEM_INFO_USERPTR : 0);
+		buf[i].index = i;
+	}
+	queries = mem_info_sort(buf, buf + n, n);
+	if (!queries) {
+		free(buf);
+		return HSAKMT_STATUS_NO_MEMORY;
+	}
+
+	for (i = 0; i < n && ret == HSAKMT_STATUS_SUCCESS; i = j) {
+		app = mem_info_aperture(MEM_INFO_ADDRESS(&queries[i]),
+					&userptr);
+		if (userptr)
+			j = n;
+		else
+			for (j = i + 1; j < n &&
+			     mem_info_aperture(MEM_INFO_ADDRESS(&queries[j]),
+					       &u) == app && !u; j++)
+				;
+		if (!app)
+			continue;
+
+		if (userptr && app->num_shards)
+			ret = mem_info_batch_shards(app, &queries[i], j - i,
+						    infos, &nodes);
+		else
+			mem_info_batch_aperture(app, userptr, &queries[i],
+						j - i, infos, &nodes);
+	}
+
+	/* On APUs, what isn't in a GPU aperture may be in the CPUVM one */
+	if (!is_dgpu) {
+		pthread_rwlock_rdlock(&cpuvm_aperture.fmm_lock);
+		for (i = 0; i < n; i++) {
+			if (infos[queries[i].index].Type != HSA_POINTER_UNKNOWN)
+				continue;
+			obj = vm_find_object_by_address_range(&cpuvm_aperture,
+						MEM_INFO_ADDRESS(&queries[i]));
+			if (obj)
+				mem_info_batch_fill(obj,
+						    &infos[queries[i].index],
+						    &nodes);
+		}
+		pthread_rwlock_unlock(&cpuvm_aperture.fmm_lock);
 	}
 
-	pthread_mutex_unlock(&aperture->fmm_mutex);
+	free(buf);
+
+	if (ret == HSAKMT_STATUS_SUCCESS && nodes.overflow)
+		ret = HSAKMT_STATUS_BUFFER_TOO_SMALL;
 	return ret;
 }
 
@@ -3559,28 +8087,52 @@ HSAKMT_STATUS fmm_set_mem_user_data(const void *mem, void *usr_data)
 	manageable_aperture_t *aperture;
 	vm_object_t *vm_obj;
 
-	vm_obj = vm_find_object(mem, 0, &aperture);
+	vm_obj = vm_find_object(mem, 0, true, &aperture);
 	if (!vm_obj)
 		return HSAKMT_STATUS_ERROR;
 
 	vm_obj->user_data = usr_data;
 
-	pthread_mutex_unlock(&aperture->fmm_mutex);
+	pthread_rwlock_unlock(&aperture->fmm_lock);
 	return HSAKMT_STATUS_SUCCESS;
 }
 
+/* Empty a tree, keeping its augmentation callback */
+static void vm_reset_tree(rbtree_t *tree)
+{
+	rbtree_augment_pt augment = tree->augment;
+
+	rbtree_init_augmented(tree, augment);
+}
+
 static void fmm_clear_aperture(manageable_aperture_t *app)
 {
 	rbtree_node_t *n;
+	uint32_t i;
 
-	pthread_mutex_init(&app->fmm_mutex, NULL);
-
-	while ((n = rbtree_node_any(&app->tree, MID)))
-		vm_remove_object(app, vm_object_entry(n, 0));
+	for (i = 0; i < app->num_shards; i++)
+		fmm_clear_aperture(&app->shards[i]);
 
-	while (app->vm_ranges)
-		vm_remove_area(app, app->vm_ranges);
+	fmm_init_lock(&app->fmm_lock);
 
+	/* All objects and areas live in the aperture's slabs. Only free
+	 * what the objects point to, then drop the slabs as a whole.
+	 */
+	if (app->tree.root)
+		for (n = rbtree_node_any(&app->tree, LEFT); n;
+		     n = rbtree_next(&app->tree, n))
+			vm_free_object_arrays(vm_object_entry(n, 0));
+
+	vm_reset_tree(&app->tree);
+	vm_reset_tree(&app->user_tree);
+	vm_reset_tree(&app->area_tree);
+	app->vm_ranges = NULL;
+	app->num_userptrs = 0;
+	app->num_areas = app->num_objects = app->num_holes = 0;
+	app->area_bytes = app->object_bytes = app->userptr_bytes = 0;
+
+	vm_slab_cache_destroy(&app->object_cache);
+	vm_slab_cache_destroy(&app->area_cache);
 }
 
 /* This is a special funcion that should be called only from the child process
@@ -3599,11 +8151,30 @@ void fmm_clear_all_mem(void)
 			drm_render_fds[i] = 0;
 		}
 
+	fmm_epoch++;
+	deferred_free_clear();
+	trace_clear();
+	alloc_track_clear();
+	bo_cache_clear();
+	suballoc_clear();
+	ucache_clear();
+	icache_clear();
 	fmm_clear_aperture(&cpuvm_aperture);
 	fmm_clear_aperture(&svm.apertures[SVM_DEFAULT]);
 	fmm_clear_aperture(&svm.apertures[SVM_COHERENT]);
 
-	if (dgpu_shared_aperture_limit) {
+	if (dgpu_shared_aperture_limit && svm.grow_size) {
+		/* Only the grown parts are ours, anything else in the
+		 * range must not be replaced
+		 */
+		if (!svm_remap_growth(&svm.apertures[SVM_COHERENT], false) ||
+		    !svm_remap_growth(&svm.apertures[SVM_DEFAULT], false)) {
+			svm_remap_growth(&svm.apertures[SVM_COHERENT], true);
+			svm_remap_growth(&svm.apertures[SVM_DEFAULT], true);
+			dgpu_shared_aperture_base = NULL;
+			dgpu_shared_aperture_limit = NULL;
+		}
+	} else if (dgpu_shared_aperture_limit) {
 		/* Use the same dgpu range as the parent. If failed, then set
 		 * is_dgpu_mem_init to false. Later on dgpu_mem_init will try
 		 * to get a new range
@@ -3622,11 +8193,7 @@ void fmm_clear_all_mem(void)
 		}
 	}
 
-	if (all_gpu_id_array)
-		free(all_gpu_id_array);
-
-	all_gpu_id_array_size = 0;
-	all_gpu_id_array = NULL;
+	all_gpu_mask = 0;
 
 	/* Nothing is initialized. */
 	if (!gpu_mem)
@@ -3641,3 +8208,46 @@ void fmm_clear_all_mem(void)
 	free(gpu_mem);
 	gpu_mem = NULL;
 }
+
+HSAKMT_STATUS fmm_get_cache_stats(HSA_MEMORY_CACHE_TYPE type,
+				  HsaMemoryCacheStats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+
+	switch (type) {
+	case HSA_MEMORY_CACHE_POINTER_LOOKUP:
+		/* Counts of other threads may still be pending */
+		vm_lookup_stats_flush();
+		stats->Hits = __atomic_load_n(&vm_lookup_hits, __ATOMIC_RELAXED);
+		stats->Misses = __atomic_load_n(&vm_lookup_misses, __ATOMIC_RELAXED);
+		break;
+	case HSA_MEMORY_CACHE_BUFFER_OBJECT:
+		pthread_mutex_lock(&bo_cache.lock);
+		stats->Hits = bo_cache.hits;
+		stats->Misses = bo_cache.misses;
+		stats->BytesCached = bo_cache.bytes;
+		stats->Evictions = bo_cache.evictions;
+		pthread_mutex_unlock(&bo_cache.lock);
+		break;
+	case HSA_MEMORY_CACHE_USERPTR:
+		pthread_mutex_lock(&ucache.lock);
+		stats->Hits = ucache.hits;
+		stats->Misses = ucache.misses;
+		stats->BytesCached = ucache.idle_bytes;
+		stats->Evictions = ucache.evictions;
+		pthread_mutex_unlock(&ucache.lock);
+		break;
+	case HSA_MEMORY_CACHE_IPC_IMPORT:
+		pthread_mutex_lock(&icache.lock);
+		stats->Hits = icache.hits;
+		stats->Misses = icache.misses;
+		stats->BytesCached = icache.idle_bytes;
+		stats->Evictions = icache.evictions;
+		pthread_mutex_unlock(&icache.lock);
+		break;
+	default:
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+	}
+
+	return HSAKMT_STATUS_SUCCESS;
+}
@@ -54,13 +54,29 @@ void *fmm_allocate_device(uint32_t gpu_id, void *address, uint64_t MemorySizeInB
 void *fmm_allocate_doorbell(uint32_t gpu_id, uint64_t MemorySizeInBytes, uint64_t doorbell_offset);
 void *fmm_allocate_host(uint32_t node_id, void *address, uint64_t MemorySizeInBytes,
 			HsaMemFlags flags);
+void *fmm_allocate_host_interleaved(uint32_t num_nodes, const uint32_t *node_ids,
+				    void *address, uint64_t MemorySizeInBytes,
+				    HsaMemFlags flags);
 void fmm_print(uint32_t node);
 HSAKMT_STATUS fmm_release(void *address);
+void fmm_flush_deferred_frees(void);
 int fmm_map_to_gpu(void *address, uint64_t size, uint64_t *gpuvm_address);
+int fmm_register_and_map(void *address, uint64_t size,
+			 const uint32_t *gpu_id_array, uint32_t n_gpus,
+			 uint64_t *gpuvm_address);
 int fmm_unmap_from_gpu(void *address);
 bool fmm_get_handle(void *address, uint64_t *handle);
 HSAKMT_STATUS fmm_get_mem_info(const void *address, HsaPointerInfo *info);
+HSAKMT_STATUS fmm_get_mem_info_batch(const void **addresses, uint64_t n,
+				     HsaPointerInfo *infos,
+				     uint32_t *node_ids, uint64_t num_node_ids);
 HSAKMT_STATUS fmm_set_mem_user_data(const void *mem, void *usr_data);
+HSAKMT_STATUS fmm_get_virtual_memory_stats(HsaVirtualMemoryStats *stats);
+HSAKMT_STATUS fmm_get_aperture_stats(uint32_t gpu_id,
+				     HSA_MEMORY_APERTURE type,
+				     HsaApertureStats *stats);
+HSAKMT_STATUS fmm_get_cache_stats(HSA_MEMORY_CACHE_TYPE type,
+				  HsaMemoryCacheStats *stats);
 
 /* Topology interface*/
 HSAKMT_STATUS fmm_node_added(HSAuint32 gpu_id);
@@ -85,8 +101,76 @@ HSAKMT_STATUS fmm_register_shared_memory(const HsaSharedMemoryHandle *SharedMemo
 					 void **MemoryAddress,
 					 uint32_t *gpu_id_array,
 					 uint32_t gpu_id_array_size);
+HSAKMT_STATUS fmm_map_batch(HsaMemoryMapRequest *requests,
+			    uint64_t n_requests, bool map);
 HSAKMT_STATUS fmm_map_to_gpu_nodes(void *address, uint64_t size,
 		uint32_t *nodes_to_map, uint64_t num_of_nodes, uint64_t *gpuvm_address);
 
+/* Trace of memory management calls, see HSA_TRACE_FILE. A trace file
+ * is an fmm_trace_header_t followed by fmm_trace_record_t entries in
+ * the order the calls completed.
+ */
+#define FMM_TRACE_MAGIC		"FMMTRACE"
+#define FMM_TRACE_VERSION	1
+
+typedef enum {
+	FMM_TRACE_ALLOC = 1,		/* hsaKmtAllocMemory */
+	FMM_TRACE_ALLOC_INTERLEAVED,	/* gpus has a mask of HSA node IDs */
+	FMM_TRACE_FREE,
+	FMM_TRACE_REGISTER,		/* userptr, flags.CoarseGrain */
+	FMM_TRACE_DEREGISTER,
+	FMM_TRACE_MAP,
+	FMM_TRACE_UNMAP,
+	FMM_TRACE_REGISTER_AND_MAP,	/* second half of AllocAndMap */
+	FMM_TRACE_MAP_BATCH,		/* one record per request, */
+	FMM_TRACE_UNMAP_BATCH,		/* flags is the batch size */
+	FMM_TRACE_NUM_OPS
+} fmm_trace_op_t;
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t num_gpus;
+	uint32_t page_size;
+	uint64_t start_time;	/* CLOCK_REALTIME in ns */
+	uint64_t dropped;	/* records lost because the ring was full */
+} fmm_trace_header_t;
+
+typedef struct {
+	uint64_t time_ns;	/* start of the call since start_time */
+	uint64_t address;
+	uint64_t size;
+	uint64_t gpus;		/* GPUs by gpu_mem index, 0 for none or all.
+				 * HSA node IDs for ALLOC_INTERLEAVED.
+				 */
+	uint32_t flags;		/* HsaMemFlags */
+	uint32_t duration_ns;
+	uint32_t tid;
+	uint16_t node;
+	uint8_t op;
+	uint8_t status;		/* HSAKMT_STATUS */
+} fmm_trace_record_t;
+
+/* fmm_trace_begin returns 0 if tracing is disabled. All other trace
+ * functions do nothing in that case.
+ */
+uint64_t fmm_trace_begin(void);
+uint64_t fmm_trace_gpus(uint64_t begin, const uint32_t *ids, uint64_t n,
+			bool node_ids);
+void fmm_trace_end(uint64_t begin, fmm_trace_op_t op, const void *address,
+		   uint64_t size, uint32_t node, uint64_t gpus, uint32_t flags,
+		   HSAKMT_STATUS status);
+void fmm_trace_batch(uint64_t begin, const HsaMemoryMapRequest *requests,
+		     uint64_t n_requests, bool map);
+
+/* Attribute the allocation or registration at address to the caller's
+ * call stack, see HSA_ALLOC_TRACK
+ */
+void fmm_track_allocation(const void *address);
+HSAKMT_STATUS fmm_get_allocation_sites(HsaAllocationSite *sites,
+				       uint32_t *num_sites);
+HSAKMT_STATUS fmm_dump_allocation_sites(uint32_t max_sites);
+
 int open_drm_render_device(int minor);
 #endif /* FMM_H_ */
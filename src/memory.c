@@ -106,6 +106,16 @@ HSAuint32 PageSizeFromFlags(unsigned int pageSizeFlags)
 	}
 }
 
+/* Record an allocation in the trace, see HSA_TRACE_FILE */
+static void trace_alloc(uint64_t trace, uint32_t node, uint32_t gpu_id,
+			void *mem, uint64_t size, HsaMemFlags flags)
+{
+	fmm_trace_end(trace, FMM_TRACE_ALLOC, mem, size, node,
+		      fmm_trace_gpus(trace, &gpu_id, gpu_id ? 1 : 0, false),
+		      flags.Value, mem ? HSAKMT_STATUS_SUCCESS :
+					 HSAKMT_STATUS_NO_MEMORY);
+}
+
 HSAKMT_STATUS HSAKMTAPI hsaKmtAllocMemory(HSAuint32 PreferredNode,
 					  HSAuint64 SizeInBytes,
 					  HsaMemFlags MemFlags,
@@ -114,6 +124,7 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtAllocMemory(HSAuint32 PreferredNode,
 	HSAKMT_STATUS result;
 	uint32_t gpu_id;
 	HSAuint64 page_size;
+	uint64_t trace;
 
 	CHECK_KFD_OPEN();
 
@@ -136,8 +147,12 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtAllocMemory(HSAuint32 PreferredNode,
 	} else
 		*MemoryAddress = NULL;
 
+	trace = fmm_trace_begin();
+
 	if (MemFlags.ui32.Scratch) {
 		*MemoryAddress = fmm_allocate_scratch(gpu_id, *MemoryAddress, SizeInBytes);
+		trace_alloc(trace, PreferredNode, gpu_id, *MemoryAddress,
+			    SizeInBytes, MemFlags);
 
 		if (!(*MemoryAddress)) {
 			pr_err("[%s] failed to allocate %lu bytes from scratch\n",
@@ -145,6 +160,7 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtAllocMemory(HSAuint32 PreferredNode,
 			return HSAKMT_STATUS_NO_MEMORY;
 		}
 
+		fmm_track_allocation(*MemoryAddress);
 		return HSAKMT_STATUS_SUCCESS;
 	}
 
@@ -160,6 +176,8 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtAllocMemory(HSAuint32 PreferredNode,
 
 		*MemoryAddress = fmm_allocate_host(PreferredNode,  *MemoryAddress,
 						   SizeInBytes,	MemFlags);
+		trace_alloc(trace, PreferredNode, gpu_id, *MemoryAddress,
+			    SizeInBytes, MemFlags);
 
 		if (!(*MemoryAddress)) {
 			pr_err("[%s] failed to allocate %lu bytes from host\n",
@@ -167,11 +185,14 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtAllocMemory(HSAuint32 PreferredNode,
 			return HSAKMT_STATUS_ERROR;
 		}
 
+		fmm_track_allocation(*MemoryAddress);
 		return HSAKMT_STATUS_SUCCESS;
 	}
 
 	/* GPU allocated VRAM */
 	*MemoryAddress = fmm_allocate_device(gpu_id, *MemoryAddress, SizeInBytes, MemFlags);
+	trace_alloc(trace, PreferredNode, gpu_id, *MemoryAddress, SizeInBytes,
+		    MemFlags);
 
 	if (!(*MemoryAddress)) {
 		pr_err("[%s] failed to allocate %lu bytes from device\n",
@@ -179,13 +200,76 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtAllocMemory(HSAuint32 PreferredNode,
 		return HSAKMT_STATUS_NO_MEMORY;
 	}
 
+	fmm_track_allocation(*MemoryAddress);
 	return HSAKMT_STATUS_SUCCESS;
 
 }
 
+HSAKMT_STATUS HSAKMTAPI hsaKmtAllocMemoryInterleaved(HSAuint32 NumberOfNodes,
+						     HSAuint32 *NodeArray,
+						     HSAuint64 SizeInBytes,
+						     HsaMemFlags MemFlags,
+						     void **MemoryAddress)
+{
+	HSAuint64 page_size, nodes = 0;
+	uint32_t gpu_id, i;
+	uint64_t trace;
+
+	CHECK_KFD_OPEN();
+
+	pr_debug("[%s] number of nodes %d\n", __func__, NumberOfNodes);
+
+	if (!NumberOfNodes || !NodeArray || MemFlags.ui32.NonPaged ||
+	    MemFlags.ui32.Scratch || MemFlags.ui32.GDSMemory)
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	for (i = 0; i < NumberOfNodes; i++) {
+		if (validate_nodeid(NodeArray[i], &gpu_id) !=
+		    HSAKMT_STATUS_SUCCESS) {
+			pr_err("[%s] invalid node ID: %d\n", __func__,
+			       NodeArray[i]);
+			return HSAKMT_STATUS_INVALID_NODE_UNIT;
+		}
+	}
+
+	page_size = PageSizeFromFlags(MemFlags.ui32.PageSize);
+
+	if (!MemoryAddress || !SizeInBytes || (SizeInBytes & (page_size-1)))
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	if (MemFlags.ui32.FixedAddress) {
+		if (*MemoryAddress == NULL)
+			return HSAKMT_STATUS_INVALID_PARAMETER;
+	} else
+		*MemoryAddress = NULL;
+
+	trace = fmm_trace_begin();
+	*MemoryAddress = fmm_allocate_host_interleaved(NumberOfNodes, NodeArray,
+						       *MemoryAddress,
+						       SizeInBytes, MemFlags);
+	for (i = 0; trace && i < NumberOfNodes; i++)
+		if (NodeArray[i] < 64)
+			nodes |= 1ULL << NodeArray[i];
+	fmm_trace_end(trace, FMM_TRACE_ALLOC_INTERLEAVED, *MemoryAddress,
+		      SizeInBytes, NodeArray[0], nodes, MemFlags.Value,
+		      *MemoryAddress ? HSAKMT_STATUS_SUCCESS :
+				       HSAKMT_STATUS_NO_MEMORY);
+	if (!(*MemoryAddress)) {
+		pr_err("[%s] failed to allocate %lu bytes from host\n",
+			__func__, SizeInBytes);
+		return HSAKMT_STATUS_ERROR;
+	}
+
+	fmm_track_allocation(*MemoryAddress);
+	return HSAKMT_STATUS_SUCCESS;
+}
+
 HSAKMT_STATUS HSAKMTAPI hsaKmtFreeMemory(void *MemoryAddress,
 					 HSAuint64 SizeInBytes)
 {
+	HSAKMT_STATUS ret;
+	uint64_t trace;
+
 	CHECK_KFD_OPEN();
 
 	pr_debug("[%s] address %p\n", __func__, MemoryAddress);
@@ -195,12 +279,43 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtFreeMemory(void *MemoryAddress,
 		return HSAKMT_STATUS_ERROR;
 	}
 
-	return fmm_release(MemoryAddress);
+	trace = fmm_trace_begin();
+	ret = fmm_release(MemoryAddress);
+	fmm_trace_end(trace, FMM_TRACE_FREE, MemoryAddress, SizeInBytes, 0, 0,
+		      0, ret);
+
+	return ret;
+}
+
+HSAKMT_STATUS HSAKMTAPI hsaKmtFlushDeferredFrees(void)
+{
+	CHECK_KFD_OPEN();
+
+	pr_debug("[%s]\n", __func__);
+
+	fmm_flush_deferred_frees();
+
+	return HSAKMT_STATUS_SUCCESS;
+}
+
+static void trace_register(uint64_t trace, void *address, uint64_t size,
+			   uint64_t gpus, bool coarse_grain,
+			   HSAKMT_STATUS status)
+{
+	HsaMemFlags flags;
+
+	flags.Value = 0;
+	flags.ui32.CoarseGrain = coarse_grain;
+	fmm_trace_end(trace, FMM_TRACE_REGISTER, address, size, 0, gpus,
+		      flags.Value, status);
 }
 
 HSAKMT_STATUS HSAKMTAPI hsaKmtRegisterMemory(void *MemoryAddress,
 					     HSAuint64 MemorySizeInBytes)
 {
+	HSAKMT_STATUS ret;
+	uint64_t trace;
+
 	CHECK_KFD_OPEN();
 
 	pr_debug("[%s] address %p\n", __func__, MemoryAddress);
@@ -209,8 +324,14 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtRegisterMemory(void *MemoryAddress,
 		/* TODO: support mixed APU and dGPU configurations */
 		return HSAKMT_STATUS_SUCCESS;
 
-	return fmm_register_memory(MemoryAddress, MemorySizeInBytes,
-				   NULL, 0, true);
+	trace = fmm_trace_begin();
+	ret = fmm_register_memory(MemoryAddress, MemorySizeInBytes,
+				  NULL, 0, true);
+	trace_register(trace, MemoryAddress, MemorySizeInBytes, 0, true, ret);
+	if (ret == HSAKMT_STATUS_SUCCESS)
+		fmm_track_allocation(MemoryAddress);
+
+	return ret;
 }
 
 HSAKMT_STATUS HSAKMTAPI hsaKmtRegisterMemoryToNodes(void *MemoryAddress,
@@ -221,6 +342,7 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtRegisterMemoryToNodes(void *MemoryAddress,
 	CHECK_KFD_OPEN();
 	uint32_t *gpu_id_array;
 	HSAKMT_STATUS ret = HSAKMT_STATUS_SUCCESS;
+	uint64_t trace, gpus;
 
 	pr_debug("[%s] address %p number of nodes %lu\n",
 		__func__, MemoryAddress, NumberOfNodes);
@@ -233,12 +355,20 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtRegisterMemoryToNodes(void *MemoryAddress,
 			NumberOfNodes, NodeArray);
 
 	if (ret == HSAKMT_STATUS_SUCCESS) {
+		/* gpu_id_array belongs to the registration once it succeeded */
+		trace = fmm_trace_begin();
+		gpus = fmm_trace_gpus(trace, gpu_id_array, NumberOfNodes,
+				      false);
 		ret = fmm_register_memory(MemoryAddress, MemorySizeInBytes,
 					  gpu_id_array,
 					  NumberOfNodes*sizeof(uint32_t),
 					  true);
+		trace_register(trace, MemoryAddress, MemorySizeInBytes, gpus,
+			       true, ret);
 		if (ret != HSAKMT_STATUS_SUCCESS)
 			free(gpu_id_array);
+		else
+			fmm_track_allocation(MemoryAddress);
 	}
 
 	return ret;
@@ -250,6 +380,7 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtRegisterMemoryWithFlags(void *MemoryAddress,
 {
 	CHECK_KFD_OPEN();
 	HSAKMT_STATUS ret = HSAKMT_STATUS_SUCCESS;
+	uint64_t trace;
 
 	pr_debug("[%s] address %p\n",
 		__func__, MemoryAddress);
@@ -262,8 +393,13 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtRegisterMemoryWithFlags(void *MemoryAddress,
 		/* TODO: support mixed APU and dGPU configurations */
 		return HSAKMT_STATUS_NOT_SUPPORTED;
 
+	trace = fmm_trace_begin();
 	ret = fmm_register_memory(MemoryAddress, MemorySizeInBytes,
 		NULL, 0, MemFlags.ui32.CoarseGrain);
+	trace_register(trace, MemoryAddress, MemorySizeInBytes, 0,
+		       MemFlags.ui32.CoarseGrain, ret);
+	if (ret == HSAKMT_STATUS_SUCCESS)
+		fmm_track_allocation(MemoryAddress);
 
 	return ret;
 }
@@ -445,17 +581,28 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtProcessVMWrite(HSAuint32 Pid,
 
 HSAKMT_STATUS HSAKMTAPI hsaKmtDeregisterMemory(void *MemoryAddress)
 {
+	HSAKMT_STATUS ret;
+	uint64_t trace;
+
 	CHECK_KFD_OPEN();
 
 	pr_debug("[%s] address %p\n", __func__, MemoryAddress);
 
-	return fmm_deregister_memory(MemoryAddress);
+	trace = fmm_trace_begin();
+	ret = fmm_deregister_memory(MemoryAddress);
+	fmm_trace_end(trace, FMM_TRACE_DEREGISTER, MemoryAddress, 0, 0, 0, 0,
+		      ret);
+
+	return ret;
 }
 
 HSAKMT_STATUS HSAKMTAPI hsaKmtMapMemoryToGPU(void *MemoryAddress,
 					     HSAuint64 MemorySizeInBytes,
 					     HSAuint64 *AlternateVAGPU)
 {
+	HSAKMT_STATUS ret;
+	uint64_t trace;
+
 	CHECK_KFD_OPEN();
 
 	pr_debug("[%s] address %p\n", __func__, MemoryAddress);
@@ -468,10 +615,15 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtMapMemoryToGPU(void *MemoryAddress,
 	if (AlternateVAGPU)
 		*AlternateVAGPU = 0;
 
+	trace = fmm_trace_begin();
 	if (!fmm_map_to_gpu(MemoryAddress, MemorySizeInBytes, AlternateVAGPU))
-		return HSAKMT_STATUS_SUCCESS;
+		ret = HSAKMT_STATUS_SUCCESS;
 	else
-		return HSAKMT_STATUS_ERROR;
+		ret = HSAKMT_STATUS_ERROR;
+	fmm_trace_end(trace, FMM_TRACE_MAP, MemoryAddress, MemorySizeInBytes,
+		      0, 0, 0, ret);
+
+	return ret;
 }
 
 HSAKMT_STATUS HSAKMTAPI hsaKmtMapMemoryToGPUNodes(void *MemoryAddress,
@@ -483,6 +635,7 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtMapMemoryToGPUNodes(void *MemoryAddress,
 {
 	uint32_t *gpu_id_array;
 	HSAKMT_STATUS ret;
+	uint64_t trace;
 
 	pr_debug("[%s] address %p number of nodes %lu\n",
 		__func__, MemoryAddress, NumberOfNodes);
@@ -502,8 +655,12 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtMapMemoryToGPUNodes(void *MemoryAddress,
 	if (ret != HSAKMT_STATUS_SUCCESS)
 		return ret;
 
+	trace = fmm_trace_begin();
 	ret = fmm_map_to_gpu_nodes(MemoryAddress, MemorySizeInBytes,
 		gpu_id_array, NumberOfNodes, AlternateVAGPU);
+	fmm_trace_end(trace, FMM_TRACE_MAP, MemoryAddress, MemorySizeInBytes,
+		      0, fmm_trace_gpus(trace, gpu_id_array, NumberOfNodes,
+					false), 0, ret);
 
 	if (gpu_id_array)
 		free(gpu_id_array);
@@ -513,6 +670,9 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtMapMemoryToGPUNodes(void *MemoryAddress,
 
 HSAKMT_STATUS HSAKMTAPI hsaKmtUnmapMemoryToGPU(void *MemoryAddress)
 {
+	HSAKMT_STATUS ret;
+	uint64_t trace;
+
 	CHECK_KFD_OPEN();
 
 	pr_debug("[%s] address %p\n", __func__, MemoryAddress);
@@ -523,10 +683,54 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtUnmapMemoryToGPU(void *MemoryAddress)
 		return HSAKMT_STATUS_SUCCESS;
 	}
 
+	trace = fmm_trace_begin();
 	if (!fmm_unmap_from_gpu(MemoryAddress))
-		return HSAKMT_STATUS_SUCCESS;
+		ret = HSAKMT_STATUS_SUCCESS;
 	else
-		return HSAKMT_STATUS_ERROR;
+		ret = HSAKMT_STATUS_ERROR;
+	fmm_trace_end(trace, FMM_TRACE_UNMAP, MemoryAddress, 0, 0, 0, 0, ret);
+
+	return ret;
+}
+
+HSAKMT_STATUS HSAKMTAPI hsaKmtMapMemoryToGPUBatch(HsaMemoryMapRequest *Requests,
+						  HSAuint64 NumberOfRequests)
+{
+	HSAKMT_STATUS ret;
+	uint64_t trace;
+
+	CHECK_KFD_OPEN();
+
+	pr_debug("[%s] number of requests %lu\n", __func__, NumberOfRequests);
+
+	if (!Requests || !NumberOfRequests)
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	trace = fmm_trace_begin();
+	ret = fmm_map_batch(Requests, NumberOfRequests, true);
+	fmm_trace_batch(trace, Requests, NumberOfRequests, true);
+
+	return ret;
+}
+
+HSAKMT_STATUS HSAKMTAPI hsaKmtUnmapMemoryToGPUBatch(HsaMemoryMapRequest *Requests,
+						    HSAuint64 NumberOfRequests)
+{
+	HSAKMT_STATUS ret;
+	uint64_t trace;
+
+	CHECK_KFD_OPEN();
+
+	pr_debug("[%s] number of requests %lu\n", __func__, NumberOfRequests);
+
+	if (!Requests || !NumberOfRequests)
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	trace = fmm_trace_begin();
+	ret = fmm_map_batch(Requests, NumberOfRequests, false);
+	fmm_trace_batch(trace, Requests, NumberOfRequests, false);
+
+	return ret;
 }
 
 HSAKMT_STATUS HSAKMTAPI hsaKmtMapGraphicHandle(HSAuint32 NodeId,
@@ -599,6 +803,22 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtQueryPointerInfo(const void *Pointer,
 	return fmm_get_mem_info(Pointer, PointerInfo);
 }
 
+HSAKMT_STATUS HSAKMTAPI hsaKmtQueryPointerInfoBatch(HSAuint64 NumPointers,
+						    const void **Pointers,
+						    HsaPointerInfo *PointerInfo,
+						    HSAuint32 *NodeIds,
+						    HSAuint64 NumNodeIds)
+{
+	pr_debug("[%s] %lu pointers\n", __func__, NumPointers);
+
+	if (!NumPointers)
+		return HSAKMT_STATUS_SUCCESS;
+	if (!Pointers || !PointerInfo)
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+	return fmm_get_mem_info_batch(Pointers, NumPointers, PointerInfo,
+				      NodeIds, NumNodeIds);
+}
+
 HSAKMT_STATUS HSAKMTAPI hsaKmtSetMemoryUserData(const void *Pointer,
 						void *UserData)
 {
@@ -606,3 +826,250 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtSetMemoryUserData(const void *Pointer,
 
 	return fmm_set_mem_user_data(Pointer, UserData);
 }
+
+HSAKMT_STATUS HSAKMTAPI hsaKmtGetMemoryCacheStats(HSA_MEMORY_CACHE_TYPE CacheType,
+						  HsaMemoryCacheStats *Stats)
+{
+	pr_debug("[%s] cache type %d\n", __func__, CacheType);
+
+	if (!Stats)
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	return fmm_get_cache_stats(CacheType, Stats);
+}
+
+HSAKMT_STATUS HSAKMTAPI hsaKmtGetVirtualMemoryStats(HsaVirtualMemoryStats *Stats)
+{
+	CHECK_KFD_OPEN();
+
+	pr_debug("[%s]\n", __func__);
+
+	if (!Stats)
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	return fmm_get_virtual_memory_stats(Stats);
+}
+
+HSAKMT_STATUS HSAKMTAPI hsaKmtGetApertureStats(HSAuint32 NodeId,
+					      HSA_MEMORY_APERTURE Aperture,
+					      HsaApertureStats *Stats)
+{
+	HSAKMT_STATUS result;
+	uint32_t gpu_id = 0;
+
+	CHECK_KFD_OPEN();
+
+	pr_debug("[%s] node %d aperture %d\n", __func__, NodeId, Aperture);
+
+	if (!Stats || Aperture >= HSA_MEMORY_APERTURE_NUM_TYPES)
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	if (Aperture == HSA_MEMORY_APERTURE_GPUVM ||
+	    Aperture == HSA_MEMORY_APERTURE_SCRATCH) {
+		result = validate_nodeid(NodeId, &gpu_id);
+		if (result != HSAKMT_STATUS_SUCCESS)
+			return result;
+		if (!gpu_id)
+			return HSAKMT_STATUS_INVALID_NODE_UNIT;
+	}
+
+	return fmm_get_aperture_stats(gpu_id, Aperture, Stats);
+}
+
+HSAKMT_STATUS HSAKMTAPI hsaKmtAllocAndMapMemory(HSAuint32 PreferredNode,
+						HSAuint64 SizeInBytes,
+						HsaMemFlags MemFlags,
+						HSAuint64 NumberOfNodes,
+						HSAuint32 *NodeArray,
+						void **MemoryAddress,
+						HSAuint64 *AlternateVAGPU)
+{
+	uint32_t *gpu_id_array = NULL;
+	HSAKMT_STATUS ret;
+	uint64_t trace;
+	int err;
+
+	CHECK_KFD_OPEN();
+
+	pr_debug("[%s] node %d number of nodes %lu\n", __func__,
+		 PreferredNode, NumberOfNodes);
+
+	/* Registration is a no-op on APUs */
+	if (!is_dgpu)
+		NumberOfNodes = 0;
+
+	if (NumberOfNodes) {
+		ret = validate_nodeid_array(&gpu_id_array, NumberOfNodes,
+					    NodeArray);
+		if (ret != HSAKMT_STATUS_SUCCESS)
+			return ret;
+	}
+
+	if (AlternateVAGPU)
+		*AlternateVAGPU = 0;
+
+	ret = hsaKmtAllocMemory(PreferredNode, SizeInBytes, MemFlags,
+				MemoryAddress);
+	if (ret != HSAKMT_STATUS_SUCCESS)
+		goto out;
+
+	trace = fmm_trace_begin();
+	err = fmm_register_and_map(*MemoryAddress, SizeInBytes, gpu_id_array,
+				   NumberOfNodes, AlternateVAGPU);
+	fmm_trace_end(trace, FMM_TRACE_REGISTER_AND_MAP, *MemoryAddress,
+		      SizeInBytes, 0, fmm_trace_gpus(trace, gpu_id_array,
+						     NumberOfNodes, false),
+		      0, err ? HSAKMT_STATUS_ERROR : HSAKMT_STATUS_SUCCESS);
+	if (err) {
+		/* Freeing the BO also unmaps it from GPUs it got mapped to */
+		trace = fmm_trace_begin();
+		fmm_release(*MemoryAddress);
+		fmm_trace_end(trace, FMM_TRACE_FREE, *MemoryAddress,
+			      SizeInBytes, 0, 0, 0, HSAKMT_STATUS_SUCCESS);
+		*MemoryAddress = NULL;
+		ret = HSAKMT_STATUS_ERROR;
+	}
+
+out:
+	free(gpu_id_array);
+	return ret;
+}
+
+/* A memory arena is a single BO mapped to its GPUs up front. Memory is
+ * carved out of it by bumping top, so allocations and resets don't need
+ * any locks or kernel calls.
+ */
+struct _HsaMemoryArena {
+	void *base;
+	HSAuint64 size;
+	HSAuint64 top;
+};
+
+HSAKMT_STATUS HSAKMTAPI hsaKmtCreateMemoryArena(HSAuint32 PreferredNode,
+						HSAuint64 SizeInBytes,
+						HsaMemFlags MemFlags,
+						HSAuint64 NumberOfNodes,
+						HSAuint32 *NodeArray,
+						HSA_MEMORY_ARENA *Arena)
+{
+	HsaMemMapFlags map_flags = {0};
+	struct _HsaMemoryArena *arena;
+	HSAuint64 gpuva;
+	HSAKMT_STATUS ret;
+
+	CHECK_KFD_OPEN();
+
+	pr_debug("[%s] node %d size %lu\n", __func__, PreferredNode,
+		 SizeInBytes);
+
+	if (!Arena || !SizeInBytes || (NumberOfNodes && !NodeArray))
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	arena = calloc(1, sizeof(*arena));
+	if (!arena)
+		return HSAKMT_STATUS_NO_MEMORY;
+
+	ret = hsaKmtAllocMemory(PreferredNode, SizeInBytes, MemFlags,
+				&arena->base);
+	if (ret != HSAKMT_STATUS_SUCCESS)
+		goto err_free_arena;
+	arena->size = SizeInBytes;
+
+	if (NumberOfNodes)
+		ret = hsaKmtMapMemoryToGPUNodes(arena->base, SizeInBytes, &gpuva,
+						map_flags, NumberOfNodes,
+						NodeArray);
+	else
+		ret = hsaKmtMapMemoryToGPU(arena->base, SizeInBytes, &gpuva);
+	if (ret != HSAKMT_STATUS_SUCCESS)
+		goto err_free_mem;
+
+	*Arena = arena;
+	return HSAKMT_STATUS_SUCCESS;
+
+err_free_mem:
+	hsaKmtFreeMemory(arena->base, SizeInBytes);
+err_free_arena:
+	free(arena);
+	return ret;
+}
+
+HSAKMT_STATUS HSAKMTAPI hsaKmtAllocFromMemoryArena(HSA_MEMORY_ARENA Arena,
+						   HSAuint64 SizeInBytes,
+						   HSAuint64 Alignment,
+						   void **MemoryAddress)
+{
+	HSAuint64 top, start, base;
+
+	if (!Arena || !MemoryAddress || (Alignment & (Alignment - 1)))
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	if (!Alignment)
+		Alignment = 1;
+	base = (HSAuint64)Arena->base;
+
+	top = __atomic_load_n(&Arena->top, __ATOMIC_RELAXED);
+	do {
+		start = ALIGN_UP(base + top, Alignment) - base;
+		if (start + SizeInBytes > Arena->size ||
+		    start + SizeInBytes < start)
+			return HSAKMT_STATUS_NO_MEMORY;
+	} while (!__atomic_compare_exchange_n(&Arena->top, &top,
+					      start + SizeInBytes, true,
+					      __ATOMIC_RELAXED,
+					      __ATOMIC_RELAXED));
+
+	*MemoryAddress = VOID_PTR_ADD(Arena->base, start);
+	return HSAKMT_STATUS_SUCCESS;
+}
+
+HSAKMT_STATUS HSAKMTAPI hsaKmtResetMemoryArena(HSA_MEMORY_ARENA Arena)
+{
+	if (!Arena)
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	__atomic_store_n(&Arena->top, 0, __ATOMIC_RELAXED);
+
+	return HSAKMT_STATUS_SUCCESS;
+}
+
+HSAKMT_STATUS HSAKMTAPI hsaKmtDestroyMemoryArena(HSA_MEMORY_ARENA Arena)
+{
+	HSAKMT_STATUS ret;
+
+	CHECK_KFD_OPEN();
+
+	if (!Arena)
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	pr_debug("[%s] address %p\n", __func__, Arena->base);
+
+	hsaKmtUnmapMemoryToGPU(Arena->base);
+	ret = hsaKmtFreeMemory(Arena->base, Arena->size);
+	if (ret == HSAKMT_STATUS_SUCCESS)
+		free(Arena);
+
+	return ret;
+}
+
+HSAKMT_STATUS HSAKMTAPI hsaKmtGetAllocationSites(HsaAllocationSite *Sites,
+						 HSAuint32 *NumSites)
+{
+	CHECK_KFD_OPEN();
+
+	pr_debug("[%s]\n", __func__);
+
+	if (!Sites || !NumSites)
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	return fmm_get_allocation_sites(Sites, NumSites);
+}
+
+HSAKMT_STATUS HSAKMTAPI hsaKmtDumpAllocationSites(HSAuint32 MaxSites)
+{
+	CHECK_KFD_OPEN();
+
+	pr_debug("[%s] max sites %u\n", __func__, MaxSites);
+
+	return fmm_dump_allocation_sites(MaxSites);
+}
@@ -453,24 +453,11 @@ void *allocate_exec_aligned_memory_gpu(uint32_t size, uint32_t align,
 
 	size = ALIGN_UP(size, align);
 
-	ret = hsaKmtAllocMemory(DeviceLocal ? NodeId : cpu_id, size, flags, &mem);
+	ret = hsaKmtAllocAndMapMemory(DeviceLocal ? NodeId : cpu_id, size, flags,
+				      NodeId ? 1 : 0, &NodeId, &mem, &gpu_va);
 	if (ret != HSAKMT_STATUS_SUCCESS)
 		return NULL;
 
-	if (NodeId != 0) {
-		uint32_t nodes_array[1] = {NodeId};
-
-		if (hsaKmtRegisterMemoryToNodes(mem, size, 1, nodes_array) != HSAKMT_STATUS_SUCCESS) {
-			hsaKmtFreeMemory(mem, size);
-			return NULL;
-		}
-	}
-
-	if (hsaKmtMapMemoryToGPU(mem, size, &gpu_va) != HSAKMT_STATUS_SUCCESS) {
-		hsaKmtFreeMemory(mem, size);
-		return NULL;
-	}
-
 	return mem;
 }
 
@@ -27,10 +27,10 @@
 
 #include "rbtree.h"
 
-static inline void rbtree_left_rotate(rbtree_node_t **root,
-		rbtree_node_t *sentinel, rbtree_node_t *node);
-static inline void rbtree_right_rotate(rbtree_node_t **root,
-		rbtree_node_t *sentinel, rbtree_node_t *node);
+static inline void rbtree_left_rotate(rbtree_t *tree,
+		rbtree_node_t *node);
+static inline void rbtree_right_rotate(rbtree_t *tree,
+		rbtree_node_t *node);
 
 static void
 rbtree_insert_value(rbtree_node_t *temp, rbtree_node_t *node,
@@ -75,11 +75,17 @@ rbtree_insert(rbtree_t *tree, rbtree_node_t *node)
 		rbt_black(node);
 		*root = node;
 
+		if (tree->augment) {
+			tree->augment(node, sentinel);
+		}
+
 		return;
 	}
 
 	rbtree_insert_value(*root, node, sentinel);
 
+	rbtree_augment_propagate(tree, node);
+
 	/* re-balance tree */
 
 	while (node != *root && rbt_is_red(node->parent)) {
@@ -96,12 +102,12 @@ rbtree_insert(rbtree_t *tree, rbtree_node_t *node)
 			} else {
 				if (node == node->parent->right) {
 					node = node->parent;
-					rbtree_left_rotate(root, sentinel, node);
+					rbtree_left_rotate(tree, node);
 				}
 
 				rbt_black(node->parent);
 				rbt_red(node->parent->parent);
-				rbtree_right_rotate(root, sentinel, node->parent->parent);
+				rbtree_right_rotate(tree, node->parent->parent);
 			}
 
 		} else {
@@ -116,12 +122,12 @@ rbtree_insert(rbtree_t *tree, rbtree_node_t *node)
 			} else {
 				if (node == node->parent->left) {
 					node = node->parent;
-					rbtree_right_rotate(root, sentinel, node);
+					rbtree_right_rotate(tree, node);
 				}
 
 				rbt_black(node->parent);
 				rbt_red(node->parent->parent);
-				rbtree_left_rotate(root, sentinel, node->parent->parent);
+				rbtree_left_rotate(tree, node->parent->parent);
 			}
 		}
 	}
@@ -213,6 +219,12 @@ rbtree_delete(rbtree_t *tree, rbtree_node_t *node)
 		}
 	}
 
+	/*
+	 * temp->parent is the lowest node whose subtree changed. If subst
+	 * moved into node's place, it is on the way up from there.
+	 */
+	rbtree_augment_propagate(tree, temp->parent);
+
 	if (red) {
 		return;
 	}
@@ -227,7 +239,7 @@ rbtree_delete(rbtree_t *tree, rbtree_node_t *node)
 			if (rbt_is_red(w)) {
 				rbt_black(w);
 				rbt_red(temp->parent);
-				rbtree_left_rotate(root, sentinel, temp->parent);
+				rbtree_left_rotate(tree, temp->parent);
 				w = temp->parent->right;
 			}
 
@@ -239,14 +251,14 @@ rbtree_delete(rbtree_t *tree, rbtree_node_t *node)
 				if (rbt_is_black(w->right)) {
 					rbt_black(w->left);
 					rbt_red(w);
-					rbtree_right_rotate(root, sentinel, w);
+					rbtree_right_rotate(tree, w);
 					w = temp->parent->right;
 				}
 
 				rbt_copy_color(w, temp->parent);
 				rbt_black(temp->parent);
 				rbt_black(w->right);
-				rbtree_left_rotate(root, sentinel, temp->parent);
+				rbtree_left_rotate(tree, temp->parent);
 				temp = *root;
 			}
 
@@ -256,7 +268,7 @@ rbtree_delete(rbtree_t *tree, rbtree_node_t *node)
 			if (rbt_is_red(w)) {
 				rbt_black(w);
 				rbt_red(temp->parent);
-				rbtree_right_rotate(root, sentinel, temp->parent);
+				rbtree_right_rotate(tree, temp->parent);
 				w = temp->parent->left;
 			}
 
@@ -268,14 +280,14 @@ rbtree_delete(rbtree_t *tree, rbtree_node_t *node)
 				if (rbt_is_black(w->left)) {
 					rbt_black(w->right);
 					rbt_red(w);
-					rbtree_left_rotate(root, sentinel, w);
+					rbtree_left_rotate(tree, w);
 					w = temp->parent->left;
 				}
 
 				rbt_copy_color(w, temp->parent);
 				rbt_black(temp->parent);
 				rbt_black(w->left);
-				rbtree_right_rotate(root, sentinel, temp->parent);
+				rbtree_right_rotate(tree, temp->parent);
 				temp = *root;
 			}
 		}
@@ -286,10 +298,12 @@ rbtree_delete(rbtree_t *tree, rbtree_node_t *node)
 
 
 static inline void
-rbtree_left_rotate(rbtree_node_t **root, rbtree_node_t *sentinel,
-		rbtree_node_t *node)
+rbtree_left_rotate(rbtree_t *tree, rbtree_node_t *node)
 {
-	rbtree_node_t  *temp;
+	rbtree_node_t  **root, *sentinel, *temp;
+
+	root = &tree->root;
+	sentinel = &tree->sentinel;
 
 	temp = node->right;
 	node->right = temp->left;
@@ -312,14 +326,22 @@ rbtree_left_rotate(rbtree_node_t **root, rbtree_node_t *sentinel,
 
 	temp->left = node;
 	node->parent = temp;
+
+	/* node is now a child of temp, update it first */
+	if (tree->augment) {
+		tree->augment(node, sentinel);
+		tree->augment(temp, sentinel);
+	}
 }
 
 
 static inline void
-rbtree_right_rotate(rbtree_node_t **root, rbtree_node_t *sentinel,
-		rbtree_node_t *node)
+rbtree_right_rotate(rbtree_t *tree, rbtree_node_t *node)
 {
-	rbtree_node_t  *temp;
+	rbtree_node_t  **root, *sentinel, *temp;
+
+	root = &tree->root;
+	sentinel = &tree->sentinel;
 
 	temp = node->left;
 	node->left = temp->right;
@@ -342,6 +364,56 @@ rbtree_right_rotate(rbtree_node_t **root, rbtree_node_t *sentinel,
 
 	temp->right = node;
 	node->parent = temp;
+
+	/* node is now a child of temp, update it first */
+	if (tree->augment) {
+		tree->augment(node, sentinel);
+		tree->augment(temp, sentinel);
+	}
+}
+
+
+void
+rbtree_interval_augment(rbtree_node_t *node, rbtree_node_t *sentinel)
+{
+	unsigned long  end;
+
+	end = node->key.addr + node->key.size;
+
+	/* the sentinel's augmented value is 0 */
+	if (node->left->augmented > end) {
+		end = node->left->augmented;
+	}
+
+	if (node->right->augmented > end) {
+		end = node->right->augmented;
+	}
+
+	node->augmented = end;
+}
+
+
+void
+rbtree_augment_propagate(rbtree_t *tree, rbtree_node_t *node)
+{
+	rbtree_node_t  *sentinel;
+
+	if (tree->augment == NULL || node == NULL) {
+		return;
+	}
+
+	sentinel = &tree->sentinel;
+
+	while (node != sentinel) {
+		tree->augment(node, sentinel);
+
+		/* the parent of the root is not always valid */
+		if (node == tree->root) {
+			break;
+		}
+
+		node = node->parent;
+	}
 }
 
 
@@ -47,23 +47,47 @@ struct rbtree_node_s {
 	rbtree_node_t   *left;
 	rbtree_node_t   *right;
 	rbtree_node_t   *parent;
+	unsigned long   augmented;
 	unsigned char   color;
 	unsigned char   data;
 };
 
+/*
+ * Recompute node->augmented from the node itself and the augmented
+ * values of its children. The sentinel's augmented value is always 0.
+ */
+typedef void (*rbtree_augment_pt) (rbtree_node_t *node,
+		rbtree_node_t *sentinel);
+
 typedef struct rbtree_s rbtree_t;
 
 struct rbtree_s {
 	rbtree_node_t   *root;
 	rbtree_node_t   sentinel;
+	rbtree_augment_pt augment;
 };
 
 #define rbtree_init(tree)				\
 	rbtree_sentinel_init(&(tree)->sentinel);	\
-	(tree)->root = &(tree)->sentinel;
+	(tree)->sentinel.augmented = 0;			\
+	(tree)->root = &(tree)->sentinel;		\
+	(tree)->augment = NULL;
+
+#define rbtree_init_augmented(tree, fn)			\
+	rbtree_init(tree)				\
+	(tree)->augment = (fn);
+
+/*
+ * Interval tree: each node covers [key.addr, key.addr + key.size) and
+ * augmented is the highest end address in its subtree.
+ */
+#define rbtree_init_interval(tree)			\
+	rbtree_init_augmented(tree, rbtree_interval_augment)
 
 void rbtree_insert(rbtree_t *tree, rbtree_node_t *node);
 void rbtree_delete(rbtree_t *tree, rbtree_node_t *node);
+void rbtree_augment_propagate(rbtree_t *tree, rbtree_node_t *node);
+void rbtree_interval_augment(rbtree_node_t *node, rbtree_node_t *sentinel);
 rbtree_node_t *rbtree_next(rbtree_t *tree,
 		rbtree_node_t *node);
 
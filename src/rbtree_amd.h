@@ -143,6 +143,42 @@ rbtree_lookup_nearest(rbtree_t *rbtree, rbtree_key_t *key,
 	return n;
 }
 
+/*
+ * Find the node with the lowest key whose interval contains addr in a
+ * tree initialized with rbtree_init_interval. Only subtrees that are
+ * known to contain a match are entered, so this is O(log n) no matter
+ * how much the intervals overlap.
+ */
+static inline rbtree_node_t *
+rbtree_lookup_interval(rbtree_t *rbtree, unsigned long addr)
+{
+	rbtree_node_t *node, *sentinel;
+
+	node = rbtree->root;
+	sentinel = &rbtree->sentinel;
+
+	while (node != sentinel && node->augmented > addr) {
+		/* An interval in the left subtree ends above addr. It
+		 * contains addr unless this node starts above addr, in
+		 * which case nothing to the right can contain it either.
+		 */
+		if (node->left->augmented > addr) {
+			node = node->left;
+			continue;
+		}
+
+		if (node->key.addr > addr)
+			return NULL;
+
+		if (addr - node->key.addr < node->key.size)
+			return node;
+
+		node = node->right;
+	}
+
+	return NULL;
+}
+
 static inline rbtree_node_t *
 rbtree_lookup(rbtree_t *rbtree, rbtree_key_t *key,
 		unsigned int type)
@@ -0,0 +1,2626 @@
+/*
+ * Copyright © 2026 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including
+ * the next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <numa.h>
+#include "fmmsim.h"
+
+typedef struct {
+	void *addr;
+	uint64_t size;
+} buffer_t;
+
+static unsigned long page_size;
+
+static uint64_t random_size(uint64_t *seed)
+{
+	/* 1 to 16 pages */
+	return ((fmmsim_rand(seed) & 15) + 1) * page_size;
+}
+
+/* Churn the SVM aperture at increasing numbers of live VA areas. With
+ * an O(log n) hole search the cost per operation stays flat.
+ */
+static int bench_va(unsigned long max_live, unsigned long ops)
+{
+	static const unsigned long levels[] = {1000, 10000, 100000, 200000, 500000};
+	buffer_t *live = calloc(max_live, sizeof(*live));
+	unsigned long n_live = 0, l, i;
+	uint64_t seed = 0x12345678;
+	int ret = 0;
+
+	if (!live)
+		return -1;
+
+	printf("%12s %16s %16s\n", "live areas", "alloc ns/op", "free ns/op");
+	for (l = 0; l < sizeof(levels) / sizeof(levels[0]) &&
+		    levels[l] <= max_live; l++) {
+		uint64_t alloc_ns = 0, free_ns = 0, t;
+
+		for (; n_live < levels[l]; n_live++) {
+			live[n_live].size = random_size(&seed);
+			live[n_live].addr = fmmsim_va_alloc(live[n_live].size, 0);
+			if (!live[n_live].addr) {
+				fprintf(stderr, "VA allocation failed\n");
+				ret = -1;
+				goto out;
+			}
+		}
+
+		for (i = 0; i < ops; i++) {
+			buffer_t *b = &live[fmmsim_rand(&seed) % n_live];
+
+			t = fmmsim_now_ns();
+			fmmsim_va_free(b->addr, b->size);
+			free_ns += fmmsim_now_ns() - t;
+
+			b->size = random_size(&seed);
+			t = fmmsim_now_ns();
+			b->addr = fmmsim_va_alloc(b->size, 0);
+			alloc_ns += fmmsim_now_ns() - t;
+			if (!b->addr) {
+				fprintf(stderr, "VA allocation failed\n");
+				ret = -1;
+				goto out;
+			}
+		}
+
+		printf("%12lu %16.0f %16.0f\n", n_live,
+		       (double)alloc_ns / ops, (double)free_ns / ops);
+	}
+
+out:
+	for (i = 0; i < n_live; i++)
+		if (live[i].addr)
+			fmmsim_va_free(live[i].addr, live[i].size);
+	free(live);
+
+	return ret;
+}
+
+/* Allocate and free VRAM BOs at increasing numbers of live BOs. This
+ * exercises the complete allocation path in fmm.c including the
+ * object and area metadata.
+ */
+static int bench_alloc(unsigned long max_live, unsigned long ops)
+{
+	/* Every BO has a CPU mapping, stay below vm.max_map_count */
+	static const unsigned long levels[] = {1000, 10000, 25000};
+	buffer_t *live = calloc(max_live, sizeof(*live));
+	uint32_t gpu_id = fmmsim_gpu_id(0);
+	unsigned long n_live = 0, l, i;
+	uint64_t seed = 0x6a09e667f3bcc908ULL;
+	HsaMemFlags flags;
+	int ret = 0;
+
+	if (!live)
+		return -1;
+
+	flags.Value = 0;
+	flags.ui32.NonPaged = 1;
+	flags.ui32.NoSubstitute = 1;
+
+	printf("%12s %16s %16s\n", "live BOs", "alloc ns/op", "free ns/op");
+	for (l = 0; l < sizeof(levels) / sizeof(levels[0]) &&
+		    levels[l] <= max_live; l++) {
+		uint64_t alloc_ns = 0, free_ns = 0, t;
+
+		for (; n_live < levels[l]; n_live++) {
+			live[n_live].size = random_size(&seed);
+			live[n_live].addr = fmm_allocate_device(gpu_id, NULL,
+						live[n_live].size, flags);
+			if (!live[n_live].addr) {
+				fprintf(stderr, "BO allocation failed\n");
+				ret = -1;
+				goto out;
+			}
+		}
+
+		for (i = 0; i < ops; i++) {
+			buffer_t *b = &live[fmmsim_rand(&seed) % n_live];
+
+			t = fmmsim_now_ns();
+			fmm_release(b->addr);
+			free_ns += fmmsim_now_ns() - t;
+
+			b->size = random_size(&seed);
+			t = fmmsim_now_ns();
+			b->addr = fmm_allocate_device(gpu_id, NULL, b->size, flags);
+			alloc_ns += fmmsim_now_ns() - t;
+			if (!b->addr) {
+				fprintf(stderr, "BO allocation failed\n");
+				ret = -1;
+				goto out;
+			}
+		}
+
+		printf("%12lu %16.0f %16.0f\n", n_live,
+		       (double)alloc_ns / ops, (double)free_ns / ops);
+	}
+
+out:
+	for (i = 0; i < n_live; i++)
+		if (live[i].addr)
+			fmm_release(live[i].addr);
+	free(live);
+
+	if (fmmsim_check())
+		ret = -1;
+
+	return ret;
+}
+
+/* Allocations and frees drawn from a few sizes, as frameworks with
+ * their own pools do. Run with HSA_BO_CACHE_MB set to use the BO cache.
+ */
+static int bench_bocache(unsigned long max_live, unsigned long ops)
+{
+	static const unsigned int size_pages[] = {1, 2, 16, 64, 256, 512};
+	buffer_t *live = calloc(max_live, sizeof(*live));
+	uint32_t gpu_id = fmmsim_gpu_id(0);
+	uint64_t seed = 0x510e527fade682d1ULL;
+	uint64_t alloc_ns = 0, free_ns = 0, t;
+	HsaMemoryCacheStats stats;
+	HsaMemFlags flags;
+	unsigned long i;
+	int ret = 0;
+
+	if (!live)
+		return -1;
+
+	flags.Value = 0;
+	flags.ui32.NonPaged = 1;
+	flags.ui32.NoSubstitute = 1;
+
+	for (i = 0; i < ops; i++) {
+		buffer_t *b = &live[fmmsim_rand(&seed) % max_live];
+
+		if (b->addr) {
+			t = fmmsim_now_ns();
+			fmm_release(b->addr);
+			free_ns += fmmsim_now_ns() - t;
+		}
+
+		b->size = size_pages[fmmsim_rand(&seed) %
+			(sizeof(size_pages) / sizeof(size_pages[0]))] * page_size;
+		t = fmmsim_now_ns();
+		b->addr = fmm_allocate_device(gpu_id, NULL, b->size, flags);
+		alloc_ns += fmmsim_now_ns() - t;
+		if (!b->addr) {
+			fprintf(stderr, "BO allocation failed\n");
+			ret = -1;
+			goto out;
+		}
+	}
+
+	fmm_get_cache_stats(HSA_MEMORY_CACHE_BUFFER_OBJECT, &stats);
+	printf("%16s %16s %16s %16s\n", "alloc ns/op", "free ns/op",
+	       "cache hit rate", "cached MB");
+	printf("%16.0f %16.0f %15.1f%% %16.1f\n", (double)alloc_ns / ops,
+	       (double)free_ns / ops,
+	       stats.Hits + stats.Misses ?
+			100.0 * stats.Hits / (stats.Hits + stats.Misses) : 0.0,
+	       stats.BytesCached / 1048576.0);
+
+out:
+	for (i = 0; i < max_live; i++)
+		if (live[i].addr)
+			fmm_release(live[i].addr);
+	free(live);
+
+	if (fmmsim_check())
+		ret = -1;
+
+	return ret;
+}
+
+/* Small BO allocations that are mapped to all GPUs, queried and freed.
+ * Run with HSA_SUBALLOC=1 to pack them into shared BOs.
+ */
+static int bench_suballoc(unsigned long max_live, unsigned long ops,
+			  unsigned int gpus)
+{
+	buffer_t *live = calloc(max_live, sizeof(*live));
+	uint32_t gpu_id = fmmsim_gpu_id(0);
+	uint64_t seed = 0x1f83d9abfb41bd6bULL;
+	uint64_t alloc_ns = 0, free_ns = 0, t, gpuvm_address;
+	fmmsim_stats_t before, after;
+	HsaPointerInfo info;
+	HsaMemFlags flags;
+	unsigned long i;
+	int ret = 0;
+
+	if (!live)
+		return -1;
+
+	flags.Value = 0;
+	flags.ui32.NonPaged = 1;
+	flags.ui32.NoSubstitute = 1;
+
+	fmmsim_get_stats(&before);
+	for (i = 0; i < ops; i++) {
+		buffer_t *b = &live[fmmsim_rand(&seed) % max_live];
+
+		if (b->addr) {
+			t = fmmsim_now_ns();
+			fmm_release(b->addr);
+			free_ns += fmmsim_now_ns() - t;
+		}
+
+		b->size = (1 + fmmsim_rand(&seed) % 15) * page_size;
+		t = fmmsim_now_ns();
+		b->addr = fmm_allocate_device(gpu_id, NULL, b->size, flags);
+		alloc_ns += fmmsim_now_ns() - t;
+		if (!b->addr) {
+			fprintf(stderr, "BO allocation failed\n");
+			ret = -1;
+			goto out;
+		}
+
+		if (fmm_map_to_gpu(b->addr, b->size, &gpuvm_address) ||
+		    fmm_get_mem_info(b->addr, &info) ||
+		    info.GPUAddress != (HSAuint64)b->addr ||
+		    info.SizeInBytes != b->size ||
+		    info.NMappedNodes != gpus) {
+			fprintf(stderr, "bad pointer info for %p\n", b->addr);
+			ret = -1;
+			goto out;
+		}
+		/* Unmap some BOs again, freeing others while mapped */
+		if ((fmmsim_rand(&seed) & 1) && fmm_unmap_from_gpu(b->addr)) {
+			fprintf(stderr, "unmapping %p failed\n", b->addr);
+			ret = -1;
+			goto out;
+		}
+	}
+	fmmsim_get_stats(&after);
+
+	printf("%16s %16s %16s %16s\n", "alloc ns/op", "free ns/op",
+	       "live BOs", "map ioctls");
+	printf("%16.0f %16.0f %16lu %16lu\n", (double)alloc_ns / ops,
+	       (double)free_ns / ops,
+	       (unsigned long)(after.live_bos - before.live_bos),
+	       (unsigned long)(after.maps - before.maps));
+
+out:
+	for (i = 0; i < max_live; i++)
+		if (live[i].addr)
+			fmm_release(live[i].addr);
+	free(live);
+
+	if (fmmsim_check())
+		ret = -1;
+
+	return ret;
+}
+
+/* Allocations and frees on a latency-critical thread. Run with
+ * HSA_DEFERRED_FREE=1 to move the frees to the background thread.
+ */
+static int bench_deferred(unsigned long max_live, unsigned long ops)
+{
+	buffer_t *live = calloc(max_live, sizeof(*live));
+	uint32_t gpu_id = fmmsim_gpu_id(0);
+	uint64_t seed = 0x9b05688c2b3e6c1fULL;
+	uint64_t alloc_ns = 0, free_ns = 0, flush_ns, t;
+	HsaPointerInfo info;
+	HsaMemFlags flags;
+	unsigned long i;
+	int ret = 0;
+
+	if (!live)
+		return -1;
+
+	flags.Value = 0;
+	flags.ui32.NonPaged = 1;
+	flags.ui32.NoSubstitute = 1;
+
+	for (i = 0; i < ops; i++) {
+		buffer_t *b = &live[fmmsim_rand(&seed) % max_live];
+
+		if (b->addr) {
+			t = fmmsim_now_ns();
+			if (fmm_release(b->addr)) {
+				fprintf(stderr, "freeing %p failed\n", b->addr);
+				ret = -1;
+				goto out;
+			}
+			free_ns += fmmsim_now_ns() - t;
+		}
+
+		b->size = (1 + fmmsim_rand(&seed) % 64) * page_size;
+		t = fmmsim_now_ns();
+		b->addr = fmm_allocate_device(gpu_id, NULL, b->size, flags);
+		alloc_ns += fmmsim_now_ns() - t;
+		if (!b->addr) {
+			fprintf(stderr, "BO allocation failed\n");
+			ret = -1;
+			goto out;
+		}
+	}
+
+out:
+	for (i = 0; i < max_live; i++)
+		if (live[i].addr)
+			fmm_release(live[i].addr);
+
+	t = fmmsim_now_ns();
+	fmm_flush_deferred_frees();
+	flush_ns = fmmsim_now_ns() - t;
+
+	/* All frees must be done after the flush */
+	for (i = 0; i < max_live; i++)
+		if (live[i].addr && !fmm_get_mem_info(live[i].addr, &info)) {
+			fprintf(stderr, "%p not freed after flush\n",
+				live[i].addr);
+			ret = -1;
+			break;
+		}
+	free(live);
+
+	if (!ret) {
+		printf("%16s %16s %16s\n", "alloc ns/op", "free ns/op",
+		       "final flush us");
+		printf("%16.0f %16.0f %16.0f\n", (double)alloc_ns / ops,
+		       (double)free_ns / ops, flush_ns / 1000.0);
+	}
+
+	if (fmmsim_check())
+		ret = -1;
+
+	return ret;
+}
+
+/* Pointer info queries that keep hitting a few hot BOs among many
+ * live ones, as a runtime does for its most used buffers
+ */
+static int bench_hot(unsigned long max_live, unsigned long ops)
+{
+	static const unsigned int hot_counts[] = {1, 4, 16};
+	buffer_t *live = calloc(max_live, sizeof(*live));
+	uint32_t gpu_id = fmmsim_gpu_id(0);
+	uint64_t seed = 0xbb67ae8584caa73bULL;
+	HsaMemoryCacheStats before, after;
+	HsaPointerInfo info;
+	HsaMemFlags flags;
+	unsigned long i, h;
+	int ret = 0;
+
+	if (!live)
+		return -1;
+
+	flags.Value = 0;
+	flags.ui32.NonPaged = 1;
+	flags.ui32.NoSubstitute = 1;
+
+	for (i = 0; i < max_live; i++) {
+		live[i].size = random_size(&seed);
+		live[i].addr = fmm_allocate_device(gpu_id, NULL, live[i].size, flags);
+		if (!live[i].addr) {
+			fprintf(stderr, "BO allocation failed\n");
+			ret = -1;
+			goto out;
+		}
+	}
+
+	printf("%12s %16s %16s\n", "hot BOs", "query ns/op", "cache hit rate");
+	for (h = 0; h < sizeof(hot_counts) / sizeof(hot_counts[0]); h++) {
+		uint64_t t;
+
+		fmm_get_cache_stats(HSA_MEMORY_CACHE_POINTER_LOOKUP, &before);
+		t = fmmsim_now_ns();
+		for (i = 0; i < ops; i++) {
+			buffer_t *b = &live[(i % hot_counts[h]) * (max_live / 16)];
+
+			if (fmm_get_mem_info(b->addr, &info) ||
+			    info.CPUAddress != b->addr) {
+				fprintf(stderr, "bad pointer info for %p\n", b->addr);
+				ret = -1;
+				goto out;
+			}
+		}
+		t = fmmsim_now_ns() - t;
+		fmm_get_cache_stats(HSA_MEMORY_CACHE_POINTER_LOOKUP, &after);
+
+		printf("%12u %16.0f %15.1f%%\n", hot_counts[h], (double)t / ops,
+		       100.0 * (after.Hits - before.Hits) /
+		       (after.Hits - before.Hits + after.Misses - before.Misses));
+	}
+
+out:
+	for (i = 0; i < max_live; i++)
+		if (live[i].addr)
+			fmm_release(live[i].addr);
+	free(live);
+
+	return ret;
+}
+
+/* Pointer info queries for batches of random pointers into BOs and
+ * userptrs registered and mapped to random GPUs, one by one and in a
+ * batch. Batched results must be the same as single ones.
+ */
+#define PTRBATCH_SIZE 4096
+
+static bool same_nodes(const HSAuint32 *a, const HSAuint32 *b, HSAuint32 n)
+{
+	return !n || (a && b && !memcmp(a, b, n * sizeof(*a)));
+}
+
+static int bench_ptrbatch(unsigned long max_live, unsigned long ops,
+			  unsigned int gpus)
+{
+	buffer_t *live = calloc(max_live, sizeof(*live));
+	const void **ptrs = calloc(PTRBATCH_SIZE, sizeof(*ptrs));
+	HsaPointerInfo *infos = calloc(PTRBATCH_SIZE, sizeof(*infos));
+	uint32_t *node_ids = calloc(PTRBATCH_SIZE * 2 * gpus,
+				    sizeof(*node_ids));
+	uint64_t seed = 0x3c6ef372fe94f82bULL, t_single = 0, t_batch = 0, t;
+	unsigned long i, j, n_ops = 0, unknown = 0;
+	bool *userptr = calloc(max_live, sizeof(*userptr));
+	uint32_t *gpu_ids, gpu_id;
+	HsaPointerInfo info;
+	HsaMemFlags flags;
+	int ret = 0;
+
+	if (!live || !ptrs || !infos || !node_ids || !userptr) {
+		ret = -1;
+		goto out;
+	}
+
+	for (i = 0; i < max_live && !ret; i++) {
+		live[i].size = random_size(&seed);
+		gpu_id = fmmsim_gpu_id(fmmsim_rand(&seed) % gpus);
+		if (fmmsim_rand(&seed) % 4) {
+			flags.Value = 0;
+			flags.ui32.NonPaged = fmmsim_rand(&seed) & 1;
+			flags.ui32.HostAccess = !flags.ui32.NonPaged;
+			if (flags.ui32.NonPaged)
+				live[i].addr = fmm_allocate_device(gpu_id, NULL,
+								   live[i].size,
+								   flags);
+			else
+				live[i].addr = fmm_allocate_host(0, NULL,
+								 live[i].size,
+								 flags);
+			if (live[i].addr && (fmmsim_rand(&seed) & 1) &&
+			    fmm_map_to_gpu_nodes(live[i].addr, live[i].size,
+						 &gpu_id, 1, NULL))
+				ret = -1;
+		} else {
+			userptr[i] = true;
+			live[i].addr = mmap(NULL, live[i].size,
+					    PROT_READ | PROT_WRITE,
+					    MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+			gpu_ids = malloc(sizeof(*gpu_ids));
+			if (live[i].addr == MAP_FAILED || !gpu_ids ||
+			    fmm_register_memory(live[i].addr, live[i].size,
+						gpu_ids ? (*gpu_ids = gpu_id,
+							   gpu_ids) : NULL,
+						sizeof(*gpu_ids), true)) {
+				free(gpu_ids);
+				if (live[i].addr != MAP_FAILED)
+					munmap(live[i].addr, live[i].size);
+				live[i].addr = NULL;
+			}
+		}
+		if (!live[i].addr)
+			ret = -1;
+	}
+	if (ret) {
+		fprintf(stderr, "Allocation failed\n");
+		goto out;
+	}
+
+	while (n_ops < ops && !ret) {
+		for (i = 0; i < PTRBATCH_SIZE; i++) {
+			buffer_t *b = &live[fmmsim_rand(&seed) % max_live];
+
+			/* Some pointers are not known */
+			if (!(fmmsim_rand(&seed) % 16))
+				ptrs[i] = (void *)((fmmsim_rand(&seed) % 4096 + 1) *
+						   page_size);
+			else
+				ptrs[i] = (char *)b->addr +
+					fmmsim_rand(&seed) % b->size;
+		}
+
+		t = fmmsim_now_ns();
+		for (i = 0; i < PTRBATCH_SIZE; i++)
+			fmm_get_mem_info(ptrs[i], &info);
+		t_single += fmmsim_now_ns() - t;
+
+		t = fmmsim_now_ns();
+		if (fmm_get_mem_info_batch(ptrs, PTRBATCH_SIZE, infos, node_ids,
+					   PTRBATCH_SIZE * 2 * gpus))
+			ret = -1;
+		t_batch += fmmsim_now_ns() - t;
+
+		for (i = 0; i < PTRBATCH_SIZE && !ret; i++) {
+			if (fmm_get_mem_info(ptrs[i], &info)) {
+				unknown++;
+				if (infos[i].Type != HSA_POINTER_UNKNOWN)
+					ret = -1;
+				continue;
+			}
+			if (infos[i].Type != info.Type ||
+			    infos[i].Node != info.Node ||
+			    infos[i].CPUAddress != info.CPUAddress ||
+			    infos[i].GPUAddress != info.GPUAddress ||
+			    infos[i].SizeInBytes != info.SizeInBytes ||
+			    infos[i].NRegisteredNodes != info.NRegisteredNodes ||
+			    infos[i].NMappedNodes != info.NMappedNodes ||
+			    !same_nodes(infos[i].RegisteredNodes,
+					info.RegisteredNodes,
+					info.NRegisteredNodes) ||
+			    !same_nodes(infos[i].MappedNodes, info.MappedNodes,
+					info.NMappedNodes))
+				ret = -1;
+		}
+		if (ret)
+			fprintf(stderr, "bad batched pointer info for %p\n",
+				ptrs[i - 1]);
+		n_ops += PTRBATCH_SIZE;
+	}
+
+	printf("%12s %12s %12s\n", "pointers", "single ns", "batch ns");
+	printf("%12lu %12.0f %12.0f\n", n_ops, (double)t_single / n_ops,
+	       (double)t_batch / n_ops);
+	if (unknown * 8 > n_ops) {
+		fprintf(stderr, "%lu of %lu pointers unknown\n", unknown, n_ops);
+		ret = -1;
+	}
+
+	/* Without space for node IDs only the counts are returned */
+	if (!ret && fmm_get_mem_info_batch(ptrs, PTRBATCH_SIZE, infos,
+					   NULL, 0) == HSAKMT_STATUS_SUCCESS) {
+		for (j = 0; j < PTRBATCH_SIZE; j++)
+			if (infos[j].NRegisteredNodes || infos[j].NMappedNodes)
+				break;
+		if (j < PTRBATCH_SIZE) {
+			fprintf(stderr, "missing node ID space not reported\n");
+			ret = -1;
+		}
+	}
+
+out:
+	for (i = 0; live && i < max_live; i++) {
+		if (!live[i].addr)
+			continue;
+		if (userptr[i]) {
+			fmm_deregister_memory(live[i].addr);
+			munmap(live[i].addr, live[i].size);
+		} else {
+			fmm_release(live[i].addr);
+		}
+	}
+	free(userptr);
+	free(node_ids);
+	free(infos);
+	free(ptrs);
+	free(live);
+
+	if (fmmsim_check())
+		ret = -1;
+
+	return ret;
+}
+
+/* Pointer info queries on overlapping userptr registrations: small
+ * registrations every other page, with one big registration covering
+ * the upper half of them. Queries hit the upper half, including the
+ * gaps that are only covered by the big registration.
+ */
+#define USERPTR_BASE 0x7f0000000000ULL
+
+static int bench_ptrinfo(unsigned long max_live, unsigned long ops)
+{
+	static const unsigned long levels[] = {1000, 10000, 100000, 200000};
+	uint64_t seed = 0x2545f4914f6cdd1dULL;
+	unsigned long l, i;
+	int ret = 0;
+
+	printf("%12s %16s\n", "userptrs", "query ns/op");
+	for (l = 0; l < sizeof(levels) / sizeof(levels[0]) &&
+		    levels[l] <= max_live && !ret; l++) {
+		unsigned long n = levels[l];
+		uint64_t span = n * 2 * page_size;
+		char *big = (char *)USERPTR_BASE + span / 2;
+		uint64_t query_ns = 0, t;
+		HsaPointerInfo info;
+
+		for (i = 0; i < n && !ret; i++)
+			if (fmm_register_memory((char *)USERPTR_BASE + i * 2 * page_size,
+						page_size, NULL, 0, true))
+				ret = -1;
+		if (!ret && fmm_register_memory(big, span / 2, NULL, 0, true))
+			ret = -1;
+		if (ret) {
+			fprintf(stderr, "userptr registration failed\n");
+			break;
+		}
+
+		for (i = 0; i < ops; i++) {
+			char *addr = big + fmmsim_rand(&seed) % (span / 2);
+
+			t = fmmsim_now_ns();
+			if (fmm_get_mem_info(addr, &info) ||
+			    addr < (char *)info.CPUAddress ||
+			    addr >= (char *)info.CPUAddress + info.SizeInBytes) {
+				fprintf(stderr, "bad pointer info for %p\n", addr);
+				ret = -1;
+				break;
+			}
+			query_ns += fmmsim_now_ns() - t;
+		}
+		if (!ret)
+			printf("%12lu %16.0f\n", n + 1, (double)query_ns / ops);
+
+		fmm_deregister_memory(big);
+		for (i = 0; i < n; i++)
+			fmm_deregister_memory((char *)USERPTR_BASE + i * 2 * page_size);
+		if (fmmsim_check())
+			ret = -1;
+	}
+
+	return ret;
+}
+
+/* Registrations of overlapping slices of a few big host buffers, each
+ * mapped and queried while registered. Run with HSA_USERPTR_CACHE_MB to
+ * share userptr BOs between the registrations.
+ */
+#define REGCACHE_BUFFERS 8
+#define REGCACHE_BUFFER_SIZE (64ULL << 20)
+
+static int bench_regcache(unsigned long max_live, unsigned long ops)
+{
+	buffer_t *live = calloc(max_live, sizeof(*live));
+	uint64_t seed = 0x9b05688c2b3e6c1fULL;
+	uint64_t reg_ns = 0, dereg_ns = 0, t, gpuvm_address;
+	fmmsim_stats_t before, after;
+	HsaMemoryCacheStats stats;
+	HsaPointerInfo info;
+	unsigned long i;
+	int ret = 0;
+
+	if (!live)
+		return -1;
+
+	fmmsim_get_stats(&before);
+	for (i = 0; i < ops; i++) {
+		unsigned long slot = fmmsim_rand(&seed) % max_live;
+		buffer_t *b = &live[slot];
+		uint64_t buf = fmmsim_rand(&seed) % REGCACHE_BUFFERS;
+		uint64_t offset;
+
+		if (b->addr) {
+			t = fmmsim_now_ns();
+			fmm_deregister_memory(b->addr);
+			dereg_ns += fmmsim_now_ns() - t;
+		}
+
+		/* Up to 256 pages at any byte offset. Live slices never start
+		 * at the same address, so they can be told apart when
+		 * unmapping.
+		 */
+		b->size = (1 + fmmsim_rand(&seed) % 256) * page_size -
+			fmmsim_rand(&seed) % page_size;
+		offset = fmmsim_rand(&seed) %
+			(REGCACHE_BUFFER_SIZE - b->size - page_size);
+		offset = (offset & ~(page_size - 1)) + slot % page_size;
+		b->addr = (char *)USERPTR_BASE + buf * 2 * REGCACHE_BUFFER_SIZE +
+			offset;
+		t = fmmsim_now_ns();
+		if (fmm_register_memory(b->addr, b->size, NULL, 0, true)) {
+			fprintf(stderr, "userptr registration failed\n");
+			b->addr = NULL;
+			ret = -1;
+			goto out;
+		}
+		reg_ns += fmmsim_now_ns() - t;
+
+		/* Other registrations may overlap the queried address */
+		if (fmm_map_to_gpu(b->addr, b->size, &gpuvm_address) ||
+		    fmm_get_mem_info(b->addr, &info) ||
+		    (char *)b->addr < (char *)info.CPUAddress ||
+		    (char *)b->addr >= (char *)info.CPUAddress + info.SizeInBytes ||
+		    fmm_unmap_from_gpu(b->addr)) {
+			fprintf(stderr, "bad userptr %p\n", b->addr);
+			ret = -1;
+			goto out;
+		}
+	}
+	fmmsim_get_stats(&after);
+
+	fmm_get_cache_stats(HSA_MEMORY_CACHE_USERPTR, &stats);
+	printf("%16s %16s %16s %16s %16s\n", "register ns/op",
+	       "deregister ns/op", "BO allocs", "cache hit rate", "cached MB");
+	printf("%16.0f %16.0f %16lu %15.1f%% %16.1f\n", (double)reg_ns / ops,
+	       (double)dereg_ns / ops,
+	       (unsigned long)(after.allocs - before.allocs),
+	       stats.Hits + stats.Misses ?
+			100.0 * stats.Hits / (stats.Hits + stats.Misses) : 0.0,
+	       stats.BytesCached / 1048576.0);
+
+out:
+	for (i = 0; i < max_live; i++)
+		if (live[i].addr)
+			fmm_deregister_memory(live[i].addr);
+	free(live);
+
+	if (fmmsim_check())
+		ret = -1;
+
+	return ret;
+}
+
+/* Repeated imports of a few exported BOs, as a process that receives
+ * the same IPC handles over and over does. Run with HSA_IPC_CACHE_MB
+ * set to share the imports of a handle.
+ */
+#define IPC_BUFFERS 64
+
+static int bench_ipc(unsigned long max_live, unsigned long ops)
+{
+	buffer_t *live = calloc(max_live, sizeof(*live));
+	unsigned int *live_buf = calloc(max_live, sizeof(*live_buf));
+	buffer_t exported[IPC_BUFFERS] = {{0}};
+	HsaSharedMemoryHandle handles[IPC_BUFFERS];
+	/* Live imports of each buffer and the address of the first one */
+	unsigned long imports[IPC_BUFFERS] = {0};
+	void *first[IPC_BUFFERS] = {0};
+	uint32_t gpu_id = fmmsim_gpu_id(0);
+	uint64_t seed = 0x3c6ef372fe94f82bULL;
+	uint64_t import_ns = 0, dereg_ns = 0, t, gpuvm_address, size;
+	fmmsim_stats_t before, after;
+	HsaMemoryCacheStats stats;
+	HsaPointerInfo info;
+	HsaMemFlags flags;
+	unsigned long i;
+	unsigned int buf;
+	int ret = 0;
+
+	if (!live || !live_buf) {
+		free(live);
+		free(live_buf);
+		return -1;
+	}
+
+	flags.Value = 0;
+	flags.ui32.NonPaged = 1;
+	flags.ui32.NoSubstitute = 1;
+
+	for (buf = 0; buf < IPC_BUFFERS; buf++) {
+		exported[buf].size = random_size(&seed) * 4;
+		exported[buf].addr = fmm_allocate_device(gpu_id, NULL,
+						exported[buf].size, flags);
+		if (!exported[buf].addr ||
+		    fmm_share_memory(exported[buf].addr, exported[buf].size,
+				     &handles[buf])) {
+			fprintf(stderr, "BO export failed\n");
+			ret = -1;
+			goto out;
+		}
+	}
+
+	fmmsim_get_stats(&before);
+	for (i = 0; i < ops; i++) {
+		unsigned long slot = fmmsim_rand(&seed) % max_live;
+		buffer_t *b = &live[slot];
+
+		if (b->addr) {
+			t = fmmsim_now_ns();
+			fmm_deregister_memory(b->addr);
+			dereg_ns += fmmsim_now_ns() - t;
+			imports[live_buf[slot]]--;
+		}
+
+		buf = fmmsim_rand(&seed) % IPC_BUFFERS;
+		t = fmmsim_now_ns();
+		if (fmm_register_shared_memory(&handles[buf], &size, &b->addr,
+					       NULL, 0)) {
+			fprintf(stderr, "import failed\n");
+			b->addr = NULL;
+			ret = -1;
+			goto out;
+		}
+		import_ns += fmmsim_now_ns() - t;
+		b->size = size;
+		live_buf[slot] = buf;
+
+		if (fmm_get_mem_info(b->addr, &info) ||
+		    info.Type != HSA_POINTER_REGISTERED_SHARED ||
+		    info.GPUAddress != (HSAuint64)b->addr ||
+		    info.SizeInBytes != exported[buf].size) {
+			fprintf(stderr, "bad import %p\n", b->addr);
+			ret = -1;
+			goto out;
+		}
+
+		/* With the cache, live imports of a buffer share one mapping.
+		 * The first one maps it to the GPU, which must be undone when
+		 * the last one is deregistered.
+		 */
+		if (!imports[buf]++) {
+			first[buf] = b->addr;
+			if (fmm_map_to_gpu(b->addr, b->size, &gpuvm_address)) {
+				fprintf(stderr, "mapping import %p failed\n",
+					b->addr);
+				ret = -1;
+				goto out;
+			}
+		} else if (getenv("HSA_IPC_CACHE_MB") && b->addr != first[buf]) {
+			fprintf(stderr, "import %p of buffer %u not shared\n",
+				b->addr, buf);
+			ret = -1;
+			goto out;
+		}
+	}
+	fmmsim_get_stats(&after);
+
+	fmm_get_cache_stats(HSA_MEMORY_CACHE_IPC_IMPORT, &stats);
+	printf("%16s %16s %16s %16s %16s\n", "import ns/op",
+	       "deregister ns/op", "BO imports", "cache hit rate",
+	       "cached MB");
+	printf("%16.0f %16.0f %16lu %15.1f%% %16.1f\n",
+	       (double)import_ns / ops, (double)dereg_ns / ops,
+	       (unsigned long)(after.allocs - before.allocs),
+	       stats.Hits + stats.Misses ?
+			100.0 * stats.Hits / (stats.Hits + stats.Misses) : 0.0,
+	       stats.BytesCached / 1048576.0);
+
+out:
+	for (i = 0; i < max_live; i++)
+		if (live[i].addr)
+			fmm_deregister_memory(live[i].addr);
+	for (buf = 0; buf < IPC_BUFFERS; buf++)
+		if (exported[buf].addr)
+			fmm_release(exported[buf].addr);
+	free(live);
+	free(live_buf);
+
+	if (fmmsim_check())
+		ret = -1;
+
+	return ret;
+}
+
+/* Registration of a large, freshly mapped host buffer, mapped to all
+ * GPUs. Run with HSA_CHECK_USERPTR=1 to prefault it and with
+ * HSA_USERPTR_SPLIT_MB to split it into BOs created in parallel.
+ */
+#define BIGREG_SIZE (1ULL << 30)
+#define BIGREG_ROUNDS 4
+
+static int bench_bigreg(unsigned int gpus)
+{
+	uint64_t reg_ns = 0, map_ns = 0, t, gpuvm_address;
+	fmmsim_stats_t before, after;
+	HsaPointerInfo info;
+	unsigned int i;
+	int ret = 0;
+	char *buf;
+
+	for (i = 0; i < BIGREG_ROUNDS && !ret; i++) {
+		buf = mmap(NULL, BIGREG_SIZE, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (buf == MAP_FAILED) {
+			fprintf(stderr, "Failed to map the buffer\n");
+			return -1;
+		}
+
+		fmmsim_get_stats(&before);
+		t = fmmsim_now_ns();
+		ret = fmm_register_memory(buf, BIGREG_SIZE, NULL, 0, true);
+		reg_ns += fmmsim_now_ns() - t;
+		fmmsim_get_stats(&after);
+
+		/* Split or not, it's one object mapped to all GPUs */
+		t = fmmsim_now_ns();
+		if (ret || fmm_map_to_gpu(buf, BIGREG_SIZE, &gpuvm_address)) {
+			fprintf(stderr, "registering %p failed\n", buf);
+			ret = -1;
+		}
+		map_ns += fmmsim_now_ns() - t;
+		if (!ret && (fmm_get_mem_info(buf + BIGREG_SIZE / 2, &info) ||
+			     info.CPUAddress != buf ||
+			     info.SizeInBytes != BIGREG_SIZE ||
+			     info.GPUAddress != gpuvm_address ||
+			     info.NMappedNodes != gpus)) {
+			fprintf(stderr, "bad pointer info for %p\n", buf);
+			ret = -1;
+		}
+
+		if (!ret && (fmm_unmap_from_gpu(buf) ||
+			     fmm_deregister_memory(buf))) {
+			fprintf(stderr, "deregistering %p failed\n", buf);
+			ret = -1;
+		}
+		munmap(buf, BIGREG_SIZE);
+	}
+
+	if (!ret) {
+		printf("%16s %16s %16s\n", "register ms", "map ms", "BOs");
+		printf("%16.1f %16.1f %16lu\n", reg_ns / 1e6 / BIGREG_ROUNDS,
+		       map_ns / 1e6 / BIGREG_ROUNDS,
+		       (unsigned long)(after.allocs - before.allocs));
+	}
+
+	if (fmmsim_check())
+		ret = -1;
+
+	return ret;
+}
+
+/* Allocation of large paged system memory buffers with 2MB pages
+ * requested, followed by random CPU accesses to their 4KB pages. Run
+ * with HSA_PAGED_HUGE_POPULATE=1 to fault in huge pages up front and
+ * with HSA_PAGED_HUGE_PAGES to choose how they are backed.
+ */
+#define HUGEPAGED_SIZE (64ULL << 20)
+#define HUGEPAGED_ROUNDS 8
+#define HUGEPAGED_TOUCHES (1UL << 20)
+
+static int bench_hugepaged(void)
+{
+	uint64_t alloc_ns = 0, touch_ns = 0, free_ns = 0, t;
+	uint64_t seed = 0x510e527fade682d1ULL;
+	unsigned int i, huge = 0;
+	HsaPointerInfo info;
+	HsaMemFlags flags;
+	unsigned long j;
+	int ret = 0;
+	char *buf;
+
+	flags.Value = 0;
+	flags.ui32.HostAccess = 1;
+	flags.ui32.PageSize = HSA_PAGE_SIZE_2MB;
+
+	for (i = 0; i < HUGEPAGED_ROUNDS && !ret; i++) {
+		t = fmmsim_now_ns();
+		buf = fmm_allocate_host(0, NULL, HUGEPAGED_SIZE, flags);
+		alloc_ns += fmmsim_now_ns() - t;
+		if (!buf) {
+			fprintf(stderr, "allocating paged memory failed\n");
+			return -1;
+		}
+
+		t = fmmsim_now_ns();
+		for (j = 0; j < HUGEPAGED_TOUCHES; j++)
+			buf[(fmmsim_rand(&seed) % (HUGEPAGED_SIZE / 4096)) *
+			    4096]++;
+		touch_ns += fmmsim_now_ns() - t;
+
+		if (fmm_get_mem_info(buf, &info) ||
+		    info.SizeInBytes != HUGEPAGED_SIZE) {
+			fprintf(stderr, "bad pointer info for %p\n", buf);
+			ret = -1;
+		} else if (info.MemFlags.ui32.PageSize == HSA_PAGE_SIZE_2MB) {
+			huge++;
+		}
+
+		t = fmmsim_now_ns();
+		if (fmm_release(buf)) {
+			fprintf(stderr, "releasing %p failed\n", buf);
+			ret = -1;
+		}
+		free_ns += fmmsim_now_ns() - t;
+	}
+
+	if (!ret) {
+		printf("%16s %16s %16s %16s\n", "alloc ms", "touch ns/op",
+		       "free ms", "huge");
+		printf("%16.1f %16.1f %16.1f %12u/%u\n",
+		       alloc_ns / 1e6 / HUGEPAGED_ROUNDS,
+		       (double)touch_ns / HUGEPAGED_ROUNDS / HUGEPAGED_TOUCHES,
+		       free_ns / 1e6 / HUGEPAGED_ROUNDS, huge, HUGEPAGED_ROUNDS);
+	}
+
+	if (fmmsim_check())
+		ret = -1;
+
+	return ret;
+}
+
+/* Time to first use of large paged system memory buffers requested from
+ * a GPU node: allocation followed by one write to every page, without and
+ * with the Populate flag. The best of POPULATE_ROUNDS is reported. Sizes
+ * that don't fit in half of the physical memory are skipped.
+ */
+#define POPULATE_ROUNDS 3
+
+static int populate_first_use(uint32_t node, uint64_t size, bool populate,
+			      uint64_t *alloc_ns, uint64_t *touch_ns)
+{
+	HsaMemFlags flags;
+	uint64_t off, t;
+	char *buf;
+
+	flags.Value = 0;
+	flags.ui32.HostAccess = 1;
+	flags.ui32.Populate = populate;
+
+	t = fmmsim_now_ns();
+	buf = fmm_allocate_host(node, NULL, size, flags);
+	*alloc_ns = fmmsim_now_ns() - t;
+	if (!buf) {
+		fprintf(stderr, "allocating %lu MB failed\n",
+			(unsigned long)(size >> 20));
+		return -1;
+	}
+
+	t = fmmsim_now_ns();
+	for (off = 0; off < size; off += page_size)
+		buf[off] = 1;
+	*touch_ns = fmmsim_now_ns() - t;
+
+	if (fmm_release(buf)) {
+		fprintf(stderr, "releasing %p failed\n", buf);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int bench_populate(void)
+{
+	static const unsigned int sizes_gb[] = {1, 8, 64};
+	uint64_t phys = (uint64_t)sysconf(_SC_PHYS_PAGES) * page_size;
+	uint64_t alloc_ns[2], touch_ns[2], best[2], a, t, size;
+	uint32_t node = fmmsim_gpu_node(0);
+	unsigned int s, p, r;
+
+	printf("%8s %12s %12s %12s %12s %12s %12s\n", "GB",
+	       "alloc ms", "touch ms", "total ms",
+	       "pop alloc", "pop touch", "pop total");
+	for (s = 0; s < sizeof(sizes_gb) / sizeof(sizes_gb[0]); s++) {
+		size = (uint64_t)sizes_gb[s] << 30;
+		if (size > phys / 2) {
+			printf("%8u %12s\n", sizes_gb[s], "skipped");
+			continue;
+		}
+
+		best[0] = best[1] = ~0ULL;
+		for (r = 0; r < POPULATE_ROUNDS; r++) {
+			for (p = 0; p < 2; p++) {
+				if (populate_first_use(node, size, p, &a, &t))
+					return -1;
+				if (a + t < best[p]) {
+					best[p] = a + t;
+					alloc_ns[p] = a;
+					touch_ns[p] = t;
+				}
+			}
+		}
+
+		printf("%8u %12.1f %12.1f %12.1f %12.1f %12.1f %12.1f\n",
+		       sizes_gb[s], alloc_ns[0] / 1e6, touch_ns[0] / 1e6,
+		       (alloc_ns[0] + touch_ns[0]) / 1e6, alloc_ns[1] / 1e6,
+		       touch_ns[1] / 1e6, (alloc_ns[1] + touch_ns[1]) / 1e6);
+	}
+
+	return fmmsim_check();
+}
+
+/* Placement of paged system memory interleaved across the CPU nodes of
+ * all GPUs, compared to memory requested from the first GPU. Prints how
+ * many pages each NUMA node got. With one NUMA node nothing is
+ * interleaved.
+ */
+#define INTERLEAVE_SIZE (256ULL << 20)
+
+static int interleave_placement(const char *name, uint32_t *nodes,
+				unsigned int n, bool interleave)
+{
+	unsigned long count = INTERLEAVE_SIZE / page_size, i;
+	unsigned long per_node[64] = {0};
+	HsaPointerInfo info;
+	HsaMemFlags flags;
+	void **pages;
+	int *status;
+	char *buf;
+	int ret = 0;
+
+	flags.Value = 0;
+	flags.ui32.HostAccess = 1;
+	flags.ui32.Populate = 1;
+	if (interleave)
+		buf = fmm_allocate_host_interleaved(n, nodes, NULL,
+						    INTERLEAVE_SIZE, flags);
+	else
+		buf = fmm_allocate_host(nodes[0], NULL, INTERLEAVE_SIZE, flags);
+	pages = calloc(count, sizeof(*pages));
+	status = calloc(count, sizeof(*status));
+	if (!buf || !pages || !status) {
+		fprintf(stderr, "allocating paged memory failed\n");
+		ret = -1;
+		goto out;
+	}
+
+	for (i = 0; i < count; i++)
+		pages[i] = buf + i * page_size;
+	if (numa_move_pages(0, count, pages, NULL, status, 0)) {
+		fprintf(stderr, "querying page placement failed\n");
+		ret = -1;
+		goto out;
+	}
+	for (i = 0; i < count; i++)
+		if (status[i] >= 0 && status[i] < 64)
+			per_node[status[i]]++;
+
+	if (fmm_get_mem_info(buf, &info)) {
+		fprintf(stderr, "bad pointer info for %p\n", buf);
+		ret = -1;
+		goto out;
+	}
+	printf("%12s %12s %8u", name,
+	       info.MemFlags.ui32.Interleave ? "yes" : "no", info.Node);
+	for (i = 0; i < 64; i++)
+		if (per_node[i])
+			printf(" %lu:%lu", i, per_node[i]);
+	printf("\n");
+
+out:
+	if (buf && fmm_release(buf))
+		ret = -1;
+	free(pages);
+	free(status);
+	return ret;
+}
+
+static int bench_interleave(unsigned int gpus)
+{
+	uint32_t nodes[64];
+	unsigned int g;
+
+	if (gpus > 64)
+		return -1;
+	for (g = 0; g < gpus; g++)
+		nodes[g] = fmmsim_gpu_node(g);
+
+	printf("%12s %12s %8s %s\n", "policy", "interleaved", "node",
+	       "node:pages");
+	if (interleave_placement("gpu0", nodes, gpus, false) ||
+	    interleave_placement("interleave", nodes, gpus, true))
+		return -1;
+
+	return fmmsim_check();
+}
+
+/* Virtual size of the process in MB */
+static uint64_t vm_size_mb(void)
+{
+	char line[256];
+	uint64_t kb = 0;
+	FILE *f;
+
+	f = fopen("/proc/self/status", "r");
+	if (!f)
+		return 0;
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "VmSize: %lu kB", &kb) == 1)
+			break;
+	fclose(f);
+
+	return kb >> 10;
+}
+
+/* Allocate address space for 64GB of buffers and compare the virtual
+ * size before and after. Run with HSA_RESERVE_SVM=1 and HSA_SVM_GROW_MB
+ * to reserve the SVM aperture on demand. A foreign mapping is placed
+ * right after the reserved window, growing must not replace it.
+ */
+#define SVMGROW_AREAS 256
+#define SVMGROW_AREA_SIZE (256ULL << 20)
+
+static int bench_svmgrow(void)
+{
+	const uint64_t step = 2ULL << 20;
+	uint64_t vsz_init = vm_size_mb(), vsz_used, alloc_ns, t;
+	void *areas[SVMGROW_AREAS], *first, *foreign = NULL;
+	unsigned long i, failed = 0;
+	uint64_t a;
+	int ret = 0;
+
+	first = fmmsim_va_alloc(page_size, page_size);
+	if (!first)
+		return -1;
+
+	if (getenv("HSA_SVM_GROW_MB")) {
+		/* Only fits where nothing is reserved */
+		for (a = ((uint64_t)first + step) & ~(step - 1), i = 0;
+		     i < (1UL << 20) && !foreign; a += step, i++) {
+			void *p = mmap((void *)a, page_size,
+				       PROT_READ | PROT_WRITE,
+				       MAP_ANONYMOUS | MAP_PRIVATE |
+				       MAP_FIXED_NOREPLACE, -1, 0);
+
+			if (p == (void *)a)
+				foreign = p;
+			else if (p != MAP_FAILED)
+				munmap(p, page_size);
+		}
+		if (!foreign) {
+			fprintf(stderr, "No unreserved address after %p\n",
+				first);
+			ret = -1;
+			goto out;
+		}
+		memset(foreign, 0x5a, page_size);
+	}
+
+	t = fmmsim_now_ns();
+	for (i = 0; i < SVMGROW_AREAS; i++) {
+		areas[i] = fmmsim_va_alloc(SVMGROW_AREA_SIZE, page_size);
+		if (!areas[i])
+			failed++;
+		else if (foreign && (uint64_t)foreign - (uint64_t)areas[i] <
+			 SVMGROW_AREA_SIZE) {
+			fprintf(stderr, "%p allocated over foreign mapping\n",
+				areas[i]);
+			ret = -1;
+		}
+	}
+	alloc_ns = fmmsim_now_ns() - t;
+	vsz_used = vm_size_mb();
+
+	printf("%12s %12s %12s %12s\n", "VSZ init MB", "VSZ used MB",
+	       "alloc ns/op", "failed");
+	printf("%12lu %12lu %12.0f %12lu\n", vsz_init, vsz_used,
+	       (double)alloc_ns / SVMGROW_AREAS, failed);
+
+	if (foreign && *(volatile char *)foreign != 0x5a) {
+		fprintf(stderr, "Foreign mapping was replaced\n");
+		ret = -1;
+	}
+	if (failed)
+		ret = -1;
+
+	for (i = 0; i < SVMGROW_AREAS; i++)
+		if (areas[i])
+			fmmsim_va_free(areas[i], SVMGROW_AREA_SIZE);
+out:
+	fmmsim_va_free(first, page_size);
+	if (foreign)
+		munmap(foreign, page_size);
+
+	if (fmmsim_check())
+		ret = -1;
+
+	return ret;
+}
+
+/* Churn host-accessible device BOs and report the memory mappings they
+ * use. With vm.max_map_count lowered below what max_live BOs need,
+ * allocations are refused before the limit and freeing everything must
+ * not leave holes in reserved apertures.
+ */
+static int bench_vmacount(unsigned long max_live, unsigned long ops)
+{
+	buffer_t *live = calloc(max_live, sizeof(*live));
+	uint32_t gpu_id = fmmsim_gpu_id(0);
+	uint64_t seed = 0x9b05688c2b3e6c1fULL;
+	uint64_t alloc_ns = 0, t;
+	HsaVirtualMemoryStats before, churn, after;
+	HsaMemFlags flags;
+	unsigned long i, refused = 0;
+	int ret = 0;
+
+	if (!live)
+		return -1;
+
+	flags.Value = 0;
+	flags.ui32.NonPaged = 1;
+	flags.ui32.HostAccess = 1;
+
+	fmm_get_virtual_memory_stats(&before);
+	for (i = 0; i < ops; i++) {
+		buffer_t *b = &live[fmmsim_rand(&seed) % max_live];
+
+		if (b->addr) {
+			fmm_release(b->addr);
+			b->addr = NULL;
+			continue;
+		}
+
+		b->size = random_size(&seed);
+		t = fmmsim_now_ns();
+		b->addr = fmm_allocate_device(gpu_id, NULL, b->size, flags);
+		alloc_ns += fmmsim_now_ns() - t;
+		if (!b->addr)
+			refused++;
+	}
+	fmm_get_virtual_memory_stats(&churn);
+
+	for (i = 0; i < max_live; i++)
+		if (live[i].addr)
+			fmm_release(live[i].addr);
+	fmm_flush_deferred_frees();
+	fmm_get_virtual_memory_stats(&after);
+
+	printf("%12s %12s %12s %12s %12s %12s\n", "", "mappings", "limit",
+	       "aperture", "areas", "refused");
+	printf("%12s %12lu %12lu %12lu %12lu %12s\n", "start",
+	       before.MapCount, before.MaxMapCount, before.ApertureMappings,
+	       before.ApertureAreas, "");
+	printf("%12s %12lu %12lu %12lu %12lu %12lu\n", "churn",
+	       churn.MapCount, churn.MaxMapCount, churn.ApertureMappings,
+	       churn.ApertureAreas, refused);
+	printf("%12s %12lu %12lu %12lu %12lu %12s\n", "freed",
+	       after.MapCount, after.MaxMapCount, after.ApertureMappings,
+	       after.ApertureAreas, "");
+	printf("alloc ns/op %.0f, %lu recounts\n",
+	       (double)alloc_ns / ops, after.Recounts);
+
+	if (refused != churn.Refused - before.Refused) {
+		fprintf(stderr, "%lu allocations failed, %lu refused\n",
+			refused, churn.Refused - before.Refused);
+		ret = -1;
+	}
+	/* Cached BOs and sub-allocator chunks may stay, and malloc and
+	 * background threads add a few more mappings. Holes punched into
+	 * reservations would leave many more than the remaining areas
+	 * explain.
+	 */
+	if (after.MapCount - before.MapCount >
+	    after.ApertureMappings - before.ApertureMappings + 8) {
+		fprintf(stderr, "Mappings left after freeing all BOs\n");
+		ret = -1;
+	}
+
+	free(live);
+
+	if (fmmsim_check())
+		ret = -1;
+
+	return ret;
+}
+
+/* Churn device BOs and poll the SVM aperture statistics. Without the BO
+ * cache and the sub-allocator, every live BO is one object and one area.
+ */
+static int bench_apstats(unsigned long max_live, unsigned long ops)
+{
+	buffer_t *live = calloc(max_live, sizeof(*live));
+	uint32_t gpu_id = fmmsim_gpu_id(0);
+	uint64_t seed = 0x3c6ef372fe94f82bULL;
+	uint64_t stats_ns = 0, t;
+	HsaApertureStats before, churn, after;
+	HsaMemFlags flags;
+	unsigned long i, n_live = 0, polls = 0;
+	bool exact = !getenv("HSA_BO_CACHE_MB") && !getenv("HSA_SUBALLOC");
+	int ret = 0;
+
+	if (!live)
+		return -1;
+
+	flags.Value = 0;
+	flags.ui32.NonPaged = 1;
+
+	fmm_flush_deferred_frees();
+	if (fmm_get_aperture_stats(0, HSA_MEMORY_APERTURE_SVM, &before)) {
+		free(live);
+		return -1;
+	}
+	for (i = 0; i < ops; i++) {
+		buffer_t *b = &live[fmmsim_rand(&seed) % max_live];
+
+		if (b->addr) {
+			fmm_release(b->addr);
+			b->addr = NULL;
+			n_live--;
+		} else {
+			b->size = random_size(&seed);
+			b->addr = fmm_allocate_device(gpu_id, NULL, b->size,
+						      flags);
+			if (!b->addr) {
+				ret = -1;
+				break;
+			}
+			n_live++;
+		}
+
+		if (i % 64 == 0) {
+			t = fmmsim_now_ns();
+			fmm_get_aperture_stats(0, HSA_MEMORY_APERTURE_SVM,
+					       &churn);
+			stats_ns += fmmsim_now_ns() - t;
+			polls++;
+		}
+	}
+	fmm_flush_deferred_frees();
+	fmm_get_aperture_stats(0, HSA_MEMORY_APERTURE_SVM, &churn);
+
+	for (i = 0; i < max_live; i++)
+		if (live[i].addr)
+			fmm_release(live[i].addr);
+	fmm_flush_deferred_frees();
+	fmm_get_aperture_stats(0, HSA_MEMORY_APERTURE_SVM, &after);
+
+	printf("%8s %10s %12s %10s %12s %12s %10s %12s\n", "", "objects",
+	       "object MB", "areas", "area MB", "unbacked MB", "holes",
+	       "largest MB");
+	printf("%8s %10lu %12lu %10lu %12lu %12lu %10lu %12lu\n", "start",
+	       before.ObjectCount, before.ObjectBytes >> 20,
+	       before.AreaCount, before.AreaBytes >> 20,
+	       before.UnbackedBytes >> 20, before.HoleCount,
+	       before.LargestHole >> 20);
+	printf("%8s %10lu %12lu %10lu %12lu %12lu %10lu %12lu\n", "churn",
+	       churn.ObjectCount, churn.ObjectBytes >> 20,
+	       churn.AreaCount, churn.AreaBytes >> 20,
+	       churn.UnbackedBytes >> 20, churn.HoleCount,
+	       churn.LargestHole >> 20);
+	printf("%8s %10lu %12lu %10lu %12lu %12lu %10lu %12lu\n", "freed",
+	       after.ObjectCount, after.ObjectBytes >> 20,
+	       after.AreaCount, after.AreaBytes >> 20,
+	       after.UnbackedBytes >> 20, after.HoleCount,
+	       after.LargestHole >> 20);
+	printf("stats ns/query %.0f, %lu live BOs\n",
+	       polls ? (double)stats_ns / polls : 0.0, n_live);
+
+	if (exact && (churn.ObjectCount - before.ObjectCount != n_live ||
+		      churn.AreaCount - before.AreaCount != n_live)) {
+		fprintf(stderr, "Objects or areas don't match live BOs\n");
+		ret = -1;
+	}
+	if (churn.ObjectBytes > churn.AreaBytes ||
+	    churn.AreaBytes + churn.GuardBytes > churn.ReservedBytes ||
+	    (!getenv("HSA_SVM_GROW_MB") &&
+	     churn.LargestHole > churn.ReservedBytes) ||
+	    (churn.HoleCount && !churn.LargestHole)) {
+		fprintf(stderr, "Inconsistent aperture statistics\n");
+		ret = -1;
+	}
+	if (exact && (after.ObjectCount != before.ObjectCount ||
+		      after.AreaBytes != before.AreaBytes)) {
+		fprintf(stderr, "Statistics not back to start after freeing\n");
+		ret = -1;
+	}
+
+	free(live);
+
+	if (fmmsim_check())
+		ret = -1;
+
+	return ret;
+}
+
+/* Calls as hsaKmt* records them, see src/memory.c */
+static void *traced_alloc(uint32_t gpu, uint64_t size, HsaMemFlags flags)
+{
+	uint64_t trace = fmm_trace_begin();
+	uint32_t gpu_id = flags.ui32.NonPaged ? fmmsim_gpu_id(gpu) : 0;
+	uint32_t node = gpu_id ? fmmsim_gpu_node(gpu) : 0;
+	void *mem;
+
+	if (gpu_id)
+		mem = fmm_allocate_device(gpu_id, NULL, size, flags);
+	else
+		mem = fmm_allocate_host(node, NULL, size, flags);
+	fmm_trace_end(trace, FMM_TRACE_ALLOC, mem, size, node,
+		      fmm_trace_gpus(trace, &gpu_id, gpu_id ? 1 : 0, false),
+		      flags.Value, mem ? HSAKMT_STATUS_SUCCESS :
+					 HSAKMT_STATUS_NO_MEMORY);
+	return mem;
+}
+
+static HSAKMT_STATUS traced_register(void *addr, uint64_t size,
+				     uint32_t gpu)
+{
+	uint64_t trace = fmm_trace_begin();
+	uint32_t *gpu_ids = malloc(sizeof(*gpu_ids));
+	HsaMemFlags flags;
+	HSAKMT_STATUS ret;
+	uint64_t mask;
+
+	if (!gpu_ids)
+		return HSAKMT_STATUS_NO_MEMORY;
+	gpu_ids[0] = fmmsim_gpu_id(gpu);
+	mask = fmm_trace_gpus(trace, gpu_ids, 1, false);
+	ret = fmm_register_memory(addr, size, gpu_ids, sizeof(*gpu_ids), true);
+	if (ret != HSAKMT_STATUS_SUCCESS)
+		free(gpu_ids);
+	flags.Value = 0;
+	flags.ui32.CoarseGrain = 1;
+	fmm_trace_end(trace, FMM_TRACE_REGISTER, addr, size, 0, mask,
+		      flags.Value, ret);
+	return ret;
+}
+
+static HSAKMT_STATUS traced_map(void *addr, uint64_t size, uint32_t gpu)
+{
+	uint64_t trace = fmm_trace_begin();
+	uint32_t gpu_id = fmmsim_gpu_id(gpu);
+	HSAKMT_STATUS ret;
+
+	ret = fmm_map_to_gpu_nodes(addr, size, &gpu_id, 1, NULL);
+	fmm_trace_end(trace, FMM_TRACE_MAP, addr, size, 0,
+		      fmm_trace_gpus(trace, &gpu_id, 1, false), 0, ret);
+	return ret;
+}
+
+static HSAKMT_STATUS traced_op(fmm_trace_op_t op, void *addr, uint64_t size)
+{
+	uint64_t trace = fmm_trace_begin();
+	HSAKMT_STATUS ret;
+
+	if (op == FMM_TRACE_UNMAP)
+		ret = fmm_unmap_from_gpu(addr) ? HSAKMT_STATUS_ERROR :
+						 HSAKMT_STATUS_SUCCESS;
+	else if (op == FMM_TRACE_DEREGISTER)
+		ret = fmm_deregister_memory(addr);
+	else
+		ret = fmm_release(addr);
+	fmm_trace_end(trace, op, addr, size, 0, 0, 0, ret);
+	return ret;
+}
+
+/* Churn BOs and userptrs with the calls recorded like the API does.
+ * Run with and without HSA_TRACE_FILE to see the overhead of tracing,
+ * then replay the trace with fmmreplay.
+ */
+#define TRACE_BATCH 8
+
+static int bench_trace(unsigned long max_live, unsigned long ops,
+		       unsigned int gpus)
+{
+	buffer_t *live = calloc(max_live, sizeof(*live));
+	uint8_t *kind = calloc(max_live, sizeof(*kind));
+	HsaMemoryMapRequest requests[TRACE_BATCH];
+	uint32_t node_ids[1];
+	uint64_t seed = 0x510e527fade682d1ULL, t, trace;
+	HsaMemFlags flags;
+	unsigned long i, j, n;
+	HSAKMT_STATUS err;
+	int ret = 0;
+
+	/* 0: free, 1: BO, 2: mapped BO, 3: userptr */
+	if (!live || !kind) {
+		free(live);
+		free(kind);
+		return -1;
+	}
+
+	t = fmmsim_now_ns();
+	for (i = 0; i < ops && !ret; i++) {
+		unsigned long slot = fmmsim_rand(&seed) % max_live;
+		buffer_t *b = &live[slot];
+		uint32_t gpu = fmmsim_rand(&seed) % gpus;
+
+		switch (kind[slot]) {
+		case 0:
+			b->size = random_size(&seed);
+			if (fmmsim_rand(&seed) % 4) {
+				flags.Value = 0;
+				flags.ui32.NonPaged = fmmsim_rand(&seed) & 1;
+				flags.ui32.HostAccess = !flags.ui32.NonPaged;
+				b->addr = traced_alloc(gpu, b->size, flags);
+				kind[slot] = 1;
+			} else {
+				b->addr = mmap(NULL, b->size,
+					       PROT_READ | PROT_WRITE,
+					       MAP_ANONYMOUS | MAP_PRIVATE,
+					       -1, 0);
+				if (b->addr == MAP_FAILED ||
+				    traced_register(b->addr, b->size, gpu))
+					b->addr = NULL;
+				kind[slot] = 3;
+			}
+			if (!b->addr) {
+				kind[slot] = 0;
+				ret = -1;
+			}
+			break;
+		case 1:
+			if (fmmsim_rand(&seed) & 1) {
+				err = traced_map(b->addr, b->size, gpu);
+				kind[slot] = 2;
+			} else {
+				err = traced_op(FMM_TRACE_FREE, b->addr,
+						b->size);
+				kind[slot] = 0;
+			}
+			ret = err ? -1 : 0;
+			break;
+		case 2:
+			ret = traced_op(FMM_TRACE_UNMAP, b->addr, b->size) ?
+				-1 : 0;
+			kind[slot] = 1;
+			break;
+		default:
+			ret = traced_op(FMM_TRACE_DEREGISTER, b->addr,
+					b->size) ? -1 : 0;
+			munmap(b->addr, b->size);
+			kind[slot] = 0;
+			break;
+		}
+
+		if (i % 256 != 255)
+			continue;
+
+		/* Map a few unmapped BOs in one batch */
+		node_ids[0] = fmmsim_gpu_node(gpu);
+		for (j = n = 0; j < max_live && n < TRACE_BATCH; j++) {
+			if (kind[j] != 1)
+				continue;
+			requests[n].MemoryAddress = live[j].addr;
+			requests[n].SizeInBytes = live[j].size;
+			requests[n].NumberOfNodes = 1;
+			requests[n].NodeArray = node_ids;
+			kind[j] = 2;
+			n++;
+		}
+		if (!n)
+			continue;
+		trace = fmm_trace_begin();
+		err = fmm_map_batch(requests, n, true);
+		fmm_trace_batch(trace, requests, n, true);
+		if (err)
+			ret = -1;
+	}
+	t = fmmsim_now_ns() - t;
+
+	for (i = 0; i < max_live; i++) {
+		if (kind[i] == 3) {
+			traced_op(FMM_TRACE_DEREGISTER, live[i].addr,
+				  live[i].size);
+			munmap(live[i].addr, live[i].size);
+		} else if (kind[i]) {
+			traced_op(FMM_TRACE_FREE, live[i].addr, live[i].size);
+		}
+	}
+
+	printf("%12s %12s\n", "tracing", "ns/op");
+	printf("%12s %12.0f\n", fmm_trace_begin() ? "on" : "off",
+	       (double)t / ops);
+
+	free(kind);
+	free(live);
+
+	if (ret)
+		fprintf(stderr, "Call failed after %lu operations\n", i);
+	if (fmmsim_check())
+		ret = -1;
+
+	return ret;
+}
+
+/* Allocations from three call sites as hsaKmt* tracks them, see
+ * src/memory.c. Each must be a separate function to be its own site.
+ */
+static __attribute__((noinline)) void *tracked_alloc(uint64_t size)
+{
+	HsaMemFlags flags = { .ui32.HostAccess = 1 };
+	void *mem = fmm_allocate_host(0, NULL, size, flags);
+
+	fmm_track_allocation(mem);
+	return mem;
+}
+
+static __attribute__((noinline)) void *leaked_alloc(uint64_t size)
+{
+	HsaMemFlags flags = { .ui32.HostAccess = 1 };
+	void *mem = fmm_allocate_host(0, NULL, size, flags);
+
+	fmm_track_allocation(mem);
+	return mem;
+}
+
+static __attribute__((noinline)) HSAKMT_STATUS tracked_register(void *addr,
+								uint64_t size)
+{
+	HSAKMT_STATUS ret = fmm_register_memory(addr, size, NULL, 0, true);
+
+	if (ret == HSAKMT_STATUS_SUCCESS)
+		fmm_track_allocation(addr);
+	return ret;
+}
+
+/* BO and userptr churn with 1 in 16 allocations leaked from their own
+ * call site. With HSA_ALLOC_TRACK=1 the leaked memory must be found
+ * exactly, and all sites must be back to 0 live bytes once everything
+ * is freed.
+ */
+#define LEAKS_SITES 16
+
+static int bench_leaks(unsigned long max_live, unsigned long ops)
+{
+	buffer_t *live = calloc(max_live, sizeof(*live));
+	uint8_t *kind = calloc(max_live, sizeof(*kind));
+	HsaAllocationSite sites[LEAKS_SITES];
+	uint64_t seed = 0x9b05688c2b3e6c1fULL, t, leaked = 0, sum;
+	unsigned long i, n_leaked = 0;
+	uint32_t n, j, sample = 0;
+	int ret = 0;
+
+	/* 0: free, 1: BO, 2: leaked BO, 3: userptr */
+	if (!live || !kind) {
+		free(live);
+		free(kind);
+		return -1;
+	}
+
+	t = fmmsim_now_ns();
+	for (i = 0; i < ops && !ret; i++) {
+		unsigned long slot = fmmsim_rand(&seed) % max_live;
+		buffer_t *b = &live[slot];
+
+		switch (kind[slot]) {
+		case 0:
+			b->size = random_size(&seed);
+			if (!(fmmsim_rand(&seed) % 16)) {
+				b->addr = leaked_alloc(b->size);
+				kind[slot] = 2;
+			} else if (fmmsim_rand(&seed) % 4) {
+				b->addr = tracked_alloc(b->size);
+				kind[slot] = 1;
+			} else {
+				b->addr = mmap(NULL, b->size,
+					       PROT_READ | PROT_WRITE,
+					       MAP_ANONYMOUS | MAP_PRIVATE,
+					       -1, 0);
+				if (b->addr == MAP_FAILED ||
+				    tracked_register(b->addr, b->size))
+					b->addr = NULL;
+				kind[slot] = 3;
+			}
+			if (!b->addr) {
+				kind[slot] = 0;
+				ret = -1;
+			} else if (kind[slot] == 2) {
+				leaked += b->size;
+				n_leaked++;
+			}
+			break;
+		case 1:
+			ret = fmm_release(b->addr) ? -1 : 0;
+			kind[slot] = 0;
+			break;
+		case 2:
+			break;
+		default:
+			ret = fmm_deregister_memory(b->addr) ? -1 : 0;
+			munmap(b->addr, b->size);
+			kind[slot] = 0;
+			break;
+		}
+	}
+	t = fmmsim_now_ns() - t;
+
+	for (i = 0; i < max_live; i++) {
+		if (kind[i] == 1) {
+			fmm_release(live[i].addr);
+			kind[i] = 0;
+		} else if (kind[i] == 3) {
+			fmm_deregister_memory(live[i].addr);
+			munmap(live[i].addr, live[i].size);
+			kind[i] = 0;
+		}
+	}
+	fmm_flush_deferred_frees();
+
+	n = LEAKS_SITES;
+	if (fmm_get_allocation_sites(sites, &n) == HSAKMT_STATUS_SUCCESS) {
+		sample = sites[0].SampleRate;
+		for (j = 0, sum = 0; j < n; j++)
+			sum += sites[j].LiveBytes;
+		/* Sampling only estimates what leaked */
+		if (sample == 1 && (sum != leaked || n < 3 ||
+				    sites[0].LiveBytes != leaked ||
+				    sites[0].LiveCount != n_leaked)) {
+			fprintf(stderr, "Leaked %lu bytes in %lu allocations, "
+				"found %lu bytes, top site %lu bytes in %lu\n",
+				leaked, n_leaked, sum, sites[0].LiveBytes,
+				sites[0].LiveCount);
+			ret = -1;
+		}
+		fmm_dump_allocation_sites(3);
+	}
+
+	printf("%12s %12s %12s %12s\n", "sampling", "ns/op", "leaked",
+	       "reported");
+	printf("%12u %12.0f %12lu %12lu\n", sample,
+	       (double)t / ops, leaked, sample ? sites[0].LiveBytes : 0);
+
+	for (i = 0; i < max_live; i++)
+		if (kind[i] == 2)
+			fmm_release(live[i].addr);
+	fmm_flush_deferred_frees();
+
+	n = LEAKS_SITES;
+	if (sample && fmm_get_allocation_sites(sites, &n) ==
+		      HSAKMT_STATUS_SUCCESS) {
+		for (j = 0; j < n; j++)
+			if (sites[j].LiveBytes || sites[j].LiveCount) {
+				fprintf(stderr, "Site %u still has %lu live bytes\n",
+					j, sites[j].LiveBytes);
+				ret = -1;
+			}
+		if (sites[n - 1].PeakBytes == 0)
+			ret = -1;
+	}
+
+	free(kind);
+	free(live);
+
+	if (fmmsim_check())
+		ret = -1;
+
+	return ret;
+}
+
+/* Pointer info queries from several threads while another thread keeps
+ * allocating and freeing BOs. Queries only take the aperture lock for
+ * reading, so query throughput should scale with the number of threads
+ * and allocations should not be starved.
+ */
+#define MT_CHURN_BOS 1000
+
+typedef struct {
+	buffer_t *live;
+	unsigned long n_live;
+	unsigned long ops;
+	uint64_t seed;
+	uint64_t ns;
+	int ret;
+} mt_query_t;
+
+typedef struct {
+	volatile bool stop;
+	uint64_t seed;
+	unsigned long ops;
+	uint64_t ns;
+	int ret;
+} mt_churn_t;
+
+static void *mt_query_thread(void *arg)
+{
+	mt_query_t *q = arg;
+	HsaPointerInfo info;
+	unsigned long i;
+	uint64_t t;
+
+	t = fmmsim_now_ns();
+	for (i = 0; i < q->ops; i++) {
+		buffer_t *b = &q->live[fmmsim_rand(&q->seed) % q->n_live];
+		char *addr = (char *)b->addr + (fmmsim_rand(&q->seed) % b->size);
+
+		if (fmm_get_mem_info(addr, &info) ||
+		    info.GPUAddress != (HSAuint64)b->addr ||
+		    info.SizeInBytes != b->size) {
+			fprintf(stderr, "bad pointer info for %p\n", addr);
+			q->ret = -1;
+			break;
+		}
+	}
+	q->ns = fmmsim_now_ns() - t;
+
+	return NULL;
+}
+
+static void *mt_churn_thread(void *arg)
+{
+	mt_churn_t *c = arg;
+	buffer_t live[MT_CHURN_BOS] = {{0}};
+	uint32_t gpu_id = fmmsim_gpu_id(0);
+	HsaMemFlags flags;
+	unsigned long i;
+	uint64_t t;
+
+	flags.Value = 0;
+	flags.ui32.NonPaged = 1;
+	flags.ui32.NoSubstitute = 1;
+
+	while (!c->stop) {
+		buffer_t *b = &live[fmmsim_rand(&c->seed) % MT_CHURN_BOS];
+
+		t = fmmsim_now_ns();
+		if (b->addr) {
+			fmm_release(b->addr);
+			b->addr = NULL;
+		} else {
+			b->size = random_size(&c->seed);
+			b->addr = fmm_allocate_device(gpu_id, NULL, b->size, flags);
+			if (!b->addr) {
+				fprintf(stderr, "BO allocation failed\n");
+				c->ret = -1;
+				break;
+			}
+		}
+		c->ns += fmmsim_now_ns() - t;
+		c->ops++;
+	}
+
+	for (i = 0; i < MT_CHURN_BOS; i++)
+		if (live[i].addr)
+			fmm_release(live[i].addr);
+
+	return NULL;
+}
+
+static int bench_mt(unsigned long max_live, unsigned long ops,
+		    unsigned int max_threads)
+{
+	/* Every BO has a CPU mapping, stay below vm.max_map_count */
+	unsigned long n_live = max_live < 10000 ? max_live : 10000;
+	buffer_t *live = calloc(n_live, sizeof(*live));
+	mt_query_t *queries = calloc(max_threads, sizeof(*queries));
+	pthread_t *threads = calloc(max_threads, sizeof(*threads));
+	uint32_t gpu_id = fmmsim_gpu_id(0);
+	uint64_t seed = 0x3c6ef372fe94f82bULL;
+	unsigned int n, i;
+	HsaMemFlags flags;
+	unsigned long j;
+	int ret = 0;
+
+	if (!live || !queries || !threads || !n_live) {
+		ret = -1;
+		goto out;
+	}
+
+	flags.Value = 0;
+	flags.ui32.NonPaged = 1;
+	flags.ui32.NoSubstitute = 1;
+
+	for (j = 0; j < n_live; j++) {
+		live[j].size = random_size(&seed);
+		live[j].addr = fmm_allocate_device(gpu_id, NULL, live[j].size, flags);
+		if (!live[j].addr) {
+			fprintf(stderr, "BO allocation failed\n");
+			ret = -1;
+			goto out;
+		}
+	}
+
+	printf("%12s %16s %16s %16s\n", "threads", "query ns/op",
+	       "queries/s", "alloc/free ns/op");
+	for (n = 1; n <= max_threads && !ret; n *= 2) {
+		mt_churn_t churn = { .seed = seed };
+		pthread_t churn_thread;
+		uint64_t t, query_ns = 0;
+
+		if (pthread_create(&churn_thread, NULL, mt_churn_thread, &churn)) {
+			ret = -1;
+			break;
+		}
+
+		t = fmmsim_now_ns();
+		for (i = 0; i < n; i++) {
+			queries[i] = (mt_query_t) {
+				.live = live,
+				.n_live = n_live,
+				.ops = ops,
+				.seed = seed + i + 1,
+			};
+			if (pthread_create(&threads[i], NULL, mt_query_thread,
+					   &queries[i])) {
+				n = i;
+				ret = -1;
+				break;
+			}
+		}
+		for (i = 0; i < n; i++) {
+			pthread_join(threads[i], NULL);
+			query_ns += queries[i].ns;
+			if (queries[i].ret)
+				ret = -1;
+		}
+		t = fmmsim_now_ns() - t;
+
+		churn.stop = true;
+		pthread_join(churn_thread, NULL);
+		if (churn.ret)
+			ret = -1;
+
+		if (!ret)
+			printf("%12u %16.0f %16.0f %16.0f\n", n,
+			       (double)query_ns / (n * ops),
+			       1e9 * n * ops / t,
+			       churn.ops ? (double)churn.ns / churn.ops : 0.0);
+	}
+
+out:
+	if (live)
+		for (j = 0; j < n_live; j++)
+			if (live[j].addr)
+				fmm_release(live[j].addr);
+	free(threads);
+	free(queries);
+	free(live);
+
+	if (fmmsim_check())
+		ret = -1;
+
+	return ret;
+}
+
+/* BO allocations and userptr registrations from several threads, each
+ * working on its own buffers. With sharded SVM apertures (see
+ * HSA_RESERVE_SVM) threads allocate in different shards and throughput
+ * should scale with the number of threads.
+ */
+#define MTALLOC_BOS 256
+
+typedef struct {
+	unsigned int index;
+	unsigned long ops;
+	uint64_t ns;
+	int ret;
+} mtalloc_thread_t;
+
+static void *mtalloc_thread(void *arg)
+{
+	mtalloc_thread_t *m = arg;
+	buffer_t live[MTALLOC_BOS] = {{0}};
+	char *userptr = (char *)USERPTR_BASE +
+		(uint64_t)m->index * MTALLOC_BOS * 16 * page_size;
+	uint64_t seed = 0x510e527fade682d1ULL + m->index;
+	uint32_t gpu_id = fmmsim_gpu_id(0);
+	HsaPointerInfo info;
+	HsaMemFlags flags;
+	unsigned long i;
+	uint64_t t;
+
+	flags.Value = 0;
+	flags.ui32.NonPaged = 1;
+	flags.ui32.NoSubstitute = 1;
+
+	t = fmmsim_now_ns();
+	for (i = 0; i < m->ops && !m->ret; i++) {
+		unsigned int j = fmmsim_rand(&seed) % MTALLOC_BOS;
+		buffer_t *b = &live[j];
+
+		if (b->addr) {
+			if (j & 1)
+				fmm_deregister_memory(b->addr);
+			else
+				fmm_release(b->addr);
+			b->addr = NULL;
+			continue;
+		}
+
+		b->size = random_size(&seed);
+		if (j & 1) {
+			/* Userptrs don't overlap between threads */
+			b->addr = userptr + j * 16 * page_size;
+			if (fmm_register_memory(b->addr, b->size, NULL, 0, true) ||
+			    fmm_get_mem_info(b->addr, &info) ||
+			    info.CPUAddress != b->addr) {
+				fprintf(stderr, "bad userptr %p\n", b->addr);
+				m->ret = -1;
+			}
+		} else {
+			b->addr = fmm_allocate_device(gpu_id, NULL, b->size, flags);
+			if (!b->addr) {
+				fprintf(stderr, "BO allocation failed\n");
+				m->ret = -1;
+			}
+		}
+	}
+	m->ns = fmmsim_now_ns() - t;
+
+	for (i = 0; i < MTALLOC_BOS; i++) {
+		if (!live[i].addr)
+			continue;
+		if (i & 1)
+			fmm_deregister_memory(live[i].addr);
+		else
+			fmm_release(live[i].addr);
+	}
+
+	return NULL;
+}
+
+static int bench_mtalloc(unsigned long ops, unsigned int max_threads)
+{
+	mtalloc_thread_t *m = calloc(max_threads, sizeof(*m));
+	pthread_t *threads = calloc(max_threads, sizeof(*threads));
+	unsigned int n, i;
+	int ret = 0;
+
+	if (!m || !threads) {
+		ret = -1;
+		goto out;
+	}
+
+	printf("%12s %16s %16s\n", "threads", "ns/op", "ops/s");
+	for (n = 1; n <= max_threads && !ret; n *= 2) {
+		uint64_t t, ns = 0;
+
+		t = fmmsim_now_ns();
+		for (i = 0; i < n; i++) {
+			m[i] = (mtalloc_thread_t) { .index = i, .ops = ops };
+			if (pthread_create(&threads[i], NULL, mtalloc_thread,
+					   &m[i])) {
+				n = i;
+				ret = -1;
+				break;
+			}
+		}
+		for (i = 0; i < n; i++) {
+			pthread_join(threads[i], NULL);
+			ns += m[i].ns;
+			if (m[i].ret)
+				ret = -1;
+		}
+		t = fmmsim_now_ns() - t;
+
+		if (fmmsim_check())
+			ret = -1;
+		if (!ret)
+			printf("%12u %16.0f %16.0f\n", n, (double)ns / (n * ops),
+			       1e9 * n * ops / t);
+	}
+
+out:
+	free(threads);
+	free(m);
+
+	return ret;
+}
+
+/* Remap a few BOs to random subsets of the GPUs with
+ * fmm_map_to_gpu_nodes and check the mapped nodes in the pointer info
+ */
+#define NODES_BOS 16
+
+static uint64_t node_ids_to_gpus(const uint32_t *node_ids, uint32_t n,
+				 unsigned int gpus)
+{
+	uint64_t mask = 0;
+	unsigned int g;
+	uint32_t i;
+
+	for (i = 0; i < n; i++)
+		for (g = 0; g < gpus; g++)
+			if (node_ids[i] == fmmsim_gpu_node(g))
+				mask |= 1ULL << g;
+
+	return mask;
+}
+
+static int bench_nodes(unsigned long ops, unsigned int gpus)
+{
+	void *bos[NODES_BOS] = {NULL};
+	uint32_t gpu_ids[64];
+	uint64_t seed = 0x3c6ef372fe94f82bULL;
+	uint64_t t, gpuvm_address;
+	HsaPointerInfo info;
+	HsaMemFlags flags;
+	unsigned long i;
+	unsigned int g, n;
+	int ret = 0;
+
+	if (gpus > 64)
+		return -1;
+
+	flags.Value = 0;
+	flags.ui32.NonPaged = 1;
+	flags.ui32.NoSubstitute = 1;
+
+	for (i = 0; i < NODES_BOS; i++) {
+		bos[i] = fmm_allocate_device(fmmsim_gpu_id(0), NULL,
+					     page_size << 4, flags);
+		if (!bos[i]) {
+			fprintf(stderr, "BO allocation failed\n");
+			ret = -1;
+			goto out;
+		}
+	}
+
+	t = fmmsim_now_ns();
+	for (i = 0; i < ops; i++) {
+		void *bo = bos[i % NODES_BOS];
+		uint64_t subset = fmmsim_rand(&seed);
+
+		if (gpus < 64)
+			subset &= (1ULL << gpus) - 1;
+		if (!subset)
+			subset = 1;
+		n = 0;
+		for (g = 0; g < gpus; g++)
+			if (subset & (1ULL << g))
+				gpu_ids[n++] = fmmsim_gpu_id(g);
+
+		if (fmm_map_to_gpu_nodes(bo, page_size << 4, gpu_ids, n,
+					 &gpuvm_address) ||
+		    fmm_get_mem_info(bo, &info) || info.NMappedNodes != n ||
+		    node_ids_to_gpus(info.MappedNodes, n, gpus) != subset) {
+			fprintf(stderr, "bad mapping of %p to %u nodes\n", bo, n);
+			ret = -1;
+			goto out;
+		}
+	}
+	t = fmmsim_now_ns() - t;
+
+	printf("%12s %16s\n", "GPUs", "remap ns/op");
+	printf("%12u %16.0f\n", gpus, (double)t / ops);
+
+out:
+	for (i = 0; i < NODES_BOS; i++)
+		if (bos[i])
+			fmm_release(bos[i]);
+
+	return ret;
+}
+
+/* Buffer setup as queue creation does it: allocate, register to one
+ * GPU and map, either in separate steps or with fmm_register_and_map.
+ * Only registration and mapping are timed.
+ */
+static int bench_allocmap(unsigned long ops, unsigned int gpus)
+{
+	uint32_t gpu_id = fmmsim_gpu_id(gpus - 1);
+	uint64_t ns[2] = {0, 0}, t, gpuvm_address;
+	uint32_t *gpu_id_array;
+	HsaPointerInfo info;
+	HsaMemFlags flags;
+	unsigned long i;
+	int fused, r;
+	void *mem;
+
+	flags.Value = 0;
+	flags.ui32.NonPaged = 1;
+	flags.ui32.HostAccess = 1;
+	flags.ui32.ExecuteAccess = 1;
+
+	for (i = 0; i < 2 * ops; i++) {
+		fused = i & 1;
+
+		mem = fmm_allocate_device(gpu_id, NULL, page_size << 2, flags);
+		t = fmmsim_now_ns();
+		if (!mem)
+			r = -1;
+		else if (fused)
+			r = fmm_register_and_map(mem, page_size << 2, &gpu_id, 1,
+						 &gpuvm_address);
+		else {
+			/* fmm_register_memory takes ownership of the array */
+			gpu_id_array = malloc(sizeof(*gpu_id_array));
+			*gpu_id_array = gpu_id;
+			r = fmm_register_memory(mem, page_size << 2, gpu_id_array,
+						sizeof(*gpu_id_array), true) ||
+				fmm_map_to_gpu(mem, page_size << 2,
+					       &gpuvm_address);
+		}
+		ns[fused] += fmmsim_now_ns() - t;
+
+		if (r || fmm_get_mem_info(mem, &info) ||
+		    info.NRegisteredNodes != 1 || info.NMappedNodes != 1 ||
+		    info.MappedNodes[0] != fmmsim_gpu_node(gpus - 1)) {
+			fprintf(stderr, "bad setup of %p\n", mem);
+			return -1;
+		}
+
+		fmm_unmap_from_gpu(mem);
+		fmm_release(mem);
+	}
+
+	printf("%16s %16s\n", "2 calls ns/op", "fused ns/op");
+	printf("%16.0f %16.0f\n", (double)ns[0] / ops, (double)ns[1] / ops);
+
+	return fmmsim_check();
+}
+
+/* Mapping many buffers to all GPUs and unmapping them again, one call
+ * per buffer vs. one batch, as when loading a model
+ */
+static int bench_batch(unsigned long max_live, unsigned int gpus)
+{
+	static const unsigned long levels[] = {1000, 10000};
+	HsaMemoryMapRequest *requests;
+	uint32_t gpu_ids[64], node_ids[64];
+	uint64_t ns[4], t, gpuvm_address;
+	HsaPointerInfo info;
+	HsaMemFlags flags;
+	unsigned long l, n, i;
+	unsigned int g;
+	int ret = 0;
+
+	if (gpus > 64)
+		return -1;
+	for (g = 0; g < gpus; g++) {
+		gpu_ids[g] = fmmsim_gpu_id(g);
+		node_ids[g] = fmmsim_gpu_node(g);
+	}
+
+	flags.Value = 0;
+	flags.ui32.NonPaged = 1;
+	flags.ui32.NoSubstitute = 1;
+
+	printf("%12s %16s %16s %16s %16s\n", "buffers", "map ns/buf",
+	       "batch map ns/buf", "unmap ns/buf", "batch unmap ns/buf");
+	for (l = 0; l < sizeof(levels) / sizeof(levels[0]) &&
+		    levels[l] <= max_live && !ret; l++) {
+		n = levels[l];
+		requests = calloc(n, sizeof(*requests));
+		if (!requests)
+			return -1;
+		for (i = 0; i < n; i++) {
+			requests[i].SizeInBytes = page_size << 4;
+			requests[i].MemoryAddress = fmm_allocate_device(gpu_ids[0],
+					NULL, requests[i].SizeInBytes, flags);
+			requests[i].NumberOfNodes = gpus;
+			requests[i].NodeArray = node_ids;
+			if (!requests[i].MemoryAddress) {
+				fprintf(stderr, "BO allocation failed\n");
+				ret = -1;
+				goto out;
+			}
+		}
+
+		t = fmmsim_now_ns();
+		for (i = 0; i < n && !ret; i++)
+			ret = fmm_map_to_gpu_nodes(requests[i].MemoryAddress,
+						   requests[i].SizeInBytes,
+						   gpu_ids, gpus,
+						   &gpuvm_address);
+		ns[0] = fmmsim_now_ns() - t;
+		t = fmmsim_now_ns();
+		for (i = 0; i < n && !ret; i++)
+			ret = fmm_unmap_from_gpu(requests[i].MemoryAddress);
+		ns[2] = fmmsim_now_ns() - t;
+
+		t = fmmsim_now_ns();
+		if (!ret)
+			ret = fmm_map_batch(requests, n, true);
+		ns[1] = fmmsim_now_ns() - t;
+		for (i = 0; i < n && !ret; i++)
+			if (fmm_get_mem_info(requests[i].MemoryAddress, &info) ||
+			    info.NMappedNodes != gpus) {
+				fprintf(stderr, "%p not mapped\n",
+					requests[i].MemoryAddress);
+				ret = -1;
+			}
+		t = fmmsim_now_ns();
+		if (!ret)
+			ret = fmm_map_batch(requests, n, false);
+		ns[3] = fmmsim_now_ns() - t;
+		for (i = 0; i < n && !ret; i++)
+			if (fmm_get_mem_info(requests[i].MemoryAddress, &info) ||
+			    info.NMappedNodes) {
+				fprintf(stderr, "%p still mapped\n",
+					requests[i].MemoryAddress);
+				ret = -1;
+			}
+
+		if (!ret)
+			printf("%12lu %16.0f %16.0f %16.0f %16.0f\n", n,
+			       (double)ns[0] / n, (double)ns[1] / n,
+			       (double)ns[2] / n, (double)ns[3] / n);
+		else
+			fprintf(stderr, "mapping %lu buffers failed\n", n);
+
+out:
+		for (i = 0; i < n; i++)
+			if (requests[i].MemoryAddress)
+				fmm_release(requests[i].MemoryAddress);
+		free(requests);
+		if (fmmsim_check())
+			ret = -1;
+	}
+
+	return ret;
+}
+
+/* Random VA allocations and frees, checking the consistency of the
+ * aperture bookkeeping along the way
+ */
+static int verify_va(unsigned long max_live, unsigned long ops)
+{
+	buffer_t *live = calloc(max_live, sizeof(*live));
+	uint64_t seed = 0x9e3779b97f4a7c15ULL;
+	unsigned long i;
+	int ret = 0;
+
+	if (!live)
+		return -1;
+
+	for (i = 0; i < ops && !ret; i++) {
+		buffer_t *b = &live[fmmsim_rand(&seed) % max_live];
+
+		if (b->addr) {
+			fmmsim_va_free(b->addr, b->size);
+			b->addr = NULL;
+		} else {
+			uint64_t align = page_size << (fmmsim_rand(&seed) % 10);
+
+			b->size = random_size(&seed) *
+				((fmmsim_rand(&seed) & 7) + 1);
+			b->addr = fmmsim_va_alloc(b->size, align);
+			if (!b->addr || (uint64_t)b->addr & (align - 1)) {
+				fprintf(stderr, "bad VA allocation %p align 0x%lx\n",
+					b->addr, (unsigned long)align);
+				ret = -1;
+			}
+		}
+
+		if ((i & 1023) == 0 && fmmsim_check())
+			ret = -1;
+	}
+
+	for (i = 0; i < max_live; i++)
+		if (live[i].addr)
+			fmmsim_va_free(live[i].addr, live[i].size);
+	free(live);
+
+	if (fmmsim_check())
+		ret = -1;
+
+	printf("verify va: %s\n", ret ? "FAILED" : "passed");
+	return ret;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s <test> [-n max_live] [-i ops] [-g gpus] [-t threads]\n"
+		"Tests:\n"
+		"  va      VA allocation latency vs. number of live areas\n"
+		"  alloc   BO allocation latency vs. number of live BOs\n"
+		"  bocache BO allocations and frees of a few sizes\n"
+		"  suballoc small BO allocations mapped to all GPUs\n"
+		"  deferred BO allocations and frees, timed on the caller\n"
+		"  hot     pointer info queries on a few hot BOs\n"
+		"  ptrinfo pointer info queries on overlapping userptrs\n"
+		"  ptrbatch pointer info queries one by one and in batches\n"
+		"  regcache registrations of overlapping userptr slices\n"
+		"  ipc     repeated imports of a few IPC handles\n"
+		"  bigreg  registration of a 1GB host buffer\n"
+		"  hugepaged paged system memory with 2MB pages requested\n"
+		"  populate time to first use of 1/8/64GB of paged memory\n"
+		"  interleave NUMA placement of interleaved paged memory\n"
+		"  vmacount memory mappings used by host-accessible BOs\n"
+		"  svmgrow virtual size with 64GB of address space allocated\n"
+		"  apstats SVM aperture statistics during BO churn\n"
+		"  trace   BO and userptr churn recorded like API calls\n"
+		"  leaks   BO and userptr churn with leaks from one call site\n"
+		"  mt      concurrent pointer info queries with BO churn\n"
+		"  mtalloc concurrent BO allocations and userptr registrations\n"
+		"  nodes   remapping BOs to random subsets of GPUs\n"
+		"  allocmap allocate, register and map, separately and fused\n"
+		"  batch   mapping many BOs one by one and in a batch\n"
+		"  verify  randomized consistency check\n"
+		"Set HSA_RESERVE_SVM=1 to use the reserved SVM aperture.\n"
+		"Set HSA_BO_CACHE_MB to enable the BO cache.\n"
+		"Set HSA_SUBALLOC=1 to enable the sub-allocator.\n"
+		"Set HSA_DEFERRED_FREE=1 to free BOs in the background.\n"
+		"Set HSA_USERPTR_CACHE_MB to enable the userptr BO cache.\n"
+		"Set HSA_USERPTR_SPLIT_MB to split large userptrs.\n"
+		"Set HSA_IPC_CACHE_MB to enable the IPC import cache.\n"
+		"Set HSA_SVM_GROW_MB to reserve SVM apertures on demand.\n"
+		"Set HSA_TRACE_FILE to record a trace for fmmreplay.\n"
+		"Set HSA_ALLOC_TRACK=N to track 1 in N allocations.\n"
+		"Set HSA_PAGED_HUGE_PAGES=thp|hugetlb to back all paged memory\n"
+		"with huge pages, HSA_PAGED_HUGE_POPULATE=1 to populate it.\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long max_live = 200000, ops = 100000;
+	unsigned int gpus = 1, threads = 8;
+	const char *test;
+	int opt, ret;
+
+	if (argc < 2) {
+		usage(argv[0]);
+		return 1;
+	}
+	test = argv[1];
+	optind = 2;
+
+	while ((opt = getopt(argc, argv, "n:i:g:t:")) != -1) {
+		switch (opt) {
+		case 'n':
+			max_live = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			ops = strtoul(optarg, NULL, 0);
+			break;
+		case 'g':
+			gpus = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			threads = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	page_size = sysconf(_SC_PAGESIZE);
+
+	if (fmmsim_init(gpus)) {
+		fprintf(stderr, "Failed to initialize simulated KFD\n");
+		return 1;
+	}
+
+	if (!strcmp(test, "va")) {
+		ret = bench_va(max_live, ops);
+	} else if (!strcmp(test, "alloc")) {
+		ret = bench_alloc(max_live, ops);
+	} else if (!strcmp(test, "bocache")) {
+		ret = bench_bocache(max_live, ops);
+	} else if (!strcmp(test, "suballoc")) {
+		ret = bench_suballoc(max_live, ops, gpus);
+	} else if (!strcmp(test, "deferred")) {
+		ret = bench_deferred(max_live, ops);
+	} else if (!strcmp(test, "hot")) {
+		ret = bench_hot(max_live, ops);
+	} else if (!strcmp(test, "ptrinfo")) {
+		ret = bench_ptrinfo(max_live, ops);
+	} else if (!strcmp(test, "regcache")) {
+		ret = bench_regcache(max_live, ops);
+	} else if (!strcmp(test, "ipc")) {
+		ret = bench_ipc(max_live, ops);
+	} else if (!strcmp(test, "bigreg")) {
+		ret = bench_bigreg(gpus);
+	} else if (!strcmp(test, "hugepaged")) {
+		ret = bench_hugepaged();
+	} else if (!strcmp(test, "populate")) {
+		ret = bench_populate();
+	} else if (!strcmp(test, "interleave")) {
+		ret = bench_interleave(gpus);
+	} else if (!strcmp(test, "vmacount")) {
+		ret = bench_vmacount(max_live, ops);
+	} else if (!strcmp(test, "svmgrow")) {
+		ret = bench_svmgrow();
+	} else if (!strcmp(test, "apstats")) {
+		ret = bench_apstats(max_live, ops);
+	} else if (!strcmp(test, "trace")) {
+		ret = bench_trace(max_live, ops, gpus);
+	} else if (!strcmp(test, "leaks")) {
+		ret = bench_leaks(max_live, ops);
+	} else if (!strcmp(test, "ptrbatch")) {
+		ret = bench_ptrbatch(max_live, ops, gpus);
+	} else if (!strcmp(test, "mt")) {
+		ret = bench_mt(max_live, ops, threads);
+	} else if (!strcmp(test, "mtalloc")) {
+		ret = bench_mtalloc(ops, threads);
+	} else if (!strcmp(test, "nodes")) {
+		ret = bench_nodes(ops, gpus);
+	} else if (!strcmp(test, "allocmap")) {
+		ret = bench_allocmap(ops, gpus);
+	} else if (!strcmp(test, "batch")) {
+		ret = bench_batch(max_live, gpus);
+	} else if (!strcmp(test, "verify")) {
+		ret = verify_va(max_live, ops);
+	} else {
+		usage(argv[0]);
+		ret = -1;
+	}
+
+	fmmsim_fini();
+
+	return ret ? 1 : 0;
+}
@@ -0,0 +1,560 @@
+/*
+ * Copyright © 2026 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including
+ * the next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/* Replay a trace recorded with HSA_TRACE_FILE against the simulated KFD
+ *
+ * Calls are replayed one after another in the order they completed in
+ * the traced process, on the fmm.c functions the traced API calls used.
+ * Addresses differ between the traced process and the replay, they are
+ * translated through a table of the live allocations. Userptrs that
+ * aren't allocations of the trace are backed by fresh anonymous
+ * mappings, so overlapping registrations of the same user buffer don't
+ * overlap in the replay.
+ *
+ * The memory manager is configured by the environment of the replay,
+ * see fmmsim.h, so the same trace can be compared across settings.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "fmmsim.h"
+
+static const char *op_names[FMM_TRACE_NUM_OPS] = {
+	[FMM_TRACE_ALLOC] = "alloc",
+	[FMM_TRACE_ALLOC_INTERLEAVED] = "alloc-il",
+	[FMM_TRACE_FREE] = "free",
+	[FMM_TRACE_REGISTER] = "register",
+	[FMM_TRACE_DEREGISTER] = "deregister",
+	[FMM_TRACE_MAP] = "map",
+	[FMM_TRACE_UNMAP] = "unmap",
+	[FMM_TRACE_REGISTER_AND_MAP] = "reg+map",
+	[FMM_TRACE_MAP_BATCH] = "map-batch",
+	[FMM_TRACE_UNMAP_BATCH] = "unmap-batch",
+};
+
+typedef struct {
+	uint64_t count;
+	uint64_t traced_ns;
+	uint64_t replay_ns;
+	uint64_t replay_max_ns;
+	uint64_t failed;
+} op_stats_t;
+
+/* Address translation of a live allocation or userptr of the trace.
+ * Open addressing with linear probing, key 0 is free and ~0 deleted.
+ */
+typedef struct {
+	uint64_t key;
+	void *addr;
+	uint64_t size;
+	uint32_t refs;		/* registrations of a userptr */
+	bool userptr;		/* backed by an anonymous mapping */
+} xlate_t;
+
+#define XLATE_DELETED	(~0ULL)
+
+static xlate_t *xlate;
+static uint64_t xlate_size, xlate_used;
+static unsigned long page_size;
+static unsigned int num_gpus;
+static uint64_t unmatched;
+
+static uint64_t xlate_hash(uint64_t key)
+{
+	return (key >> 12) * 0x9e3779b97f4a7c15ULL;
+}
+
+static xlate_t *xlate_find(uint64_t key)
+{
+	uint64_t i;
+
+	if (!key)
+		return NULL;
+
+	for (i = xlate_hash(key) & (xlate_size - 1); xlate[i].key;
+	     i = (i + 1) & (xlate_size - 1))
+		if (xlate[i].key == key)
+			return &xlate[i];
+
+	return NULL;
+}
+
+static int xlate_grow(void)
+{
+	xlate_t *old = xlate;
+	uint64_t old_size = xlate_size, i, j;
+
+	xlate_size = old_size ? old_size * 2 : 4096;
+	xlate = calloc(xlate_size, sizeof(*xlate));
+	if (!xlate)
+		return -1;
+
+	xlate_used = 0;
+	for (i = 0; i < old_size; i++) {
+		if (!old[i].key || old[i].key == XLATE_DELETED)
+			continue;
+		for (j = xlate_hash(old[i].key) & (xlate_size - 1);
+		     xlate[j].key; j = (j + 1) & (xlate_size - 1))
+			;
+		xlate[j] = old[i];
+		xlate_used++;
+	}
+	free(old);
+
+	return 0;
+}
+
+static xlate_t *xlate_add(uint64_t key, void *addr, uint64_t size)
+{
+	uint64_t i;
+
+	/* Deleted entries count as used until the next rehash */
+	if ((xlate_used + 1) * 2 > xlate_size && xlate_grow())
+		return NULL;
+
+	for (i = xlate_hash(key) & (xlate_size - 1);
+	     xlate[i].key && xlate[i].key != XLATE_DELETED;
+	     i = (i + 1) & (xlate_size - 1))
+		;
+	if (!xlate[i].key)
+		xlate_used++;
+	xlate[i].key = key;
+	xlate[i].addr = addr;
+	xlate[i].size = size;
+	xlate[i].refs = 0;
+	xlate[i].userptr = false;
+
+	return &xlate[i];
+}
+
+static void xlate_remove(xlate_t *x)
+{
+	x->key = XLATE_DELETED;
+}
+
+/* Replay address of a traced address, NULL if it isn't known */
+static void *xlate_addr(uint64_t key)
+{
+	xlate_t *x = xlate_find(key);
+
+	if (!x) {
+		unmatched++;
+		return NULL;
+	}
+	return x->addr;
+}
+
+/* Traced GPUs are assigned to the simulated ones round-robin */
+static uint32_t gpus_to_ids(uint64_t gpus, uint32_t *ids, bool node_ids)
+{
+	uint32_t n = 0, g;
+
+	for (; gpus && n < 64; gpus &= gpus - 1) {
+		g = __builtin_ctzll(gpus) % num_gpus;
+		ids[n++] = node_ids ? fmmsim_gpu_node(g) : fmmsim_gpu_id(g);
+	}
+	return n;
+}
+
+static HSAKMT_STATUS replay_alloc(const fmm_trace_record_t *r)
+{
+	HsaMemFlags flags;
+	uint32_t gpu_id = 0, node = 0, nodes[64], n = 0;
+	uint64_t mask;
+	void *mem;
+
+	flags.Value = r->flags;
+	/* The traced address is meaningless in this process */
+	flags.ui32.FixedAddress = 0;
+	if (r->gpus && r->op != FMM_TRACE_ALLOC_INTERLEAVED) {
+		gpu_id = fmmsim_gpu_id(__builtin_ctzll(r->gpus) % num_gpus);
+		node = fmmsim_gpu_node(__builtin_ctzll(r->gpus) % num_gpus);
+	}
+
+	/* Interleaved allocations record HSA node IDs. Nodes that the
+	 * simulated topology doesn't have are skipped, the CPU node is
+	 * used if none is left.
+	 */
+	if (r->op == FMM_TRACE_ALLOC_INTERLEAVED) {
+		for (mask = r->gpus; mask; mask &= mask - 1)
+			if (__builtin_ctzll(mask) <= (int)num_gpus)
+				nodes[n++] = __builtin_ctzll(mask);
+		if (!n)
+			nodes[n++] = 0;
+		mem = fmm_allocate_host_interleaved(n, nodes, NULL, r->size,
+						    flags);
+	} else if (flags.ui32.Scratch)
+		mem = fmm_allocate_scratch(gpu_id, NULL, r->size);
+	else if (!gpu_id || !flags.ui32.NonPaged)
+		mem = fmm_allocate_host(node, NULL, r->size, flags);
+	else
+		mem = fmm_allocate_device(gpu_id, NULL, r->size, flags);
+	if (!mem)
+		return HSAKMT_STATUS_NO_MEMORY;
+
+	if (!xlate_add(r->address, mem, r->size)) {
+		fmm_release(mem);
+		return HSAKMT_STATUS_NO_MEMORY;
+	}
+	return HSAKMT_STATUS_SUCCESS;
+}
+
+static HSAKMT_STATUS replay_free(const fmm_trace_record_t *r)
+{
+	xlate_t *x = xlate_find(r->address);
+	HSAKMT_STATUS ret;
+
+	if (!x || x->userptr) {
+		unmatched++;
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+	}
+	ret = fmm_release(x->addr);
+	xlate_remove(x);
+
+	return ret;
+}
+
+static HSAKMT_STATUS replay_register(const fmm_trace_record_t *r)
+{
+	xlate_t *x = xlate_find(r->address);
+	uint32_t ids[64], *id_array = NULL, n;
+	uint64_t offset = r->address & (page_size - 1);
+	HsaMemFlags flags;
+	HSAKMT_STATUS ret;
+	void *mem;
+
+	flags.Value = r->flags;
+	n = gpus_to_ids(r->gpus, ids, false);
+	if (n) {
+		/* The registration keeps the array */
+		id_array = malloc(n * sizeof(*id_array));
+		if (!id_array)
+			return HSAKMT_STATUS_NO_MEMORY;
+		memcpy(id_array, ids, n * sizeof(*id_array));
+	}
+
+	if (!x) {
+		mem = mmap(NULL, r->size + offset, PROT_READ | PROT_WRITE,
+			   MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+		if (mem == MAP_FAILED) {
+			free(id_array);
+			return HSAKMT_STATUS_NO_MEMORY;
+		}
+		x = xlate_add(r->address, (char *)mem + offset, r->size);
+		if (!x) {
+			munmap(mem, r->size + offset);
+			free(id_array);
+			return HSAKMT_STATUS_NO_MEMORY;
+		}
+		x->userptr = true;
+	}
+
+	ret = fmm_register_memory(x->addr, r->size, id_array,
+				  n * sizeof(*id_array),
+				  flags.ui32.CoarseGrain);
+	if (ret != HSAKMT_STATUS_SUCCESS)
+		free(id_array);
+	else
+		x->refs++;
+	if (x->userptr && !x->refs) {
+		munmap((char *)x->addr - offset, x->size + offset);
+		xlate_remove(x);
+	}
+
+	return ret;
+}
+
+static HSAKMT_STATUS replay_deregister(const fmm_trace_record_t *r)
+{
+	xlate_t *x = xlate_find(r->address);
+	uint64_t offset = r->address & (page_size - 1);
+	HSAKMT_STATUS ret;
+
+	if (!x) {
+		unmatched++;
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+	}
+	ret = fmm_deregister_memory(x->addr);
+	if (x->refs)
+		x->refs--;
+	if (x->userptr && !x->refs) {
+		munmap((char *)x->addr - offset, x->size + offset);
+		xlate_remove(x);
+	}
+
+	return ret;
+}
+
+static HSAKMT_STATUS replay_map(const fmm_trace_record_t *r)
+{
+	void *mem = xlate_addr(r->address);
+	uint32_t ids[64], n;
+
+	if (!mem)
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	switch (r->op) {
+	case FMM_TRACE_MAP:
+		n = gpus_to_ids(r->gpus, ids, false);
+		if (!n)
+			return fmm_map_to_gpu(mem, r->size, NULL) ?
+				HSAKMT_STATUS_ERROR : HSAKMT_STATUS_SUCCESS;
+		return fmm_map_to_gpu_nodes(mem, r->size, ids, n, NULL);
+	case FMM_TRACE_UNMAP:
+		return fmm_unmap_from_gpu(mem) ?
+			HSAKMT_STATUS_ERROR : HSAKMT_STATUS_SUCCESS;
+	default:
+		n = gpus_to_ids(r->gpus, ids, false);
+		return fmm_register_and_map(mem, r->size, n ? ids : NULL, n,
+					    NULL) ?
+			HSAKMT_STATUS_ERROR : HSAKMT_STATUS_SUCCESS;
+	}
+}
+
+/* Replay n records of a batch with one call */
+static HSAKMT_STATUS replay_batch(const fmm_trace_record_t *r, uint64_t n)
+{
+	HsaMemoryMapRequest *requests = calloc(n, sizeof(*requests));
+	uint32_t *nodes = malloc(n * 64 * sizeof(*nodes));
+	uint64_t i, valid = 0;
+	HSAKMT_STATUS ret = HSAKMT_STATUS_NO_MEMORY;
+
+	if (!requests || !nodes)
+		goto out;
+
+	for (i = 0; i < n; i++) {
+		HsaMemoryMapRequest *request = &requests[valid];
+
+		request->MemoryAddress = xlate_addr(r[i].address);
+		if (!request->MemoryAddress)
+			continue;
+		request->SizeInBytes = r[i].size;
+		request->NodeArray = &nodes[valid * 64];
+		request->NumberOfNodes = gpus_to_ids(r[i].gpus,
+						     request->NodeArray, true);
+		valid++;
+	}
+	ret = valid ? fmm_map_batch(requests, valid,
+				    r->op == FMM_TRACE_MAP_BATCH) :
+		HSAKMT_STATUS_INVALID_PARAMETER;
+out:
+	free(nodes);
+	free(requests);
+	return ret;
+}
+
+static HSAKMT_STATUS replay_one(const fmm_trace_record_t *r)
+{
+	switch (r->op) {
+	case FMM_TRACE_ALLOC:
+	case FMM_TRACE_ALLOC_INTERLEAVED:
+		return replay_alloc(r);
+	case FMM_TRACE_FREE:
+		return replay_free(r);
+	case FMM_TRACE_REGISTER:
+		return replay_register(r);
+	case FMM_TRACE_DEREGISTER:
+		return replay_deregister(r);
+	default:
+		return replay_map(r);
+	}
+}
+
+static void sleep_until(uint64_t ns)
+{
+	uint64_t now = fmmsim_now_ns();
+	struct timespec ts;
+
+	if (ns <= now)
+		return;
+	ts.tv_sec = (ns - now) / 1000000000ULL;
+	ts.tv_nsec = (ns - now) % 1000000000ULL;
+	nanosleep(&ts, NULL);
+}
+
+static int replay(FILE *f, bool paced, op_stats_t *stats, uint64_t *skipped)
+{
+	fmm_trace_record_t *records = NULL;
+	uint64_t capacity = 0, n = 0, i, batch, start, t, ns;
+	HSAKMT_STATUS ret;
+	bool is_batch;
+
+	/* Batches are replayed from consecutive records */
+	for (;;) {
+		if (n == capacity) {
+			fmm_trace_record_t *r;
+
+			capacity = capacity ? capacity * 2 : 65536;
+			r = realloc(records, capacity * sizeof(*r));
+			if (!r) {
+				free(records);
+				return -1;
+			}
+			records = r;
+		}
+		if (fread(&records[n], sizeof(*records), 1, f) != 1)
+			break;
+		if (records[n].op && records[n].op < FMM_TRACE_NUM_OPS)
+			n++;
+		else
+			(*skipped)++;
+	}
+
+	start = fmmsim_now_ns();
+	for (i = 0; i < n; i += batch) {
+		const fmm_trace_record_t *r = &records[i];
+		op_stats_t *s = &stats[r->op];
+
+		is_batch = r->op == FMM_TRACE_MAP_BATCH ||
+			   r->op == FMM_TRACE_UNMAP_BATCH;
+		batch = is_batch && r->flags > 1 && r->flags <= n - i ?
+			r->flags : 1;
+
+		/* Calls that failed when traced left nothing to replay */
+		if (!is_batch && r->status != HSAKMT_STATUS_SUCCESS) {
+			(*skipped)++;
+			continue;
+		}
+		if (paced)
+			sleep_until(start + r->time_ns - records[0].time_ns);
+
+		t = fmmsim_now_ns();
+		if (is_batch)
+			ret = replay_batch(r, batch);
+		else
+			ret = replay_one(r);
+		ns = fmmsim_now_ns() - t;
+
+		s->count++;
+		s->traced_ns += r->duration_ns;
+		s->replay_ns += ns;
+		if (ns > s->replay_max_ns)
+			s->replay_max_ns = ns;
+		if (ret != HSAKMT_STATUS_SUCCESS)
+			s->failed++;
+	}
+
+	free(records);
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s <trace> [-g gpus] [-p]\n"
+		"Replays a trace recorded with HSA_TRACE_FILE.\n"
+		"  -g  number of simulated GPUs, default from the trace\n"
+		"  -p  keep the time between calls of the trace\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	op_stats_t stats[FMM_TRACE_NUM_OPS] = {{0}};
+	fmm_trace_header_t header;
+	uint64_t skipped = 0, total_traced = 0, total_replay = 0;
+	bool paced = false;
+	int opt, ret;
+	unsigned int i;
+	FILE *f;
+
+	if (argc < 2) {
+		usage(argv[0]);
+		return 1;
+	}
+	optind = 2;
+	while ((opt = getopt(argc, argv, "g:p")) != -1) {
+		switch (opt) {
+		case 'g':
+			num_gpus = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			paced = true;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	f = fopen(argv[1], "rb");
+	if (!f) {
+		perror(argv[1]);
+		return 1;
+	}
+	if (fread(&header, sizeof(header), 1, f) != 1 ||
+	    memcmp(header.magic, FMM_TRACE_MAGIC, sizeof(header.magic)) ||
+	    header.version != FMM_TRACE_VERSION ||
+	    header.record_size != sizeof(fmm_trace_record_t)) {
+		fprintf(stderr, "%s is not a version %u trace\n", argv[1],
+			FMM_TRACE_VERSION);
+		fclose(f);
+		return 1;
+	}
+	if (!num_gpus)
+		num_gpus = header.num_gpus ? header.num_gpus : 1;
+
+	page_size = sysconf(_SC_PAGESIZE);
+
+	if (fmmsim_init(num_gpus)) {
+		fprintf(stderr, "Failed to initialize simulated KFD\n");
+		fclose(f);
+		return 1;
+	}
+
+	ret = replay(f, paced, stats, &skipped);
+	fclose(f);
+
+	printf("%12s %10s %14s %14s %14s %8s\n", "op", "calls",
+	       "traced ns/op", "replay ns/op", "replay max ns", "failed");
+	for (i = 1; i < FMM_TRACE_NUM_OPS; i++) {
+		op_stats_t *s = &stats[i];
+
+		if (!s->count)
+			continue;
+		printf("%12s %10lu %14.0f %14.0f %14lu %8lu\n", op_names[i],
+		       s->count, (double)s->traced_ns / s->count,
+		       (double)s->replay_ns / s->count, s->replay_max_ns,
+		       s->failed);
+		total_traced += s->traced_ns;
+		total_replay += s->replay_ns;
+	}
+	printf("total traced %.3f ms, replayed %.3f ms\n",
+	       total_traced / 1e6, total_replay / 1e6);
+	printf("%lu records skipped, %lu dropped when tracing, "
+	       "%lu addresses not found\n", skipped, header.dropped,
+	       unmatched);
+
+	if (fmmsim_check())
+		ret = -1;
+
+	fmmsim_fini();
+
+	return ret ? 1 : 0;
+}
@@ -0,0 +1,660 @@
+/*
+ * Copyright © 2026 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including
+ * the next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <strings.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* The DRM render nodes opened by fmm.c don't exist without a GPU.
+ * Redirect them to /dev/zero, which also backs all CPU mappings of
+ * simulated BOs.
+ */
+static int fmmsim_open(const char *path, int flags, ...);
+#define open fmmsim_open
+#include "../../src/fmm.c"
+#undef open
+
+#include "fmmsim.h"
+
+#define SIM_FIRST_GPU_ID	0x1000
+#define SIM_DEVICE_ID		0x66a0	/* Vega20, GFXv9 with 48-bit VA */
+#define SIM_LOCAL_MEM_SIZE	(16ULL << 30)
+#define SIM_GPUVM_BASE		0x1000000ULL
+#define SIM_GPUVM_LIMIT		((1ULL << 47) - 1)
+#define SIM_MMAP_OFFSET_BASE	(1ULL << 40)
+
+/* Globals normally provided by the rest of libhsakmt */
+int PAGE_SIZE;
+int PAGE_SHIFT;
+int kfd_fd = -1;
+bool is_dgpu;
+int hsakmt_debug_level = HSAKMT_DEBUG_LEVEL_DEFAULT;
+
+static unsigned int sim_num_gpus;
+static uint64_t sim_ioctl_delay_ns;
+
+/* Simulated BOs, indexed by handle. A size of 0 means free. */
+static pthread_mutex_t sim_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t *sim_bo_size;
+static uint64_t sim_bo_capacity;
+static uint64_t sim_next_handle = 1;
+static fmmsim_stats_t sim_stats;
+
+uint64_t fmmsim_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int fmmsim_open(const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+	va_list ap;
+
+	if (flags & O_CREAT) {
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+
+	if (!strncmp(path, "/dev/dri/renderD", strlen("/dev/dri/renderD")))
+		path = "/dev/zero";
+
+	return open(path, flags, mode);
+}
+
+/* Topology and debugger queries used by fmm.c */
+static bool sim_gpu_index(uint32_t gpu_id, uint32_t *index)
+{
+	if (gpu_id <= SIM_FIRST_GPU_ID ||
+	    gpu_id > SIM_FIRST_GPU_ID + sim_num_gpus)
+		return false;
+
+	*index = gpu_id - SIM_FIRST_GPU_ID - 1;
+	return true;
+}
+
+int debug_get_reg_status(uint32_t node_id, bool *is_debugged)
+{
+	*is_debugged = false;
+	return 0;
+}
+
+uint16_t get_device_id_by_gpu_id(HSAuint32 gpu_id)
+{
+	uint32_t index;
+
+	return sim_gpu_index(gpu_id, &index) ? SIM_DEVICE_ID : 0;
+}
+
+uint32_t get_num_sysfs_nodes(void)
+{
+	return sim_num_gpus + 1;
+}
+
+HSAKMT_STATUS gpuid_to_nodeid(uint32_t gpu_id, uint32_t *node_id)
+{
+	uint32_t index;
+
+	if (!sim_gpu_index(gpu_id, &index))
+		return HSAKMT_STATUS_INVALID_NODE_UNIT;
+
+	*node_id = index + 1;
+	return HSAKMT_STATUS_SUCCESS;
+}
+
+HSAKMT_STATUS validate_nodeid(uint32_t nodeid, uint32_t *gpu_id)
+{
+	if (nodeid > sim_num_gpus)
+		return HSAKMT_STATUS_INVALID_NODE_UNIT;
+
+	/* Node 0 is the CPU */
+	*gpu_id = nodeid ? SIM_FIRST_GPU_ID + nodeid : 0;
+	return HSAKMT_STATUS_SUCCESS;
+}
+
+uint32_t get_direct_link_cpu(uint32_t gpu_node)
+{
+	/* All GPUs are attached to the CPU node */
+	return gpu_node && gpu_node <= sim_num_gpus ? 0 : INVALID_NODEID;
+}
+
+bool topology_is_dgpu(uint16_t device_id)
+{
+	return true;
+}
+
+bool topology_is_svm_needed(uint16_t device_id)
+{
+	return true;
+}
+
+HSAKMT_STATUS topology_sysfs_get_node_props(uint32_t node_id,
+					    HsaNodeProperties *props,
+					    uint32_t *gpu_id,
+					    struct pci_access *pacc)
+{
+	if (node_id > sim_num_gpus)
+		return HSAKMT_STATUS_INVALID_NODE_UNIT;
+
+	validate_nodeid(node_id, gpu_id);
+	if (node_id) {
+		props->DrmRenderMinor = DRM_FIRST_RENDER_NODE + node_id - 1;
+		props->DeviceId = SIM_DEVICE_ID;
+		props->LocalMemSize = SIM_LOCAL_MEM_SIZE;
+	}
+
+	return HSAKMT_STATUS_SUCCESS;
+}
+
+struct pci_access *pci_alloc(void)
+{
+	return NULL;
+}
+
+void pci_init(struct pci_access *pacc)
+{
+}
+
+void pci_cleanup(struct pci_access *pacc)
+{
+}
+
+/* Simulated KFD */
+static void sim_delay(void)
+{
+	uint64_t end;
+
+	if (!sim_ioctl_delay_ns)
+		return;
+
+	end = fmmsim_now_ns() + sim_ioctl_delay_ns;
+	while (fmmsim_now_ns() < end)
+		;
+}
+
+static bool sim_bo_valid(uint64_t handle)
+{
+	return handle && handle < sim_next_handle && sim_bo_size[handle];
+}
+
+/* Returns the index of a new BO, 0 on failure */
+static uint64_t sim_new_bo(uint64_t size)
+{
+	uint64_t handle;
+
+	pthread_mutex_lock(&sim_mutex);
+	if (sim_next_handle >= sim_bo_capacity) {
+		uint64_t capacity = sim_bo_capacity ? sim_bo_capacity * 2 : 4096;
+		uint64_t *sizes = realloc(sim_bo_size, capacity * sizeof(*sizes));
+
+		if (!sizes) {
+			pthread_mutex_unlock(&sim_mutex);
+			errno = ENOMEM;
+			return 0;
+		}
+		memset(sizes + sim_bo_capacity, 0,
+		       (capacity - sim_bo_capacity) * sizeof(*sizes));
+		sim_bo_size = sizes;
+		sim_bo_capacity = capacity;
+	}
+	handle = sim_next_handle++;
+	sim_bo_size[handle] = size;
+	sim_stats.allocs++;
+	sim_stats.live_bos++;
+	sim_stats.live_bytes += size;
+	pthread_mutex_unlock(&sim_mutex);
+
+	return handle;
+}
+
+static int sim_alloc_memory(struct kfd_ioctl_alloc_memory_of_gpu_args *args)
+{
+	uint32_t index;
+	uint64_t handle;
+
+	if (!sim_gpu_index(args->gpu_id, &index) || !args->size) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* KFD faults in the pages of userptrs for writing to pin them.
+	 * Made up userptr addresses are not mapped, which is ignored.
+	 */
+	if (args->flags & KFD_IOC_ALLOC_MEM_FLAGS_USERPTR)
+		madvise((void *)args->mmap_offset, args->size,
+			MADV_POPULATE_WRITE);
+
+	handle = sim_new_bo(args->size);
+	if (!handle)
+		return -1;
+
+	args->handle = ((uint64_t)args->gpu_id << 32) | handle;
+	if (!(args->flags & KFD_IOC_ALLOC_MEM_FLAGS_USERPTR))
+		args->mmap_offset = SIM_MMAP_OFFSET_BASE +
+			(handle << PAGE_SHIFT);
+
+	return 0;
+}
+
+static int sim_free_memory(struct kfd_ioctl_free_memory_of_gpu_args *args)
+{
+	uint64_t handle = args->handle & 0xffffffff;
+	int ret = 0;
+
+	pthread_mutex_lock(&sim_mutex);
+	if (sim_bo_valid(handle)) {
+		sim_stats.frees++;
+		sim_stats.live_bos--;
+		sim_stats.live_bytes -= sim_bo_size[handle];
+		sim_bo_size[handle] = 0;
+	} else {
+		errno = EINVAL;
+		ret = -1;
+	}
+	pthread_mutex_unlock(&sim_mutex);
+
+	return ret;
+}
+
+static int sim_map_memory(uint64_t handle, uint32_t n_devices,
+			  uint32_t *n_success, bool map)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&sim_mutex);
+	if (sim_bo_valid(handle & 0xffffffff)) {
+		if (map)
+			sim_stats.maps++;
+		else
+			sim_stats.unmaps++;
+		*n_success = n_devices;
+	} else {
+		errno = EINVAL;
+		ret = -1;
+	}
+	pthread_mutex_unlock(&sim_mutex);
+
+	return ret;
+}
+
+/* Share handles name the exported BO. Importing one creates a BO of
+ * its own in the simulated importing process.
+ */
+static int sim_export_handle(struct kfd_ioctl_ipc_export_handle_args *args)
+{
+	uint64_t handle = args->handle & 0xffffffff;
+	uint32_t index;
+
+	if (!sim_gpu_index(args->gpu_id, &index)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&sim_mutex);
+	if (!sim_bo_valid(handle)) {
+		pthread_mutex_unlock(&sim_mutex);
+		errno = EINVAL;
+		return -1;
+	}
+	pthread_mutex_unlock(&sim_mutex);
+
+	memset(args->share_handle, 0, sizeof(args->share_handle));
+	args->share_handle[0] = (uint32_t)handle;
+	args->share_handle[1] = args->gpu_id;
+
+	return 0;
+}
+
+static int sim_import_handle(struct kfd_ioctl_ipc_import_handle_args *args)
+{
+	uint64_t exported = args->share_handle[0], size = 0, handle;
+	uint32_t index;
+
+	if (!sim_gpu_index(args->gpu_id, &index)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&sim_mutex);
+	if (sim_bo_valid(exported))
+		size = sim_bo_size[exported];
+	pthread_mutex_unlock(&sim_mutex);
+	if (!size) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	handle = sim_new_bo(size);
+	if (!handle)
+		return -1;
+
+	args->handle = ((uint64_t)args->gpu_id << 32) | handle;
+	args->mmap_offset = SIM_MMAP_OFFSET_BASE + (handle << PAGE_SHIFT);
+
+	return 0;
+}
+
+static int sim_get_process_apertures(
+		struct kfd_ioctl_get_process_apertures_new_args *args)
+{
+	struct kfd_process_device_apertures *apertures =
+		(void *)args->kfd_process_device_apertures_ptr;
+	uint32_t i;
+
+	if (args->num_of_nodes < sim_num_gpus) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	for (i = 0; i < sim_num_gpus; i++) {
+		memset(&apertures[i], 0, sizeof(apertures[i]));
+		apertures[i].gpu_id = SIM_FIRST_GPU_ID + i + 1;
+		apertures[i].gpuvm_base = SIM_GPUVM_BASE;
+		apertures[i].gpuvm_limit = SIM_GPUVM_LIMIT;
+		apertures[i].lds_base = 0x1000000000000ULL;
+		apertures[i].lds_limit = 0x100000000ffffULL;
+		apertures[i].scratch_base = 0x2000000000000ULL;
+		apertures[i].scratch_limit = 0x20000ffffffffULL;
+	}
+	args->num_of_nodes = sim_num_gpus;
+
+	return 0;
+}
+
+int kmtIoctl(int fd, unsigned long request, void *arg)
+{
+	sim_delay();
+
+	switch (request) {
+	case AMDKFD_IOC_GET_PROCESS_APERTURES_NEW:
+		return sim_get_process_apertures(arg);
+	case AMDKFD_IOC_ACQUIRE_VM:
+	case AMDKFD_IOC_SET_MEMORY_POLICY:
+	case AMDKFD_IOC_SET_SCRATCH_BACKING_VA:
+		return 0;
+	case AMDKFD_IOC_ALLOC_MEMORY_OF_GPU:
+		return sim_alloc_memory(arg);
+	case AMDKFD_IOC_FREE_MEMORY_OF_GPU:
+		return sim_free_memory(arg);
+	case AMDKFD_IOC_MAP_MEMORY_TO_GPU: {
+		struct kfd_ioctl_map_memory_to_gpu_args *args = arg;
+
+		return sim_map_memory(args->handle, args->n_devices,
+				      &args->n_success, true);
+	}
+	case AMDKFD_IOC_UNMAP_MEMORY_FROM_GPU: {
+		struct kfd_ioctl_unmap_memory_from_gpu_args *args = arg;
+
+		return sim_map_memory(args->handle, args->n_devices,
+				      &args->n_success, false);
+	}
+	case AMDKFD_IOC_IPC_EXPORT_HANDLE:
+		return sim_export_handle(arg);
+	case AMDKFD_IOC_IPC_IMPORT_HANDLE:
+		return sim_import_handle(arg);
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+}
+
+int fmmsim_init(unsigned int num_gpus)
+{
+	char *str;
+
+	PAGE_SIZE = sysconf(_SC_PAGESIZE);
+	PAGE_SHIFT = ffs(PAGE_SIZE) - 1;
+
+	str = getenv("HSAKMT_DEBUG_LEVEL");
+	if (str)
+		hsakmt_debug_level = atoi(str);
+	str = getenv("FMMSIM_IOCTL_DELAY_NS");
+	if (str)
+		sim_ioctl_delay_ns = strtoull(str, NULL, 0);
+
+	kfd_fd = open("/dev/zero", O_RDWR | O_CLOEXEC);
+	if (kfd_fd < 0)
+		return -1;
+
+	is_dgpu = true;
+	sim_num_gpus = num_gpus;
+
+	if (fmm_init_process_apertures(num_gpus + 1) != HSAKMT_STATUS_SUCCESS)
+		return -1;
+
+	return 0;
+}
+
+void fmmsim_fini(void)
+{
+	fmm_destroy_process_apertures();
+	close(kfd_fd);
+	kfd_fd = -1;
+}
+
+uint32_t fmmsim_gpu_node(unsigned int gpu)
+{
+	return gpu + 1;
+}
+
+uint32_t fmmsim_gpu_id(unsigned int gpu)
+{
+	return SIM_FIRST_GPU_ID + gpu + 1;
+}
+
+void *fmmsim_va_alloc(uint64_t size, uint64_t align)
+{
+	return fmm_allocate_va(svm.dgpu_aperture, NULL, size, align, NULL);
+}
+
+void fmmsim_va_free(void *addr, uint64_t size)
+{
+	fmm_release_va(svm.dgpu_aperture, addr, size);
+}
+
+void fmmsim_get_stats(fmmsim_stats_t *stats)
+{
+	pthread_mutex_lock(&sim_mutex);
+	*stats = sim_stats;
+	pthread_mutex_unlock(&sim_mutex);
+}
+
+/* Consistency checks */
+static int check_failed(const char *name, const char *what, const void *addr)
+{
+	fprintf(stderr, "fmmsim: %s: %s at %p\n", name, what, addr);
+	return -1;
+}
+
+static int check_area_augmented(const char *name, rbtree_t *tree,
+				rbtree_node_t *n, uint64_t *max_hole)
+{
+	uint64_t left = 0, right = 0, hole;
+
+	if (n == &tree->sentinel) {
+		*max_hole = 0;
+		return 0;
+	}
+
+	if (check_area_augmented(name, tree, n->left, &left) ||
+	    check_area_augmented(name, tree, n->right, &right))
+		return -1;
+
+	hole = vm_area_hole_size(vm_area_entry(n));
+	hole = MAX(hole, left);
+	hole = MAX(hole, right);
+	if (n->augmented != hole)
+		return check_failed(name, "stale largest-hole value",
+				    vm_area_entry(n)->start);
+
+	*max_hole = hole;
+	return 0;
+}
+
+static int check_interval_augmented(const char *name, rbtree_t *tree,
+				    rbtree_node_t *n, uint64_t *max_end)
+{
+	uint64_t left = 0, right = 0, end;
+
+	if (n == &tree->sentinel) {
+		*max_end = 0;
+		return 0;
+	}
+
+	if (check_interval_augmented(name, tree, n->left, &left) ||
+	    check_interval_augmented(name, tree, n->right, &right))
+		return -1;
+
+	end = n->key.addr + n->key.size;
+	end = MAX(end, left);
+	end = MAX(end, right);
+	if (n->augmented != end)
+		return check_failed(name, "stale interval end",
+				    (void *)n->key.addr);
+
+	*max_end = end;
+	return 0;
+}
+
+static int check_areas(const char *name, manageable_aperture_t *app)
+{
+	vm_area_t *area, *prev = NULL;
+	rbtree_node_t *n;
+	uint64_t max_hole, inner_hole = 0;
+	uint32_t holes = 0;
+	void *hole_start;
+
+	if (app->ops != &reserved_aperture_ops || !app->area_tree.root)
+		return 0;
+
+	/* The area list and the area tree must agree */
+	n = rbtree_min_max(&app->area_tree, LEFT);
+	for (area = app->vm_ranges; area; prev = area, area = area->next) {
+		if (!n || vm_area_entry(n) != area)
+			return check_failed(name, "area missing from tree",
+					    area->start);
+		if (area->prev != prev)
+			return check_failed(name, "broken area list",
+					    area->start);
+		if (area->start > area->end)
+			return check_failed(name, "inverted area",
+					    area->start);
+		if (prev && prev->end >= area->start)
+			return check_failed(name, "overlapping areas",
+					    area->start);
+		if (n->key.addr != (unsigned long)area->start)
+			return check_failed(name, "stale area key",
+					    area->start);
+		hole_start = prev ? VOID_PTR_ADD(prev->end, 1) : app->base;
+		if (area->has_hole != (area->start > hole_start))
+			return check_failed(name, "stale hole flag",
+					    area->start);
+		holes += area->has_hole;
+		if (prev)
+			inner_hole = MAX(inner_hole, vm_area_hole_size(area));
+		n = rbtree_next(&app->area_tree, n);
+	}
+	if (n)
+		return check_failed(name, "area missing from list",
+				    vm_area_entry(n)->start);
+	if (holes != app->num_holes)
+		return check_failed(name, "wrong hole count", app->base);
+	if (inner_hole != vm_largest_inner_hole(app))
+		return check_failed(name, "wrong largest hole", app->base);
+
+	return check_area_augmented(name, &app->area_tree,
+				    app->area_tree.root, &max_hole);
+}
+
+static int check_aperture(const char *name, manageable_aperture_t *app)
+{
+	uint64_t max_end;
+	uint32_t i;
+
+	for (i = 0; i < app->num_shards; i++) {
+		manageable_aperture_t *shard = &app->shards[i];
+		vm_area_t *area;
+
+		if (check_aperture(name, shard))
+			return -1;
+
+		/* Everything in a shard must be within its range */
+		for (area = shard->vm_ranges; area; area = area->next)
+			if (area->start < shard->base || area->end > shard->limit)
+				return check_failed(name, "area outside shard",
+						    area->start);
+	}
+
+	/* Growable apertures must have reserved everything allocated */
+	if (app->reserved_limit) {
+		vm_area_t *area;
+
+		for (area = app->vm_ranges; area; area = area->next)
+			if (area->end > app->reserved_limit)
+				return check_failed(name, "area not reserved",
+						    area->start);
+	}
+
+	if (!app->tree.root)
+		return 0;
+
+	if (check_interval_augmented(name, &app->tree, app->tree.root,
+				     &max_end) ||
+	    check_interval_augmented(name, &app->user_tree,
+				     app->user_tree.root, &max_end))
+		return -1;
+
+	return check_areas(name, app);
+}
+
+int fmmsim_check(void)
+{
+	unsigned int i;
+
+	if (check_aperture("svm", &svm.apertures[SVM_DEFAULT]) ||
+	    check_aperture("svm coherent", &svm.apertures[SVM_COHERENT]))
+		return -1;
+
+	for (i = 0; i < gpu_mem_count; i++)
+		if (check_aperture("gpuvm", &gpu_mem[i].gpuvm_aperture) ||
+		    check_aperture("scratch", &gpu_mem[i].scratch_physical))
+			return -1;
+
+	return 0;
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright © 2026 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including
+ * the next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef FMMSIM_H_
+#define FMMSIM_H_
+
+/* GPU-less harness for the flat memory manager
+ *
+ * fmmsim builds src/fmm.c against a simulated KFD: kmtIoctl, the
+ * topology queries and the DRM render nodes are replaced so that the
+ * address space management, object tracking and locking in fmm.c run
+ * unmodified on any Linux machine. Buffer contents are backed by
+ * /dev/zero mappings.
+ *
+ * Environment:
+ *   FMMSIM_IOCTL_DELAY_NS  busy-wait this long in every simulated ioctl
+ *   HSA_RESERVE_SVM=1      use the reserved SVM aperture allocator
+ *                          instead of mmap apertures (as on GFX8)
+ *   HSA_SVM_SHARDS         maximum number of shards per reserved SVM
+ *                          aperture, 1 disables sharding
+ *   HSA_SVM_GROW_MB        reserve SVM apertures in steps of this size
+ *                          when they are used instead of all at once
+ *   HSA_BO_CACHE_MB        enable the BO cache with this high watermark
+ *   HSA_SUBALLOC=1         pack small BOs into shared 2MB BOs
+ *   HSA_DEFERRED_FREE=1    free BOs on a background thread
+ *   HSA_USERPTR_CACHE_MB   share userptr BOs between registrations and
+ *                          keep this much of unused ones
+ *   HSA_USERPTR_SPLIT_MB   split larger userptrs into BOs of this size
+ *   HSA_IPC_CACHE_MB       share imports of the same IPC handle and keep
+ *                          this much of unused ones
+ *   HSA_PAGED_HUGE_PAGES   thp or hugetlb to back all paged memory of at
+ *                          least 2MB with huge pages
+ *   HSA_PAGED_HUGE_POPULATE=1  populate huge paged memory when allocated
+ *   HSA_TRACE_FILE         record hsaKmt memory calls to this file with the
+ *                          PID appended, replay them with fmmreplay
+ *   HSA_TRACE_BUFFER_KB    size of the trace ring buffer, default 1024
+ *   HSA_ALLOC_TRACK=N      attribute 1 in N allocations and registrations
+ *                          to their call stack
+ *   HSA_ALLOC_TRACK_SITES  sites reported when KFD is closed, default 10
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "hsakmttypes.h"
+#include "fmm.h"
+
+typedef struct {
+	uint64_t allocs;
+	uint64_t frees;
+	uint64_t maps;
+	uint64_t unmaps;
+	uint64_t live_bos;
+	uint64_t live_bytes;
+} fmmsim_stats_t;
+
+/* Set up the simulated topology with num_gpus GPU nodes after one CPU
+ * node and initialize the process apertures
+ */
+int fmmsim_init(unsigned int num_gpus);
+void fmmsim_fini(void);
+
+/* HSA node ID and KFD gpu_id of the GPU with the given index */
+uint32_t fmmsim_gpu_node(unsigned int gpu);
+uint32_t fmmsim_gpu_id(unsigned int gpu);
+
+/* Reserve and release virtual address space in the SVM aperture
+ * without creating a BO
+ */
+void *fmmsim_va_alloc(uint64_t size, uint64_t align);
+void fmmsim_va_free(void *addr, uint64_t size);
+
+/* Verify the internal consistency of all apertures. Returns 0 if
+ * consistent, prints the first problem and returns -1 otherwise.
+ */
+int fmmsim_check(void);
+
+void fmmsim_get_stats(fmmsim_stats_t *stats);
+
+uint64_t fmmsim_now_ns(void);
+
+/* Small deterministic PRNG for reproducible runs */
+static inline uint64_t fmmsim_rand(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+
+	return x;
+}
+
+#endif /* FMMSIM_H_ */
@@ -1240,6 +1240,753 @@ TEST_F(KFDMemoryTest, QueryPointerInfo) {
     TEST_END
 }
 
+/* Repeated lookups of the same pointer should be served by the
+ * per-thread lookup cache. Freeing the memory must invalidate it.
+ */
+TEST_F(KFDMemoryTest, PointerLookupCache) {
+    TEST_START(TESTPROFILE_RUNALL)
+
+    HsaMemoryCacheStats before, after;
+    HsaPointerInfo ptrInfo;
+    void *mem;
+    int i;
+
+    EXPECT_EQ(HSAKMT_STATUS_INVALID_PARAMETER,
+              hsaKmtGetMemoryCacheStats(HSA_MEMORY_CACHE_NUM_TYPES, &before));
+
+    m_MemoryFlags.ui32.NoNUMABind = 1;
+    ASSERT_SUCCESS(hsaKmtAllocMemory(0 /* system */, PAGE_SIZE, m_MemoryFlags, &mem));
+
+    EXPECT_SUCCESS(hsaKmtGetMemoryCacheStats(HSA_MEMORY_CACHE_POINTER_LOOKUP, &before));
+    for (i = 0; i < 10; i++) {
+        EXPECT_SUCCESS(hsaKmtQueryPointerInfo(mem, &ptrInfo));
+        EXPECT_EQ(ptrInfo.CPUAddress, mem);
+    }
+    EXPECT_SUCCESS(hsaKmtGetMemoryCacheStats(HSA_MEMORY_CACHE_POINTER_LOOKUP, &after));
+    EXPECT_GE(after.Hits - before.Hits, 9ULL);
+
+    EXPECT_SUCCESS(hsaKmtFreeMemory(mem, PAGE_SIZE));
+    EXPECT_NE(HSAKMT_STATUS_SUCCESS, hsaKmtQueryPointerInfo(mem, &ptrInfo));
+
+    TEST_END
+}
+
+/* With the BO cache enabled (HSA_BO_CACHE_MB), freeing VRAM and
+ * allocating the same size again should reuse the freed BO. The reused
+ * BO must not be visible while it is cached.
+ */
+TEST_F(KFDMemoryTest, BufferObjectCache) {
+    if (!is_dgpu()) {
+        LOG() << "Skipping test: VRAM is not allocated from KFD on APUs." << std::endl;
+        return;
+    }
+    TEST_START(TESTPROFILE_RUNALL)
+
+    int defaultGPUNode = m_NodeInfo.HsaDefaultGPUNode();
+    ASSERT_GE(defaultGPUNode, 0) << "failed to get default GPU Node";
+
+    HsaMemoryCacheStats before, after;
+    HsaPointerInfo ptrInfo;
+    HsaMemFlags memFlags = {0};
+    void *mem, *mem2;
+
+    memFlags.ui32.HostAccess = 0;
+    memFlags.ui32.NonPaged = 1;
+
+    EXPECT_SUCCESS(hsaKmtGetMemoryCacheStats(HSA_MEMORY_CACHE_BUFFER_OBJECT, &before));
+
+    ASSERT_SUCCESS(hsaKmtAllocMemory(defaultGPUNode, PAGE_SIZE * 16, memFlags, &mem));
+    EXPECT_SUCCESS(hsaKmtFreeMemory(mem, PAGE_SIZE * 16));
+    EXPECT_NE(HSAKMT_STATUS_SUCCESS, hsaKmtQueryPointerInfo(mem, &ptrInfo));
+    ASSERT_SUCCESS(hsaKmtAllocMemory(defaultGPUNode, PAGE_SIZE * 16, memFlags, &mem2));
+    EXPECT_SUCCESS(hsaKmtQueryPointerInfo(mem2, &ptrInfo));
+    EXPECT_EQ(ptrInfo.Type, HSA_POINTER_ALLOCATED);
+
+    EXPECT_SUCCESS(hsaKmtGetMemoryCacheStats(HSA_MEMORY_CACHE_BUFFER_OBJECT, &after));
+    if (after.Misses == before.Misses) {
+        LOG() << "BO cache is disabled, set HSA_BO_CACHE_MB to test it." << std::endl;
+    } else {
+        EXPECT_EQ(after.Hits - before.Hits, 1ULL);
+        EXPECT_EQ(mem2, mem);
+    }
+
+    EXPECT_SUCCESS(hsaKmtFreeMemory(mem2, PAGE_SIZE * 16));
+
+    TEST_END
+}
+
+TEST_F(KFDMemoryTest, SubAllocation) {
+    if (!is_dgpu()) {
+        LOG() << "Skipping test: VRAM is not allocated from KFD on APUs." << std::endl;
+        return;
+    }
+    TEST_START(TESTPROFILE_RUNALL)
+
+    int defaultGPUNode = m_NodeInfo.HsaDefaultGPUNode();
+    ASSERT_GE(defaultGPUNode, 0) << "failed to get default GPU Node";
+
+    HsaSharedMemoryHandle sharedHandle;
+    HsaPointerInfo ptrInfo;
+    HsaMemFlags memFlags = {0};
+    HSAuint64 alternateVAGPU;
+    void *mem, *mem2;
+
+    memFlags.ui32.HostAccess = 0;
+    memFlags.ui32.NonPaged = 1;
+
+    ASSERT_SUCCESS(hsaKmtAllocMemory(defaultGPUNode, PAGE_SIZE * 2, memFlags, &mem));
+    ASSERT_SUCCESS(hsaKmtAllocMemory(defaultGPUNode, PAGE_SIZE * 2, memFlags, &mem2));
+
+    if (mem2 != reinterpret_cast<char *>(mem) + PAGE_SIZE * 2) {
+        LOG() << "Sub-allocator is disabled, set HSA_SUBALLOC=1 to test it." << std::endl;
+    } else {
+        EXPECT_SUCCESS(hsaKmtQueryPointerInfo(mem2, &ptrInfo));
+        EXPECT_EQ(ptrInfo.Type, HSA_POINTER_ALLOCATED);
+        EXPECT_EQ(ptrInfo.CPUAddress, mem2);
+        EXPECT_EQ(ptrInfo.SizeInBytes, PAGE_SIZE * 2);
+
+        /* Unmapping one sub-allocation must leave the other mapped */
+        EXPECT_SUCCESS(hsaKmtMapMemoryToGPU(mem, PAGE_SIZE * 2, &alternateVAGPU));
+        EXPECT_SUCCESS(hsaKmtMapMemoryToGPU(mem2, PAGE_SIZE * 2, &alternateVAGPU));
+        EXPECT_SUCCESS(hsaKmtUnmapMemoryToGPU(mem));
+        EXPECT_SUCCESS(hsaKmtQueryPointerInfo(mem, &ptrInfo));
+        EXPECT_EQ(ptrInfo.NMappedNodes, 0U);
+        EXPECT_SUCCESS(hsaKmtQueryPointerInfo(mem2, &ptrInfo));
+        EXPECT_EQ(ptrInfo.NMappedNodes, 1U);
+        EXPECT_SUCCESS(hsaKmtUnmapMemoryToGPU(mem2));
+
+        EXPECT_EQ(HSAKMT_STATUS_NOT_SUPPORTED,
+                  hsaKmtShareMemory(mem2, PAGE_SIZE * 2, &sharedHandle));
+    }
+
+    EXPECT_SUCCESS(hsaKmtFreeMemory(mem, PAGE_SIZE * 2));
+    EXPECT_NE(HSAKMT_STATUS_SUCCESS, hsaKmtQueryPointerInfo(mem, &ptrInfo));
+    EXPECT_SUCCESS(hsaKmtQueryPointerInfo(mem2, &ptrInfo));
+    EXPECT_SUCCESS(hsaKmtFreeMemory(mem2, PAGE_SIZE * 2));
+
+    TEST_END
+}
+
+TEST_F(KFDMemoryTest, FlushDeferredFrees) {
+    TEST_START(TESTPROFILE_RUNALL)
+
+    int defaultGPUNode = m_NodeInfo.HsaDefaultGPUNode();
+    ASSERT_GE(defaultGPUNode, 0) << "failed to get default GPU Node";
+
+    const unsigned int numBuffers = 64;
+    HsaPointerInfo ptrInfo;
+    HsaMemFlags memFlags = {0};
+    void *mem[numBuffers];
+    unsigned int i;
+
+    memFlags.ui32.HostAccess = 1;
+    memFlags.ui32.NonPaged = 1;
+
+    for (i = 0; i < numBuffers; i++)
+        ASSERT_SUCCESS(hsaKmtAllocMemory(defaultGPUNode, PAGE_SIZE * 4, memFlags, &mem[i]));
+    /* With HSA_DEFERRED_FREE set, frees are only queued here */
+    for (i = 0; i < numBuffers; i++)
+        EXPECT_SUCCESS(hsaKmtFreeMemory(mem[i], PAGE_SIZE * 4));
+
+    EXPECT_SUCCESS(hsaKmtFlushDeferredFrees());
+    for (i = 0; i < numBuffers; i++)
+        EXPECT_NE(HSAKMT_STATUS_SUCCESS, hsaKmtQueryPointerInfo(mem[i], &ptrInfo));
+
+    TEST_END
+}
+
+TEST_F(KFDMemoryTest, AllocAndMapMemory) {
+    TEST_START(TESTPROFILE_RUNALL)
+
+    int defaultGPUNode = m_NodeInfo.HsaDefaultGPUNode();
+    ASSERT_GE(defaultGPUNode, 0) << "failed to get default GPU Node";
+
+    HsaPointerInfo ptrInfo;
+    HsaMemFlags memFlags = {0};
+    HSAuint32 node = defaultGPUNode;
+    HSAuint64 alternateVAGPU;
+    void *mem;
+
+    memFlags.ui32.HostAccess = 1;
+    memFlags.ui32.NonPaged = 1;
+
+    ASSERT_SUCCESS(hsaKmtAllocAndMapMemory(defaultGPUNode, PAGE_SIZE, memFlags, 1, &node,
+                                           &mem, &alternateVAGPU));
+    EXPECT_SUCCESS(hsaKmtQueryPointerInfo(mem, &ptrInfo));
+    EXPECT_EQ(ptrInfo.Type, HSA_POINTER_ALLOCATED);
+    EXPECT_EQ(ptrInfo.SizeInBytes, PAGE_SIZE);
+    EXPECT_EQ(ptrInfo.NMappedNodes, 1U);
+    if (is_dgpu()) {
+        EXPECT_EQ(ptrInfo.NRegisteredNodes, 1U);
+        EXPECT_EQ(ptrInfo.RegisteredNodes[0], node);
+    }
+    EXPECT_SUCCESS(hsaKmtUnmapMemoryToGPU(mem));
+    EXPECT_SUCCESS(hsaKmtFreeMemory(mem, PAGE_SIZE));
+
+    /* An invalid node must not leave anything allocated */
+    node = 0xffff;
+    EXPECT_NE(HSAKMT_STATUS_SUCCESS,
+              hsaKmtAllocAndMapMemory(defaultGPUNode, PAGE_SIZE, memFlags, 1, &node,
+                                      &mem, &alternateVAGPU));
+
+    TEST_END
+}
+
+TEST_F(KFDMemoryTest, MapMemoryBatch) {
+    if (!is_dgpu()) {
+        LOG() << "Skipping test: Mapping to nodes is only supported on dGPUs." << std::endl;
+        return;
+    }
+    TEST_START(TESTPROFILE_RUNALL)
+
+    int defaultGPUNode = m_NodeInfo.HsaDefaultGPUNode();
+    ASSERT_GE(defaultGPUNode, 0) << "failed to get default GPU Node";
+
+    const unsigned int numBuffers = 64;
+    HsaMemoryMapRequest requests[numBuffers + 1] = {};
+    HsaPointerInfo ptrInfo;
+    HsaMemFlags memFlags = {0};
+    HSAuint32 node = defaultGPUNode;
+    unsigned int i;
+
+    memFlags.ui32.HostAccess = 1;
+    memFlags.ui32.NonPaged = 1;
+
+    for (i = 0; i < numBuffers; i++) {
+        requests[i].SizeInBytes = PAGE_SIZE;
+        ASSERT_SUCCESS(hsaKmtAllocMemory(i & 1 ? 0 : defaultGPUNode, PAGE_SIZE, memFlags,
+                                         &requests[i].MemoryAddress));
+        requests[i].NumberOfNodes = 1;
+        requests[i].NodeArray = &node;
+    }
+    /* Not allocated, must fail without affecting the others */
+    requests[numBuffers].MemoryAddress = reinterpret_cast<void *>(PAGE_SIZE);
+    requests[numBuffers].SizeInBytes = PAGE_SIZE;
+
+    EXPECT_NE(HSAKMT_STATUS_SUCCESS, hsaKmtMapMemoryToGPUBatch(requests, numBuffers + 1));
+    EXPECT_NE(HSAKMT_STATUS_SUCCESS, requests[numBuffers].Status);
+    for (i = 0; i < numBuffers; i++) {
+        EXPECT_SUCCESS(requests[i].Status);
+        EXPECT_SUCCESS(hsaKmtQueryPointerInfo(requests[i].MemoryAddress, &ptrInfo));
+        EXPECT_EQ(ptrInfo.NMappedNodes, 1U);
+        EXPECT_EQ(ptrInfo.MappedNodes[0], node);
+    }
+
+    EXPECT_SUCCESS(hsaKmtUnmapMemoryToGPUBatch(requests, numBuffers));
+    for (i = 0; i < numBuffers; i++) {
+        EXPECT_SUCCESS(hsaKmtQueryPointerInfo(requests[i].MemoryAddress, &ptrInfo));
+        EXPECT_EQ(ptrInfo.NMappedNodes, 0U);
+        EXPECT_SUCCESS(hsaKmtFreeMemory(requests[i].MemoryAddress, PAGE_SIZE));
+    }
+
+    TEST_END
+}
+
+TEST_F(KFDMemoryTest, MemoryArena) {
+    TEST_START(TESTPROFILE_RUNALL)
+
+    int defaultGPUNode = m_NodeInfo.HsaDefaultGPUNode();
+    ASSERT_GE(defaultGPUNode, 0) << "failed to get default GPU Node";
+
+    const HSAuint64 arenaSize = PAGE_SIZE * 16;
+    HSA_MEMORY_ARENA arena;
+    HsaPointerInfo ptrInfo;
+    HsaMemFlags memFlags = {0};
+    HSAuint32 node = defaultGPUNode;
+    void *mem, *mem2, *mem3;
+
+    memFlags.ui32.HostAccess = 1;
+    memFlags.ui32.NonPaged = 1;
+
+    ASSERT_SUCCESS(hsaKmtCreateMemoryArena(0, arenaSize, memFlags, 1, &node, &arena));
+
+    ASSERT_SUCCESS(hsaKmtAllocFromMemoryArena(arena, 24, 0, &mem));
+    ASSERT_SUCCESS(hsaKmtAllocFromMemoryArena(arena, 64, 256, &mem2));
+    EXPECT_EQ(reinterpret_cast<HSAuint64>(mem2) % 256, 0ULL);
+    EXPECT_GE(mem2, reinterpret_cast<char *>(mem) + 24);
+    EXPECT_EQ(HSAKMT_STATUS_INVALID_PARAMETER, hsaKmtAllocFromMemoryArena(arena, 64, 3, &mem3));
+
+    /* Allocations are part of the arena's BO, which is already mapped */
+    EXPECT_SUCCESS(hsaKmtQueryPointerInfo(mem2, &ptrInfo));
+    EXPECT_EQ(ptrInfo.Type, HSA_POINTER_ALLOCATED);
+    EXPECT_EQ(ptrInfo.CPUAddress, mem);
+    EXPECT_EQ(ptrInfo.SizeInBytes, arenaSize);
+    EXPECT_EQ(ptrInfo.NMappedNodes, 1U);
+    memset(mem2, 0xa5, 64);
+
+    EXPECT_EQ(HSAKMT_STATUS_NO_MEMORY, hsaKmtAllocFromMemoryArena(arena, arenaSize, 0, &mem3));
+
+    EXPECT_SUCCESS(hsaKmtResetMemoryArena(arena));
+    ASSERT_SUCCESS(hsaKmtAllocFromMemoryArena(arena, arenaSize, 0, &mem3));
+    EXPECT_EQ(mem3, mem);
+
+    EXPECT_SUCCESS(hsaKmtDestroyMemoryArena(arena));
+    EXPECT_NE(HSAKMT_STATUS_SUCCESS, hsaKmtQueryPointerInfo(mem, &ptrInfo));
+
+    TEST_END
+}
+
+TEST_F(KFDMemoryTest, UserptrCache) {
+    if (!is_dgpu()) {
+        LOG() << "Skipping test: Userptr registration is a no-op on APUs." << std::endl;
+        return;
+    }
+    TEST_START(TESTPROFILE_RUNALL)
+
+    const HSAuint64 bufSize = PAGE_SIZE * 64;
+    HsaMemoryCacheStats before, after;
+    HSAuint64 bigVA, sliceVA;
+    HsaPointerInfo ptrInfo;
+    char *buf;
+
+    ASSERT_EQ(0, posix_memalign(reinterpret_cast<void **>(&buf), PAGE_SIZE, bufSize));
+
+    EXPECT_SUCCESS(hsaKmtGetMemoryCacheStats(HSA_MEMORY_CACHE_USERPTR, &before));
+
+    ASSERT_SUCCESS(hsaKmtRegisterMemory(buf, bufSize));
+    ASSERT_SUCCESS(hsaKmtMapMemoryToGPU(buf, bufSize, &bigVA));
+
+    /* A slice inside the registered buffer at an unaligned offset */
+    ASSERT_SUCCESS(hsaKmtRegisterMemory(buf + PAGE_SIZE * 3 + 16, PAGE_SIZE * 2));
+    ASSERT_SUCCESS(hsaKmtMapMemoryToGPU(buf + PAGE_SIZE * 3 + 16, PAGE_SIZE * 2, &sliceVA));
+    EXPECT_SUCCESS(hsaKmtQueryPointerInfo(buf + PAGE_SIZE * 3 + 16, &ptrInfo));
+    EXPECT_EQ(ptrInfo.Type, HSA_POINTER_REGISTERED_USER);
+    EXPECT_EQ(ptrInfo.GPUAddress, sliceVA);
+
+    EXPECT_SUCCESS(hsaKmtGetMemoryCacheStats(HSA_MEMORY_CACHE_USERPTR, &after));
+    if (after.Misses == before.Misses) {
+        LOG() << "Userptr cache is disabled, set HSA_USERPTR_CACHE_MB to test it." << std::endl;
+    } else {
+        EXPECT_EQ(after.Hits - before.Hits, 1ULL);
+        EXPECT_EQ(sliceVA, bigVA + PAGE_SIZE * 3 + 16);
+    }
+
+    /* Unmapping the slice must leave the buffer mapped */
+    EXPECT_SUCCESS(hsaKmtUnmapMemoryToGPU(buf + PAGE_SIZE * 3 + 16));
+    EXPECT_SUCCESS(hsaKmtDeregisterMemory(buf + PAGE_SIZE * 3 + 16));
+    EXPECT_SUCCESS(hsaKmtQueryPointerInfo(buf, &ptrInfo));
+    EXPECT_EQ(ptrInfo.NMappedNodes, 1U);
+
+    EXPECT_SUCCESS(hsaKmtUnmapMemoryToGPU(buf));
+    EXPECT_SUCCESS(hsaKmtDeregisterMemory(buf));
+    EXPECT_NE(HSAKMT_STATUS_SUCCESS, hsaKmtQueryPointerInfo(buf, &ptrInfo));
+
+    /* The unused BO is kept, registering the buffer again hits */
+    EXPECT_SUCCESS(hsaKmtGetMemoryCacheStats(HSA_MEMORY_CACHE_USERPTR, &before));
+    ASSERT_SUCCESS(hsaKmtRegisterMemory(buf, bufSize));
+    EXPECT_SUCCESS(hsaKmtGetMemoryCacheStats(HSA_MEMORY_CACHE_USERPTR, &after));
+    EXPECT_EQ(after.Misses - before.Misses, 0ULL);
+    EXPECT_SUCCESS(hsaKmtDeregisterMemory(buf));
+
+    free(buf);
+
+    TEST_END
+}
+
+TEST_F(KFDMemoryTest, LargeUserptr) {
+    if (!is_dgpu()) {
+        LOG() << "Skipping test: Userptr registration is a no-op on APUs." << std::endl;
+        return;
+    }
+    TEST_START(TESTPROFILE_RUNALL)
+
+    int defaultGPUNode = m_NodeInfo.HsaDefaultGPUNode();
+    ASSERT_GE(defaultGPUNode, 0) << "failed to get default GPU Node";
+
+    /* Split into several BOs if HSA_USERPTR_SPLIT_MB is below 256 */
+    const HSAuint64 bufSize = 256ULL << 20;
+    HsaPointerInfo ptrInfo;
+    HSAuint64 gpuVA;
+    char *buf;
+
+    ASSERT_EQ(0, posix_memalign(reinterpret_cast<void **>(&buf), PAGE_SIZE, bufSize));
+
+    ASSERT_SUCCESS(hsaKmtRegisterMemory(buf, bufSize));
+    ASSERT_SUCCESS(hsaKmtMapMemoryToGPU(buf, bufSize, &gpuVA));
+
+    /* It's one object, no matter how many BOs back it */
+    EXPECT_SUCCESS(hsaKmtQueryPointerInfo(buf + bufSize - PAGE_SIZE, &ptrInfo));
+    EXPECT_EQ(ptrInfo.Type, HSA_POINTER_REGISTERED_USER);
+    EXPECT_EQ(ptrInfo.CPUAddress, buf);
+    EXPECT_EQ(ptrInfo.SizeInBytes, bufSize);
+    EXPECT_EQ(ptrInfo.GPUAddress, gpuVA);
+    EXPECT_EQ(ptrInfo.NMappedNodes, 1U);
+
+    /* The GPU sees the end of the buffer at the end of its VA range */
+    unsigned int *last = reinterpret_cast<unsigned int *>(buf + bufSize) - 1;
+    PM4Queue queue;
+    ASSERT_SUCCESS(queue.Create(defaultGPUNode));
+    *last = 0;
+    queue.PlaceAndSubmitPacket(PM4WriteDataPacket(
+        reinterpret_cast<unsigned int *>(gpuVA + bufSize) - 1, 0xdeadbeef));
+    queue.PlaceAndSubmitPacket(PM4ReleaseMemoryPacket(m_FamilyId, true, 0, 0));
+    queue.Wait4PacketConsumption();
+    EXPECT_EQ(true, WaitOnValue(last, 0xdeadbeef));
+    EXPECT_SUCCESS(queue.Destroy());
+
+    EXPECT_SUCCESS(hsaKmtUnmapMemoryToGPU(buf));
+    EXPECT_SUCCESS(hsaKmtDeregisterMemory(buf));
+    free(buf);
+
+    TEST_END
+}
+
+TEST_F(KFDMemoryTest, HugePagedMemory) {
+    if (!is_dgpu()) {
+        LOG() << "Skipping test: Paged memory is not a userptr on APUs." << std::endl;
+        return;
+    }
+    TEST_START(TESTPROFILE_RUNALL)
+
+    const HSAuint64 bufSize = 64ULL << 20;
+    HsaPointerInfo ptrInfo;
+    HsaMemFlags memFlags = {0};
+    char *buf;
+
+    memFlags.ui32.HostAccess = 1;
+    memFlags.ui32.PageSize = HSA_PAGE_SIZE_2MB;
+    ASSERT_SUCCESS(hsaKmtAllocMemory(0, bufSize, memFlags, reinterpret_cast<void **>(&buf)));
+
+    /* Placed so that it can be backed by huge pages */
+    EXPECT_EQ(reinterpret_cast<HSAuint64>(buf) & ((2ULL << 20) - 1), 0ULL);
+
+    /* Pointer info tells whether they were obtained */
+    EXPECT_SUCCESS(hsaKmtQueryPointerInfo(buf + bufSize / 2, &ptrInfo));
+    EXPECT_EQ(ptrInfo.Type, HSA_POINTER_ALLOCATED);
+    EXPECT_EQ(ptrInfo.CPUAddress, buf);
+    EXPECT_EQ(ptrInfo.SizeInBytes, bufSize);
+    EXPECT_TRUE(ptrInfo.MemFlags.ui32.PageSize == HSA_PAGE_SIZE_2MB ||
+                ptrInfo.MemFlags.ui32.PageSize == HSA_PAGE_SIZE_4KB);
+    LOG() << "Huge pages " << (ptrInfo.MemFlags.ui32.PageSize == HSA_PAGE_SIZE_2MB ?
+                               "obtained" : "not obtained") << std::endl;
+
+    memset(buf, 0xa5, bufSize);
+    EXPECT_EQ(buf[bufSize - 1], static_cast<char>(0xa5));
+
+    EXPECT_SUCCESS(hsaKmtFreeMemory(buf, bufSize));
+
+    TEST_END
+}
+
+TEST_F(KFDMemoryTest, PopulatedHostMemory) {
+    TEST_START(TESTPROFILE_RUNALL)
+
+    int defaultGPUNode = m_NodeInfo.HsaDefaultGPUNode();
+    ASSERT_GE(defaultGPUNode, 0) << "failed to get default GPU Node";
+
+    /* Paged memory from a GPU node is populated on the CPU node linked to it */
+    const HSAuint64 bufSize = 512ULL << 20;
+    HsaMemFlags memFlags = {0};
+    char *buf;
+
+    memFlags.ui32.HostAccess = 1;
+    memFlags.ui32.Populate = 1;
+    ASSERT_SUCCESS(hsaKmtAllocMemory(defaultGPUNode, bufSize, memFlags,
+                                     reinterpret_cast<void **>(&buf)));
+
+    /* Every page is resident and zeroed */
+    unsigned char vec[256];
+    ASSERT_EQ(0, mincore(buf, sizeof(vec) * PAGE_SIZE, vec));
+    for (unsigned int i = 0; i < sizeof(vec); i++)
+        EXPECT_TRUE(vec[i] & 1) << "page " << i << " is not resident";
+    for (HSAuint64 off = 0; off < bufSize; off += PAGE_SIZE)
+        ASSERT_EQ(buf[off], 0) << "offset " << off;
+
+    EXPECT_SUCCESS(hsaKmtFreeMemory(buf, bufSize));
+
+    TEST_END
+}
+
+TEST_F(KFDMemoryTest, InterleavedHostMemory) {
+    if (!is_dgpu()) {
+        LOG() << "Skipping test: Paged memory is not interleaved on APUs." << std::endl;
+        return;
+    }
+    TEST_START(TESTPROFILE_RUNALL)
+
+    const std::vector<int> gpuNodes = m_NodeInfo.GetNodesWithGPU();
+    std::vector<HSAuint32> nodes(gpuNodes.begin(), gpuNodes.end());
+    const HSAuint64 bufSize = 64ULL << 20;
+    HsaPointerInfo ptrInfo;
+    HsaMemFlags memFlags = {0};
+    HSAuint32 badNode = 0xffff;
+    char *buf;
+
+    memFlags.ui32.HostAccess = 1;
+    EXPECT_EQ(HSAKMT_STATUS_INVALID_NODE_UNIT,
+              hsaKmtAllocMemoryInterleaved(1, &badNode, bufSize, memFlags,
+                                           reinterpret_cast<void **>(&buf)));
+
+    /* Interleave across the CPU nodes of all GPUs */
+    ASSERT_SUCCESS(hsaKmtAllocMemoryInterleaved(nodes.size(), &nodes[0], bufSize,
+                                                memFlags, reinterpret_cast<void **>(&buf)));
+    EXPECT_SUCCESS(hsaKmtQueryPointerInfo(buf, &ptrInfo));
+    EXPECT_EQ(ptrInfo.Type, HSA_POINTER_ALLOCATED);
+    EXPECT_EQ(ptrInfo.SizeInBytes, bufSize);
+    if (numa_available() == -1 || numa_max_node() == 0)
+        EXPECT_EQ(ptrInfo.MemFlags.ui32.Interleave, 0U);
+    LOG() << "Interleaved: " << ptrInfo.MemFlags.ui32.Interleave
+          << ", first node " << ptrInfo.Node << std::endl;
+
+    memset(buf, 0x5a, bufSize);
+    EXPECT_EQ(buf[bufSize - 1], 0x5a);
+    EXPECT_SUCCESS(hsaKmtFreeMemory(buf, bufSize));
+
+    TEST_END
+}
+
+TEST_F(KFDMemoryTest, VirtualMemoryStats) {
+    TEST_START(TESTPROFILE_RUNALL)
+
+    const HSAuint64 bufSize = PAGE_SIZE;
+    const unsigned int numBufs = 64;
+    HsaVirtualMemoryStats before, during, after;
+    HsaMemFlags memFlags = {0};
+    void *bufs[numBufs];
+
+    EXPECT_EQ(HSAKMT_STATUS_INVALID_PARAMETER, hsaKmtGetVirtualMemoryStats(NULL));
+
+    memFlags.ui32.HostAccess = 1;
+    memFlags.ui32.NoSubstitute = 1;
+    EXPECT_SUCCESS(hsaKmtGetVirtualMemoryStats(&before));
+    for (unsigned int i = 0; i < numBufs; i++)
+        ASSERT_SUCCESS(hsaKmtAllocMemory(0, bufSize, memFlags, &bufs[i]));
+    EXPECT_SUCCESS(hsaKmtGetVirtualMemoryStats(&during));
+    for (unsigned int i = 0; i < numBufs; i++)
+        EXPECT_SUCCESS(hsaKmtFreeMemory(bufs[i], bufSize));
+    EXPECT_SUCCESS(hsaKmtGetVirtualMemoryStats(&after));
+
+    EXPECT_GT(before.MapCount, 0ULL);
+    if (before.MaxMapCount)
+        EXPECT_EQ(before.Headroom, before.MaxMapCount - before.MapCount);
+    EXPECT_GE(during.ApertureAreas, before.ApertureAreas + numBufs);
+    EXPECT_GT(during.MapCount, before.MapCount);
+    EXPECT_EQ(after.ApertureAreas, before.ApertureAreas);
+    EXPECT_EQ(after.Refused, before.Refused);
+    LOG() << "Mappings: " << before.MapCount << " -> " << during.MapCount
+          << " -> " << after.MapCount << " of " << before.MaxMapCount << std::endl;
+
+    TEST_END
+}
+
+TEST_F(KFDMemoryTest, ApertureStats) {
+    TEST_START(TESTPROFILE_RUNALL)
+
+    int defaultGPUNode = m_NodeInfo.HsaDefaultGPUNode();
+    ASSERT_GE(defaultGPUNode, 0) << "failed to get default GPU Node";
+
+    const HSAuint64 bufSize = PAGE_SIZE;
+    const unsigned int numBufs = 16;
+    HsaApertureStats before, during, after;
+    HSA_MEMORY_APERTURE aperture = HSA_MEMORY_APERTURE_SVM;
+    HsaMemFlags memFlags = {0};
+    void *bufs[numBufs];
+
+    EXPECT_EQ(HSAKMT_STATUS_INVALID_PARAMETER,
+              hsaKmtGetApertureStats(defaultGPUNode, aperture, NULL));
+    EXPECT_EQ(HSAKMT_STATUS_INVALID_PARAMETER,
+              hsaKmtGetApertureStats(defaultGPUNode, HSA_MEMORY_APERTURE_NUM_TYPES, &before));
+
+    /* APUs allocate device memory in the per-GPU GPUVM aperture */
+    if (hsaKmtGetApertureStats(defaultGPUNode, aperture, &before) != HSAKMT_STATUS_SUCCESS) {
+        aperture = HSA_MEMORY_APERTURE_GPUVM;
+        ASSERT_SUCCESS(hsaKmtGetApertureStats(defaultGPUNode, aperture, &before));
+    }
+
+    memFlags.ui32.PageSize = HSA_PAGE_SIZE_4KB;
+    memFlags.ui32.NonPaged = 1;
+    memFlags.ui32.NoSubstitute = 1;
+    for (unsigned int i = 0; i < numBufs; i++)
+        ASSERT_SUCCESS(hsaKmtAllocMemory(defaultGPUNode, bufSize, memFlags, &bufs[i]));
+    EXPECT_SUCCESS(hsaKmtGetApertureStats(defaultGPUNode, aperture, &during));
+    for (unsigned int i = 0; i < numBufs; i++)
+        EXPECT_SUCCESS(hsaKmtFreeMemory(bufs[i], bufSize));
+    EXPECT_SUCCESS(hsaKmtFlushDeferredFrees());
+    EXPECT_SUCCESS(hsaKmtGetApertureStats(defaultGPUNode, aperture, &after));
+
+    EXPECT_GE(during.ObjectCount, before.ObjectCount + numBufs);
+    EXPECT_GE(during.ObjectBytes, before.ObjectBytes + numBufs * bufSize);
+    EXPECT_LE(during.ObjectBytes, during.AreaBytes);
+    EXPECT_EQ(during.UnbackedBytes, during.AreaBytes - during.ObjectBytes);
+    EXPECT_LE(after.ObjectCount, during.ObjectCount - numBufs);
+    if (during.HoleCount)
+        EXPECT_GT(during.LargestHole, 0ULL);
+    LOG() << "Objects: " << before.ObjectCount << " -> " << during.ObjectCount
+          << " -> " << after.ObjectCount << ", " << during.HoleCount << " holes, largest "
+          << (during.LargestHole >> 20) << "MB" << std::endl;
+
+    TEST_END
+}
+
+/* Needs HSA_ALLOC_TRACK=1 in the environment */
+TEST_F(KFDMemoryTest, AllocationSites) {
+    TEST_START(TESTPROFILE_RUNALL)
+
+    int defaultGPUNode = m_NodeInfo.HsaDefaultGPUNode();
+    ASSERT_GE(defaultGPUNode, 0) << "failed to get default GPU Node";
+
+    const HSAuint64 bufSize = 16 * PAGE_SIZE;
+    const unsigned int numBufs = 8;
+    HsaAllocationSite sites[16];
+    HSAuint32 numSites = 16;
+    HsaMemFlags memFlags = {0};
+    void *bufs[numBufs];
+
+    if (hsaKmtGetAllocationSites(sites, &numSites) == HSAKMT_STATUS_NOT_SUPPORTED) {
+        LOG() << "Skipping test: HSA_ALLOC_TRACK is not set." << std::endl;
+        return;
+    }
+
+    memFlags.ui32.PageSize = HSA_PAGE_SIZE_4KB;
+    memFlags.ui32.HostAccess = 1;
+    for (unsigned int i = 0; i < numBufs; i++)
+        ASSERT_SUCCESS(hsaKmtAllocMemory(0, bufSize, memFlags, &bufs[i]));
+
+    /* All buffers come from the same call stack */
+    numSites = 16;
+    ASSERT_SUCCESS(hsaKmtGetAllocationSites(sites, &numSites));
+    ASSERT_GE(numSites, 1U);
+    EXPECT_GT(sites[0].NumFrames, 0U);
+    if (sites[0].SampleRate == 1) {
+        EXPECT_GE(sites[0].LiveBytes, numBufs * bufSize);
+        EXPECT_GE(sites[0].LiveCount, numBufs);
+    }
+    EXPECT_SUCCESS(hsaKmtDumpAllocationSites(1));
+
+    for (unsigned int i = 0; i < numBufs; i++)
+        EXPECT_SUCCESS(hsaKmtFreeMemory(bufs[i], bufSize));
+    EXPECT_SUCCESS(hsaKmtFlushDeferredFrees());
+
+    numSites = 16;
+    ASSERT_SUCCESS(hsaKmtGetAllocationSites(sites, &numSites));
+    for (unsigned int i = 0; i < numSites; i++)
+        EXPECT_LE(sites[i].LiveBytes, sites[i].PeakBytes);
+
+    TEST_END
+}
+
+TEST_F(KFDMemoryTest, QueryPointerInfoBatch) {
+    TEST_START(TESTPROFILE_RUNALL)
+
+    const HSAuint64 bufSize = 4 * PAGE_SIZE;
+    const unsigned int numBufs = 8, numPtrs = 3 * numBufs + 1;
+    const std::vector<int> gpuNodes = m_NodeInfo.GetNodesWithGPU();
+    HSAuint64 numNodeIds = numPtrs * 2 * gpuNodes.size();
+    std::vector<HSAuint32> nodeIds(numNodeIds);
+    HsaPointerInfo infos[numPtrs], ptrInfo;
+    const void *ptrs[numPtrs];
+    HsaMemFlags memFlags = {0};
+    void *bufs[numBufs];
+    int unknown;
+
+    memFlags.ui32.PageSize = HSA_PAGE_SIZE_4KB;
+    memFlags.ui32.HostAccess = 1;
+    for (unsigned int i = 0; i < numBufs; i++)
+        ASSERT_SUCCESS(hsaKmtAllocMemory(0, bufSize, memFlags, &bufs[i]));
+
+    /* Start, middle and last byte of each buffer in reverse order, and
+     * a pointer that is not known
+     */
+    for (unsigned int i = 0; i < numBufs; i++) {
+        char *buf = reinterpret_cast<char *>(bufs[numBufs - 1 - i]);
+
+        ptrs[3 * i] = buf + bufSize - 1;
+        ptrs[3 * i + 1] = buf + bufSize / 2;
+        ptrs[3 * i + 2] = buf;
+    }
+    ptrs[numPtrs - 1] = &unknown;
+
+    EXPECT_EQ(HSAKMT_STATUS_INVALID_PARAMETER,
+              hsaKmtQueryPointerInfoBatch(numPtrs, NULL, infos, &nodeIds[0], numNodeIds));
+    ASSERT_SUCCESS(hsaKmtQueryPointerInfoBatch(numPtrs, ptrs, infos, &nodeIds[0], numNodeIds));
+
+    for (unsigned int i = 0; i < numPtrs - 1; i++) {
+        EXPECT_SUCCESS(hsaKmtQueryPointerInfo(ptrs[i], &ptrInfo));
+        EXPECT_EQ(infos[i].Type, HSA_POINTER_ALLOCATED);
+        EXPECT_EQ(infos[i].CPUAddress, bufs[numBufs - 1 - i / 3]);
+        EXPECT_EQ(infos[i].CPUAddress, ptrInfo.CPUAddress);
+        EXPECT_EQ(infos[i].SizeInBytes, ptrInfo.SizeInBytes);
+        EXPECT_EQ(infos[i].NMappedNodes, ptrInfo.NMappedNodes);
+        for (unsigned int j = 0; j < infos[i].NMappedNodes; j++)
+            EXPECT_EQ(infos[i].MappedNodes[j], ptrInfo.MappedNodes[j]);
+    }
+    EXPECT_EQ(infos[numPtrs - 1].Type, HSA_POINTER_UNKNOWN);
+
+    /* Without space for node IDs only the counts are returned */
+    if (infos[0].NMappedNodes) {
+        EXPECT_EQ(HSAKMT_STATUS_BUFFER_TOO_SMALL,
+                  hsaKmtQueryPointerInfoBatch(numPtrs, ptrs, infos, NULL, 0));
+        EXPECT_EQ(infos[0].MappedNodes, (const HSAuint32 *)NULL);
+        EXPECT_GT(infos[0].NMappedNodes, 0U);
+    }
+
+    for (unsigned int i = 0; i < numBufs; i++)
+        EXPECT_SUCCESS(hsaKmtFreeMemory(bufs[i], bufSize));
+
+    TEST_END
+}
+
+TEST_F(KFDMemoryTest, IpcImportCache) {
+    TEST_START(TESTPROFILE_RUNALL)
+
+    int defaultGPUNode = m_NodeInfo.HsaDefaultGPUNode();
+    ASSERT_GE(defaultGPUNode, 0) << "failed to get default GPU Node";
+
+    const HSAuint64 bufSize = PAGE_SIZE * 16;
+    HsaMemoryCacheStats before, after;
+    HsaSharedMemoryHandle sharedHandle;
+    HsaMemFlags memFlags = {0};
+    HSAuint64 size1, size2, alternateVAGPU;
+    HsaPointerInfo ptrInfo;
+    void *mem, *import1, *import2;
+
+    memFlags.ui32.HostAccess = 1;
+    memFlags.ui32.NonPaged = 1;
+
+    ASSERT_SUCCESS(hsaKmtAllocMemory(defaultGPUNode, bufSize, memFlags, &mem));
+    ASSERT_SUCCESS(hsaKmtShareMemory(mem, bufSize, &sharedHandle));
+
+    EXPECT_SUCCESS(hsaKmtGetMemoryCacheStats(HSA_MEMORY_CACHE_IPC_IMPORT, &before));
+    ASSERT_SUCCESS(hsaKmtRegisterSharedHandle(&sharedHandle, &import1, &size1));
+    ASSERT_SUCCESS(hsaKmtMapMemoryToGPU(import1, size1, &alternateVAGPU));
+    ASSERT_SUCCESS(hsaKmtRegisterSharedHandle(&sharedHandle, &import2, &size2));
+    EXPECT_SUCCESS(hsaKmtGetMemoryCacheStats(HSA_MEMORY_CACHE_IPC_IMPORT, &after));
+    EXPECT_EQ(size1, bufSize);
+    EXPECT_EQ(size2, bufSize);
+
+    if (after.Misses == before.Misses) {
+        LOG() << "IPC import cache is disabled, set HSA_IPC_CACHE_MB to test it." << std::endl;
+        EXPECT_SUCCESS(hsaKmtDeregisterMemory(import2));
+    } else {
+        EXPECT_EQ(after.Hits - before.Hits, 1ULL);
+        EXPECT_EQ(import2, import1);
+
+        /* The mapping stays until the last import is deregistered */
+        EXPECT_SUCCESS(hsaKmtDeregisterMemory(import2));
+        EXPECT_SUCCESS(hsaKmtQueryPointerInfo(import1, &ptrInfo));
+        EXPECT_EQ(ptrInfo.Type, HSA_POINTER_REGISTERED_SHARED);
+        EXPECT_EQ(ptrInfo.NMappedNodes, 1U);
+    }
+
+    EXPECT_SUCCESS(hsaKmtUnmapMemoryToGPU(import1));
+    EXPECT_SUCCESS(hsaKmtDeregisterMemory(import1));
+    EXPECT_NE(HSAKMT_STATUS_SUCCESS, hsaKmtQueryPointerInfo(import1, &ptrInfo));
+
+    /* The unused import is kept, importing the handle again hits */
+    if (after.Misses != before.Misses) {
+        EXPECT_SUCCESS(hsaKmtGetMemoryCacheStats(HSA_MEMORY_CACHE_IPC_IMPORT, &before));
+        ASSERT_SUCCESS(hsaKmtRegisterSharedHandle(&sharedHandle, &import2, &size2));
+        EXPECT_SUCCESS(hsaKmtGetMemoryCacheStats(HSA_MEMORY_CACHE_IPC_IMPORT, &after));
+        EXPECT_EQ(after.Misses - before.Misses, 0ULL);
+        EXPECT_EQ(import2, import1);
+        EXPECT_SUCCESS(hsaKmtDeregisterMemory(import2));
+    }
+
+    EXPECT_SUCCESS(hsaKmtFreeMemory(mem, bufSize));
+
+    TEST_END
+}
+
 /* Linux OS-specific test for a debugger accessing HSA memory in a
  * debugged process.
  *